@@ -0,0 +1,169 @@
+// RUN: %hc %s -O3 -I%S/../../lib/hsa -o %t.out && %t.out -d 3
+
+// bookkeeping of in-flight commands of an HSA queue
+//
+// A host thread pushes commands into a queue which the device completes in
+// order, DEPTH commands behind; every WAIT_EVERY commands the host waits for
+// one of them, as a completion_future would. The AsyncOpRing the HSAQueue
+// uses is compared against the previous scheme: a vector indexed by position,
+// nulled from the waited command backwards, compacted once it grows past a
+// threshold and drained completely at the in-flight limit. A flag per
+// command stands in for its completion signal, so no HSA agent is needed.
+
+#include "async_op_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#define MAX_INFLIGHT_COMMANDS_PER_QUEUE  (2*8192)
+#define ASYNCOPS_VECTOR_GC_SIZE (2*8192)
+
+#define DISPATCH_COUNT 5
+
+// Text width for labels.
+#define TW 40
+
+int p_dispatch_count = DISPATCH_COUNT;
+
+// commands per repetition
+const uint64_t OPS = 1 << 20;
+
+// the host waits for a command every WAIT_EVERY commands
+const uint64_t WAIT_EVERY = 64;
+
+typedef std::chrono::duration<double> dur_t;
+
+struct Op {
+  uint64_t seq;
+  int index;
+  std::atomic<bool> done;
+  Op(uint64_t seq) : seq(seq), index(-1), done(false) {}
+};
+
+// the device: completes commands in order, depth commands behind the host
+struct Device {
+  std::vector<std::shared_ptr<Op>> inflight;
+  size_t first;
+  size_t depth;
+  Device(size_t depth) : inflight(), first(0), depth(depth) {}
+  void submitted(const std::shared_ptr<Op>& op) {
+    inflight.push_back(op);
+    while (inflight.size() - first > depth)
+      inflight[first++]->done = true;
+    if (first > 4096) {
+      inflight.erase(inflight.begin(), inflight.begin() + first);
+      first = 0;
+    }
+  }
+  // a host wait: the device catches up to op
+  void finish(const Op* op) {
+    while (first < inflight.size() && inflight[first]->seq <= op->seq)
+      inflight[first++]->done = true;
+  }
+  void finish_all() {
+    while (first < inflight.size())
+      inflight[first++]->done = true;
+  }
+};
+
+// the bookkeeping as it was
+struct VectorOps {
+  std::vector<std::shared_ptr<Op>> asyncOps;
+  size_t drains = 0;
+  void push(const std::shared_ptr<Op>& op, Device& dev) {
+    if (asyncOps.size() >= MAX_INFLIGHT_COMMANDS_PER_QUEUE - 1) {
+      ++drains;
+      dev.finish_all();
+      asyncOps.clear();
+    }
+    op->index = asyncOps.size();
+    asyncOps.push_back(op);
+  }
+  void remove(Op* op) {
+    int target = op->index;
+    if (target < (int)asyncOps.size() && op == asyncOps[target].get()) {
+      for (int i = target; i >= 0 && asyncOps[i]; --i)
+        asyncOps[i] = nullptr;
+    }
+    if (asyncOps.size() > ASYNCOPS_VECTOR_GC_SIZE)
+      asyncOps.erase(std::remove(asyncOps.begin(), asyncOps.end(), nullptr), asyncOps.end());
+  }
+};
+
+struct RingOps {
+  AsyncOpRing<Op> asyncOps;
+  size_t drains = 0;
+  RingOps() : asyncOps(MAX_INFLIGHT_COMMANDS_PER_QUEUE, [](Op* op) { return op->done.load(std::memory_order_acquire); }) {}
+  void push(const std::shared_ptr<Op>& op, Device& dev) {
+    while (!asyncOps.push(op, op->seq)) {
+      std::shared_ptr<Op> oldest = asyncOps.oldest();
+      dev.finish(oldest.get());
+      asyncOps.retire(oldest.get(), oldest->seq);
+    }
+  }
+  void remove(Op* op) { asyncOps.retire(op, op->seq); }
+};
+
+struct result {
+  double rate;      // million commands per second
+  size_t drains;    // forced queue drains
+};
+
+// medians over the repetitions
+template <typename Ops>
+static result run(size_t depth) {
+  typedef std::chrono::high_resolution_clock clock;
+  std::vector<dur_t> elapsed;
+  size_t drains = 0;
+  for (int r = 0; r < p_dispatch_count; ++r) {
+    Ops ops;
+    Device dev(depth);
+    auto start = clock::now();
+    for (uint64_t s = 1; s <= OPS; ++s) {
+      std::shared_ptr<Op> op = std::make_shared<Op>(s);
+      ops.push(op, dev);
+      dev.submitted(op);
+      if (s % WAIT_EVERY == 0 && dev.inflight.size() > depth / 2) {
+        // wait for a command half the pipeline back
+        std::shared_ptr<Op>& waited = dev.inflight[dev.inflight.size() - 1 - depth / 2];
+        dev.finish(waited.get());
+        ops.remove(waited.get());
+      }
+    }
+    elapsed.push_back(clock::now() - start);
+    drains = ops.drains;
+  }
+  std::sort(elapsed.begin(), elapsed.end());
+  return result{double(OPS) / elapsed[elapsed.size() / 2].count() / 1e6, drains};
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      return 0;
+    }
+  }
+
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Median million commands per second / forced queue drains\n\n";
+
+  for (size_t depth = 16; depth <= 4096; depth *= 4) {
+    result before = run<VectorOps>(depth);
+    result after = run<RingOps>(depth);
+    std::cout << "depth = " << std::setw(TW - 20) << std::left << depth
+              << "vector " << std::setprecision(4) << before.rate << " / " << std::setw(8) << before.drains
+              << "ring " << std::setprecision(4) << after.rate << " / " << after.drains << "\n";
+  }
+
+  return 0;
+}
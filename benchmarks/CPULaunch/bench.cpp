@@ -0,0 +1,119 @@
+// RUN: %hc -cpu %s -O3 -o %t.out && HCC_RUNTIME=CPU %t.out
+
+// benchmark for kernel launch latency on the CPU execution path
+//
+// Compares the persistent CPU worker pool used by parallel_for_each against
+// the previous launch scheme, which spawned and joined Kalmar::NTHREAD fresh
+// std::threads for every kernel. Both run the same 1K-element kernel.
+
+#include <hc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#define GRID_SIZE 1024
+#define DISPATCH_COUNT 10000
+
+// Text width for labels.
+#define TW 48
+
+int p_dispatch_count = DISPATCH_COUNT;
+int p_grid_size = GRID_SIZE;
+
+typedef std::chrono::duration<double> dur_t;
+
+static double average_us(const std::vector<dur_t>& v) {
+  double sum = 0.0;
+  for (const auto& d : v)
+    sum += d.count();
+  return v.empty() ? 0.0 : sum / v.size() * 1000000.0;
+}
+
+static double median_us(std::vector<dur_t> v) {
+  if (v.empty())
+    return 0.0;
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2].count() * 1000000.0;
+}
+
+static void report(const char* name, const std::vector<dur_t>& v) {
+  std::cout << std::setw(TW) << std::left << name
+            << "avg " << std::setw(12) << std::setprecision(6) << average_us(v)
+            << "median " << std::setprecision(6) << median_us(v) << "\n";
+}
+
+// launch scheme used before the worker pool: one new thread per partition
+static void spawn_launch(float* y, const float* x, float a, int n) {
+  std::vector<std::thread> th(Kalmar::NTHREAD);
+  for (unsigned int part = 0; part < Kalmar::NTHREAD; ++part) {
+    th[part] = std::thread([=]() {
+      int start = n * part / Kalmar::NTHREAD;
+      int end = n * (part + 1) / Kalmar::NTHREAD;
+      for (int i = start; i < end; ++i)
+        y[i] = a * x[i] + y[i];
+    });
+  }
+  for (auto& t : th)
+    t.join();
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else if ((!strcmp(argv[i], "--grid_size") || !strcmp(argv[i], "-g")) && i + 1 < argc) {
+      p_grid_size = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      std::cout << " --grid_size, -g           : Set number of work-items per kernel\n";
+      return 0;
+    }
+  }
+
+  std::vector<float> x(p_grid_size, 1.0f);
+  std::vector<float> y(p_grid_size, 0.0f);
+  hc::array_view<const float, 1> av_x(p_grid_size, x.data());
+  hc::array_view<float, 1> av_y(p_grid_size, y.data());
+  const float a = 2.0f;
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+
+  std::cout << "CPU worker threads:               " << Kalmar::NTHREAD << "\n";
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Work-items per kernel:            " << p_grid_size << "\n\n";
+
+  // warm up, also brings up the worker pool
+  hc::parallel_for_each(av, hc::extent<1>(p_grid_size), [=](hc::index<1> idx) __HC__ {
+    av_y[idx] = a * av_x[idx] + av_y[idx];
+  }).wait();
+
+  std::vector<dur_t> elapsed_spawn, elapsed_pool;
+  std::chrono::high_resolution_clock::time_point start, end;
+
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    start = std::chrono::high_resolution_clock::now();
+    spawn_launch(y.data(), x.data(), a, p_grid_size);
+    end = std::chrono::high_resolution_clock::now();
+    elapsed_spawn.push_back(end - start);
+  }
+
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    start = std::chrono::high_resolution_clock::now();
+    hc::parallel_for_each(av, hc::extent<1>(p_grid_size), [=](hc::index<1> idx) __HC__ {
+      av_y[idx] = a * av_x[idx] + av_y[idx];
+    }).wait();
+    end = std::chrono::high_resolution_clock::now();
+    elapsed_pool.push_back(end - start);
+  }
+
+  report("thread spawn per launch (us):", elapsed_spawn);
+  report("persistent worker pool (us):", elapsed_pool);
+
+  return 0;
+}
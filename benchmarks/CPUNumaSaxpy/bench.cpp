@@ -0,0 +1,101 @@
+// RUN: %hc -cpu %s -O3 -o %t.out && HCC_RUNTIME=CPU %t.out -d 3
+
+// memory bandwidth of saxpy on the CPU path
+//
+// Compares saxpy over hc::array, whose pages the CPU device spreads over the
+// NUMA nodes the way the launch spreads the index space over the workers,
+// against saxpy over array_views of host vectors which the host thread
+// initialized, so all of their pages sit on the node of the host thread.
+// Run once more with HCC_CPU_NUMA=0 to see unpinned workers and unplaced
+// arrays. On a single node host all variants should perform alike.
+
+#include <hc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#define DISPATCH_COUNT 20
+
+// Text width for labels.
+#define TW 40
+
+int p_dispatch_count = DISPATCH_COUNT;
+
+typedef std::chrono::duration<double> dur_t;
+
+static double median(std::vector<dur_t> v) {
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2].count();
+}
+
+// bytes moved by one saxpy: read x and y, write y
+static double gbps(int n, double seconds) {
+  return 3.0 * n * sizeof(float) / seconds / 1e9;
+}
+
+template <typename F>
+static double run_saxpy(int n, F launch) {
+  std::vector<dur_t> elapsed;
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    auto start = std::chrono::high_resolution_clock::now();
+    launch().wait();
+    auto end = std::chrono::high_resolution_clock::now();
+    elapsed.push_back(end - start);
+  }
+  return gbps(n, median(elapsed));
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      return 0;
+    }
+  }
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+  const Kalmar::CPUTopology& topology = Kalmar::CPUTopology::get();
+
+  std::cout << "CPU worker threads:               " << Kalmar::NTHREAD << "\n";
+  std::cout << "NUMA nodes:                       " << topology.nodes() << "\n";
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Median bandwidth in GB/s\n\n";
+
+  const float a = 2.0f;
+  for (int n : {1 << 20, 1 << 24, 1 << 26}) {
+    // the CPU device placed the pages of the arrays, a kernel fills them
+    hc::array<float, 1> x(n, av), y(n, av);
+    hc::parallel_for_each(av, x.get_extent(), [&x, &y](hc::index<1> idx) __HC__ {
+      x[idx] = 1.0f;
+      y[idx] = 2.0f;
+    }).wait();
+    double placed = run_saxpy(n, [&] {
+      return hc::parallel_for_each(av, x.get_extent(), [&x, &y, a](hc::index<1> idx) __HC__ {
+        y[idx] = a * x[idx] + y[idx];
+      });
+    });
+
+    // the host thread touches every page of the vectors
+    std::vector<float> hx(n, 1.0f), hy(n, 2.0f);
+    hc::array_view<float, 1> vx(n, hx), vy(n, hy);
+    double host = run_saxpy(n, [&] {
+      return hc::parallel_for_each(av, vx.get_extent(), [=](hc::index<1> idx) __HC__ {
+        vy[idx] = a * vx[idx] + vy[idx];
+      });
+    });
+
+    std::cout << "n = " << std::setw(TW - 4) << std::left << n
+              << "array " << std::setw(10) << std::setprecision(4) << placed
+              << "host array_view " << std::setw(10) << std::setprecision(4) << host
+              << "speedup " << std::setprecision(3) << placed / host << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+// RUN: %hc -cpu %s -O3 -o %t.out && HCC_RUNTIME=CPU %t.out -d 3
+
+// benchmark for work distribution of CPU path kernels over odd extents
+//
+// Compares parallel_for_each, which hands out cache-line aligned chunks of the
+// linearized index space to the worker pool, against the previous static
+// scheme that split only ext[0] into Kalmar::NTHREAD contiguous ranges.
+// Besides the shapes, a kernel whose cost grows with ext[0] shows how both
+// behave with skewed per-index costs. Set HCC_CPU_GRAIN_SIZE to try other
+// chunk sizes.
+
+#include <hc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#define DISPATCH_COUNT 20
+
+// Text width for labels.
+#define TW 40
+
+int p_dispatch_count = DISPATCH_COUNT;
+
+typedef std::chrono::duration<double> dur_t;
+
+static double median_ms(std::vector<dur_t> v) {
+  if (v.empty())
+    return 0.0;
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2].count() * 1000.0;
+}
+
+// static split of ext[0] as done before the chunk scheduler
+template <typename F>
+static void static_launch(const hc::extent<3>& ext, F body) {
+  std::vector<std::thread> th(Kalmar::NTHREAD);
+  for (unsigned int part = 0; part < Kalmar::NTHREAD; ++part) {
+    th[part] = std::thread([=]() {
+      int start = ext[0] * part / Kalmar::NTHREAD;
+      int end = ext[0] * (part + 1) / Kalmar::NTHREAD;
+      for (int i = start; i < end; ++i)
+        for (int j = 0; j < ext[1]; ++j)
+          for (int k = 0; k < ext[2]; ++k)
+            body(i, j, k);
+    });
+  }
+  for (auto& t : th)
+    t.join();
+}
+
+static void run_shape(hc::accelerator_view& av, const char* name, hc::extent<3> ext, bool skewed) {
+  const int n = ext.size();
+  const int d1 = ext[1], d2 = ext[2];
+  const int rounds = skewed ? 64 : 1;
+  const int d0 = ext[0];
+  std::vector<float> y(n, 0.0f);
+  float* py = y.data();
+  hc::array_view<float, 3> av_y(ext, y.data());
+
+  std::vector<dur_t> elapsed_static, elapsed_dynamic;
+  std::chrono::high_resolution_clock::time_point start, end;
+
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    start = std::chrono::high_resolution_clock::now();
+    static_launch(ext, [=](int i0, int i1, int i2) {
+      int cost = skewed ? 1 + rounds * i0 / d0 : 1;
+      float v = py[(i0 * d1 + i1) * d2 + i2];
+      for (int r = 0; r < cost; ++r)
+        v = v * 0.5f + 1.0f;
+      py[(i0 * d1 + i1) * d2 + i2] = v;
+    });
+    end = std::chrono::high_resolution_clock::now();
+    elapsed_static.push_back(end - start);
+  }
+
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    start = std::chrono::high_resolution_clock::now();
+    hc::parallel_for_each(av, ext, [=](hc::index<3> idx) __HC__ {
+      int cost = skewed ? 1 + rounds * idx[0] / d0 : 1;
+      float v = av_y[idx];
+      for (int r = 0; r < cost; ++r)
+        v = v * 0.5f + 1.0f;
+      av_y[idx] = v;
+    }).wait();
+    end = std::chrono::high_resolution_clock::now();
+    elapsed_dynamic.push_back(end - start);
+  }
+
+  double s = median_ms(elapsed_static);
+  double d = median_ms(elapsed_dynamic);
+  std::cout << std::setw(TW) << std::left << name
+            << "static " << std::setw(10) << std::setprecision(4) << s
+            << "chunked " << std::setw(10) << std::setprecision(4) << d
+            << "speedup " << std::setprecision(3) << s / d << "\n";
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      return 0;
+    }
+  }
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+
+  std::cout << "CPU worker threads:               " << Kalmar::NTHREAD << "\n";
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Median time per launch in ms\n\n";
+
+  run_shape(av, "extent(3, 1, 1000000):", hc::extent<3>(3, 1, 1000000), false);
+  run_shape(av, "extent(1000000, 1, 3):", hc::extent<3>(1000000, 1, 3), false);
+  run_shape(av, "extent(7, 13, 10007):", hc::extent<3>(7, 13, 10007), false);
+  run_shape(av, "extent(1, 999983, 1):", hc::extent<3>(1, 999983, 1), false);
+  run_shape(av, "extent(64, 128, 128) skewed cost:", hc::extent<3>(64, 128, 128), true);
+
+  return 0;
+}
@@ -0,0 +1,109 @@
+// RUN: %hc -cpu %s -O3 -o %t.out && HCC_RUNTIME=CPU %t.out -d 3
+
+// vectorization of the innermost loop of CPU path kernels
+//
+// Runs float and double saxpy over array_views and over raw pointers to the
+// same host vectors. The innermost dimension of a CPU kernel is walked by a
+// loop the compiler may vectorize; the raw pointer kernel shows what that
+// loop reaches without the bookkeeping of array_view, the array_view kernel
+// shows how close element accesses get to it. The small size stays in the
+// caches, the large one is bound by memory bandwidth.
+
+#include <hc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#define DISPATCH_COUNT 20
+
+// Text width for labels.
+#define TW 40
+
+int p_dispatch_count = DISPATCH_COUNT;
+
+typedef std::chrono::duration<double> dur_t;
+
+static double median(std::vector<dur_t> v) {
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2].count();
+}
+
+// bytes moved by one saxpy: read x and y, write y
+template <typename T>
+static double gbps(int n, double seconds) {
+  return 3.0 * n * sizeof(T) / seconds / 1e9;
+}
+
+template <typename T, typename F>
+static double run_saxpy(int n, F launch) {
+  // kernels on the small sizes are short, time enough of them back to back
+  const int batch = std::max(1, (1 << 24) / n);
+  launch().wait();
+  std::vector<dur_t> elapsed;
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int b = 0; b < batch; ++b)
+      launch().wait();
+    auto end = std::chrono::high_resolution_clock::now();
+    elapsed.push_back((end - start) / batch);
+  }
+  return gbps<T>(n, median(elapsed));
+}
+
+template <typename T>
+static void run_type(hc::accelerator_view& av, const char* name, int n) {
+  const T a = T(2);
+  std::vector<T> hx(n, T(1)), hy(n, T(2));
+
+  hc::array_view<const T, 1> vx(n, hx);
+  hc::array_view<T, 1> vy(n, hy);
+  double view = run_saxpy<T>(n, [&] {
+    return hc::parallel_for_each(av, vy.get_extent(), [=](hc::index<1> idx) __HC__ {
+      vy[idx] = a * vx[idx] + vy[idx];
+    });
+  });
+  vy.synchronize();
+
+  const T* px = hx.data();
+  T* py = hy.data();
+  double raw = run_saxpy<T>(n, [&] {
+    return hc::parallel_for_each(av, hc::extent<1>(n), [=](hc::index<1> idx) __HC__ {
+      py[idx[0]] = a * px[idx[0]] + py[idx[0]];
+    });
+  });
+
+  std::cout << std::setw(8) << std::left << name
+            << "n = " << std::setw(TW - 12) << std::left << n
+            << "array_view " << std::setw(10) << std::setprecision(4) << view
+            << "raw pointer " << std::setw(10) << std::setprecision(4) << raw
+            << "ratio " << std::setprecision(3) << view / raw << "\n";
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      return 0;
+    }
+  }
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+
+  std::cout << "CPU worker threads:               " << Kalmar::NTHREAD << "\n";
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Median bandwidth in GB/s\n\n";
+
+  for (int n : {1 << 16, 1 << 24}) {
+    run_type<float>(av, "float", n);
+    run_type<double>(av, "double", n);
+  }
+
+  return 0;
+}
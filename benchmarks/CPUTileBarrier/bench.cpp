@@ -0,0 +1,99 @@
+// RUN: %hc -cpu %s -O3 -o %t.out && HCC_RUNTIME=CPU %t.out -d 3
+
+// benchmark for tile barriers on the CPU execution path
+//
+// On the CPU path the work-items of a tile run as fibers on one worker thread
+// and tile_barrier::wait() switches between them. This runs the same
+// elementwise work once untiled and once tiled with a barrier after each step,
+// so the difference is the cost of the barriers and the fiber switches.
+
+#include <hc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#define GRID_SIZE (1024 * 1024)
+#define TILE_SIZE 64
+#define DISPATCH_COUNT 20
+
+// Text width for labels.
+#define TW 40
+
+int p_dispatch_count = DISPATCH_COUNT;
+int p_grid_size = GRID_SIZE;
+int p_steps = 4;
+
+typedef std::chrono::duration<double> dur_t;
+
+static double median_ms(std::vector<dur_t> v) {
+  if (v.empty())
+    return 0.0;
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2].count() * 1000.0;
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else if ((!strcmp(argv[i], "--grid_size") || !strcmp(argv[i], "-g")) && i + 1 < argc) {
+      p_grid_size = atoi(argv[++i]) / TILE_SIZE * TILE_SIZE;
+    } else if ((!strcmp(argv[i], "--steps") || !strcmp(argv[i], "-s")) && i + 1 < argc) {
+      p_steps = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      std::cout << " --grid_size, -g           : Set number of work-items per kernel\n";
+      std::cout << " --steps, -s               : Set number of steps, each followed by a barrier\n";
+      return 0;
+    }
+  }
+
+  std::vector<float> y(p_grid_size, 0.0f);
+  hc::array_view<float, 1> av_y(p_grid_size, y.data());
+  const int steps = p_steps;
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+
+  std::cout << "CPU worker threads:               " << Kalmar::NTHREAD << "\n";
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Work-items per kernel:            " << p_grid_size << "\n";
+  std::cout << "Barriers per work-item:           " << p_steps << "\n\n";
+
+  std::vector<dur_t> elapsed_untiled, elapsed_tiled;
+  std::chrono::high_resolution_clock::time_point start, end;
+
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    start = std::chrono::high_resolution_clock::now();
+    hc::parallel_for_each(av, hc::extent<1>(p_grid_size), [=](hc::index<1> idx) __HC__ {
+      for (int s = 0; s < steps; ++s)
+        av_y[idx] = av_y[idx] * 0.5f + 1.0f;
+    }).wait();
+    end = std::chrono::high_resolution_clock::now();
+    elapsed_untiled.push_back(end - start);
+  }
+
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    start = std::chrono::high_resolution_clock::now();
+    hc::parallel_for_each(av, hc::extent<1>(p_grid_size).tile(TILE_SIZE), [=](hc::tiled_index<1> tidx) __HC__ {
+      for (int s = 0; s < steps; ++s) {
+        av_y[tidx.global] = av_y[tidx.global] * 0.5f + 1.0f;
+        tidx.barrier.wait();
+      }
+    }).wait();
+    end = std::chrono::high_resolution_clock::now();
+    elapsed_tiled.push_back(end - start);
+  }
+
+  double u = median_ms(elapsed_untiled);
+  double t = median_ms(elapsed_tiled);
+  std::cout << std::setw(TW) << std::left << "untiled (ms):" << std::setprecision(4) << u << "\n";
+  std::cout << std::setw(TW) << std::left << "tiled with barriers (ms):" << std::setprecision(4) << t << "\n";
+  std::cout << std::setw(TW) << std::left << "ratio:" << std::setprecision(3) << t / u << "\n";
+
+  return 0;
+}
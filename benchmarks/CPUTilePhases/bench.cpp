@@ -0,0 +1,133 @@
+// RUN: %hc -cpu %s -O3 -o %t.out && HCC_RUNTIME=CPU %t.out -d 3
+
+// benchmark for tile reductions on the CPU execution path
+//
+// Runs the tile_static tree reduction used by the parallel STL reduce
+// (_REDUCE_STEP) three ways:
+//  - a tiled kernel calling tile_barrier::wait(), run with one fiber per
+//    work-item (partitioned_task_tile_1D)
+//  - the same steps given as hc::tile_phases in cpu_tile_mode::fibers
+//  - hc::tile_phases in cpu_tile_mode::fission, each phase a loop over the tile
+
+#include <hc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#define TILE_SIZE 256
+#define GRID_SIZE (TILE_SIZE * 4096)
+#define DISPATCH_COUNT 20
+
+// Text width for labels.
+#define TW 40
+
+int p_dispatch_count = DISPATCH_COUNT;
+
+typedef std::chrono::duration<double> dur_t;
+
+static double median_ms(std::vector<dur_t> v) {
+  if (v.empty())
+    return 0.0;
+  std::sort(v.begin(), v.end());
+  return v[v.size() / 2].count() * 1000.0;
+}
+
+struct private_state {
+  int local;
+};
+
+struct shared_state {
+  int scratch[TILE_SIZE];
+};
+
+#define REDUCE_PHASE(_W) \
+  [=](const hc::tiled_index<1>& tidx, private_state& p, shared_state& s) __HC__ { \
+    if (p.local < _W) \
+      s.scratch[p.local] += s.scratch[p.local + _W]; \
+  }
+
+template <typename F>
+static void measure(const char* name, std::vector<int>& out, const std::vector<int>& ref, F launch) {
+  std::vector<dur_t> elapsed;
+  bool ok = true;
+  for (int i = 0; i < p_dispatch_count; ++i) {
+    auto start = std::chrono::high_resolution_clock::now();
+    launch();
+    auto end = std::chrono::high_resolution_clock::now();
+    elapsed.push_back(end - start);
+    ok &= (out == ref);
+  }
+  std::cout << std::setw(TW) << std::left << name << std::setprecision(4) << median_ms(elapsed)
+            << (ok ? "" : "  (wrong result)") << "\n";
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      return 0;
+    }
+  }
+
+  std::vector<int> in(GRID_SIZE);
+  std::vector<int> out(GRID_SIZE / TILE_SIZE);
+  std::vector<int> ref(GRID_SIZE / TILE_SIZE, 0);
+  for (int i = 0; i < GRID_SIZE; ++i) {
+    in[i] = i % 13;
+    ref[i / TILE_SIZE] += in[i];
+  }
+  hc::array_view<const int, 1> av_in(GRID_SIZE, in.data());
+  hc::array_view<int, 1> av_out(GRID_SIZE / TILE_SIZE, out.data());
+
+  hc::accelerator_view av = hc::accelerator().get_default_view();
+  hc::tiled_extent<1> ext = hc::extent<1>(GRID_SIZE).tile(TILE_SIZE);
+
+  std::cout << "CPU worker threads:               " << Kalmar::NTHREAD << "\n";
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Tiles of " << TILE_SIZE << " work-items:         " << GRID_SIZE / TILE_SIZE << "\n";
+  std::cout << "Median time per launch in ms\n\n";
+
+  measure("tile_barrier::wait():", out, ref, [&] {
+    hc::parallel_for_each(av, ext, [=](hc::tiled_index<1> tidx) __HC__ {
+      tile_static int scratch[TILE_SIZE];
+      int l = tidx.local[0];
+      scratch[l] = av_in[tidx.global];
+      tidx.barrier.wait();
+      for (int w = TILE_SIZE / 2; w > 0; w >>= 1) {
+        if (l < w)
+          scratch[l] += scratch[l + w];
+        tidx.barrier.wait();
+      }
+      if (l == 0)
+        av_out[tidx.tile] = scratch[0];
+    }).wait();
+    av_out.synchronize();
+  });
+
+  auto load = [=](const hc::tiled_index<1>& tidx, private_state& p, shared_state& s) __HC__ {
+    p.local = tidx.local[0];
+    s.scratch[p.local] = av_in[tidx.global];
+  };
+  auto store = [=](const hc::tiled_index<1>& tidx, private_state& p, shared_state& s) __HC__ {
+    if (p.local == 0)
+      av_out[tidx.tile] = s.scratch[0];
+  };
+
+  for (auto mode : { hc::cpu_tile_mode::fibers, hc::cpu_tile_mode::fission }) {
+    measure(mode == hc::cpu_tile_mode::fibers ? "tile_phases, fibers:" : "tile_phases, fission:", out, ref, [&] {
+      hc::parallel_for_each(av, ext, hc::make_tile_phases<1, private_state, shared_state>(mode,
+        load, REDUCE_PHASE(128), REDUCE_PHASE(64), REDUCE_PHASE(32), REDUCE_PHASE(16),
+        REDUCE_PHASE(8), REDUCE_PHASE(4), REDUCE_PHASE(2), REDUCE_PHASE(1), store)).wait();
+      av_out.synchronize();
+    });
+  }
+
+  return 0;
+}
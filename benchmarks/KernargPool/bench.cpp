@@ -0,0 +1,167 @@
+// RUN: %hc %s -O3 -I%S/../../lib/hsa -o %t.out && %t.out -d 3
+
+// scalability of the kernarg buffer pool of the HSA runtime
+//
+// Host threads take kernarg buffers and give them back the way dispatches
+// do, each keeping a window of buffers in flight. The lock-free ResourcePool
+// the HSA device uses is compared against the previous pool, a mutex around
+// a cursor scan over a flag per buffer. Kernarg memory comes from a software
+// stand-in for hsa_amd_memory_pool_allocate, so no HSA agent is needed.
+
+#include "resource_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define KERNARG_BUFFER_SIZE (512)
+#define KERNARG_POOL_SIZE (1024)
+
+#define DISPATCH_COUNT 5
+
+// Text width for labels.
+#define TW 40
+
+int p_dispatch_count = DISPATCH_COUNT;
+
+// operations per thread and repetition
+const int OPS = 1 << 18;
+
+// buffers each thread keeps in flight
+const int WINDOW = 16;
+
+typedef std::chrono::duration<double> dur_t;
+
+// software stand-in for the kernarg memory pool of an HSA agent
+struct StandInKernargRegion {
+  static void* allocate(size_t size) {
+    void* p = nullptr;
+    if (posix_memalign(&p, 4096, size) != 0)
+      return nullptr;
+    memset(p, 0, size);
+    return p;
+  }
+  static void free(void* p) { ::free(p); }
+};
+
+// the pool as it was: one mutex, a cursor and a flag per buffer
+class LockedPool {
+public:
+  LockedPool() : cursor(0) { grow(); }
+  ~LockedPool() {
+    for (size_t i = 0; i < pool.size(); i += KERNARG_POOL_SIZE)
+      StandInKernargRegion::free(pool[i]);
+  }
+  int acquire(void*& ret) {
+    std::lock_guard<std::mutex> l(mutex);
+    int start = cursor;
+    do {
+      if (!flag[cursor]) {
+        int index = cursor;
+        flag[index] = true;
+        ret = pool[index];
+        if (++cursor == (int)pool.size()) cursor = 0;
+        return index;
+      }
+      if (++cursor == (int)pool.size()) cursor = 0;
+    } while (cursor != start);
+    cursor = pool.size();
+    grow();
+    flag[cursor] = true;
+    ret = pool[cursor];
+    return cursor++;
+  }
+  void release(int index) {
+    std::lock_guard<std::mutex> l(mutex);
+    flag[index] = false;
+  }
+private:
+  void grow() {
+    char* p = static_cast<char*>(StandInKernargRegion::allocate(KERNARG_POOL_SIZE * KERNARG_BUFFER_SIZE));
+    for (int i = 0; i < KERNARG_POOL_SIZE; ++i) {
+      pool.push_back(p + i * KERNARG_BUFFER_SIZE);
+      flag.push_back(false);
+    }
+  }
+  std::vector<void*> pool;
+  std::vector<bool> flag;
+  int cursor;
+  std::mutex mutex;
+};
+
+static ResourcePool<void*>* make_pool() {
+  return new ResourcePool<void*>(KERNARG_POOL_SIZE,
+    [](void** buffers, size_t count) {
+      char* p = static_cast<char*>(StandInKernargRegion::allocate(count * KERNARG_BUFFER_SIZE));
+      for (size_t i = 0; i < count; ++i)
+        buffers[i] = p + i * KERNARG_BUFFER_SIZE;
+      return p != nullptr;
+    },
+    [](void** buffers, size_t) { StandInKernargRegion::free(buffers[0]); });
+}
+
+// million acquire/release pairs per second over all threads
+template <typename Pool>
+static double run(Pool& pool, int threads) {
+  std::vector<dur_t> elapsed;
+  for (int r = 0; r < p_dispatch_count; ++r) {
+    std::vector<std::thread> th;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; ++t) {
+      th.emplace_back([&pool] {
+        int window[WINDOW];
+        void* buf = nullptr;
+        for (int w = 0; w < WINDOW; ++w)
+          window[w] = pool.acquire(buf);
+        for (int i = 0; i < OPS; ++i) {
+          pool.release(window[i % WINDOW]);
+          window[i % WINDOW] = pool.acquire(buf);
+          // the dispatch writes its arguments
+          *static_cast<volatile int*>(buf) = i;
+        }
+        for (int w = 0; w < WINDOW; ++w)
+          pool.release(window[w]);
+      });
+    }
+    for (auto& t : th)
+      t.join();
+    elapsed.push_back(std::chrono::high_resolution_clock::now() - start);
+  }
+  std::sort(elapsed.begin(), elapsed.end());
+  return double(OPS) * threads / elapsed[elapsed.size() / 2].count() / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if ((!strcmp(argv[i], "--dispatch_count") || !strcmp(argv[i], "-d")) && i + 1 < argc) {
+      p_dispatch_count = atoi(argv[++i]);
+    } else {
+      std::cout << " --dispatch_count, -d      : Set dispatch count\n";
+      return 0;
+    }
+  }
+
+  const int hw = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << "Hardware threads:                 " << hw << "\n";
+  std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
+  std::cout << "Median million acquire/release pairs per second\n\n";
+
+  for (int threads = 1; threads <= std::max(16, hw); threads *= 2) {
+    LockedPool locked;
+    std::unique_ptr<ResourcePool<void*>> lockfree(make_pool());
+    double before = run(locked, threads);
+    double after = run(*lockfree, threads);
+    std::cout << "threads = " << std::setw(TW - 10) << std::left << threads
+              << "mutex " << std::setw(10) << std::setprecision(4) << before
+              << "lock-free " << std::setw(10) << std::setprecision(4) << after
+              << "speedup " << std::setprecision(3) << after / before << "\n";
+  }
+
+  return 0;
+}
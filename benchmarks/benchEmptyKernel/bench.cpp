@@ -2,6 +2,8 @@
 // RUN: %t.out -d 10000 -h %T
 // // This runs burst of 100 kernels to measure kernel-to-kernel overhead:
 // RUN: %t.out -d 1000 -b 100 -h %T 
+// // Same bursts, each submitted as one batch:
+// RUN: %t.out -d 1000 -b 100 -B -h %T
 // // Run again with --execute_any_order:
 // RUN: %t.out -d 10000 -h %T --execute_any_order
 // RUN: %t.out -d 1000 -b 100 -h %T  --execute_any_order
@@ -60,6 +62,7 @@ int p_useSystemScope = false;
 int p_dispatch_count = DISPATCH_COUNT;
 int p_burst_count = 1;
 int p_execute_any_order = 0;
+int p_batch = 0; // submit each burst as one batch
 
 int p_queue_wait = 0; // use queue wait vs event wait
 
@@ -109,9 +112,11 @@ void time_dispatch_hsa_kernel(std::string testName, const grid_launch_parm *lp,
   for(int i = 0; i < p_dispatch_count; ++i) {
     start = std::chrono::high_resolution_clock::now();
 
+    if (p_batch) lp->av->begin_batch();
     for (int j=0; j<p_burst_count ;j++) {
         explicit_launch_null_kernel(lp, k);
     };
+    if (p_batch) lp->av->end_batch();
 
     if (p_queue_wait) 
     {
@@ -163,6 +168,7 @@ int parseString(const char *str, const char **output)
 void usage() {
     printf (" --dispatch_count, -d      : Set dispatch count\n");
     printf (" --burst_count, -b         : Set burst count (commands before sync) \n");
+    printf (" --batch, -B               : Submit each burst as one batch (begin_batch/end_batch)\n");
     printf (" --hsaco_dir, -h           : Directory to look for nullkernel hsaco file\n");
     printf (" --tests, -t               : Bit vector to control which tests are run, see p_tests in code\n");
     printf (" --system_scope, -S        : Use system-scope acquire/release for GL submissions\n");
@@ -187,6 +193,8 @@ int main(int argc, char* argv[]) {
         if (++i >= argc || !parseInt(argv[i], &p_burst_count)) {
             failed ("Bad burst_count");
         };
+    } else if (!strcmp(arg, "--batch") || (!strcmp(arg, "-B"))) {
+        p_batch = true;
     } else if (!strcmp(arg, "--hsaco_dir") || (!strcmp(arg, "-h"))) {
         if (++i >= argc || !parseString(argv[i], &nullkernel_hsaco_dir)) {
             failed ("Bad hsaco dir");
@@ -234,7 +242,7 @@ int main(int argc, char* argv[]) {
 
   std::cout << "\n";
   std::cout << "Iterations per test:              " << p_dispatch_count << "\n";
-  std::cout << "Bursts (#dispatches before sync): " << p_burst_count  << "\n";
+  std::cout << "Bursts (#dispatches before sync): " << p_burst_count  << (p_batch ? ", batched" : "") << "\n";
   std::cout << "\n";
 
 
@@ -256,11 +264,13 @@ int main(int argc, char* argv[]) {
         start = std::chrono::high_resolution_clock::now();
 
         hc::completion_future cf;
+        if (p_batch) av.begin_batch();
         for (int j=0; j<p_burst_count ;j++) {
             cf = hc::parallel_for_each(av, hc::extent<3>(lp.grid_dim.x*lp.group_dim.x,1,1).tile(lp.group_dim.x,1,1),
             [=](hc::index<3>& idx) __HC__ {
             });
         };
+        if (p_batch) av.end_batch();
         cf.wait(hc::hcWaitModeActive);
 
         end = std::chrono::high_resolution_clock::now();
@@ -279,11 +289,13 @@ int main(int argc, char* argv[]) {
       for(int i = 0; i < p_dispatch_count; ++i) {
         start = std::chrono::high_resolution_clock::now();
         hc::completion_future cf;
+        if (p_batch) av.begin_batch();
         for (int j=0; j<p_burst_count ;j++) {
             cf = hc::parallel_for_each(av, hc::extent<3>(lp.grid_dim.x*lp.group_dim.x,1,1).tile(lp.group_dim.x,1,1),
             [=](hc::index<3>& idx) __HC__ {
             });
         };
+        if (p_batch) av.end_batch();
         cf.wait(hc::hcWaitModeBlocked);
         end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> dur = end - start;
@@ -303,9 +315,11 @@ int main(int argc, char* argv[]) {
         hc::completion_future cf; // create new completion-future 
         lp.cf = &cf;
 
+        if (p_batch) av.begin_batch();
         for (int j=0; j<p_burst_count ;j++) {
             nullkernel(lp, 0x0);
         }
+        if (p_batch) av.end_batch();
         //std::cout << "CF get_use_count=" << cf.get_use_count() << "is_ready=" << cf.is_ready()<< "\n";
         cf.wait(hc::hcWaitModeActive);
 
@@ -327,9 +341,11 @@ int main(int argc, char* argv[]) {
         hc::completion_future cf; // create new completion-future 
         lp.cf = &cf;
 
+        if (p_batch) av.begin_batch();
         for (int j=0; j<p_burst_count ;j++) {
             nullkernel(lp, 0x0);
         };
+        if (p_batch) av.end_batch();
         //std::cout << "CF get_use_count=" << cf.get_use_count() << "is_ready=" << cf.is_ready()<< "\n";
         cf.wait(hc::hcWaitModeBlocked);
 
@@ -5,6 +5,9 @@
 # burst of kernels:
 ./bench --dispatch_count 5000 --burst_count 100  $@
 
+# same bursts, each submitted with a single doorbell:
+./bench --dispatch_count 5000 --burst_count 100 --batch $@
+
 # Just the code mode dispatches
 ./bench --dispatch_count 5000 --burst_count 100   --tests 0x30 $@
 
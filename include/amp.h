@@ -586,7 +586,7 @@ public:
      *                  initialize this.
      */
     completion_future(const completion_future& other)
-        : __amp_future(other.__amp_future), __thread_then(other.__thread_then) {}
+        : __amp_future(other.__amp_future) {}
 
     /**
      * Move constructor. Move constructs a new completion_future object that
@@ -598,7 +598,7 @@ public:
      *                  completion_future
      */
     completion_future(completion_future&& other)
-        : __amp_future(std::move(other.__amp_future)), __thread_then(other.__thread_then) {}
+        : __amp_future(std::move(other.__amp_future)) {}
 
     /**
      * Copy assignment. Copy assigns the contents of other to this. This method
@@ -611,7 +611,6 @@ public:
     completion_future& operator=(const completion_future& other) {
         if (this != &other) {
            __amp_future = other.__amp_future;
-           __thread_then = other.__thread_then;
         }
         return (*this);
     }
@@ -628,7 +627,6 @@ public:
     completion_future& operator=(completion_future&& other) {
         if (this != &other) {
             __amp_future = std::move(other.__amp_future);
-            __thread_then = other.__thread_then;
         }
         return (*this);
     }
@@ -697,37 +695,22 @@ public:
      * executed upon completion of the asynchronous operation associated with
      * this completion_future object. The completion callback func should have
      * an operator() that is valid when invoked with non arguments, i.e., "func()".
+     *
+     * func is copied and runs on the completion thread of the runtime.
      */
-    // FIXME: notice we removed const from the signature here
-    //        the original signature in the specification should be
-    //        template<typename functor>
-    //        void then(const functor& func) const;
     template<typename functor>
-    void then(const functor & func) {
+    void then(const functor & func) const {
 #if __KALMAR_ACCELERATOR__ != 1
-      // could only assign once
-      if (__thread_then == nullptr) {
-        // spawn a new thread to wait on the future and then execute the callback functor
-        __thread_then = new std::thread([&]() restrict(cpu) {
-          this->wait();
-          if(this->valid())
-            func();
+      if (this->valid()) {
+        Kalmar::CompletionThread::get().post_when_ready(__amp_future, [func]() restrict(cpu) {
+          func();
         });
       }
 #endif
     }
 
-    ~completion_future() {
-      if (__thread_then != nullptr) {
-        __thread_then->join();
-      }
-      delete __thread_then;
-      __thread_then = nullptr;
-    }
-
 private:
     std::shared_future<void> __amp_future;
-    std::thread* __thread_then = nullptr;
 
     completion_future(const std::shared_future<void> &__future)
         : __amp_future(__future) {}
@@ -1101,33 +1084,8 @@ private:
 // ------------------------------------------------------------------------
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
-template <typename Ker, typename Ti>
-void bar_wrapper(Ker *f, Ti *t)
-{
-    (*f)(*t);
-}
-
-struct barrier_t {
-    std::unique_ptr<ucontext_t[]> ctx;
-    int idx;
-    barrier_t (int a) :
-        ctx(new ucontext_t[a + 1]) {}
-    template <typename Ti, typename Ker>
-    void setctx(int x, char *stack, Ker& f, Ti* tidx, int S) {
-        getcontext(&ctx[x]);
-        ctx[x].uc_stack.ss_sp = stack;
-        ctx[x].uc_stack.ss_size = S;
-        ctx[x].uc_link = &ctx[x - 1];
-        makecontext(&ctx[x], (void (*)(void))bar_wrapper<Ker, Ti>, 2, &f, tidx);
-    }
-    void swap(int a, int b) {
-        swapcontext(&ctx[a], &ctx[b]);
-    }
-    void wait() {
-        --idx;
-        swapcontext(&ctx[idx + 1], &ctx[idx]);
-    }
-};
+/// the work-items of a tile run as fibers switching at the barriers
+typedef Kalmar::CPUTileFibers barrier_t;
 #endif
 
 #ifndef CLK_LOCAL_MEM_FENCE
@@ -1426,7 +1384,7 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K, int D1_, int D2_, int D3_> friend
-        void partitioned_task_tile(K const&, tiled_extent<D1_, D2_, D3_> const&, int);
+        void partitioned_task_tile(K const&, tiled_extent<D1_, D2_, D3_> const&, Kalmar::CPUChunkScheduler&);
 #endif
 };
 
@@ -1560,7 +1518,7 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K, int D> friend
-        void partitioned_task_tile(K const&, tiled_extent<D> const&, int);
+        void partitioned_task_tile(K const&, tiled_extent<D> const&, Kalmar::CPUChunkScheduler&);
 #endif
 };
 
@@ -1697,7 +1655,7 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K, int D1_, int D2_> friend
-        void partitioned_task_tile(K const&, tiled_extent<D1_, D2_> const&, int);
+        void partitioned_task_tile(K const&, tiled_extent<D1_, D2_> const&, Kalmar::CPUChunkScheduler&);
 #endif
 };
 
@@ -2035,136 +1993,134 @@ public:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
 #define SSIZE 1024 * 10
-template <int N, typename Kernel,  int K>
+template <typename Kernel, int K>
 struct cpu_helper
 {
-    static inline void call(const Kernel& k, index<K>& idx, const extent<K>& ext) restrict(amp,cpu) {
-        int i;
-        for (i = 0; i < ext[N]; ++i) {
-            idx[N] = i;
-            cpu_helper<N + 1, Kernel, K>::call(k, idx, ext);
+    /// run the kernel over [first, last) of the innermost dimension of idx
+    static inline void call(const Kernel& k, index<K>& idx, int first, int last) restrict(amp,cpu) {
+        const index<K> row = idx;
+        KALMAR_CPU_SIMD_LOOP
+        for (int i = first; i < last; ++i) {
+            index<K> item = row;
+            item[K - 1] = i;
+            // cpu_helper only runs between enter_kernel() and leave_kernel(),
+            // saying so lets the compiler drop the synchronization branch of
+            // every array_view access in the loop
+            if (!Kalmar::CLAMP::in_cpu_kernel())
+                __builtin_unreachable();
+            (const_cast<Kernel&>(k))(item);
         }
     }
 };
-template <typename Kernel, int K>
-struct cpu_helper<K, Kernel, K>
-{
-    static inline void call(const Kernel& k, const index<K>& idx, const extent<K>& ext) restrict(amp,cpu) {
-        (const_cast<Kernel&>(k))(idx);
-    }
-};
 
 template <typename Kernel, int N>
-void partitioned_task(const Kernel& ker, const extent<N>& ext, int part) {
+void partitioned_task(const Kernel& f, const extent<N>& ext, Kalmar::CPUChunkScheduler& sched) {
+    // work on a private bitwise copy of the kernel: no store made by the
+    // kernel can alias its captures, so they are loaded once per row instead
+    // of once per work-item
+    typename std::aligned_storage<sizeof(Kernel), alignof(Kernel)>::type copy;
+    memcpy(&copy, &f, sizeof(Kernel));
+    const Kernel& ker = *reinterpret_cast<const Kernel*>(&copy);
     index<N> idx;
-    int start = ext[0] * part / Kalmar::NTHREAD;
-    int end = ext[0] * (part + 1) / Kalmar::NTHREAD;
-    for (int i = start; i < end; i++) {
-        idx[0] = i;
-        cpu_helper<1, Kernel, N>::call(ker, idx, ext);
+    const size_t row = ext[N - 1];
+    size_t begin, end;
+    while (sched.next_chunk(begin, end)) {
+        // a chunk of the linearized index space is walked one row at a time
+        while (begin < end) {
+            size_t outer = begin / row;
+            for (int d = N - 2; d >= 0; --d) {
+                idx[d] = outer % ext[d];
+                outer /= ext[d];
+            }
+            int first = begin % row;
+            int last = std::min<size_t>(row, first + (end - begin));
+            cpu_helper<Kernel, N>::call(ker, idx, first, last);
+            begin += last - first;
+        }
     }
 }
 
 template <typename Kernel, int D0>
-void partitioned_task_tile(Kernel const& f, tiled_extent<D0> const& ext, int part) {
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
+void partitioned_task_tile(Kernel const& f, tiled_extent<D0> const& ext, Kalmar::CPUChunkScheduler& sched) {
+    size_t begin, end;
+    if (!sched.next_chunk(begin, end))
         return;
-    char *stk = new char[D0 * SSIZE];
+    char *stk = Kalmar::CPUTileArena::get().reserve_stacks(D0 * SSIZE);
     tiled_index<D0> *tidx = new tiled_index<D0>[D0];
     tile_barrier::pb_t amp_bar = std::make_shared<barrier_t>(D0);
     tile_barrier tbar(amp_bar);
-    for (int tx = start; tx < end; tx++) {
-        int id = 0;
-        char *sp = stk;
-        tiled_index<D0> *tip = tidx;
-        for (int x = 0; x < D0; x++) {
-            new (tip) tiled_index<D0>(tx * D0 + x, x, tx, tbar);
-            amp_bar->setctx(++id, sp, f, tip, SSIZE);
-            sp += SSIZE;
-            ++tip;
-        }
-        amp_bar->idx = 0;
-        while (amp_bar->idx == 0) {
-            amp_bar->idx = id;
-            amp_bar->swap(0, id);
+    do {
+        for (int tx = begin; tx < end; tx++) {
+            tiled_index<D0> *tip = tidx;
+            for (int x = 0; x < D0; x++) {
+                tip->~tiled_index();
+                new (tip) tiled_index<D0>(tx * D0 + x, x, tx, tbar);
+                ++tip;
+            }
+            amp_bar->run(f, tidx, D0, stk, SSIZE);
         }
-    }
-    delete [] stk;
+    } while (sched.next_chunk(begin, end));
     delete [] tidx;
 }
 template <typename Kernel, int D0, int D1>
-void partitioned_task_tile(Kernel const& f, tiled_extent<D0, D1> const& ext, int part) {
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
+void partitioned_task_tile(Kernel const& f, tiled_extent<D0, D1> const& ext, Kalmar::CPUChunkScheduler& sched) {
+    int ntx = ext[1] / D1;
+    size_t begin, end;
+    if (!sched.next_chunk(begin, end))
         return;
-    char *stk = new char[D1 * D0 * SSIZE];
+    char *stk = Kalmar::CPUTileArena::get().reserve_stacks(D1 * D0 * SSIZE);
     tiled_index<D0, D1> *tidx = new tiled_index<D0, D1>[D0 * D1];
     tile_barrier::pb_t amp_bar = std::make_shared<barrier_t>(D0 * D1);
     tile_barrier tbar(amp_bar);
 
-    for (int tx = 0; tx < ext[1] / D1; tx++)
-        for (int ty = start; ty < end; ty++) {
-            int id = 0;
-            char *sp = stk;
+    do {
+        for (size_t t = begin; t < end; t++) {
+            int ty = t / ntx;
+            int tx = t % ntx;
             tiled_index<D0, D1> *tip = tidx;
             for (int x = 0; x < D1; x++)
                 for (int y = 0; y < D0; y++) {
+                    tip->~tiled_index();
                     new (tip) tiled_index<D0, D1>(D1 * tx + x, D0 * ty + y, x, y, tx, ty, tbar);
-                    amp_bar->setctx(++id, sp, f, tip, SSIZE);
                     ++tip;
-                    sp += SSIZE;
                 }
-            amp_bar->idx = 0;
-            while (amp_bar->idx == 0) {
-                amp_bar->idx = id;
-                amp_bar->swap(0, id);
-            }
+            amp_bar->run(f, tidx, D0 * D1, stk, SSIZE);
         }
-    delete [] stk;
+    } while (sched.next_chunk(begin, end));
     delete [] tidx;
 }
 
 template <typename Kernel, int D0, int D1, int D2>
-void partitioned_task_tile(Kernel const& f, tiled_extent<D0, D1, D2> const& ext, int part) {
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
+void partitioned_task_tile(Kernel const& f, tiled_extent<D0, D1, D2> const& ext, Kalmar::CPUChunkScheduler& sched) {
+    int ni = ext[2] / D2;
+    int nj = ext[1] / D1;
+    size_t begin, end;
+    if (!sched.next_chunk(begin, end))
         return;
-    char *stk = new char[D2 * D1 * D0 * SSIZE];
+    char *stk = Kalmar::CPUTileArena::get().reserve_stacks(D2 * D1 * D0 * SSIZE);
     tiled_index<D0, D1, D2> *tidx = new tiled_index<D0, D1, D2>[D0 * D1 * D2];
     tile_barrier::pb_t amp_bar = std::make_shared<barrier_t>(D0 * D1 * D2);
     tile_barrier tbar(amp_bar);
 
-    for (int i = 0; i < ext[2] / D2; i++)
-        for (int j = 0; j < ext[1] / D1; j++)
-            for(int k = start; k < end; k++) {
-                int id = 0;
-                char *sp = stk;
-                tiled_index<D0, D1, D2> *tip = tidx;
-                for (int x = 0; x < D2; x++)
-                    for (int y = 0; y < D1; y++)
-                        for (int z = 0; z < D0; z++) {
-                            new (tip) tiled_index<D0, D1, D2>(D2 * i + x,
-                                                              D1 * j + y,
-                                                              D0 * k + z,
-                                                              x, y, z, i, j, k, tbar);
-                            amp_bar->setctx(++id, sp, f, tip, SSIZE);
-                            ++tip;
-                            sp += SSIZE;
-                        }
-                amp_bar->idx = 0;
-                while (amp_bar->idx == 0) {
-                    amp_bar->idx = id;
-                    amp_bar->swap(0, id);
-                }
-            }
-    delete [] stk;
+    do {
+        for (size_t t = begin; t < end; t++) {
+            int k = t / (nj * ni);
+            int j = (t / ni) % nj;
+            int i = t % ni;
+            tiled_index<D0, D1, D2> *tip = tidx;
+            for (int x = 0; x < D2; x++)
+                for (int y = 0; y < D1; y++)
+                    for (int z = 0; z < D0; z++) {
+                        tip->~tiled_index();
+                        new (tip) tiled_index<D0, D1, D2>(D2 * i + x,
+                                                          D1 * j + y,
+                                                          D0 * k + z,
+                                                          x, y, z, i, j, k, tbar);
+                        ++tip;
+                    }
+            amp_bar->run(f, tidx, D0 * D1 * D2, stk, SSIZE);
+        }
+    } while (sched.next_chunk(begin, end));
     delete [] tidx;
 }
 
@@ -2172,39 +2128,49 @@ template <typename Kernel, int N>
 void launch_cpu_task(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      extent<N> const& compute_domain)
 {
+    Kalmar::CPUThreadPool& pool = Kalmar::CPUThreadPool::get(pQueue.get());
+    Kalmar::CPUChunkScheduler sched(compute_domain.size(),
+                                    Kalmar::cpu_grain_size(compute_domain.size(), Kalmar::CPU_CACHE_LINE_SIZE),
+                                    pool.shares());
     Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task<Kernel, N>, std::cref(f), std::cref(compute_domain), i);
+    for (unsigned int i = Kalmar::cpu_partitions(pool, sched); i > 0; --i)
+        obj.submit([&f, &compute_domain, &sched] { partitioned_task<Kernel, N>(f, compute_domain, sched); });
 }
 
 template <typename Kernel, int D0>
 void launch_cpu_task(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<D0> const& compute_domain)
 {
+    size_t tiles = compute_domain[0] / D0;
+    Kalmar::CPUThreadPool& pool = Kalmar::CPUThreadPool::get(pQueue.get());
+    Kalmar::CPUChunkScheduler sched(tiles, Kalmar::cpu_grain_size(tiles, 1), pool.shares());
     Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile<Kernel, D0>,
-                             std::cref(f), std::cref(compute_domain), i);
+    for (unsigned int i = Kalmar::cpu_partitions(pool, sched); i > 0; --i)
+        obj.submit([&f, &compute_domain, &sched] { partitioned_task_tile<Kernel, D0>(f, compute_domain, sched); });
 }
 
 template <typename Kernel, int D0, int D1>
 void launch_cpu_task(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<D0, D1> const& compute_domain)
 {
+    size_t tiles = (compute_domain[0] / D0) * (compute_domain[1] / D1);
+    Kalmar::CPUThreadPool& pool = Kalmar::CPUThreadPool::get(pQueue.get());
+    Kalmar::CPUChunkScheduler sched(tiles, Kalmar::cpu_grain_size(tiles, 1), pool.shares());
     Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile<Kernel, D0, D1>,
-                             std::cref(f), std::cref(compute_domain), i);
+    for (unsigned int i = Kalmar::cpu_partitions(pool, sched); i > 0; --i)
+        obj.submit([&f, &compute_domain, &sched] { partitioned_task_tile<Kernel, D0, D1>(f, compute_domain, sched); });
 }
 
 template <typename Kernel, int D0, int D1, int D2>
 void launch_cpu_task(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<D0, D1, D2> const& compute_domain)
 {
+    size_t tiles = (compute_domain[0] / D0) * (compute_domain[1] / D1) * (compute_domain[2] / D2);
+    Kalmar::CPUThreadPool& pool = Kalmar::CPUThreadPool::get(pQueue.get());
+    Kalmar::CPUChunkScheduler sched(tiles, Kalmar::cpu_grain_size(tiles, 1), pool.shares());
     Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile<Kernel, D0, D1, D2>,
-                             std::cref(f), std::cref(compute_domain), i);
+    for (unsigned int i = Kalmar::cpu_partitions(pool, sched); i > 0; --i)
+        obj.submit([&f, &compute_domain, &sched] { partitioned_task_tile<Kernel, D0, D1, D2>(f, compute_domain, sched); });
 }
 
 #endif
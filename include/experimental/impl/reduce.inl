@@ -14,13 +14,55 @@ T reduce_impl(InputIterator first, InputIterator last,
 }
 
 #define REDUCE_WAVEFRONT_SIZE 512
-#define _REDUCE_STEP(_LENGTH, _IDX, _W) \
-if ((_IDX < _W) && ((_IDX + _W) < _LENGTH)) {\
-	T mine = scratch[_IDX]; \
-	T other = scratch[_IDX + _W]; \
-	scratch[_IDX] = binary_op(mine, other); \
-}\
-    t_idx.barrier.wait();
+
+// The tile reductions are written as hc::tile_phases, so the CPU execution
+// path runs every step below as a loop over the tile instead of switching
+// between the work-items at each barrier.
+
+/// state a work-item carries between the phases of a tile reduction
+struct reduce_item {
+  unsigned int idx;   // index of the work-item in its tile
+  unsigned int tail;  // number of input elements from the start of the tile
+  int gloId;
+};
+
+template<class T>
+struct reduce_scratch {
+  T scratch[REDUCE_WAVEFRONT_SIZE];
+};
+
+/// phase folding scratch[idx + _W] into scratch[idx] for the first _W items
+template<class T, class BinaryOperation, unsigned int _W>
+struct reduce_step {
+  BinaryOperation binary_op;
+
+  void operator()(const hc::tiled_index<1>&, reduce_item& item, reduce_scratch<T>& s) const [[hc]] [[cpu]] {
+    if ((item.idx < _W) && ((item.idx + _W) < item.tail)) {
+      T mine = s.scratch[item.idx];
+      T other = s.scratch[item.idx + _W];
+      s.scratch[item.idx] = binary_op(mine, other);
+    }
+  }
+};
+
+/// a tile reduction: load fills the scratch of the tile, the steps halve it
+/// down to scratch[0] and store writes that out
+template<class T, class BinaryOperation, class Load, class Store>
+hc::tile_phases<1, reduce_item, reduce_scratch<T>, Load,
+                reduce_step<T, BinaryOperation, 256>, reduce_step<T, BinaryOperation, 128>,
+                reduce_step<T, BinaryOperation, 64>, reduce_step<T, BinaryOperation, 32>,
+                reduce_step<T, BinaryOperation, 16>, reduce_step<T, BinaryOperation, 8>,
+                reduce_step<T, BinaryOperation, 4>, reduce_step<T, BinaryOperation, 2>,
+                reduce_step<T, BinaryOperation, 1>, Store>
+reduce_phases(const Load& load, BinaryOperation binary_op, const Store& store) {
+  return hc::make_tile_phases<1, reduce_item, reduce_scratch<T>>(
+      hc::cpu_tile_mode::fission, load,
+      reduce_step<T, BinaryOperation, 256>{binary_op}, reduce_step<T, BinaryOperation, 128>{binary_op},
+      reduce_step<T, BinaryOperation, 64>{binary_op}, reduce_step<T, BinaryOperation, 32>{binary_op},
+      reduce_step<T, BinaryOperation, 16>{binary_op}, reduce_step<T, BinaryOperation, 8>{binary_op},
+      reduce_step<T, BinaryOperation, 4>{binary_op}, reduce_step<T, BinaryOperation, 2>{binary_op},
+      reduce_step<T, BinaryOperation, 1>{binary_op}, store);
+}
 
 int reduce_lexi(std::vector<int>& v) {
 
@@ -44,19 +86,19 @@ int reduce_lexi(std::vector<int>& v) {
     hc::array_view<int> result(numTiles, r);
     hc::array_view<const int> first_(N, v);
     result.discard_data();
-    kernel_launch(length,
-                  [ first_, N, length, result, binary_op ]
-                  ( hc::tiled_index<1> t_idx ) [[hc]] [[cpu]]
-                  {
+    typedef decltype(binary_op) Op;
+    auto load = [ first_, N, length, binary_op ]
+                ( const hc::tiled_index<1>& t_idx, reduce_item& item, reduce_scratch<int>& s ) [[hc]] [[cpu]]
+                {
                   using T = int;
                   int gx = t_idx.global[0];
-                  int gloId = gx;
-                  tile_static int scratch[REDUCE_WAVEFRONT_SIZE];
+                  item.gloId = gx;
                   //  Initialize local data store
-                  unsigned int tileIndex = t_idx.local[0];
+                  item.idx = t_idx.local[0];
+                  item.tail = N - (t_idx.tile[0] * REDUCE_WAVEFRONT_SIZE);
 
                   int accumulator;
-                  if (gloId < N)
+                  if (item.gloId < N)
                   {
                   accumulator = first_[gx];
                   gx += length;
@@ -72,33 +114,31 @@ int reduce_lexi(std::vector<int>& v) {
                       gx += length;
                   }
 
-                  scratch[tileIndex] = accumulator;
-                  t_idx.barrier.wait();
-
-                  unsigned int tail = N - (t_idx.tile[0] * REDUCE_WAVEFRONT_SIZE);
-
-                  _REDUCE_STEP(tail, tileIndex, 1);
-                  _REDUCE_STEP(tail, tileIndex, 2);
-                  _REDUCE_STEP(tail, tileIndex, 4);
-                  _REDUCE_STEP(tail, tileIndex, 8);
-                  _REDUCE_STEP(tail, tileIndex, 16);
-                  _REDUCE_STEP(tail, tileIndex, 32);
-                  _REDUCE_STEP(tail, tileIndex, 64);
-                  _REDUCE_STEP(tail, tileIndex, 128);
-                  _REDUCE_STEP(tail, tileIndex, 256);
-
-
+                  s.scratch[item.idx] = accumulator;
+                };
+    auto store = [ N, result ]
+                 ( const hc::tiled_index<1>& t_idx, reduce_item& item, reduce_scratch<int>& s ) [[hc]] [[cpu]]
+                 {
                   //  Abort threads that are passed the end of the input vector
-                  if (gloId >= N)
+                  if (item.gloId >= N)
                       return;
 
                   //  Write only the single reduced value for the entire workgroup
-                  if (tileIndex == 0)
+                  if (item.idx == 0)
                   {
-                      result[t_idx.tile[ 0 ]] = scratch[0];
+                      result[t_idx.tile[ 0 ]] = s.scratch[0];
                   }
-
-                  }, REDUCE_WAVEFRONT_SIZE);
+                 };
+    // the first non-1 value wins, so the steps keep the order of the input
+    kernel_launch(length,
+                  hc::make_tile_phases<1, reduce_item, reduce_scratch<int>>(
+                      hc::cpu_tile_mode::fission, load,
+                      reduce_step<int, Op, 1>{binary_op}, reduce_step<int, Op, 2>{binary_op},
+                      reduce_step<int, Op, 4>{binary_op}, reduce_step<int, Op, 8>{binary_op},
+                      reduce_step<int, Op, 16>{binary_op}, reduce_step<int, Op, 32>{binary_op},
+                      reduce_step<int, Op, 64>{binary_op}, reduce_step<int, Op, 128>{binary_op},
+                      reduce_step<int, Op, 256>{binary_op}, store),
+                  REDUCE_WAVEFRONT_SIZE);
 
     result.synchronize();
     auto ans = std::accumulate(std::begin(r), std::end(r), 1, binary_op);
@@ -132,18 +172,17 @@ T reduce_impl(RandomAccessIterator first, RandomAccessIterator last,
     hc::array_view<T> result(hc::extent<1>(numTiles), r);
     hc::array_view<const _Ty> first_(hc::extent<1>(N), f_);
     result.discard_data();
-    kernel_launch(length,
-                  [ first_, N, length, result, binary_op ]
-                  ( hc::tiled_index<1> t_idx ) [[hc]]
-                  {
+    auto load = [ first_, N, length, binary_op ]
+                ( const hc::tiled_index<1>& t_idx, reduce_item& item, reduce_scratch<T>& s ) [[hc]] [[cpu]]
+                {
                   int gx = t_idx.global[0];
-                  int gloId = gx;
-                  tile_static T scratch[REDUCE_WAVEFRONT_SIZE];
+                  item.gloId = gx;
                   //  Initialize local data store
-                  unsigned int tileIndex = t_idx.local[0];
+                  item.idx = t_idx.local[0];
+                  item.tail = N - (t_idx.tile[0] * REDUCE_WAVEFRONT_SIZE);
 
                   T accumulator;
-                  if (gloId < N)
+                  if (item.gloId < N)
                   {
                   accumulator = first_[gx];
                   gx += length;
@@ -159,33 +198,22 @@ T reduce_impl(RandomAccessIterator first, RandomAccessIterator last,
                       gx += length;
                   }
 
-                  scratch[tileIndex] = accumulator;
-                  t_idx.barrier.wait();
-
-                  unsigned int tail = N - (t_idx.tile[0] * REDUCE_WAVEFRONT_SIZE);
-
-                  _REDUCE_STEP(tail, tileIndex, 256);
-                  _REDUCE_STEP(tail, tileIndex, 128);
-                  _REDUCE_STEP(tail, tileIndex, 64);
-                  _REDUCE_STEP(tail, tileIndex, 32);
-                  _REDUCE_STEP(tail, tileIndex, 16);
-                  _REDUCE_STEP(tail, tileIndex, 8);
-                  _REDUCE_STEP(tail, tileIndex, 4);
-                  _REDUCE_STEP(tail, tileIndex, 2);
-                  _REDUCE_STEP(tail, tileIndex, 1);
-
-
+                  s.scratch[item.idx] = accumulator;
+                };
+    auto store = [ N, result ]
+                 ( const hc::tiled_index<1>& t_idx, reduce_item& item, reduce_scratch<T>& s ) [[hc]] [[cpu]]
+                 {
                   //  Abort threads that are passed the end of the input vector
-                  if (gloId >= N)
+                  if (item.gloId >= N)
                       return;
 
                   //  Write only the single reduced value for the entire workgroup
-                  if (tileIndex == 0)
+                  if (item.idx == 0)
                   {
-                      result[t_idx.tile[ 0 ]] = scratch[0];
+                      result[t_idx.tile[ 0 ]] = s.scratch[0];
                   }
-
-                  }, REDUCE_WAVEFRONT_SIZE);
+                 };
+    kernel_launch(length, reduce_phases<T>(load, binary_op, store), REDUCE_WAVEFRONT_SIZE);
 
     result.synchronize();
     auto ans = std::accumulate(std::begin(r), std::end(r), init, binary_op);
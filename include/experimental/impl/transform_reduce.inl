@@ -6,13 +6,8 @@
 
 #define _T_REDUCE_WAVEFRONT_SIZE 512
 
-#define _T_REDUCE_STEP(_LENGTH, _IDX, _W) \
-    if ((_IDX < _W) && ((_IDX + _W) < _LENGTH)) {\
-      T mine = scratch[_IDX];\
-      T other = scratch[_IDX + _W];\
-      scratch[_IDX] = binary_op(mine, other); \
-    }\
-    t_idx.barrier.wait();
+static_assert(_T_REDUCE_WAVEFRONT_SIZE == REDUCE_WAVEFRONT_SIZE,
+              "transform_reduce tiles share the tile reduction of reduce");
 
 /**
  *
@@ -56,16 +51,17 @@ T transform_reduce(InputIterator first, InputIterator last,
   hc::array_view<_Tp> first_(hc::extent<1>(N), f_);
   result.discard_data();
   auto transform_op = unary_op;
-  details::kernel_launch(length, [first_, N, length, transform_op, result, binary_op] (hc::tiled_index<1> t_idx) [[hc]]
+  auto load = [first_, N, length, transform_op, binary_op]
+              (const hc::tiled_index<1>& t_idx, details::reduce_item& item, details::reduce_scratch<T>& s) [[hc]] [[cpu]]
                 {
                 int gx = t_idx.global[0];
-                int gloId = gx;
-                tile_static T scratch[_T_REDUCE_WAVEFRONT_SIZE];
+                item.gloId = gx;
                 //  Initialize local data store
-                unsigned int tileIndex = t_idx.local[0];
+                item.idx = t_idx.local[0];
+                item.tail = N - (t_idx.tile[0] * _T_REDUCE_WAVEFRONT_SIZE);
 
                 T accumulator;
-                if (gloId < N)
+                if (item.gloId < N)
                 {
                 accumulator = transform_op(first_[gx]);
                 gx += length;
@@ -81,32 +77,22 @@ T transform_reduce(InputIterator first, InputIterator last,
                 gx += length;
                 }
 
-                scratch[tileIndex] = accumulator;
-                t_idx.barrier.wait();
-
-                unsigned int tail = N - (t_idx.tile[0] * _T_REDUCE_WAVEFRONT_SIZE);
-
-                _T_REDUCE_STEP(tail, tileIndex, 256);
-                _T_REDUCE_STEP(tail, tileIndex, 128);
-                _T_REDUCE_STEP(tail, tileIndex, 64);
-                _T_REDUCE_STEP(tail, tileIndex, 32);
-                _T_REDUCE_STEP(tail, tileIndex, 16);
-                _T_REDUCE_STEP(tail, tileIndex, 8);
-                _T_REDUCE_STEP(tail, tileIndex, 4);
-                _T_REDUCE_STEP(tail, tileIndex, 2);
-                _T_REDUCE_STEP(tail, tileIndex, 1);
-
-
+                s.scratch[item.idx] = accumulator;
+                };
+  auto store = [N, result]
+               (const hc::tiled_index<1>& t_idx, details::reduce_item& item, details::reduce_scratch<T>& s) [[hc]] [[cpu]]
+                {
                 //  Abort threads that are passed the end of the input vector
-                if (gloId >= N)
+                if (item.gloId >= N)
                     return;
 
                 //  Write only the single reduced value for the entire workgroup
-                if (tileIndex == 0)
+                if (item.idx == 0)
                 {
-                    result[t_idx.tile[ 0 ]] = scratch[0];
+                    result[t_idx.tile[ 0 ]] = s.scratch[0];
                 }
-                }, _T_REDUCE_WAVEFRONT_SIZE);
+                };
+  details::kernel_launch(length, details::reduce_phases<T>(load, binary_op, store), _T_REDUCE_WAVEFRONT_SIZE);
   result.synchronize();
   auto ans = std::accumulate(r.get(), r.get() + numTiles, init, binary_op);
   return ans;
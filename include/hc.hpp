@@ -54,6 +54,7 @@ using namespace Kalmar::CLAMP;
 class accelerator;
 class accelerator_view;
 class completion_future;
+class command_graph;
 template <int N> class extent;
 template <int N> class tiled_extent;
 template <typename T, int N> class array_view;
@@ -619,6 +620,88 @@ public:
         return false;
      }
 
+    /**
+     * Set the priority of this accelerator_view on its accelerator.
+     * The accelerator_views of an accelerator share at most HCC_MAX_QUEUES
+     * hardware queues. When an accelerator_view needs a hardware queue and
+     * none is free, it takes the one of an idle accelerator_view of lowest
+     * priority, the least recently used among those; accelerator_views of
+     * higher priority waiting for a hardware queue are served first.
+     *
+     * @param priority the priority, 0 by default. Higher is more important.
+     *
+     * @return true if operations succeeds or false if not.
+     */
+    bool set_queue_priority(int priority) {
+        return pQueue->set_queue_priority(priority);
+    }
+
+    /**
+     * Pin the hardware queue of this accelerator_view: it is not taken by
+     * other accelerator_views until this one is destroyed or unpinned.
+     *
+     * @param pinned whether the hardware queue is pinned.
+     *
+     * @return true if operations succeeds or false if not.
+     */
+    bool set_queue_pinned(bool pinned) {
+        return pQueue->set_queue_pinned(pinned);
+    }
+
+    /**
+     * Start a batch of commands on this accelerator_view. The commands
+     * enqueued until the matching end_batch() are written to the hardware
+     * queue as they are enqueued, and submitted to the device together at
+     * end_batch(), with a single doorbell ring. Batches may be nested, the
+     * outermost end_batch() submits.
+     *
+     * Waiting for a command of this accelerator_view, or querying whether it
+     * is ready, submits the commands of the batch enqueued so far.
+     */
+    void begin_batch() {
+        pQueue->beginBatch();
+    }
+
+    /**
+     * End a batch of commands started with begin_batch().
+     */
+    void end_batch() {
+        pQueue->endBatch();
+    }
+
+    /**
+     * Start recording the commands enqueued on this accelerator_view into a
+     * command_graph: kernels, copies and markers enqueued until end_capture()
+     * are not run but recorded. The recorded commands are run by launching
+     * the graph.
+     *
+     * The completion_futures of recorded commands never become ready: get()
+     * and wait() throw a runtime_exception, and so does get() of the
+     * completion_future a then() continuation of one returns, without
+     * running the continuation. They may only serve as dependencies of
+     * markers recorded into the same graph.
+     *
+     * Kernels recorded into a graph may use arrays and device memory, but
+     * not array_views: launches of the graph would not keep the host copy
+     * of an array_view coherent, so recording such a kernel throws a
+     * runtime_exception.
+     *
+     * @return true if operations succeeds or false if not, e.g. if the
+     *         accelerator_view is already recording or can not record
+     *         commands.
+     */
+    bool begin_capture() {
+        return pQueue->beginCapture();
+    }
+
+    /**
+     * Stop recording commands, see begin_capture().
+     *
+     * @return the recorded commands, an invalid command_graph if the
+     *         accelerator_view was not recording.
+     */
+    command_graph end_capture();
+
 private:
     accelerator_view(std::shared_ptr<Kalmar::KalmarQueue> pQueue) : pQueue(pQueue) {}
     std::shared_ptr<Kalmar::KalmarQueue> pQueue;
@@ -1131,7 +1214,7 @@ public:
      * object which does not refer to any asynchronous operation. Default
      * constructed completion_future objects have valid() == false
      */
-    completion_future() : __amp_future(), __thread_then(nullptr), __asyncOp(nullptr) {};
+    completion_future() : __amp_future(), __asyncOp(nullptr) {};
 
     /**
      * Copy constructor. Constructs a new completion_future object that referes
@@ -1141,7 +1224,7 @@ public:
      *                  initialize this.
      */
     completion_future(const completion_future& other)
-        : __amp_future(other.__amp_future), __thread_then(other.__thread_then), __asyncOp(other.__asyncOp) {}
+        : __amp_future(other.__amp_future), __asyncOp(other.__asyncOp) {}
 
     /**
      * Move constructor. Move constructs a new completion_future object that
@@ -1153,7 +1236,7 @@ public:
      *                  completion_future
      */
     completion_future(completion_future&& other)
-        : __amp_future(std::move(other.__amp_future)), __thread_then(other.__thread_then), __asyncOp(other.__asyncOp) {}
+        : __amp_future(std::move(other.__amp_future)), __asyncOp(std::move(other.__asyncOp)) {}
 
     /**
      * Copy assignment. Copy assigns the contents of other to this. This method
@@ -1166,7 +1249,6 @@ public:
     completion_future& operator=(const completion_future& _Other) {
         if (this != &_Other) {
            __amp_future = _Other.__amp_future;
-           __thread_then = _Other.__thread_then;
            __asyncOp = _Other.__asyncOp;
         }
         return (*this);
@@ -1184,8 +1266,7 @@ public:
     completion_future& operator=(completion_future&& _Other) {
         if (this != &_Other) {
             __amp_future = std::move(_Other.__amp_future);
-            __thread_then = _Other.__thread_then;
-           __asyncOp = _Other.__asyncOp;
+            __asyncOp = std::move(_Other.__asyncOp);
         }
         return (*this);
     }
@@ -1198,7 +1279,11 @@ public:
      * operation, this method throws that stored exception.
      */
     void get() const {
-        __amp_future.get();
+        if (__asyncOp != nullptr) {
+            __asyncOp->get();
+        } else {
+            __amp_future.get();
+        }
     }
 
     /**
@@ -1207,7 +1292,7 @@ public:
      * completion_future is associated with an asynchronous operation.
      */
     bool valid() const {
-        return __amp_future.valid();
+        return __asyncOp != nullptr || __amp_future.valid();
     }
 
     /** @{ */
@@ -1230,11 +1315,13 @@ public:
      */
     void wait(hcWaitMode mode = hcWaitModeBlocked) const {
         if (this->valid()) {
+            //TODO-ASYNC - need to reclaim older AsyncOps here.
             if (__asyncOp != nullptr) {
                 __asyncOp->setWaitMode(mode);
-            }   
-            //TODO-ASYNC - need to reclaim older AsyncOps here.
-            __amp_future.wait();
+                __asyncOp->wait();
+            } else {
+                __amp_future.wait();
+            }
         }
 
         Kalmar::getContext()->flushPrintfBuffer();
@@ -1242,12 +1329,27 @@ public:
 
     template <class _Rep, class _Period>
     std::future_status wait_for(const std::chrono::duration<_Rep, _Period>& _Rel_time) const {
-        return __amp_future.wait_for(_Rel_time);
+        if (__asyncOp == nullptr) {
+            return __amp_future.wait_for(_Rel_time);
+        }
+        return __asyncOp->waitFor(std::chrono::duration_cast<std::chrono::nanoseconds>(_Rel_time))
+               ? std::future_status::ready : std::future_status::timeout;
     }
 
     template <class _Clock, class _Duration>
     std::future_status wait_until(const std::chrono::time_point<_Clock, _Duration>& _Abs_time) const {
-        return __amp_future.wait_until(_Abs_time);
+        if (__asyncOp == nullptr) {
+            return __amp_future.wait_until(_Abs_time);
+        }
+        // the op waits for a duration, measured again should _Clock have
+        // been adjusted meanwhile
+        while (!__asyncOp->waitFor(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   _Abs_time - _Clock::now()))) {
+            if (_Clock::now() >= _Abs_time) {
+                return std::future_status::timeout;
+            }
+        }
+        return std::future_status::ready;
     }
 
     /** @} */
@@ -1258,6 +1360,10 @@ public:
      * object and refers to the same asynchronous operation.
      */
     operator std::shared_future<void>() const {
+        if (__asyncOp != nullptr) {
+            std::shared_future<void>* f = __asyncOp->getFuture();
+            return f ? *f : std::shared_future<void>();
+        }
         return __amp_future;
     }
 
@@ -1266,23 +1372,51 @@ public:
      * executed upon completion of the asynchronous operation associated with
      * this completion_future object. The completion callback func should have
      * an operator() that is valid when invoked with non arguments, i.e., "func()".
+     *
+     * func is copied and runs on a completion thread owned by the runtime,
+     * which runs the callbacks of all completion_future objects; it should
+     * not wait for another callback to run. Callbacks may be chained: the
+     * returned completion_future becomes ready once func has returned, and
+     * holds the exception func threw, if any. If the operation of this
+     * completion_future fails, get() and wait() of this one would throw,
+     * func does not run and the returned completion_future holds that
+     * exception instead. An empty completion_future is returned if this one
+     * is not valid(), and func never runs.
      */
-    // FIXME: notice we removed const from the signature here
-    //        the original signature in the specification should be
-    //        template<typename functor>
-    //        void then(const functor& func) const;
     template<typename functor>
-    void then(const functor & func) {
+    completion_future then(const functor & func) const {
 #if __KALMAR_ACCELERATOR__ != 1
-      // could only assign once
-      if (__thread_then == nullptr) {
-        // spawn a new thread to wait on the future and then execute the callback functor
-        __thread_then = new std::thread([&]() __CPU__ {
-          this->wait();
-          if(this->valid())
-            func();
-        });
+      if (!valid()) {
+        return completion_future();
+      }
+      auto next = std::make_shared<Kalmar::CPUAsyncOp>(
+          __asyncOp ? __asyncOp->getQueue() : nullptr, Kalmar::hcCommandInvalid);
+      // the callback holds the op, keeping it alive until it has completed
+      std::shared_ptr<Kalmar::KalmarAsyncOp> op = __asyncOp;
+      std::shared_future<void> fut = __amp_future;
+      auto callback = [op, fut, next, func]() __CPU__ {
+        std::exception_ptr error = nullptr;
+        try {
+          // the operation is done, this only rethrows its exception
+          if (op != nullptr) {
+            op->get();
+          } else {
+            fut.get();
+          }
+          func();
+        } catch (...) {
+          error = std::current_exception();
+        }
+        next->complete(error);
+      };
+      if (op != nullptr) {
+        op->onComplete(callback);
+      } else {
+        Kalmar::CompletionThread::get().post_when_ready(fut, callback);
       }
+      return completion_future(std::shared_ptr<Kalmar::KalmarAsyncOp>(next));
+#else
+      return completion_future();
 #endif
     }
 
@@ -1359,12 +1493,6 @@ public:
     }
 
     ~completion_future() {
-      if (__thread_then != nullptr) {
-        __thread_then->join();
-      }
-      delete __thread_then;
-      __thread_then = nullptr;
-      
       if (__asyncOp != nullptr) {
         __asyncOp = nullptr;
       }
@@ -1378,15 +1506,26 @@ public:
 
 private:
     std::shared_future<void> __amp_future;
-    std::thread* __thread_then = nullptr;
     std::shared_ptr<Kalmar::KalmarAsyncOp> __asyncOp;
 
-    completion_future(std::shared_ptr<Kalmar::KalmarAsyncOp> event) : __amp_future(*(event->getFuture())), __asyncOp(event) {}
+    // waits go to the op itself, __amp_future is left empty
+    completion_future(std::shared_ptr<Kalmar::KalmarAsyncOp> event) : __amp_future(), __asyncOp(event) {}
 
     completion_future(const std::shared_future<void> &__future)
-        : __amp_future(__future), __thread_then(nullptr), __asyncOp(nullptr) {}
+        : __amp_future(__future), __asyncOp(nullptr) {}
 
     friend class Kalmar::HSAQueue;
+
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+    template <typename Kernel, int N> friend
+        completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>&, Kernel const&, extent<N> const&);
+    template <typename Kernel> friend
+        completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>&, Kernel const&, tiled_extent<1> const&);
+    template <typename Kernel> friend
+        completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>&, Kernel const&, tiled_extent<2> const&);
+    template <typename Kernel> friend
+        completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>&, Kernel const&, tiled_extent<3> const&);
+#endif
     
     // non-tiled parallel_for_each
     // generic version
@@ -1447,6 +1586,89 @@ private:
 
     // accelerator_view
     friend class accelerator_view;
+
+    // command_graph
+    friend class command_graph;
+};
+
+// ------------------------------------------------------------------------
+// command_graph
+// ------------------------------------------------------------------------
+
+/**
+ * A sequence of commands recorded from an accelerator_view between
+ * accelerator_view::begin_capture() and accelerator_view::end_capture().
+ * Launching the graph enqueues the recorded commands again into that
+ * accelerator_view, with the kernel dispatch packets, kernel arguments and
+ * dependencies prepared at capture time, so that a sequence issued over and
+ * over does not go through the launch path of each command every time.
+ *
+ * The arguments of a recorded kernel may be changed between launches with
+ * set_kernel_arg(). Buffers accessed by the recorded commands must remain
+ * valid as long as the graph may be launched.
+ */
+class command_graph {
+public:
+    /**
+     * Default constructor. Constructs an empty command_graph, with
+     * valid() == false.
+     */
+    command_graph() : pQueue(nullptr), pGraph(nullptr) {}
+
+    /**
+     * @return true if the graph holds recorded commands.
+     */
+    bool valid() const { return pGraph != nullptr; }
+
+    /**
+     * @return the number of recorded commands.
+     */
+    size_t get_node_count() const { return pGraph ? pGraph->getNodeCount() : 0; }
+
+    /**
+     * Overwrite size bytes of the kernel arguments of a recorded kernel,
+     * starting at offset bytes into them. The new values are used from the
+     * next launch on.
+     *
+     * @param[in] node index of the kernel among the recorded commands, in
+     *                 the order they were enqueued.
+     * @param[in] offset offset in bytes into the kernel arguments.
+     * @param[in] data the new bytes.
+     * @param[in] size number of bytes.
+     *
+     * @return true if operations succeeds or false if not.
+     */
+    bool set_kernel_arg(size_t node, size_t offset, const void* data, size_t size) {
+        return pGraph ? pGraph->patchKernarg(node, offset, data, size) : false;
+    }
+
+    template <typename T>
+    bool set_kernel_arg(size_t node, size_t offset, const T& value) {
+        return set_kernel_arg(node, offset, &value, sizeof(T));
+    }
+
+    /**
+     * Enqueue the recorded commands into the accelerator_view they were
+     * recorded from.
+     *
+     * @return a completion_future which is ready once all of them are done.
+     */
+    completion_future launch() const {
+        if (!pGraph) {
+            throw runtime_exception("launch of an empty command_graph", 0);
+        }
+        return completion_future(pGraph->launch());
+    }
+
+private:
+    command_graph(std::shared_ptr<Kalmar::KalmarQueue> pQueue, std::shared_ptr<Kalmar::KalmarGraph> pGraph)
+        : pQueue(pGraph ? pQueue : nullptr), pGraph(pGraph) {}
+
+    // the graph is launched into the queue, and released before it
+    std::shared_ptr<Kalmar::KalmarQueue> pQueue;
+    std::shared_ptr<Kalmar::KalmarGraph> pGraph;
+
+    friend class accelerator_view;
 };
 
 // ------------------------------------------------------------------------
@@ -1456,6 +1678,9 @@ private:
 inline accelerator
 accelerator_view::get_accelerator() const { return pQueue->getDev(); }
 
+inline command_graph
+accelerator_view::end_capture() { return command_graph(pQueue, pQueue->endCapture()); }
+
 inline completion_future
 accelerator_view::create_marker(memory_scope scope) const {
     std::shared_ptr<Kalmar::KalmarAsyncOp> deps[1]; 
@@ -1486,7 +1711,13 @@ inline completion_future accelerator_view::create_blocking_marker(completion_fut
     }
 
     if (dependent_future.__asyncOp) {
-        deps[cnt++] = dependent_future.__asyncOp; // retrieve async op associated with completion_future
+        if (dependent_future.__asyncOp->getNativeHandle() == nullptr) {
+            // host operations such as then() continuations have no signal
+            // a barrier packet could wait on
+            dependent_future.wait();
+        } else {
+            deps[cnt++] = dependent_future.__asyncOp; // retrieve async op associated with completion_future
+        }
     } 
     
     return completion_future(pQueue->EnqueueMarkerWithDependency(cnt, deps, scope));
@@ -1514,7 +1745,11 @@ accelerator_view::create_blocking_marker(InputIterator first, InputIterator last
     // since HC sets the barrier bit in each AND barrier packet, we know
     // the barriers will execute in-order
     for (auto iter = first; iter != last; ++iter) {
-        if (iter->__asyncOp) {
+        if (iter->__asyncOp && iter->__asyncOp->getNativeHandle() == nullptr) {
+            // host operations such as then() continuations have no signal
+            // a barrier packet could wait on
+            iter->wait();
+        } else if (iter->__asyncOp) {
             deps[cnt++] = iter->__asyncOp; // retrieve async op associated with completion_future
             if (cnt == 5) {
                 lastMarker = completion_future(pQueue->EnqueueMarkerWithDependency(cnt, deps, hc::no_scope));
@@ -3215,6 +3450,26 @@ inline void abort() __HC__ {
 // group segment
 // ------------------------------------------------------------------------
 
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+// on the CPU path the group segment of a tile lives in the
+// Kalmar::CPUTileArena of the worker thread running it
+extern "C" inline unsigned int get_group_segment_size() __HC__ {
+    return Kalmar::CPUTileArena::get().group_segment_size();
+}
+
+extern "C" inline unsigned int get_static_group_segment_size() __HC__ {
+    return Kalmar::CPUTileArena::get().static_group_segment_size();
+}
+
+extern "C" inline void* get_group_segment_base_pointer() __HC__ {
+    return Kalmar::CPUTileArena::get().group_segment();
+}
+
+extern "C" inline void* get_dynamic_group_segment_base_pointer() __HC__ {
+    return Kalmar::CPUTileArena::get().dynamic_group_segment();
+}
+#endif
+
 /**
  * Fetch the size of group segment. This includes both static group segment
  * and dynamic group segment.
@@ -3246,32 +3501,10 @@ extern "C" void* get_dynamic_group_segment_base_pointer() __HC__;
 // ------------------------------------------------------------------------
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
-template <typename Ker, typename Ti>
-void bar_wrapper(Ker *f, Ti *t)
-{
-    (*f)(*t);
-}
-
-struct barrier_t {
-    std::unique_ptr<ucontext_t[]> ctx;
-    int idx;
-    barrier_t (int a) :
-        ctx(new ucontext_t[a + 1]) {}
-    template <typename Ti, typename Ker>
-    void setctx(int x, char *stack, Ker& f, Ti* tidx, int S) {
-        getcontext(&ctx[x]);
-        ctx[x].uc_stack.ss_sp = stack;
-        ctx[x].uc_stack.ss_size = S;
-        ctx[x].uc_link = &ctx[x - 1];
-        makecontext(&ctx[x], (void (*)(void))bar_wrapper<Ker, Ti>, 2, &f, tidx);
-    }
-    void swap(int a, int b) {
-        swapcontext(&ctx[a], &ctx[b]);
-    }
-    void wait() __HC__ {
-        --idx;
-        swapcontext(&ctx[idx + 1], &ctx[idx]);
-    }
+/// the work-items of a tile run as fibers switching at the barriers
+struct barrier_t : Kalmar::CPUTileFibers {
+    explicit barrier_t(int a) : Kalmar::CPUTileFibers(a) {}
+    void wait() __HC__ { Kalmar::CPUTileFibers::wait(); }
 };
 #endif
 
@@ -3524,7 +3757,7 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K> friend
-        void partitioned_task_tile_3D(K const&, tiled_extent<3> const&, int);
+        void partitioned_task_tile_3D(K const&, tiled_extent<3> const&, Kalmar::CPUChunkScheduler&);
 #endif
 };
 
@@ -3623,7 +3856,7 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K> friend
-        void partitioned_task_tile_1D(K const&, tiled_extent<1> const&, int);
+        void partitioned_task_tile_1D(K const&, tiled_extent<1> const&, Kalmar::CPUChunkScheduler&);
 #endif
 };
 
@@ -3722,149 +3955,308 @@ private:
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
     template<typename K> friend
-        void partitioned_task_tile_2D(K const&, tiled_extent<2> const&, int);
+        void partitioned_task_tile_2D(K const&, tiled_extent<2> const&, Kalmar::CPUChunkScheduler&);
 #endif
 };
 
-#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
-#define SSIZE 1024 * 10
-template <int N, typename Kernel,  int K>
-struct cpu_helper
+// ------------------------------------------------------------------------
+// tile_phases
+// ------------------------------------------------------------------------
+
+/**
+ * Selects how a tiled kernel given as tile_phases runs on the CPU execution
+ * path. On accelerators the phases always run as one kernel with a tile
+ * barrier between consecutive phases.
+ */
+enum class cpu_tile_mode {
+    /**
+     * Each phase runs as a loop over all work-items of the tile before the
+     * next phase starts, so no context switches are needed.
+     */
+    fission,
+
+    /**
+     * Each work-item runs as a fiber which switches at the barriers, the
+     * same way as any other tiled kernel.
+     */
+    fibers
+};
+
+template <typename Private, typename Shared, typename... Phases>
+struct tile_phase_list;
+
+template <typename Private, typename Shared>
+struct tile_phase_list<Private, Shared>
 {
-    static inline void call(const Kernel& k, index<K>& idx, const extent<K>& ext) __CPU__ __HC__ {
-        int i;
-        for (i = 0; i < ext[N]; ++i) {
-            idx[N] = i;
-            cpu_helper<N + 1, Kernel, K>::call(k, idx, ext);
-        }
+    tile_phase_list() __CPU__ __HC__ {}
+
+    template <typename Ti>
+    void run(const Ti&, Private&, Shared&) const __CPU__ __HC__ {}
+
+    template <typename Ti>
+    void run_fission(const Ti*, int, Private*, Shared&) const {}
+};
+
+template <typename Private, typename Shared, typename Phase, typename... Rest>
+struct tile_phase_list<Private, Shared, Phase, Rest...>
+{
+    Phase head;
+    tile_phase_list<Private, Shared, Rest...> tail;
+
+    tile_phase_list(const Phase& head, const Rest&... rest) __CPU__ __HC__
+        : head(head), tail(rest...) {}
+
+    /// run the phases for one work-item, with a barrier between them
+    template <typename Ti>
+    void run(const Ti& tidx, Private& priv, Shared& shared) const __CPU__ __HC__ {
+        head(tidx, priv, shared);
+        if (sizeof...(Rest) > 0)
+            tidx.barrier.wait();
+        tail.run(tidx, priv, shared);
     }
+
+    /// run the phases one after the other, each over all work-items of a tile
+    template <typename Ti>
+    void run_fission(const Ti* tidx, int count, Private* priv, Shared& shared) const {
+        for (int i = 0; i < count; ++i)
+            head(tidx[i], priv[i], shared);
+        tail.run_fission(tidx, count, priv, shared);
+    }
+};
+
+/**
+ * A tiled kernel written as a sequence of phases which are separated by tile
+ * barriers. Every phase is called as phase(tidx, priv, shared): priv is the
+ * state a work-item carries from one phase to the next, shared is tile_static
+ * memory common to the work-items of the tile. Phases must not call
+ * tile_barrier::wait() themselves.
+ *
+ * Because the barriers are known, the CPU execution path can run a launch in
+ * cpu_tile_mode::fission: every phase becomes a plain loop over the tile
+ * and the private states live in a compact array. Use make_tile_phases() to
+ * create one.
+ *
+ * @tparam N Rank of the tiled extent.
+ * @tparam Private Per work-item state, must be default constructible.
+ * @tparam Shared Per tile state, placed in tile_static memory.
+ */
+template <int N, typename Private, typename Shared, typename... Phases>
+class tile_phases
+{
+public:
+    tile_phases(cpu_tile_mode mode, const Phases&... phases) __CPU__ __HC__
+        : phases(phases...), mode(mode) {}
+
+    void operator()(const tiled_index<N>& tidx) const __CPU__ __HC__ {
+        tile_static Shared shared;
+        Private priv;
+        phases.run(tidx, priv, shared);
+    }
+
+    tile_phase_list<Private, Shared, Phases...> phases;
+    cpu_tile_mode mode;
 };
+
+/**
+ * Creates a tile_phases kernel from the given phases.
+ *
+ * @param[in] mode How the phases are run on the CPU execution path.
+ * @param[in] phases Callables taking (const tiled_index<N>&, Private&, Shared&).
+ */
+template <int N, typename Private, typename Shared, typename... Phases>
+tile_phases<N, Private, Shared, Phases...>
+make_tile_phases(cpu_tile_mode mode, const Phases&... phases) {
+    return tile_phases<N, Private, Shared, Phases...>(mode, phases...);
+}
+
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+#define SSIZE 1024 * 10
 template <typename Kernel, int K>
-struct cpu_helper<K, Kernel, K>
+struct cpu_helper
 {
-    static inline void call(const Kernel& k, const index<K>& idx, const extent<K>& ext) __CPU__ __HC__ {
-        (const_cast<Kernel&>(k))(idx);
+    /// run the kernel over [first, last) of the innermost dimension of idx
+    static inline void call(const Kernel& k, index<K>& idx, int first, int last) __CPU__ __HC__ {
+        const index<K> row = idx;
+        KALMAR_CPU_SIMD_LOOP
+        for (int i = first; i < last; ++i) {
+            index<K> item = row;
+            item[K - 1] = i;
+            // cpu_helper only runs between enter_kernel() and leave_kernel(),
+            // saying so lets the compiler drop the synchronization branch of
+            // every array_view access in the loop
+            if (!Kalmar::CLAMP::in_cpu_kernel())
+                __builtin_unreachable();
+            (const_cast<Kernel&>(k))(item);
+        }
     }
 };
 
 template <typename Kernel, int N>
-void partitioned_task(const Kernel& ker, const extent<N>& ext, int part) {
+void partitioned_task(const Kernel& f, const extent<N>& ext, Kalmar::CPUChunkScheduler& sched) {
+    // work on a private bitwise copy of the kernel: no store made by the
+    // kernel can alias its captures, so they are loaded once per row instead
+    // of once per work-item
+    typename std::aligned_storage<sizeof(Kernel), alignof(Kernel)>::type copy;
+    memcpy(&copy, &f, sizeof(Kernel));
+    const Kernel& ker = *reinterpret_cast<const Kernel*>(&copy);
     index<N> idx;
-    int start = ext[0] * part / Kalmar::NTHREAD;
-    int end = ext[0] * (part + 1) / Kalmar::NTHREAD;
-    for (int i = start; i < end; i++) {
-        idx[0] = i;
-        cpu_helper<1, Kernel, N>::call(ker, idx, ext);
+    const size_t row = ext[N - 1];
+    size_t begin, end;
+    while (sched.next_chunk(begin, end)) {
+        // a chunk of the linearized index space is walked one row at a time
+        while (begin < end) {
+            size_t outer = begin / row;
+            for (int d = N - 2; d >= 0; --d) {
+                idx[d] = outer % ext[d];
+                outer /= ext[d];
+            }
+            int first = begin % row;
+            int last = std::min<size_t>(row, first + (end - begin));
+            cpu_helper<Kernel, N>::call(ker, idx, first, last);
+            begin += last - first;
+        }
     }
 }
 
+/// run the work-items of one tile as fibers which switch at the barriers
+template <typename Kernel, typename Ti>
+void cpu_run_tile(Kernel const& f, Ti* tidx, int count, barrier_t& bar, char* stk) {
+    bar.run(f, tidx, count, stk, SSIZE);
+}
+
+/// run a tile of a kernel given as phases, one phase at a time unless the
+/// launch asked for fibers
+template <int N, typename Private, typename Shared, typename... Phases, typename Ti>
+void cpu_run_tile(tile_phases<N, Private, Shared, Phases...> const& f, Ti* tidx, int count, barrier_t& bar, char* stk) {
+    if (f.mode == cpu_tile_mode::fibers) {
+        bar.run(f, tidx, count, stk, SSIZE);
+        return;
+    }
+    static_assert(alignof(Private) <= Kalmar::CPU_CACHE_LINE_SIZE &&
+                  alignof(Shared) <= Kalmar::CPU_CACHE_LINE_SIZE,
+                  "tile_phases state must not be over-aligned");
+    // the shared state is the static part of the group segment, the private
+    // states of the work-items are a compact array, both in the arena of the
+    // worker thread
+    Kalmar::CPUTileArena& arena = Kalmar::CPUTileArena::get();
+    Private* priv = static_cast<Private*>(arena.reserve_private(count * sizeof(Private)));
+    for (int i = 0; i < count; ++i)
+        new (&priv[i]) Private();
+    Shared* shared = new (arena.group_segment()) Shared;
+    f.phases.run_fission(tidx, count, priv, *shared);
+    shared->~Shared();
+    for (int i = 0; i < count; ++i)
+        priv[i].~Private();
+}
+
+/// bytes of group segment the runtime places in front of the dynamic group
+/// memory of a launch; only tile_phases kernels declare theirs
+template <typename Kernel>
+struct cpu_static_group_segment
+{
+    static const size_t value = 0;
+};
+
+template <int N, typename Private, typename Shared, typename... Phases>
+struct cpu_static_group_segment<tile_phases<N, Private, Shared, Phases...>>
+{
+    static const size_t value = sizeof(Shared);
+};
+
 template <typename Kernel>
-void partitioned_task_tile_1D(Kernel const& f, tiled_extent<1> const& ext, int part) {
+void partitioned_task_tile_1D(Kernel const& f, tiled_extent<1> const& ext, Kalmar::CPUChunkScheduler& sched) {
     int D0 = ext.tile_dim[0];
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
+    size_t begin, end;
+    if (!sched.next_chunk(begin, end))
         return;
-    char *stk = new char[D0 * SSIZE];
+    Kalmar::CPUTileArena& arena = Kalmar::CPUTileArena::get();
+    arena.reserve_group(cpu_static_group_segment<Kernel>::value, ext.get_dynamic_group_segment_size());
+    char *stk = arena.reserve_stacks(D0 * SSIZE);
     tiled_index<1> *tidx = new tiled_index<1>[D0];
     tile_barrier::pb_t hc_bar = std::make_shared<barrier_t>(D0);
     tile_barrier tbar(hc_bar);
-    for (int tx = start; tx < end; tx++) {
-        int id = 0;
-        char *sp = stk;
-        tiled_index<1> *tip = tidx;
-        for (int x = 0; x < D0; x++) {
-            new (tip) tiled_index<1>(tx * D0 + x, x, tx, tbar, D0);
-            hc_bar->setctx(++id, sp, f, tip, SSIZE);
-            sp += SSIZE;
-            ++tip;
-        }
-        hc_bar->idx = 0;
-        while (hc_bar->idx == 0) {
-            hc_bar->idx = id;
-            hc_bar->swap(0, id);
+    do {
+        for (int tx = begin; tx < end; tx++) {
+            tiled_index<1> *tip = tidx;
+            for (int x = 0; x < D0; x++) {
+                tip->~tiled_index();
+                new (tip) tiled_index<1>(tx * D0 + x, x, tx, tbar, D0);
+                ++tip;
+            }
+            cpu_run_tile(f, tidx, D0, *hc_bar, stk);
         }
-    }
-    delete [] stk;
+    } while (sched.next_chunk(begin, end));
     delete [] tidx;
 }
 
 template <typename Kernel>
-void partitioned_task_tile_2D(Kernel const& f, tiled_extent<2> const& ext, int part) {
+void partitioned_task_tile_2D(Kernel const& f, tiled_extent<2> const& ext, Kalmar::CPUChunkScheduler& sched) {
     int D0 = ext.tile_dim[0];
     int D1 = ext.tile_dim[1];
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
+    int ntx = ext[1] / D1;
+    size_t begin, end;
+    if (!sched.next_chunk(begin, end))
         return;
-    char *stk = new char[D1 * D0 * SSIZE];
+    Kalmar::CPUTileArena& arena = Kalmar::CPUTileArena::get();
+    arena.reserve_group(cpu_static_group_segment<Kernel>::value, ext.get_dynamic_group_segment_size());
+    char *stk = arena.reserve_stacks(D1 * D0 * SSIZE);
     tiled_index<2> *tidx = new tiled_index<2>[D0 * D1];
     tile_barrier::pb_t hc_bar = std::make_shared<barrier_t>(D0 * D1);
     tile_barrier tbar(hc_bar);
 
-    for (int tx = 0; tx < ext[1] / D1; tx++)
-        for (int ty = start; ty < end; ty++) {
-            int id = 0;
-            char *sp = stk;
+    do {
+        for (size_t t = begin; t < end; t++) {
+            int ty = t / ntx;
+            int tx = t % ntx;
             tiled_index<2> *tip = tidx;
             for (int x = 0; x < D1; x++)
                 for (int y = 0; y < D0; y++) {
+                    tip->~tiled_index();
                     new (tip) tiled_index<2>(D1 * tx + x, D0 * ty + y, x, y, tx, ty, tbar, D0, D1);
-                    hc_bar->setctx(++id, sp, f, tip, SSIZE);
                     ++tip;
-                    sp += SSIZE;
                 }
-            hc_bar->idx = 0;
-            while (hc_bar->idx == 0) {
-                hc_bar->idx = id;
-                hc_bar->swap(0, id);
-            }
+            cpu_run_tile(f, tidx, D0 * D1, *hc_bar, stk);
         }
-    delete [] stk;
+    } while (sched.next_chunk(begin, end));
     delete [] tidx;
 }
 
 template <typename Kernel>
-void partitioned_task_tile_3D(Kernel const& f, tiled_extent<3> const& ext, int part) {
+void partitioned_task_tile_3D(Kernel const& f, tiled_extent<3> const& ext, Kalmar::CPUChunkScheduler& sched) {
     int D0 = ext.tile_dim[0];
     int D1 = ext.tile_dim[1];
     int D2 = ext.tile_dim[2];
-    int start = (ext[0] / D0) * part / Kalmar::NTHREAD;
-    int end = (ext[0] / D0) * (part + 1) / Kalmar::NTHREAD;
-    int stride = end - start;
-    if (stride == 0)
+    int ni = ext[2] / D2;
+    int nj = ext[1] / D1;
+    size_t begin, end;
+    if (!sched.next_chunk(begin, end))
         return;
-    char *stk = new char[D2 * D1 * D0 * SSIZE];
+    Kalmar::CPUTileArena& arena = Kalmar::CPUTileArena::get();
+    arena.reserve_group(cpu_static_group_segment<Kernel>::value, ext.get_dynamic_group_segment_size());
+    char *stk = arena.reserve_stacks(D2 * D1 * D0 * SSIZE);
     tiled_index<3> *tidx = new tiled_index<3>[D0 * D1 * D2];
     tile_barrier::pb_t hc_bar = std::make_shared<barrier_t>(D0 * D1 * D2);
     tile_barrier tbar(hc_bar);
 
-    for (int i = 0; i < ext[2] / D2; i++)
-        for (int j = 0; j < ext[1] / D1; j++)
-            for(int k = start; k < end; k++) {
-                int id = 0;
-                char *sp = stk;
-                tiled_index<3> *tip = tidx;
-                for (int x = 0; x < D2; x++)
-                    for (int y = 0; y < D1; y++)
-                        for (int z = 0; z < D0; z++) {
-                            new (tip) tiled_index<3>(D2 * i + x,
-                                                              D1 * j + y,
-                                                              D0 * k + z,
-                                                              x, y, z, i, j, k, tbar, D0, D1, D2);
-                            hc_bar->setctx(++id, sp, f, tip, SSIZE);
-                            ++tip;
-                            sp += SSIZE;
-                        }
-                hc_bar->idx = 0;
-                while (hc_bar->idx == 0) {
-                    hc_bar->idx = id;
-                    hc_bar->swap(0, id);
-                }
-            }
-    delete [] stk;
+    do {
+        for (size_t t = begin; t < end; t++) {
+            int k = t / (nj * ni);
+            int j = (t / ni) % nj;
+            int i = t % ni;
+            tiled_index<3> *tip = tidx;
+            for (int x = 0; x < D2; x++)
+                for (int y = 0; y < D1; y++)
+                    for (int z = 0; z < D0; z++) {
+                        tip->~tiled_index();
+                        new (tip) tiled_index<3>(D2 * i + x,
+                                                          D1 * j + y,
+                                                          D0 * k + z,
+                                                          x, y, z, i, j, k, tbar, D0, D1, D2);
+                        ++tip;
+                    }
+            cpu_run_tile(f, tidx, D0 * D1 * D2, *hc_bar, stk);
+        }
+    } while (sched.next_chunk(begin, end));
     delete [] tidx;
 }
 
@@ -3872,47 +4264,43 @@ template <typename Kernel, int N>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      extent<N> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task<Kernel, N>, std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t total = compute_domain.size();
+    return completion_future(Kalmar::launch_cpu_kernel_async(pQueue, f, compute_domain,
+                                                             partitioned_task<Kernel, N>, total,
+                                                             Kalmar::cpu_grain_size(total, Kalmar::CPU_CACHE_LINE_SIZE)));
 }
 
 template <typename Kernel>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<1> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile_1D<Kernel>,
-                             std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t tiles = compute_domain[0] / compute_domain.tile_dim[0];
+    return completion_future(Kalmar::launch_cpu_kernel_async(pQueue, f, compute_domain,
+                                                             partitioned_task_tile_1D<Kernel>, tiles,
+                                                             Kalmar::cpu_grain_size(tiles, 1)));
 }
 
 template <typename Kernel>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<2> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile_2D<Kernel>,
-                             std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t tiles = (compute_domain[0] / compute_domain.tile_dim[0]) *
+                   (compute_domain[1] / compute_domain.tile_dim[1]);
+    return completion_future(Kalmar::launch_cpu_kernel_async(pQueue, f, compute_domain,
+                                                             partitioned_task_tile_2D<Kernel>, tiles,
+                                                             Kalmar::cpu_grain_size(tiles, 1)));
 }
 
 template <typename Kernel>
 completion_future launch_cpu_task_async(const std::shared_ptr<Kalmar::KalmarQueue>& pQueue, Kernel const& f,
                      tiled_extent<3> const& compute_domain)
 {
-    Kalmar::CPUKernelRAII<Kernel> obj(pQueue, f);
-    for (int i = 0; i < Kalmar::NTHREAD; ++i)
-        obj[i] = std::thread(partitioned_task_tile_3D<Kernel>,
-                             std::cref(f), std::cref(compute_domain), i);
-    // FIXME wrap the above operation into the completion_future object
-    return completion_future();
+    size_t tiles = (compute_domain[0] / compute_domain.tile_dim[0]) *
+                   (compute_domain[1] / compute_domain.tile_dim[1]) *
+                   (compute_domain[2] / compute_domain.tile_dim[2]);
+    return completion_future(Kalmar::launch_cpu_kernel_async(pQueue, f, compute_domain,
+                                                             partitioned_task_tile_3D<Kernel>, tiles,
+                                                             Kalmar::cpu_grain_size(tiles, 1)));
 }
 
 #endif
@@ -0,0 +1,63 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <stdint.h>
+
+/// Software HSA runtime (lib/hsa_sw)
+///
+/// A stand-in for libhsa-runtime64 which runs on hosts without an HSA agent.
+/// It exposes a CPU agent and a GPU agent whose queues are processed by host
+/// threads. As the GCN code objects of a program cannot run on the host, the
+/// kernel symbols of its executables resolve by name to host entries
+/// registered here; every workgroup of a dispatch calls the entry once.
+///
+/// The library is picked up in place of the real runtime with
+/// LD_LIBRARY_PATH. Programs look hsa_sw_register_kernel up with dlsym, so
+/// they run unchanged on the real runtime.
+///
+/// Programs built with host-callable kernels (-cpu) register their kernels
+/// on the first launch, see Kalmar::SoftwareKernel; tiled kernels and
+/// kernels capturing arrays or array_views have no host entry, and their
+/// launch throws. The kernels of other programs are not found.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// a workgroup of a kernel dispatch, as seen by the host entry of the kernel
+typedef struct hsa_sw_workgroup_s {
+    /// kernarg segment of the dispatch, nullptr if the kernel has no arguments
+    const void* kernarg;
+    /// group segment of the workgroup, group_segment_size bytes
+    void* group_segment;
+    uint32_t group_segment_size;
+    /// number of dimensions of the grid, 1 to 3
+    uint32_t dimensions;
+    /// sizes of the grid and of its workgroups; the workgroups at the upper
+    /// end of a dimension are partial if the grid size is not a multiple of
+    /// the workgroup size
+    uint32_t grid_size[3];
+    uint32_t workgroup_size[3];
+    /// position of the workgroup in the grid, in workgroups
+    uint32_t workgroup_id[3];
+} hsa_sw_workgroup_t;
+
+/// host entry of a kernel: run the work-items of one workgroup
+typedef void (*hsa_sw_kernel_entry_t)(const hsa_sw_workgroup_t* workgroup);
+
+/// resolve the kernel symbols called name to entry from now on; returns 0 on
+/// success, non-zero if name is already registered with another entry
+int hsa_sw_register_kernel(const char* name, hsa_sw_kernel_entry_t entry,
+                           uint32_t kernarg_segment_size,
+                           uint32_t kernarg_segment_alignment,
+                           uint32_t group_segment_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,34 +8,526 @@
 #pragma once
 
 #include "hc_defines.h"
+#include "kalmar_cpu_topology.h"
 #include "kalmar_runtime.h"
 #include "kalmar_serialize.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
 namespace Kalmar {
 template <int D0, int D1=0, int D2=0> class tiled_extent;
 
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
 static const unsigned int NTHREAD = std::thread::hardware_concurrency();
 
+/// size in bytes of a host cache line
+static const size_t CPU_CACHE_LINE_SIZE = 64;
+
+/// The work-items of a launch are unordered, so the loop over the innermost
+/// dimension of a CPU kernel carries no dependencies the compiler has to
+/// respect; tell the vectorizer so it needs no runtime alias checks.
+#if defined(__clang__)
+#define KALMAR_CPU_SIMD_LOOP _Pragma("clang loop vectorize(assume_safety) interleave(enable)")
+#elif defined(__GNUC__)
+#define KALMAR_CPU_SIMD_LOOP _Pragma("GCC ivdep")
+#else
+#define KALMAR_CPU_SIMD_LOOP
+#endif
+
+/// CPUThreadPool
+///
+/// Process-wide pool of persistent worker threads used by the CPU kernel path.
+/// Each worker owns a task deque: it pops from the back of its own deque and,
+/// once that is empty, steals from the front of the other workers' deques.
+/// The pool is created on first use and intentionally never destroyed, so
+/// kernels launched from static destructors still find live workers.
+///
+/// Besides the pool spanning all CPUs, every CPUTopology group (a NUMA node
+/// or a configured core group) has a pool of its own, pinned to the CPUs of
+/// the group, which runs the kernels of the accelerator of that group.
+class CPUThreadPool
+{
+public:
+    typedef std::function<void()> task_t;
+
+    /// the pool of CPUTopology::groups()[group], or the one for all CPUs
+    static CPUThreadPool& get(int group = -1) {
+        static CPUThreadPool* pool = new CPUThreadPool(NTHREAD ? NTHREAD : 1, -1);
+        if (group < 0)
+            return *pool;
+        // launches find the pool of their group without taking a lock; only
+        // the first launch on a group creates it
+        static std::vector<std::atomic<CPUThreadPool*>> group_pools(CPUTopology::get().groups().size());
+        std::atomic<CPUThreadPool*>& slot = group_pools.at(group);
+        CPUThreadPool* group_pool = slot.load(std::memory_order_acquire);
+        if (group_pool)
+            return *group_pool;
+        static std::mutex group_lock;
+        std::lock_guard<std::mutex> l(group_lock);
+        group_pool = slot.load(std::memory_order_relaxed);
+        if (!group_pool) {
+            group_pool = new CPUThreadPool(CPUTopology::get().groups()[group].cpus.size(), group);
+            slot.store(group_pool, std::memory_order_release);
+        }
+        return *group_pool;
+    }
+
+    /// the pool running the kernels of queue's device
+    static CPUThreadPool& get(const KalmarQueue* queue) {
+        return get(queue->getDev()->get_cpu_group());
+    }
+
+    unsigned int size() const { return workers.size(); }
+
+    /// number of node shares CPUChunkScheduler cuts a launch on this pool into
+    unsigned int shares() const { return group < 0 ? CPUTopology::get().nodes() : 1; }
+
+    /// queue a task; tasks submitted from a worker go to that worker's deque
+    void submit(task_t task) {
+        unsigned int w = (self() >= 0) ? self() : next_victim++ % workers.size();
+        {
+            std::lock_guard<std::mutex> l(workers[w]->lock);
+            workers[w]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> l(sleep_lock);
+            ++queued;
+        }
+        sleep_cv.notify_one();
+    }
+
+    /// share of a launch the calling worker thread prefers, the index of the
+    /// CPUTopology node it is pinned to; -1 on threads outside any pool
+    static int& current_node() {
+        static thread_local int node = -1;
+        return node;
+    }
+
+    /// run one queued task on the calling thread, if there is any
+    /// used by threads which wait for pool tasks so they help instead of block
+    bool run_one() {
+        task_t task;
+        if (!take(self(), task))
+            return false;
+        task();
+        return true;
+    }
+
+private:
+    struct alignas(64) WorkerQueue {
+        std::mutex lock;
+        std::deque<task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned int> next_victim;
+    const int group;
+
+    /// number of tasks sitting in any deque, guarded by sleep_lock
+    size_t queued;
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+
+    CPUThreadPool(unsigned int n, int group)
+        : workers(), threads(), next_victim(0), group(group), queued(0) {
+        for (unsigned int i = 0; i < n; ++i)
+            workers.emplace_back(new WorkerQueue);
+        for (unsigned int i = 0; i < n; ++i)
+            threads.emplace_back(&CPUThreadPool::worker_loop, this, i);
+        for (auto& t : threads)
+            t.detach();
+    }
+
+    static int& current_worker() {
+        static thread_local int id = -1;
+        return id;
+    }
+
+    static CPUThreadPool*& current_pool() {
+        static thread_local CPUThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    /// index of the calling thread among the workers of this pool, or -1
+    int self() const { return current_pool() == this ? current_worker() : -1; }
+
+    bool pop_from(unsigned int w, bool back, task_t& task) {
+        std::lock_guard<std::mutex> l(workers[w]->lock);
+        auto& q = workers[w]->tasks;
+        if (q.empty())
+            return false;
+        if (back) {
+            task = std::move(q.back());
+            q.pop_back();
+        } else {
+            task = std::move(q.front());
+            q.pop_front();
+        }
+        return true;
+    }
+
+    /// take a task from the own deque first, then try to steal from the others
+    bool take(int self, task_t& task) {
+        unsigned int n = workers.size();
+        bool found = (self >= 0) && pop_from(self, true, task);
+        unsigned int start = (self >= 0) ? self + 1 : 0;
+        for (unsigned int i = 0; !found && i < n; ++i) {
+            unsigned int victim = (start + i) % n;
+            if (static_cast<int>(victim) != self)
+                found = pop_from(victim, false, task);
+        }
+        if (found) {
+            std::lock_guard<std::mutex> l(sleep_lock);
+            --queued;
+        }
+        return found;
+    }
+
+    void worker_loop(unsigned int self) {
+        const CPUTopology& topology = CPUTopology::get();
+        current_pool() = this;
+        current_worker() = self;
+        if (group < 0) {
+            current_node() = topology.worker_node(self, workers.size());
+            CPUTopology::pin_current_thread(topology.worker_cpu(self, workers.size()));
+        } else {
+            current_node() = 0;
+            CPUTopology::pin_current_thread(topology.groups()[group].cpus[self]);
+        }
+        task_t task;
+        while (true) {
+            if (take(self, task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> l(sleep_lock);
+            sleep_cv.wait(l, [this] { return queued > 0; });
+        }
+    }
+};
+
+/// CPUTaskGroup
+///
+/// Tracks a set of tasks submitted to the CPUThreadPool so the submitter can
+/// wait for all of them.  The waiting thread executes queued pool tasks while
+/// it waits, which keeps nested launches from a worker deadlock free.
+///
+/// The counter and the wakeup live in a state shared with the tasks: wait()
+/// may return, and the group be destroyed, as soon as the last task has
+/// counted down, before that task has notified the waiter.
+class CPUTaskGroup
+{
+    struct state {
+        std::atomic<int> pending;
+        std::mutex lock;
+        std::condition_variable cv;
+        state() : pending(0), lock(), cv() {}
+    };
+    CPUThreadPool& pool;
+    std::shared_ptr<state> st;
+public:
+    explicit CPUTaskGroup(CPUThreadPool& pool = CPUThreadPool::get())
+        : pool(pool), st(std::make_shared<state>()) {}
+
+    template <typename F>
+    void run(F&& func) {
+        ++st->pending;
+        std::shared_ptr<state> s = st;
+        pool.submit([s, func]() {
+            func();
+            if (--s->pending == 0) {
+                std::lock_guard<std::mutex> l(s->lock);
+                s->cv.notify_all();
+            }
+        });
+    }
+
+    void wait() {
+        while (st->pending > 0) {
+            if (pool.run_one())
+                continue;
+            // everything left is running on other workers
+            std::unique_lock<std::mutex> l(st->lock);
+            st->cv.wait(l, [this] { return st->pending == 0; });
+        }
+    }
+};
+
+#if defined(__x86_64__)
+extern "C" void __hcc_cpu_fiber_switch(void** from, void* to);
+extern "C" void __hcc_cpu_fiber_start();
+#endif
+
+/// CPUFiber
+///
+/// Execution context of one work-item of a tile on the CPU path. The
+/// work-items of a tile take turns on their worker thread and switch at
+/// barriers. On x86-64 a context is just a stack pointer, and a switch saves
+/// only the callee-saved registers and the floating point control words
+/// without any syscall. Other hosts fall back to ucontext.
+struct CPUFiber
+{
+#if defined(__x86_64__)
+    void* sp;
+
+    /// prepare the context to run entry(arg) on [stack, stack + size)
+    void init(char* stack, size_t size, void (*entry)(void*), void* arg) {
+        uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~uintptr_t(15);
+        void** frame = reinterpret_cast<void**>(top - 16) - 8;
+        // popped by __hcc_cpu_fiber_switch: MXCSR and x87 control word, r15,
+        // r14, r13, r12, rbx, rbp, return address; the fiber starts with the
+        // floating point modes of the thread setting it up
+        uint32_t mxcsr;
+        uint16_t fpucw;
+        asm volatile("stmxcsr %0" : "=m"(mxcsr));
+        asm volatile("fnstcw %0" : "=m"(fpucw));
+        frame[0] = nullptr;
+        memcpy(reinterpret_cast<char*>(&frame[0]), &mxcsr, sizeof(mxcsr));
+        memcpy(reinterpret_cast<char*>(&frame[0]) + 4, &fpucw, sizeof(fpucw));
+        frame[1] = frame[2] = frame[3] = nullptr;
+        frame[4] = arg;
+        frame[5] = reinterpret_cast<void*>(entry);
+        frame[6] = nullptr;
+        frame[7] = reinterpret_cast<void*>(__hcc_cpu_fiber_start);
+        sp = frame;
+    }
+
+    /// save the running context into this and resume to
+    void switch_to(CPUFiber& to) { __hcc_cpu_fiber_switch(&sp, to.sp); }
+#else
+    ucontext_t ctx;
+
+    void init(char* stack, size_t size, void (*entry)(void*), void* arg) {
+        getcontext(&ctx);
+        ctx.uc_stack.ss_sp = stack;
+        ctx.uc_stack.ss_size = size;
+        ctx.uc_link = nullptr;
+        makecontext(&ctx, (void (*)(void))entry, 1, arg);
+    }
+
+    void switch_to(CPUFiber& to) { swapcontext(&ctx, &to.ctx); }
+#endif
+};
+
+/// CPUTileFibers
+///
+/// Fibers running the work-items of one tile on a worker thread, shared by
+/// the tile_barrier of amp.h and hc.hpp. Context 0 is the thread running the
+/// tile, 1 to N its work-items. A work-item reaching a barrier, or finishing,
+/// switches to the one before it, down to the thread, which resumes the last
+/// work-item until all of them have finished.
+class CPUTileFibers
+{
+    struct item_t {
+        CPUTileFibers* tile;
+        void* tidx;
+        int x;
+    };
+    std::unique_ptr<CPUFiber[]> ctx;
+    std::unique_ptr<item_t[]> items;
+    const void* ker;
+    int idx;
+
+    template <typename Ker, typename Ti>
+    static void entry(void* p) {
+        item_t* it = static_cast<item_t*>(p);
+        CPUTileFibers* tile = it->tile;
+        (*static_cast<const Ker*>(tile->ker))(*static_cast<Ti*>(it->tidx));
+        // a finished work-item hands over to the one before it and is never
+        // resumed
+        tile->ctx[it->x].switch_to(tile->ctx[it->x - 1]);
+    }
+
+public:
+    explicit CPUTileFibers(int count)
+        : ctx(new CPUFiber[count + 1]), items(new item_t[count + 1]), ker(nullptr), idx(0) {}
+
+    /// run f on the count work-items of tidx, each on its own stack_size
+    /// bytes of stk
+    template <typename Ker, typename Ti>
+    void run(const Ker& f, Ti* tidx, int count, char* stk, size_t stack_size) {
+        ker = &f;
+        for (int x = 1; x <= count; ++x) {
+            items[x] = { this, &tidx[x - 1], x };
+            ctx[x].init(stk, stack_size, entry<Ker, Ti>, &items[x]);
+            stk += stack_size;
+        }
+        idx = 0;
+        while (idx == 0) {
+            idx = count;
+            ctx[0].switch_to(ctx[count]);
+        }
+    }
+
+    /// barrier of the running work-item
+    void wait() {
+        --idx;
+        ctx[idx + 1].switch_to(ctx[idx]);
+    }
+};
+
+/// CPUTileArena
+///
+/// Memory a worker thread uses to run tiles on the CPU path: the group
+/// segment of the tile being run, the compact private state of its
+/// work-items, and their fiber stacks. The blocks are cache-line aligned,
+/// sized from what the launch asks for, and reused by every later tile and
+/// launch on the same thread; they only grow.
+class CPUTileArena
+{
+    struct block {
+        void* ptr;
+        size_t size;
+        block() : ptr(nullptr), size(0) {}
+        ~block() { kalmar_aligned_free(ptr); }
+        void* reserve(size_t bytes) {
+            if (size < bytes) {
+                kalmar_aligned_free(ptr);
+                size = (bytes + CPU_CACHE_LINE_SIZE - 1) & ~(CPU_CACHE_LINE_SIZE - 1);
+                ptr = kalmar_aligned_alloc(CPU_CACHE_LINE_SIZE, size);
+                if (!ptr)
+                    throw std::bad_alloc();
+            }
+            return ptr;
+        }
+    };
+
+    block group;
+    block priv;
+    block stacks;
+    size_t static_group_size;
+    size_t group_size;
+
+    CPUTileArena() : group(), priv(), stacks(), static_group_size(0), group_size(0) {}
+public:
+    static CPUTileArena& get() {
+        static thread_local CPUTileArena arena;
+        return arena;
+    }
+
+    /// set up the group segment for the tiles of a launch: static_size bytes
+    /// placed by the runtime, followed by dynamic_size bytes of dynamic group
+    /// memory
+    void* reserve_group(size_t static_size, size_t dynamic_size) {
+        static_group_size = (static_size + CPU_CACHE_LINE_SIZE - 1) & ~(CPU_CACHE_LINE_SIZE - 1);
+        group_size = static_group_size + dynamic_size;
+        return group.reserve(group_size);
+    }
+
+    void* group_segment() const { return group.ptr; }
+    void* dynamic_group_segment() const { return static_cast<char*>(group.ptr) + static_group_size; }
+    size_t group_segment_size() const { return group_size; }
+    size_t static_group_segment_size() const { return static_group_size; }
+
+    /// memory for the private states of the work-items of a tile
+    void* reserve_private(size_t size) { return priv.reserve(size); }
+
+    /// memory for the fiber stacks of the work-items of a tile
+    char* reserve_stacks(size_t size) { return static_cast<char*>(stacks.reserve(size)); }
+};
+
+/// CPUChunkScheduler
+///
+/// Hands out chunks of the linearized iteration space of one kernel launch.
+/// Every partition keeps claiming chunks until the space is exhausted, so
+/// oddly shaped extents and uneven per-index costs still keep all workers
+/// busy. On NUMA hosts the space is cut into one contiguous share per
+/// CPUTopology node (CPUThreadPool::shares()), the share whose buffer pages
+/// CPUTopology::place put on that node; workers claim from the share of their
+/// own node first and only then help with the others.
+class CPUChunkScheduler
+{
+    struct share {
+        std::atomic<size_t> next;
+        size_t end;
+        char pad[CPU_CACHE_LINE_SIZE - 2 * sizeof(size_t)];
+    };
+
+    const size_t total;
+    const size_t grain;
+    const unsigned int nshares;
+    std::unique_ptr<share[]> shares;
+public:
+    CPUChunkScheduler(size_t total, size_t grain, unsigned int nodes = 1)
+        : total(total), grain(grain ? grain : 1),
+          nshares(std::max<size_t>(std::min<size_t>(nodes, chunks()), 1)),
+          shares(new share[nshares]) {
+        for (unsigned int k = 0; k < nshares; ++k) {
+            shares[k].next = CPUTopology::share_begin(chunks(), k, nshares) * this->grain;
+            shares[k].end = std::min(CPUTopology::share_begin(chunks(), k + 1, nshares) * this->grain, total);
+        }
+    }
+
+    /// number of chunks the iteration space is cut into
+    size_t chunks() const { return (total + grain - 1) / grain; }
+
+    /// claim the next chunk [begin, end), false once nothing is left
+    bool next_chunk(size_t& begin, size_t& end) {
+        int node = CPUThreadPool::current_node();
+        unsigned int home = (node > 0) ? node % nshares : 0;
+        for (unsigned int i = 0; i < nshares; ++i) {
+            share& s = shares[(home + i) % nshares];
+            if (s.next.load(std::memory_order_relaxed) >= s.end)
+                continue;
+            size_t b = s.next.fetch_add(grain, std::memory_order_relaxed);
+            if (b >= s.end)
+                continue;
+            begin = b;
+            end = std::min(b + grain, s.end);
+            return true;
+        }
+        return false;
+    }
+};
+
+/// number of consecutive work items claimed at once out of total
+///
+/// HCC_CPU_GRAIN_SIZE sets it explicitly; by default every worker gets about
+/// eight chunks so those finishing early can take over the remainder. The
+/// grain is rounded up to a multiple of align, which callers set to the work
+/// items in a cache line so neighbouring chunks do not write the same line.
+inline size_t cpu_grain_size(size_t total, size_t align) {
+    static const size_t user_grain = [] {
+        char* grain_env = getenv("HCC_CPU_GRAIN_SIZE");
+        return grain_env ? strtoul(grain_env, nullptr, 10) : 0;
+    }();
+    size_t grain = user_grain ? user_grain : total / (NTHREAD * 8);
+    if (align == 0)
+        align = 1;
+    return std::max<size_t>((grain + align - 1) / align, 1) * align;
+}
+
 template <typename Kernel>
 class CPUKernelRAII
 {
     const std::shared_ptr<Kalmar::KalmarQueue> pQueue;
     const Kernel& f;
-    std::vector<std::thread> th;
+    CPUTaskGroup group;
 public:
     CPUKernelRAII(const std::shared_ptr<Kalmar::KalmarQueue> pQueue, const Kernel& f)
-        : pQueue(pQueue), f(f), th(NTHREAD) {
+        : pQueue(pQueue), f(f), group(CPUThreadPool::get(pQueue.get())) {
         CPUVisitor vis(pQueue);
         Serialize s(&vis);
         f.__cxxamp_serialize(s);
-        CLAMP::enter_kernel();
     }
-    std::thread& operator[](int i) { return th[i]; }
+    template <typename F>
+    void submit(F func) {
+        group.run([func]() {
+            CLAMP::enter_kernel();
+            func();
+            CLAMP::leave_kernel();
+        });
+    }
     ~CPUKernelRAII() {
-        for (auto& t : th)
-            if (t.joinable())
-                t.join();
+        group.wait();
+        CLAMP::enter_kernel();
         CPUVisitor vis(pQueue);
         Serialize ss(&vis);
         f.__cxxamp_serialize(ss);
@@ -43,6 +535,90 @@ public:
     }
 };
 
+/// number of partitions worth running on pool for a launch split by sched
+inline unsigned int cpu_partitions(const CPUThreadPool& pool, const CPUChunkScheduler& sched) {
+    return std::max<unsigned int>(std::min<size_t>(pool.size(), sched.chunks()), 1);
+}
+
+/// launch a kernel on the CPU execution path without waiting for it
+///
+/// The functor is copied bitwise, the way the GPU paths copy it into kernel
+/// arguments: the copy takes no reference on the buffers it captures, so the
+/// destructors of the host side array_views still wait for the kernel. The
+/// total work items (or tiles) are split in chunks of grain, which up to one
+/// task per worker of the pool of the queue's device claim dynamically; the
+/// last task to finish restores the buffer pointers swapped by CPUVisitor and
+/// completes the returned operation. The tasks are only submitted once the
+/// previous operation of the queue has completed.
+template <typename Kernel, typename Domain>
+std::shared_ptr<KalmarAsyncOp>
+launch_cpu_kernel_async(const std::shared_ptr<KalmarQueue>& pQueue, const Kernel& f, const Domain& ext,
+                        void (*part)(const Kernel&, const Domain&, CPUChunkScheduler&),
+                        size_t total, size_t grain)
+{
+    struct launch_state {
+        const std::shared_ptr<KalmarQueue> pQueue;
+        CPUThreadPool& pool;
+        typename std::aligned_storage<sizeof(Kernel), alignof(Kernel)>::type kernarg;
+        const Domain ext;
+        CPUChunkScheduler sched;
+        std::atomic<int> remaining;
+        std::mutex errorLock;
+        std::exception_ptr error;
+        std::shared_ptr<CPUAsyncOp> op;
+        launch_state(const std::shared_ptr<KalmarQueue>& q, const Kernel& f, const Domain& ext,
+                     size_t total, size_t grain)
+            : pQueue(q), pool(CPUThreadPool::get(q.get())), kernarg(), ext(ext),
+              sched(total, grain, pool.shares()),
+              remaining(cpu_partitions(pool, sched)), errorLock(), error(nullptr),
+              op(std::make_shared<CPUAsyncOp>(q.get())) {
+            memcpy(&kernarg, &f, sizeof(Kernel));
+        }
+        const Kernel& f() const { return *reinterpret_cast<const Kernel*>(&kernarg); }
+    };
+
+    auto state = std::make_shared<launch_state>(pQueue, f, ext, total, grain);
+    {
+        // rw_info::sync waits for the last kernel in flight using a buffer,
+        // so the host only blocks here when this kernel shares a buffer with
+        // one of them; each buffer then records this kernel as its last one
+        CPUVisitor vis(pQueue, state->op);
+        Serialize s(&vis);
+        state->f().__cxxamp_serialize(s);
+    }
+
+    auto start = [state, part]() {
+        for (unsigned int i = cpu_partitions(state->pool, state->sched); i > 0; --i) {
+            state->pool.submit([state, part]() {
+                CLAMP::enter_kernel();
+                try {
+                    part(state->f(), state->ext, state->sched);
+                } catch (...) {
+                    std::lock_guard<std::mutex> l(state->errorLock);
+                    if (!state->error)
+                        state->error = std::current_exception();
+                }
+                if (--state->remaining == 0) {
+                    CPUVisitor vis(state->pQueue);
+                    Serialize ss(&vis);
+                    state->f().__cxxamp_serialize(ss);
+                    state->op->complete(state->error);
+                }
+                CLAMP::leave_kernel();
+            });
+        }
+    };
+
+    // kernels on one queue run in order: start once the previous operation
+    // has completed rather than waiting for it on the host
+    std::shared_ptr<KalmarAsyncOp> prev = pQueue->pushHostAsyncOp(state->op);
+    if (prev != nullptr && !prev->isReady())
+        prev->onComplete(start);
+    else
+        start();
+    return state->op;
+}
+
 #endif
 
 }
@@ -0,0 +1,280 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "kalmar_aligned_alloc.h"
+
+/** \cond HIDDEN_SYMBOLS */
+namespace Kalmar {
+
+/// CPUTopology
+///
+/// NUMA layout of the host as reported by /sys/devices/system/node, limited
+/// to the CPUs the process may run on. The CPU path uses it to pin its
+/// worker threads node by node, to give each node a contiguous share of the
+/// index space of a launch, and to place the matching share of every buffer
+/// on that node. Hosts without the information, and processes started with
+/// HCC_CPU_NUMA=0, see a single node and keep unpinned workers.
+///
+/// The CPU runtime also exposes every group of CPUs as an accelerator of its
+/// own. The groups are the nodes, or with HCC_CPU_GROUP_SIZE=n the nodes cut
+/// into groups of n CPUs; there are none on a single node host unless a
+/// group size is given. A host without NUMA information counts as a single
+/// node holding every CPU of the affinity mask.
+class CPUTopology
+{
+public:
+    struct node {
+        int id;                 ///< node number used by the kernel
+        std::vector<int> cpus;  ///< CPUs of the node the process may use
+    };
+
+    static const CPUTopology& get() {
+        static CPUTopology topology;
+        return topology;
+    }
+
+    /// number of nodes with usable CPUs, at least 1
+    unsigned int nodes() const { return list.empty() ? 1 : list.size(); }
+
+    const node& operator[](unsigned int i) const { return list[i]; }
+
+    /// true if worker threads should be pinned and buffers placed
+    bool numa() const { return list.size() > 1; }
+
+    /// CPU groups which get an accelerator each; id is the node of a group
+    const std::vector<node>& groups() const { return group_list; }
+
+    /// node the worker-th of workers worker threads belongs to; workers are
+    /// dealt out over the CPUs in node order so each node gets a contiguous
+    /// block of workers
+    unsigned int worker_node(unsigned int worker, unsigned int workers) const {
+        return numa() ? cpu_node[worker_slot(worker, workers)] : 0;
+    }
+
+    /// CPU the worker-th of workers worker threads is pinned to, -1 if none
+    int worker_cpu(unsigned int worker, unsigned int workers) const {
+        return numa() ? cpus[worker_slot(worker, workers)] : -1;
+    }
+
+    /// pin the calling thread to one CPU
+    static void pin_current_thread(int cpu) {
+#if defined(__linux__)
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    /// first of the nodes() contiguous shares [begin, end) of n items
+    static size_t share_begin(size_t n, unsigned int share, unsigned int shares) {
+        return n / shares * share + std::min<size_t>(share, n % shares);
+    }
+
+    /// size of a page of host memory
+    static size_t page_size() {
+#if defined(__linux__)
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        return page;
+#else
+        return 0x1000;
+#endif
+    }
+
+    /// size rounded up to whole pages; a buffer bound to a node is allocated
+    /// page aligned with that size, so no other allocation shares its pages
+    static size_t page_round(size_t size) {
+        const size_t page = page_size();
+        return (size + page - 1) / page * page;
+    }
+
+    /// allocate size bytes on whole pages of their own, the only buffers
+    /// place() and bind() may be used on: a policy applies to every page a
+    /// range touches, and would otherwise reach into other allocations
+    static void* alloc_pages(size_t size) {
+        return kalmar_aligned_alloc(page_size(), page_round(size));
+    }
+
+    /// free a buffer of size bytes from alloc_pages(); its pages go back to
+    /// the heap with the default policy, not the one of the buffer
+    static void free_pages(void* ptr, size_t size) {
+        unbind(ptr, page_round(size));
+        kalmar_aligned_free(ptr);
+    }
+
+    /// Place the pages of a buffer fresh from alloc_pages() so that share k
+    /// of it lives on node k, matching the share of the index space node k
+    /// works on. The partial last page counts as a page of the last share.
+    /// Placement is a preference, the kernel falls back to other nodes when
+    /// one runs out of memory. Buffers smaller than a page per node are left
+    /// alone.
+    void place(void* ptr, size_t size) const {
+#if defined(__linux__) && defined(SYS_mbind)
+        if (!numa() || !ptr)
+            return;
+        const size_t page = page_size();
+        if (reinterpret_cast<uintptr_t>(ptr) % page != 0)
+            return;
+        const size_t pages = page_round(size) / page;
+        if (pages < nodes())
+            return;
+        char* base = static_cast<char*>(ptr);
+        for (unsigned int k = 0; k < nodes(); ++k) {
+            size_t first = share_begin(pages, k, nodes());
+            size_t last = share_begin(pages, k + 1, nodes());
+            bind(base + first * page, (last - first) * page, list[k].id);
+        }
+#endif
+    }
+
+    /// prefer node id for the pages of [ptr, ptr + size), ptr page aligned
+    static void bind(void* ptr, size_t size, int id) {
+#if defined(__linux__) && defined(SYS_mbind)
+        if (!ptr || size == 0 || id < 0)
+            return;
+        // MPOL_PREFERRED and MPOL_MF_MOVE from <numaif.h>, which is part of
+        // libnuma and not always installed
+        const int mpol_preferred = 1;
+        const unsigned int mpol_mf_move = 1 << 1;
+        const size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(id / bits + 1, 0);
+        mask[id / bits] |= 1UL << (id % bits);
+        syscall(SYS_mbind, ptr, size, mpol_preferred, mask.data(), mask.size() * bits + 1, mpol_mf_move);
+#endif
+    }
+
+    /// back to the default policy for the pages of [ptr, ptr + size), ptr
+    /// page aligned
+    static void unbind(void* ptr, size_t size) {
+#if defined(__linux__) && defined(SYS_mbind)
+        if (!ptr || size == 0)
+            return;
+        // MPOL_DEFAULT from <numaif.h>
+        const int mpol_default = 0;
+        syscall(SYS_mbind, ptr, size, mpol_default, nullptr, 0, 0);
+#endif
+    }
+
+private:
+    std::vector<node> list;
+    std::vector<int> cpus;      ///< usable CPUs in node order
+    std::vector<int> cpu_node;  ///< index into list for every entry of cpus
+    std::vector<node> group_list;
+
+    CPUTopology() : list(), cpus(), cpu_node(), group_list() {
+        char* numa_env = getenv("HCC_CPU_NUMA");
+        if (numa_env && atoi(numa_env) == 0)
+            return;
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return;
+        read_nodes(allowed);
+        // without NUMA information all CPUs the process may use make up
+        // one node, which can still be cut into groups
+        if (list.empty()) {
+            node n;
+            n.id = 0;
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &allowed))
+                    n.cpus.push_back(cpu);
+            add(n);
+        }
+
+        char* group_env = getenv("HCC_CPU_GROUP_SIZE");
+        size_t group_size = group_env ? strtoul(group_env, nullptr, 10) : 0;
+        if (group_size == 0 && numa())
+            group_list = list;
+        for (size_t k = 0; group_size && k < list.size(); ++k) {
+            for (size_t first = 0; first < list[k].cpus.size(); first += group_size) {
+                node g;
+                g.id = list[k].id;
+                g.cpus.assign(list[k].cpus.begin() + first,
+                              list[k].cpus.begin() + std::min(first + group_size, list[k].cpus.size()));
+                group_list.push_back(g);
+            }
+        }
+#endif
+    }
+
+#if defined(__linux__)
+    /// read the nodes with CPUs in allowed from /sys/devices/system/node
+    void read_nodes(const cpu_set_t& allowed) {
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string line;
+        if (!online || !std::getline(online, line))
+            return;
+        for (int id : parse_list(line)) {
+            std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string cpu_line;
+            if (!cpulist || !std::getline(cpulist, cpu_line))
+                continue;
+            node n;
+            n.id = id;
+            for (int cpu : parse_list(cpu_line))
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    n.cpus.push_back(cpu);
+            // memory-only nodes and nodes outside our affinity have no workers
+            if (!n.cpus.empty())
+                add(n);
+        }
+    }
+#endif
+
+    void add(const node& n) {
+        for (int cpu : n.cpus) {
+            cpus.push_back(cpu);
+            cpu_node.push_back(list.size());
+        }
+        list.push_back(n);
+    }
+
+    size_t worker_slot(unsigned int worker, unsigned int workers) const {
+        return static_cast<size_t>(worker % workers) * cpus.size() / workers;
+    }
+
+    /// parse a sysfs list such as "0-3,8,10-11"
+    static std::vector<int> parse_list(const std::string& s) {
+        std::vector<int> result;
+        std::stringstream ss(s);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty())
+                continue;
+            int first = atoi(range.c_str());
+            size_t dash = range.find('-');
+            int last = (dash == std::string::npos) ? first : atoi(range.c_str() + dash + 1);
+            for (int i = first; i <= last; ++i)
+                result.push_back(i);
+        }
+        return result;
+    }
+};
+
+} // namespace Kalmar
+/** \endcond */
@@ -11,6 +11,16 @@
 #include "kalmar_runtime.h"
 #include "kalmar_serialize.h"
 
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+#include "hsa_sw.h"
+
+#include <dlfcn.h>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+#endif
+
 /** \cond HIDDEN_SYMBOLS */
 namespace Kalmar {
 
@@ -20,6 +30,7 @@ static void append_kernel(const std::shared_ptr<KalmarQueue>& pQueue, const Kern
   Kalmar::BufferArgumentsAppender vis(pQueue, kernel);
   Kalmar::Serialize s(&vis);
   f.__cxxamp_serialize(s);
+  vis.flush();
 }
 
 template <typename Kernel>
@@ -34,6 +45,106 @@ static inline std::shared_ptr<KalmarQueue> get_availabe_que(const Kernel& f)
         return getContext()->auto_select();
 }
 
+/// KernelHandleCache
+///
+/// Handles of one kernel type on the devices it has been launched on. The
+/// first launch on a device resolves the kernel by name; later launches find
+/// the handle here and neither build the name nor search the kernels of the
+/// device. Entries are only ever pushed, devices live as long as the process.
+template <typename Kernel>
+struct KernelHandleCache
+{
+    struct entry {
+        KalmarDevice* dev;
+        void* handle;
+        entry* next;
+    };
+    static std::atomic<entry*> list;
+
+    static void* get(KalmarQueue* pQueue, const Kernel& f) {
+        KalmarDevice* dev = pQueue->getDev();
+        for (entry* e = list.load(std::memory_order_acquire); e; e = e->next) {
+            if (e->dev == dev)
+                return e->handle;
+        }
+        // threads racing on the first launch all push an entry, the device
+        // hands each of them the same handle
+        entry* e = new entry{dev, CLAMP::GetKernelHandle(f.__cxxamp_trampoline_name(), pQueue), nullptr};
+        e->next = list.load(std::memory_order_relaxed);
+        while (!list.compare_exchange_weak(e->next, e, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        return e->handle;
+    }
+};
+
+template <typename Kernel>
+std::atomic<typename KernelHandleCache<Kernel>::entry*> KernelHandleCache<Kernel>::list(nullptr);
+
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+/// SoftwareKernel
+///
+/// Host entry of a kernel for the software HSA runtime (lib/hsa_sw), which
+/// cannot run the GCN code of the kernel. The entry rebuilds the kernel
+/// object with a memcpy of the kernarg segment of the dispatch, as the
+/// argument block of a trivially copyable kernel is laid out like the kernel
+/// itself, and runs the work-items of one workgroup. Kernels are registered
+/// with the runtime on their first launch; on the real runtime there is
+/// nothing to register with.
+///
+/// Only kernels of programs built with host-callable kernels (-cpu) have an
+/// entry, and of those only the kernels which are
+///   - not tiled: a workgroup entry has no tile_barrier or tiled_index, and
+///   - trivially copyable: array_views and arrays hold reference counted
+///     storage, and are not rebuilt by a memcpy; kernels use device pointers
+///     instead.
+/// Launching any other kernel on an accelerator of the software runtime
+/// throws.
+template <typename Kernel, int N>
+struct SoftwareKernel
+{
+    static void entry(const hsa_sw_workgroup_t* wg) {
+        typename std::aligned_storage<sizeof(Kernel), alignof(Kernel)>::type copy;
+        memcpy(&copy, wg->kernarg, sizeof(Kernel));
+        Kernel& ker = *reinterpret_cast<Kernel*>(&copy);
+        uint32_t first[3], last[3];
+        for (int d = 0; d < 3; ++d) {
+            first[d] = wg->workgroup_id[d] * wg->workgroup_size[d];
+            last[d] = std::min<uint64_t>(uint64_t(first[d]) + wg->workgroup_size[d], wg->grid_size[d]);
+        }
+        // dimension 0 of the grid is the last one of the index
+        int c[3];
+        for (c[0] = first[2]; c[0] < int(last[2]); ++c[0])
+            for (c[1] = first[1]; c[1] < int(last[1]); ++c[1])
+                for (c[2] = first[0]; c[2] < int(last[0]); ++c[2])
+                    ker(Kalmar::index<N>(c + 3 - N));
+    }
+
+    static void enroll(const std::shared_ptr<KalmarQueue>& pQueue, const Kernel& f, const size_t* local_size) {
+        typedef decltype(&hsa_sw_register_kernel) register_fn;
+        static register_fn reg = reinterpret_cast<register_fn>(dlsym(RTLD_DEFAULT, "hsa_sw_register_kernel"));
+        // the CPU runtime runs every kernel itself
+        if (!reg || pQueue->getDev()->get_path() == L"cpu")
+            return;
+        if (local_size)
+            throw runtime_exception("tiled kernels can not run on the software HSA runtime", E_FAIL);
+        if (!std::is_trivially_copyable<Kernel>::value)
+            throw runtime_exception("kernels which are not trivially copyable, such as kernels capturing an array_view, can not run on the software HSA runtime", E_FAIL);
+        static std::once_flag once;
+        std::call_once(once, [&f] {
+            if (reg(f.__cxxamp_trampoline_name(), entry, sizeof(Kernel),
+                    std::max<size_t>(alignof(Kernel), 16), 0) != 0)
+                throw runtime_exception("kernel already registered with the software HSA runtime", E_FAIL);
+        });
+    }
+};
+#endif
+
+template <typename Kernel>
+static inline void* create_kernel(const std::shared_ptr<KalmarQueue>& pQueue, const Kernel& f)
+{
+    return CLAMP::CreateKernelFromHandle(KernelHandleCache<Kernel>::get(pQueue.get(), f), pQueue.get());
+}
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-variable"
 template<typename Kernel, int dim_ext>
@@ -46,11 +157,10 @@ mcw_cxxamp_launch_kernel_async(const std::shared_ptr<KalmarQueue>& pQueue, size_
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  {
-      std::string kernel_name(f.__cxxamp_trampoline_name());
-      kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
-  }
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+  SoftwareKernel<Kernel, dim_ext>::enroll(pQueue, f, local_size);
+#endif
+  void *kernel = create_kernel(pQueue, f);
   append_kernel(pQueue, f, kernel);
   return pQueue->LaunchKernelAsync(kernel, dim_ext, ext, local_size);
 #endif
@@ -69,11 +179,10 @@ void mcw_cxxamp_launch_kernel(const std::shared_ptr<KalmarQueue>& pQueue, size_t
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  {
-      std::string kernel_name(f.__cxxamp_trampoline_name());
-      kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
-  }
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+  SoftwareKernel<Kernel, dim_ext>::enroll(pQueue, f, local_size);
+#endif
+  void *kernel = create_kernel(pQueue, f);
   append_kernel(pQueue, f, kernel);
   pQueue->LaunchKernel(kernel, dim_ext, ext, local_size);
 #endif // __KALMAR_ACCELERATOR__
@@ -90,10 +199,7 @@ inline void* mcw_cxxamp_get_kernel(const std::shared_ptr<KalmarQueue>& pQueue, c
   //this triggers the trampoline code being emitted
   // FIXME: implicitly casting to avoid pointer to int error
   int* foo = reinterpret_cast<int*>(&Kernel::__cxxamp_trampoline);
-  void *kernel = NULL;
-  std::string kernel_name (f.__cxxamp_trampoline_name());
-  kernel = CLAMP::CreateKernel(kernel_name, pQueue.get());
-  return kernel;
+  return create_kernel(pQueue, f);
 #else
   return NULL;
 #endif
@@ -106,6 +212,9 @@ void mcw_cxxamp_execute_kernel_with_dynamic_group_memory(
   const std::shared_ptr<KalmarQueue>& pQueue, size_t *ext, size_t *local_size,
   const Kernel& f, void *kernel, size_t dynamic_group_memory_size) restrict(cpu,amp) {
 #if __KALMAR_ACCELERATOR__ != 1
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+  SoftwareKernel<Kernel, dim_ext>::enroll(pQueue, f, local_size);
+#endif
   append_kernel(pQueue, f, kernel);
   pQueue->LaunchKernelWithDynamicGroupMemory(kernel, dim_ext, ext, local_size, dynamic_group_memory_size);
 #endif // __KALMAR_ACCELERATOR__
@@ -117,6 +226,9 @@ mcw_cxxamp_execute_kernel_with_dynamic_group_memory_async(
   const std::shared_ptr<KalmarQueue>& pQueue, size_t *ext, size_t *local_size,
   const Kernel& f, void *kernel, size_t dynamic_group_memory_size) restrict(cpu,amp) {
 #if __KALMAR_ACCELERATOR__ != 1
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+  SoftwareKernel<Kernel, dim_ext>::enroll(pQueue, f, local_size);
+#endif
   append_kernel(pQueue, f, kernel);
   return pQueue->LaunchKernelWithDynamicGroupMemoryAsync(kernel, dim_ext, ext, local_size, dynamic_group_memory_size);
 #endif // __KALMAR_ACCELERATOR__
@@ -2,6 +2,7 @@
 
 #include "hc_defines.h"
 #include "kalmar_aligned_alloc.h"
+#include "kalmar_cpu_topology.h"
 
 namespace hc {
 class AmPointerInfo;
@@ -118,15 +119,202 @@ class KalmarDevice;
 class KalmarQueue;
 struct rw_info;
 
+/// CompletionThread
+///
+/// Host thread owned by the runtime which runs the continuations registered
+/// with completion_future::then, one after the other. Operations hand their
+/// continuations over once they complete, so no thread is spent waiting per
+/// continuation. A continuation must not wait for another continuation to
+/// run. Like CPUThreadPool, the thread is created on first use and never
+/// destroyed.
+class CompletionThread
+{
+public:
+    typedef std::function<void()> callback_t;
+    typedef std::function<bool()> ready_t;
+
+    static CompletionThread& get() {
+        static CompletionThread* thread = new CompletionThread;
+        return *thread;
+    }
+
+    /// queue a callback to run on the completion thread
+    void post(callback_t callback) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            callbacks.push_back(std::move(callback));
+        }
+        cv.notify_one();
+    }
+
+    /// queue a callback to run on the completion thread once ready() returns
+    /// true; ready() is polled by the completion thread and must not block
+    void post_when(ready_t ready, callback_t callback) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            watches.push_back(watch_t{std::move(ready), std::move(callback)});
+        }
+        cv.notify_one();
+    }
+
+    /// queue a callback to run once fut is ready
+    void post_when_ready(std::shared_future<void> fut, callback_t callback) {
+        switch (fut.wait_for(std::chrono::seconds(0))) {
+        case std::future_status::ready:
+            post(std::move(callback));
+            break;
+        case std::future_status::deferred:
+            // nothing runs a deferred future until it is waited for, the
+            // completion thread does the work before running the callback
+            post([fut, callback] {
+                fut.wait();
+                callback();
+            });
+            break;
+        default:
+            post_when([fut] {
+                return fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            }, std::move(callback));
+            break;
+        }
+    }
+
+private:
+    struct watch_t {
+        ready_t ready;
+        callback_t callback;
+    };
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<callback_t> callbacks;
+    std::vector<watch_t> watches;
+
+    CompletionThread() : lock(), cv(), callbacks(), watches() {
+        std::thread(&CompletionThread::loop, this).detach();
+    }
+
+    void loop() {
+        // polling interval of pending watches, doubled while none of them
+        // turns ready
+        const std::chrono::microseconds minPollInterval(20);
+        const std::chrono::microseconds maxPollInterval(2000);
+        std::chrono::microseconds interval = minPollInterval;
+        while (true) {
+            std::deque<callback_t> ready;
+            std::vector<watch_t> pending;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                if (watches.empty()) {
+                    cv.wait(l, [this] { return !callbacks.empty() || !watches.empty(); });
+                } else {
+                    cv.wait_for(l, interval, [this] { return !callbacks.empty(); });
+                }
+                ready.swap(callbacks);
+                pending.swap(watches);
+            }
+
+            // poll without the lock, so posting never waits for a poll
+            std::vector<watch_t> waiting;
+            for (auto& w : pending) {
+                bool done = true;
+                try {
+                    done = w.ready();
+                } catch (...) {
+                    // the callback learns about the error itself
+                }
+                if (done) {
+                    ready.push_back(std::move(w.callback));
+                } else {
+                    waiting.push_back(std::move(w));
+                }
+            }
+            if (!waiting.empty()) {
+                std::lock_guard<std::mutex> l(lock);
+                for (auto& w : waiting)
+                    watches.push_back(std::move(w));
+            }
+
+            if (!ready.empty() || waiting.size() != pending.size()) {
+                interval = minPollInterval;
+            } else if (interval < maxPollInterval) {
+                interval *= 2;
+            }
+
+            for (auto& callback : ready) {
+                try {
+                    callback();
+                } catch (...) {
+                    // a continuation has nobody to report to, drop its error
+                }
+            }
+        }
+    }
+};
+
 /// KalmarAsyncOp
 ///
 /// This is an abstraction of all asynchronous operations within Kalmar
-class KalmarAsyncOp {
+class KalmarAsyncOp : public std::enable_shared_from_this<KalmarAsyncOp> {
 public:
   KalmarAsyncOp(KalmarQueue *xqueue, hcCommandKind xCommandKind) : queue(xqueue), commandKind(xCommandKind), seqNum(0) {} 
 
   virtual ~KalmarAsyncOp() {} 
   virtual std::shared_future<void>* getFuture() { return nullptr; }
+
+  /**
+   * Wait for the asynchronous operation to complete.
+   */
+  virtual void wait() {
+    if (std::shared_future<void>* f = getFuture())
+      f->wait();
+  }
+
+  /**
+   * Wait for the asynchronous operation to complete, and rethrow the
+   * exception it raised, if any.
+   */
+  virtual void get() {
+    if (std::shared_future<void>* f = getFuture())
+      f->get();
+  }
+
+  /**
+   * Wait for the asynchronous operation to complete, for at most timeout.
+   * Ops which can not wait with a deadline wait for completion instead.
+   *
+   * @return True if the operation has completed, false if timeout expired
+   *         first.
+   */
+  virtual bool waitFor(std::chrono::nanoseconds timeout) {
+    if (std::shared_future<void>* f = getFuture()) {
+      std::future_status status = f->wait_for(timeout);
+      if (status != std::future_status::deferred)
+        return status == std::future_status::ready;
+    }
+    wait();
+    return true;
+  }
+
+  /**
+   * Run a callback on the CompletionThread once the asynchronous operation
+   * has completed, or failed. The caller keeps the operation alive until
+   * then; the callback learns the outcome from get().
+   *
+   * By default the completion thread polls isReady(), so a slow operation
+   * does not hold up the callbacks of others; runtimes which are told about
+   * completion hand the callback over instead.
+   */
+  virtual void onComplete(std::function<void()> callback) {
+    if (isReady()) {
+      CompletionThread::get().post(std::move(callback));
+      return;
+    }
+    std::shared_ptr<KalmarAsyncOp> op = shared_from_this();
+    CompletionThread::get().post_when([op] { return op->isReady(); },
+                                      std::move(callback));
+  }
+
   virtual void* getNativeHandle() { return nullptr;}
 
   /**
@@ -184,6 +372,28 @@ private:
 
 };
 
+/// KalmarGraph
+///
+/// A sequence of commands recorded from a queue, see KalmarQueue::beginCapture,
+/// which can be launched again and again without going through the launch
+/// path of each command.
+class KalmarGraph {
+public:
+  virtual ~KalmarGraph() {}
+
+  /// number of commands in the graph, in the order they were recorded
+  virtual size_t getNodeCount() const = 0;
+
+  /// overwrite size bytes of the kernel arguments of the kernel at node,
+  /// from offset; effective from the next launch. Returns false if node is not
+  /// a kernel or the bytes are out of its arguments.
+  virtual bool patchKernarg(size_t node, size_t offset, const void* data, size_t size) = 0;
+
+  /// enqueue the commands of the graph into the queue they were recorded
+  /// from; the returned operation completes with the last of them
+  virtual std::shared_ptr<KalmarAsyncOp> launch() = 0;
+};
+
 /// KalmarQueue
 /// This is the implementation of accelerator_view
 /// KalamrQueue is responsible for data operations and launch kernel
@@ -303,6 +513,38 @@ public:
   /// is called.
   virtual bool set_cu_mask(const std::vector<bool>& cu_mask) { return false; };
 
+  /// set the priority of this queue when hardware queues of the device are
+  /// shared: the hardware queues of lower priority queues are taken first.
+  virtual bool set_queue_priority(int priority) { return false; };
+
+  /// keep the hardware queue of this queue until the queue is destroyed, or
+  /// let other queues take it again.
+  virtual bool set_queue_pinned(bool pinned) { return false; };
+
+  /// start a batch of commands: their packets are submitted to the device
+  /// together at the matching endBatch(). Batches may be nested.
+  virtual void beginBatch() {}
+
+  /// end a batch of commands, see beginBatch()
+  virtual void endBatch() {}
+
+  /// record the commands enqueued from now on into a graph instead of
+  /// running them, until endCapture(). Returns false if the queue can not
+  /// record commands.
+  virtual bool beginCapture() { return false; }
+
+  /// the graph of the commands recorded since beginCapture(), nullptr if
+  /// the queue was not recording
+  virtual std::shared_ptr<KalmarGraph> endCapture() { return nullptr; }
+
+  /// true between beginCapture() and endCapture()
+  virtual bool isCapturing() const { return false; }
+
+  /// record an asynchronous operation carried out by host threads on behalf
+  /// of this queue, e.g. a kernel on the CPU execution path; returns the
+  /// operation it has to start after, nullptr if there is none
+  virtual std::shared_ptr<KalmarAsyncOp> pushHostAsyncOp(std::shared_ptr<KalmarAsyncOp> op) { return nullptr; }
+
 
   uint64_t assign_op_seq_num() { return ++opSeqNums; };
 
@@ -378,6 +620,13 @@ public:
     /// create kernel
     virtual void* CreateKernel(const char* fun, KalmarQueue *queue) { return nullptr; }
 
+    /// look up kernel fun on the device; the handle stays valid as long as the
+    /// device and is cached by the launch code, one lookup per kernel type
+    virtual void* GetKernelHandle(const char* fun) { return nullptr; }
+
+    /// create kernel from a handle returned by GetKernelHandle
+    virtual void* CreateKernelFromHandle(void* handle, KalmarQueue *queue) { return nullptr; }
+
     /// check if a given kernel is compatible with the device
     virtual bool IsCompatibleKernel(void* size, void* source) { return true; }
 
@@ -409,6 +658,10 @@ public:
     /// get max tile static area size
     virtual size_t GetMaxTileStaticSize() { return 0; }
 
+    /// index into CPUTopology::groups() of the CPUs running the kernels of
+    /// this device on the CPU execution path, -1 for all CPUs
+    virtual int get_cpu_group() const { return -1; }
+
     /// get all queues associated with this device
     virtual std::vector< std::shared_ptr<KalmarQueue> > get_all_queues() { return std::vector< std::shared_ptr<KalmarQueue> >(); }
 
@@ -436,11 +689,71 @@ public:
 
 };
 
-class CPUQueue final : public KalmarQueue
+/// CPUAsyncOp
+///
+/// Asynchronous operation carried out by host threads, such as a kernel on the
+/// CPU execution path.  It becomes ready once complete() is called.
+class CPUAsyncOp final : public KalmarAsyncOp
+{
+  std::promise<void> prm;
+  std::shared_future<void> fut;
+  std::mutex callbackLock;
+  bool completed;
+  std::vector<std::function<void()>> callbacks;
+public:
+  CPUAsyncOp(KalmarQueue* queue, hcCommandKind kind = hcCommandKernel)
+      : KalmarAsyncOp(queue, kind), prm(), fut(prm.get_future().share()),
+        callbackLock(), completed(false), callbacks() {}
+
+  std::shared_future<void>* getFuture() override { return &fut; }
+  bool isReady() override {
+      return fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
+
+  void onComplete(std::function<void()> callback) override {
+      {
+          std::lock_guard<std::mutex> l(callbackLock);
+          if (!completed) {
+              callbacks.push_back(std::move(callback));
+              return;
+          }
+      }
+      CompletionThread::get().post(std::move(callback));
+  }
+
+  /// mark the operation as finished, optionally with the exception it raised
+  void complete(std::exception_ptr error = nullptr) {
+      if (error)
+          prm.set_exception(error);
+      else
+          prm.set_value();
+      std::vector<std::function<void()>> ready;
+      {
+          std::lock_guard<std::mutex> l(callbackLock);
+          completed = true;
+          ready.swap(callbacks);
+      }
+      // continuations run on the completion thread, never on the thread
+      // completing the op, which may be a worker of the CPU kernel pool
+      for (auto& callback : ready)
+          CompletionThread::get().post(std::move(callback));
+  }
+};
+
+/// CPUQueueBase
+///
+/// Common implementation of the queues of host-memory devices.  Data
+/// operations are plain memory moves; kernels on the CPU execution path run
+/// asynchronously on host worker threads and are tracked in order so wait()
+/// and markers observe them.
+class CPUQueueBase : public KalmarQueue
 {
+  std::mutex opLock;
+  /// last asynchronous operation pushed to this queue
+  std::shared_ptr<KalmarAsyncOp> lastOp;
 public:
 
-  CPUQueue(KalmarDevice* pDev) : KalmarQueue(pDev) {}
+  CPUQueueBase(KalmarDevice* pDev) : KalmarQueue(pDev), opLock(), lastOp(nullptr) {}
 
   void read(void* device, void* dst, size_t count, size_t offset) override {
       if (dst != device)
@@ -464,6 +777,63 @@ public:
   void unmap(void* device, void* addr, size_t count, size_t offset, bool modify) override {}
 
   void Push(void *kernel, int idx, void* device, bool modify) override {}
+
+  std::shared_ptr<KalmarAsyncOp> pushHostAsyncOp(std::shared_ptr<KalmarAsyncOp> op) override {
+      op->setSeqNumFromQueue();
+      std::lock_guard<std::mutex> l(opLock);
+      std::swap(lastOp, op);
+      return op;
+  }
+
+  void wait(hcWaitMode mode = hcWaitModeBlocked) override {
+      std::shared_ptr<KalmarAsyncOp> op;
+      {
+          std::lock_guard<std::mutex> l(opLock);
+          op = lastOp;
+      }
+      if (op == nullptr)
+          return;
+      op->wait();
+      std::lock_guard<std::mutex> l(opLock);
+      if (lastOp == op)
+          lastOp = nullptr;
+  }
+
+  bool isEmpty() override {
+      std::lock_guard<std::mutex> l(opLock);
+      return lastOp == nullptr || lastOp->isReady();
+  }
+
+  int getPendingAsyncOps() override { return isEmpty() ? 0 : 1; }
+
+  /// operations on this queue complete in order, so the last one doubles as
+  /// the marker
+  std::shared_ptr<KalmarAsyncOp> EnqueueMarker(memory_scope) override {
+      {
+          std::lock_guard<std::mutex> l(opLock);
+          if (lastOp != nullptr)
+              return lastOp;
+      }
+      auto marker = std::make_shared<CPUAsyncOp>(this, hcCommandMarker);
+      marker->setSeqNumFromQueue();
+      marker->complete();
+      return marker;
+  }
+
+  std::shared_ptr<KalmarAsyncOp> EnqueueMarkerWithDependency(int count, std::shared_ptr <KalmarAsyncOp> *depOps, memory_scope scope) override {
+      for (int i = 0; i < count; ++i) {
+          if (depOps[i] != nullptr)
+              depOps[i]->wait();
+      }
+      return EnqueueMarker(scope);
+  }
+};
+
+class CPUQueue final : public CPUQueueBase
+{
+public:
+
+  CPUQueue(KalmarDevice* pDev) : CPUQueueBase(pDev) {}
 };
 
 /// cpu accelerator
@@ -480,8 +850,13 @@ public:
     uint32_t get_version() const override { return 0; }
 
     std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order) override { return std::shared_ptr<KalmarQueue>(new CPUQueue(this)); }
-    void* create(size_t count, struct rw_info* /* not used */ ) override { return kalmar_aligned_alloc(0x1000, count); }
-    void release(void* ptr, struct rw_info* /* nout used */) override { kalmar_aligned_free(ptr); }
+    void* create(size_t count, struct rw_info* /* not used */ ) override {
+        void* data = CPUTopology::alloc_pages(count);
+        // spread the pages over the NUMA nodes whose workers will touch them
+        CPUTopology::get().place(data, count);
+        return data;
+    }
+    void release(void* ptr, struct rw_info* key) override;
     void* CreateKernel(const char* fun, KalmarQueue *queue) { return nullptr; }
 };
 
@@ -562,17 +937,30 @@ KalmarContext *getContext();
 
 namespace CLAMP {
 // used in parallel_for_each.h
+// CPU path kernels run on host worker threads while the launching thread
+// carries on, so the flag is tracked per thread. It is inline because every
+// element access of an array_view in a kernel checks it; libmcwamp keeps
+// exporting in_cpu_kernel(), enter_kernel() and leave_kernel() on top of it
+// for binaries built against older headers.
+inline bool& cpu_kernel_flag() {
+    static thread_local bool in_kernel = false;
+    return in_kernel;
+}
+
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
 extern bool is_cpu();
-extern bool in_cpu_kernel();
-extern void enter_kernel();
-extern void leave_kernel();
+inline bool in_cpu_kernel() { return cpu_kernel_flag(); }
+inline void enter_kernel() { cpu_kernel_flag() = true; }
+inline void leave_kernel() { cpu_kernel_flag() = false; }
 #endif
 
 extern void *CreateKernel(std::string, KalmarQueue*);
+extern void *GetKernelHandle(const char*, KalmarQueue*);
+extern void *CreateKernelFromHandle(void*, KalmarQueue*);
 
 extern void PushArg(void *, int, size_t, const void *);
 extern void PushArgPtr(void *, int, size_t, const void *);
+extern void PushArgBlock(void *, int, size_t, size_t, const void *);
 
 } // namespace CLAMP
 
@@ -666,6 +1054,10 @@ struct rw_info
     /// constructed with a given device pointer.
     bool toReleaseDevPointer;
 
+    /// last kernel on the CPU execution path using this buffer, it swaps data
+    /// back once done; recorded by CPUVisitor
+    std::shared_ptr<KalmarAsyncOp> cpu_op;
+
 
     /// consruct array_view
     /// According to standard, array_view will be constructed by size, or size with
@@ -674,7 +1066,7 @@ struct rw_info
     /// device, set the HostPtr flag to prevent destructor to release it
     rw_info(const size_t count, void* ptr)
         : data(ptr), count(count), curr(nullptr), master(nullptr), stage(nullptr),
-        devs(), mode(access_type_none), HostPtr(ptr != nullptr), toReleaseDevPointer(true) {
+        devs(), mode(access_type_none), HostPtr(ptr != nullptr), toReleaseDevPointer(true), cpu_op(nullptr) {
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
             /// if array_view is constructed in cpu path kernel
             /// allocate memory for it and do nothing
@@ -698,7 +1090,7 @@ struct rw_info
     ///    If it is not, ignore the stage one, fallback to case 1.
     rw_info(const std::shared_ptr<KalmarQueue>& Queue, const std::shared_ptr<KalmarQueue>& Stage,
             const size_t count, access_type mode_) : data(nullptr), count(count),
-    curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(true) {
+    curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(true), cpu_op(nullptr) {
 #if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
         if (CLAMP::in_cpu_kernel() && data == nullptr) {
             data = kalmar_aligned_alloc(0x1000, count);
@@ -729,7 +1121,7 @@ struct rw_info
     rw_info(const std::shared_ptr<KalmarQueue>& Queue, const std::shared_ptr<KalmarQueue>& Stage,
             const size_t count,
             void* device_pointer,
-            access_type mode_) : data(nullptr), count(count), curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(false) {
+            access_type mode_) : data(nullptr), count(count), curr(Queue), master(Queue), stage(nullptr), devs(), mode(mode_), HostPtr(false), toReleaseDevPointer(false), cpu_op(nullptr) {
          if (mode == access_type_auto)
              mode = curr->getDev()->get_access();
          devs[curr->getDev()] = { device_pointer, modified };
@@ -746,6 +1138,18 @@ struct rw_info
              stage = curr;
     }
 
+    /// On the CPU execution path kernels run asynchronously on host worker
+    /// threads; wait for the last one using this buffer before the host
+    /// touches it. Kernels using other buffers keep running.
+    void wait_cpu_kernels() {
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+        if (cpu_op && !CLAMP::in_cpu_kernel()) {
+            cpu_op->wait();
+            cpu_op = nullptr;
+        }
+#endif
+    }
+
     void* get_device_pointer() {
         return devs[curr->getDev()].data;
     }
@@ -787,6 +1191,7 @@ struct rw_info
         if (CLAMP::in_cpu_kernel())
             return;
 #endif
+        wait_cpu_kernels();
         if (!curr) {
             /// This can only happen if array_view is constructed with size and
             /// is not accessed before
@@ -853,6 +1258,7 @@ struct rw_info
             devs[curr->getDev()] = {curr->getDev()->create(count, this), modify ? modified : shared};
             return curr->map(data, cnt, offset, modify);
         }
+        wait_cpu_kernels();
         try_switch_to_cpu();
         dev_info& info = devs[curr->getDev()];
         if (info.state == shared && modify) {
@@ -871,11 +1277,20 @@ struct rw_info
 
     /// synchronize data to cpu accelerator
     /// used in array_view
-    void get_cpu_access(bool modify) { sync(get_cpu_queue(), modify); }
+    void get_cpu_access(bool modify) {
+#if __KALMAR_ACCELERATOR__ == 2 || __KALMAR_CPU__ == 2
+        // buffers are already synchronized for the CPU kernel running on this
+        // thread; do not touch the queue on every element access
+        if (CLAMP::in_cpu_kernel())
+            return;
+#endif
+        sync(get_cpu_queue(), modify);
+    }
 
     /// Write data from host source pointer to device
     /// Change state to modified, because the device has exclusive copy of data
     void write(const void* src, int cnt, int offset, bool blocking) {
+        wait_cpu_kernels();
         curr->write(devs[curr->getDev()].data, src, cnt, offset, blocking);
         dev_info& dev = devs[curr->getDev()];
         if (dev.state != modified) {
@@ -886,6 +1301,7 @@ struct rw_info
 
     /// Read data to host pointer from device
     void read(void* dst, int cnt, int offset) {
+        wait_cpu_kernels();
         curr->read(devs[curr->getDev()].data, dst, cnt, offset);
     }
 
@@ -893,6 +1309,8 @@ struct rw_info
     void copy(rw_info* other, int src_offset, int dst_offset, int cnt) {
         if (cnt == 0)
             cnt = count;
+        wait_cpu_kernels();
+        other->wait_cpu_kernels();
         if (!curr) {
             if (!other->curr)
                 return;
@@ -928,6 +1346,7 @@ struct rw_info
                 kalmar_aligned_free(data);
             return;
         }
+        wait_cpu_kernels();
 #endif
         /// If this rw_info is constructed by host pointer
         /// 1. synchronize latest data to host pointer
@@ -962,6 +1381,8 @@ struct rw_info
 
 inline void KalmarAsyncOp::setSeqNumFromQueue()  { seqNum = queue->assign_op_seq_num(); };
 
+inline void CPUDevice::release(void* ptr, struct rw_info* key) { CPUTopology::free_pages(ptr, key->count); }
+
 } // namespace Kalmar
 
 /** \endcond */
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <set>
+#include <type_traits>
 #include "kalmar_runtime.h"
 #include "kalmar_exception.h"
 
@@ -12,6 +14,8 @@ namespace Kalmar
 class FunctorBufferWalker {
 public:
     virtual void Append(size_t sz, const void* s) {}
+    /// append sz bytes of plain data as one argument aligned to align
+    virtual void AppendBlock(size_t sz, size_t align, const void* s) {}
     virtual void AppendPtr(size_t sz, const void* s) {}
     virtual void visit_buffer(struct rw_info* rw, bool modify, bool isArray) = 0;
 };
@@ -22,6 +26,13 @@ class Serialize {
 public:
     Serialize(FunctorBufferWalker* vis) : vis(vis) {}
     void Append(size_t sz, const void* s) { vis->Append(sz, s); }
+    void AppendBlock(size_t sz, size_t align, const void* s) { vis->AppendBlock(sz, align, s); }
+    /// append a trivially copyable object in one piece
+    template <typename T>
+    void Append(const T& v) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be appended in one piece");
+        vis->AppendBlock(sizeof(T), alignof(T), &v);
+    }
     void AppendPtr(size_t sz, const void* s) { vis->AppendPtr(sz, s); }
     void visit_buffer(struct rw_info* rw, bool modify, bool isArray) {
         vis->visit_buffer(rw, modify, isArray);
@@ -34,8 +45,12 @@ class CPUVisitor : public FunctorBufferWalker
 {
     std::shared_ptr<KalmarQueue> pQueue;
     std::set<struct rw_info*> bufs;
+    /// asynchronous kernel the buffers are swapped for, host accesses to
+    /// them wait for it
+    std::shared_ptr<KalmarAsyncOp> op;
 public:
-    CPUVisitor(std::shared_ptr<KalmarQueue> pQueue) : pQueue(pQueue) {}
+    CPUVisitor(std::shared_ptr<KalmarQueue> pQueue,
+               std::shared_ptr<KalmarAsyncOp> op = nullptr) : pQueue(pQueue), op(op) {}
     void visit_buffer(struct rw_info* rw, bool modify, bool isArray) override {
         if (isArray) {
             auto curr = pQueue->getDev()->get_path();
@@ -53,25 +68,72 @@ public:
             bufs.insert(rw);
             std::swap(device, data);
         }
+        if (op)
+            rw->cpu_op = op;
     }
 };
 
 /// Append kernel argument to kernel
+///
+/// Scalars are laid out in kernarg memory at offsets aligned to their size.
+/// Consecutive scalars whose source bytes sit as far apart as their kernarg
+/// offsets, as the fields of a capture usually do, are pushed as one block,
+/// so a capture of plain data costs one push rather than one per field.
+/// flush() pushes the pending block and must be called once serialization
+/// is done.
 class BufferArgumentsAppender : public FunctorBufferWalker
 {
     std::shared_ptr<KalmarQueue> pQueue;
     void* k_;
     int current_idx_;
+    /// kernarg offset after the last argument, the pending block included
+    size_t offset_;
+    /// pending block: source, size and alignment
+    const char* run_src_;
+    size_t run_size_;
+    size_t run_align_;
+
+    static size_t align_up(size_t n, size_t align) { return (n + align - 1) & ~(align - 1); }
+
+    /// alignment of a scalar, or of an aggregate pushed by size alone
+    static size_t natural_align(size_t sz) {
+        size_t a = sz & -sz;
+        return a < 16 ? a : 16;
+    }
+
+    void append(size_t sz, size_t align, const void* s) {
+        const char* src = static_cast<const char*>(s);
+        size_t pos = align_up(offset_, align);
+        uintptr_t run_end = uintptr_t(run_src_) + run_size_;
+        if (run_size_ && uintptr_t(src) >= run_end && uintptr_t(src) - run_end == pos - offset_) {
+            // the gap in the source is the kernarg padding, copy it along
+            run_size_ = uintptr_t(src) + sz - uintptr_t(run_src_);
+        } else {
+            flush();
+            run_src_ = src;
+            run_size_ = sz;
+            run_align_ = align;
+        }
+        offset_ = pos + sz;
+    }
+
 public:
     BufferArgumentsAppender(std::shared_ptr<KalmarQueue> pQueue, void* k)
-        : pQueue(pQueue), k_(k), current_idx_(0) {}
+        : pQueue(pQueue), k_(k), current_idx_(0), offset_(0),
+          run_src_(nullptr), run_size_(0), run_align_(1) {}
     void Append(size_t sz, const void *s) override {
-        CLAMP::PushArg(k_, current_idx_++, sz, s);
+        append(sz, natural_align(sz), s);
+    }
+    void AppendBlock(size_t sz, size_t align, const void *s) override {
+        append(sz, align, s);
     }
     void AppendPtr(size_t sz, const void *s) override {
+        flush();
         CLAMP::PushArgPtr(k_, current_idx_++, sz, s);
+        offset_ = align_up(offset_, sizeof(void*)) + sizeof(void*);
     }
     void visit_buffer(struct rw_info* rw, bool modify, bool isArray) override {
+        flush();
         if (isArray) {
             auto curr = pQueue->getDev()->get_path();
             auto path = rw->master->getDev()->get_path();
@@ -80,9 +142,21 @@ public:
                 if (asoc == L"cpu" || path != curr)
                     throw runtime_exception(__errorMsg_UnsupportedAccelerator, E_FAIL);
             }
+        } else if (pQueue->isCapturing()) {
+            // a launch of the graph would not keep the host copy of the
+            // array_view coherent
+            throw runtime_exception("array_view can not be used by a kernel recorded into a command_graph", E_FAIL);
         }
         rw->sync(pQueue, modify, false);
         pQueue->Push(k_, current_idx_++, rw->devs[pQueue->getDev()].data, modify);
+        offset_ = align_up(offset_, sizeof(void*)) + sizeof(void*);
+    }
+    /// push the pending block of plain data
+    void flush() {
+        if (run_size_) {
+            CLAMP::PushArgBlock(k_, current_idx_++, run_size_, run_align_, run_src_);
+            run_size_ = 0;
+        }
     }
 };
 
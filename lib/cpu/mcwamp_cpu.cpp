@@ -9,43 +9,22 @@
 #include <cassert>
 #include <iostream>
 #include <map>
+#include <string>
 #include <vector>
 
 #include <kalmar_runtime.h>
 #include <kalmar_aligned_alloc.h>
 
 extern "C" void PushArgImpl(void *ker, int idx, size_t sz, const void *v) {}
+extern "C" void PushArgBlockImpl(void *ker, int idx, size_t sz, size_t align, const void *v) {}
 
 namespace Kalmar {
 
-class CPUFallbackQueue final : public KalmarQueue
+class CPUFallbackQueue final : public CPUQueueBase
 {
 public:
 
-  CPUFallbackQueue(KalmarDevice* pDev) : KalmarQueue(pDev) {}
-
-  void read(void* device, void* dst, size_t count, size_t offset) override {
-      if (dst != device)
-          memmove(dst, (char*)device + offset, count);
-  }
-
-  void write(void* device, const void* src, size_t count, size_t offset, bool blocking) override {
-      if (src != device)
-          memmove((char*)device + offset, src, count);
-  }
-
-  void copy(void* src, void* dst, size_t count, size_t src_offset, size_t dst_offset, bool blocking) override {
-      if (src != dst)
-          memmove((char*)dst + dst_offset, (char*)src + src_offset, count);
-  }
-
-  void* map(void* device, size_t count, size_t offset, bool modify) override {
-      return (char*)device + offset;
-  }
-
-  void unmap(void* device, void* addr, size_t count, size_t offset, bool modify) override {}
-
-  void Push(void *kernel, int idx, void* device, bool isConst) override {}
+  CPUFallbackQueue(KalmarDevice* pDev) : CPUQueueBase(pDev) {}
 };
 
 class CPUFallbackDevice final : public KalmarDevice
@@ -63,10 +42,49 @@ public:
     uint32_t get_version() const override { return 0; }
 
     void* create(size_t count, struct rw_info* /* not used */) override {
-        return kalmar_aligned_alloc(0x1000, count);
+        void* data = CPUTopology::alloc_pages(count);
+        // spread the pages over the NUMA nodes whose workers will touch them
+        CPUTopology::get().place(data, count);
+        return data;
+    }
+    void release(void *device, struct rw_info* key) override {
+        CPUTopology::free_pages(device, key->count);
+    }
+    std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order) override {
+        return std::shared_ptr<KalmarQueue>(new CPUFallbackQueue(this));
+    }
+};
+
+/// One group of CPUs of the host, usually a NUMA node, as an accelerator of
+/// its own: its kernels run on the worker threads pinned to the group and its
+/// buffers are placed on the node of the group.
+class CPUGroupDevice final : public KalmarDevice
+{
+    const int group;
+    const CPUTopology::node& cpus() const { return CPUTopology::get().groups()[group]; }
+public:
+    CPUGroupDevice(int group) : KalmarDevice(), group(group) {}
+
+    std::wstring get_path() const override { return L"cpu_group" + std::to_wstring(group); }
+    std::wstring get_description() const override {
+        return L"CPU Group " + std::to_wstring(group) + L" (node " + std::to_wstring(cpus().id) + L")";
+    }
+    size_t get_mem() const override { return 0; }
+    bool is_double() const override { return true; }
+    bool is_lim_double() const override { return true; }
+    bool is_unified() const override { return true; }
+    bool is_emulated() const override { return true; }
+    uint32_t get_version() const override { return 0; }
+    unsigned int get_compute_unit_count() override { return cpus().cpus.size(); }
+    int get_cpu_group() const override { return group; }
+
+    void* create(size_t count, struct rw_info* /* not used */) override {
+        void* data = CPUTopology::alloc_pages(count);
+        CPUTopology::bind(data, CPUTopology::page_round(count), cpus().id);
+        return data;
     }
-    void release(void *device, struct rw_info* /* not used */ ) override { 
-        kalmar_aligned_free(device);
+    void release(void *device, struct rw_info* key) override {
+        CPUTopology::free_pages(device, key->count);
     }
     std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order) override {
         return std::shared_ptr<KalmarQueue>(new CPUFallbackQueue(this));
@@ -78,7 +96,12 @@ template <typename T> inline void deleter(T* ptr) { delete ptr; }
 class CPUContext final : public KalmarContext
 {
 public:
-    CPUContext() { Devices.push_back(new CPUFallbackDevice); }
+    CPUContext() {
+        Devices.push_back(new CPUFallbackDevice);
+        // the fallback device spanning all CPUs stays the default
+        for (size_t i = 0; i < CPUTopology::get().groups().size(); ++i)
+            Devices.push_back(new CPUGroupDevice(i));
+    }
     ~CPUContext() { std::for_each(std::begin(Devices), std::end(Devices), deleter<KalmarDevice>); }
 };
 
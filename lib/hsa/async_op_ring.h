@@ -0,0 +1,192 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// AsyncOpRing
+///
+/// In-flight operations of a queue, in a ring indexed by their sequence
+/// number within the queue. Operations are appended with consecutive sequence
+/// numbers and retired from the oldest end, once they are known to be
+/// complete: when one is waited on, it retires together with all older ones,
+/// and when the ring is full, the completed ones at the oldest end make room.
+/// Every operation is thus stored and retired once, there is no sweep over
+/// the ring.
+///
+/// The ring starts small and doubles up to a maximum capacity. Once that many
+/// operations are in flight and the oldest has not completed, push fails and
+/// the caller waits for the oldest one.
+///
+/// Retired operations are released outside of the lock of the ring, so their
+/// destructors may wait on them and call retire() again.
+template <typename Op>
+class AsyncOpRing
+{
+public:
+    typedef std::shared_ptr<Op> op_ptr;
+    /// whether an operation has completed; called with the ring locked
+    typedef std::function<bool(Op*)> done_fn;
+
+    AsyncOpRing(size_t max_capacity, done_fn done, size_t initial_capacity = 64)
+        : max_capacity(max_capacity), done(done), slots(initial_capacity < max_capacity ? initial_capacity : max_capacity),
+          head(0), tail(0), lock() {
+        assert((max_capacity & (max_capacity - 1)) == 0 && "capacity must be a power of 2");
+        assert((slots.size() & (slots.size() - 1)) == 0 && "capacity must be a power of 2");
+    }
+
+    AsyncOpRing(const AsyncOpRing&) = delete;
+    AsyncOpRing& operator=(const AsyncOpRing&) = delete;
+
+    /// append op, whose sequence number follows the youngest one; returns
+    /// false if the ring is full of operations which have not completed
+    bool push(op_ptr op, uint64_t seq) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (tail == head) {
+                head = tail = seq;
+            }
+            assert(seq == tail && "operations must be pushed in sequence");
+            if (tail - head < slots.size()) {
+                slots[tail & mask()] = std::move(op);
+                ++tail;
+                return true;
+            }
+        }
+        return push_full(std::move(op));
+    }
+
+    /// retire op, known to be complete, together with all older operations;
+    /// nothing happens if op is not in the ring
+    void retire(const Op* op, uint64_t seq) {
+        op_ptr batch[RETIRE_BATCH];
+        while (true) {
+            size_t n = 0;
+            {
+                std::lock_guard<std::mutex> l(lock);
+                if (seq < head || seq >= tail || slots[seq & mask()].get() != op) {
+                    return;
+                }
+                for (; n < RETIRE_BATCH && head <= seq; ++n, ++head) {
+                    batch[n] = std::move(slots[head & mask()]);
+                }
+            }
+            for (size_t i = 0; i < n; ++i) {
+                batch[i] = nullptr;
+            }
+        }
+    }
+
+    /// retire the completed operations at the oldest end; returns whether
+    /// the ring is empty afterwards
+    bool retire_completed() {
+        std::vector<op_ptr> retired;
+        std::lock_guard<std::mutex> l(lock);
+        retire_completed(retired);
+        return tail == head;
+    }
+
+    /// the youngest operation, nullptr if there is none
+    op_ptr youngest() {
+        std::lock_guard<std::mutex> l(lock);
+        return tail == head ? nullptr : slots[(tail - 1) & mask()];
+    }
+
+    /// the oldest operation, nullptr if there is none
+    op_ptr oldest() {
+        std::lock_guard<std::mutex> l(lock);
+        return tail == head ? nullptr : slots[head & mask()];
+    }
+
+    bool empty() {
+        std::lock_guard<std::mutex> l(lock);
+        return tail == head;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> l(lock);
+        return tail - head;
+    }
+
+    /// all operations in the ring, from the oldest to the youngest
+    std::vector<op_ptr> snapshot() {
+        std::lock_guard<std::mutex> l(lock);
+        std::vector<op_ptr> ops;
+        ops.reserve(tail - head);
+        for (uint64_t s = head; s != tail; ++s) {
+            ops.push_back(slots[s & mask()]);
+        }
+        return ops;
+    }
+
+    /// call f(seq, op) for every operation, from the oldest to the youngest,
+    /// with the ring locked; f must not call back into the ring
+    template <typename F>
+    void for_each(F f) {
+        std::lock_guard<std::mutex> l(lock);
+        for (uint64_t s = head; s != tail; ++s) {
+            f(s, slots[s & mask()].get());
+        }
+    }
+
+private:
+    /// operations released per lock held in retire()
+    static const size_t RETIRE_BATCH = 16;
+
+    const size_t max_capacity;
+    done_fn done;
+    std::vector<op_ptr> slots;
+    /// sequence numbers of the oldest operation and the one after the youngest
+    uint64_t head;
+    uint64_t tail;
+    std::mutex lock;
+
+    uint64_t mask() const { return slots.size() - 1; }
+
+    /// push into a full ring: make room by retiring completed operations,
+    /// or by growing the ring
+    bool push_full(op_ptr op) {
+        std::vector<op_ptr> retired;
+        std::lock_guard<std::mutex> l(lock);
+        if (tail - head == slots.size()) {
+            retire_completed(retired);
+            if (tail - head == slots.size()) {
+                if (slots.size() == max_capacity) {
+                    return false;
+                }
+                grow();
+            }
+        }
+        slots[tail & mask()] = std::move(op);
+        ++tail;
+        // ops in retired are released after the lock
+        return true;
+    }
+
+    void retire_completed(std::vector<op_ptr>& retired) {
+        while (head != tail && done(slots[head & mask()].get())) {
+            retired.push_back(std::move(slots[head & mask()]));
+            ++head;
+        }
+    }
+
+    void grow() {
+        std::vector<op_ptr> bigger(slots.size() * 2);
+        for (uint64_t s = head; s != tail; ++s) {
+            bigger[s & (bigger.size() - 1)] = std::move(slots[s & mask()]);
+        }
+        slots.swap(bigger);
+    }
+};
@@ -0,0 +1,212 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// BufferDepTable
+///
+/// Last accesses of the buffers used by the kernels of a queue, to find the
+/// operations a new access has to wait for. Each buffer keeps the last
+/// operation which wrote it and the operations which read it since, along with
+/// their sequence numbers:
+///
+///   - a read depends on the last writer (read after write),
+///   - a write depends on the last writer and on the readers since
+///     (write after write, write after read),
+///   - a read never depends on other reads.
+///
+/// Buffers are looked up in open-addressed tables with linear probing, one
+/// per shard, each with its own lock; the shard is picked by the hash of the
+/// buffer, so that threads dispatching kernels on different buffers do not
+/// contend. Operations are only referred to weakly: once an operation is
+/// released, it does not count as a dependency anymore, and a buffer whose
+/// operations are all released is dropped when its shard is rehashed.
+template <typename Op>
+class BufferDepTable
+{
+public:
+    typedef std::shared_ptr<Op> op_ptr;
+
+    BufferDepTable() = default;
+    BufferDepTable(const BufferDepTable&) = delete;
+    BufferDepTable& operator=(const BufferDepTable&) = delete;
+
+    /// append to deps the operations which an access to buffer has to wait
+    /// for; an operation may be appended more than once
+    void dependencies(const void* buffer, bool modify, std::vector<op_ptr>& deps) {
+        shard& sh = shard_of(buffer);
+        std::lock_guard<std::mutex> l(sh.lock);
+        entry* e = sh.find(buffer);
+        if (!e) {
+            return;
+        }
+        if (op_ptr writer = e->writer.op.lock()) {
+            deps.push_back(std::move(writer));
+        }
+        if (modify) {
+            for (const access& r : e->readers) {
+                if (op_ptr reader = r.op.lock()) {
+                    deps.push_back(std::move(reader));
+                }
+            }
+        }
+    }
+
+    /// record an access to buffer by op, with sequence number seq within its
+    /// queue; accesses are recorded in sequence
+    void record(const void* buffer, bool modify, const op_ptr& op, uint64_t seq) {
+        shard& sh = shard_of(buffer);
+        std::lock_guard<std::mutex> l(sh.lock);
+        entry& e = sh.insert(buffer);
+        if (modify) {
+            e.writer = access{op, seq};
+            e.readers.clear();
+        } else if (e.readers.empty() || e.readers.back().seq != seq) {
+            if (e.readers.size() >= PRUNE_READERS) {
+                e.prune();
+            }
+            e.readers.push_back(access{op, seq});
+        }
+    }
+
+    /// forget all buffers
+    void clear() {
+        for (shard& sh : shards) {
+            std::lock_guard<std::mutex> l(sh.lock);
+            sh.slots.clear();
+            sh.used = 0;
+        }
+    }
+
+private:
+    static const size_t SHARDS = 8;
+    static const size_t INITIAL_SLOTS = 64;
+    /// readers of a buffer before the released ones are dropped
+    static const size_t PRUNE_READERS = 16;
+
+    struct access {
+        std::weak_ptr<Op> op;
+        uint64_t seq;
+    };
+
+    struct entry {
+        /// nullptr for an empty slot
+        const void* buffer = nullptr;
+        access writer = access{std::weak_ptr<Op>(), 0};
+        std::vector<access> readers;
+
+        void prune() {
+            size_t n = 0;
+            for (size_t i = 0; i < readers.size(); ++i) {
+                if (!readers[i].op.expired()) {
+                    readers[n++] = std::move(readers[i]);
+                }
+            }
+            readers.resize(n);
+        }
+
+        bool released() const {
+            if (!writer.op.expired()) {
+                return false;
+            }
+            for (const access& r : readers) {
+                if (!r.op.expired()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    static uint64_t hash(const void* buffer) {
+        // buffers are at least 16-byte aligned
+        return (reinterpret_cast<uintptr_t>(buffer) >> 4) * 0x9E3779B97F4A7C15ull;
+    }
+
+    struct shard {
+        std::mutex lock;
+        /// a power of 2 of slots, empty until the first insert
+        std::vector<entry> slots;
+        size_t used = 0;
+
+        size_t mask() const { return slots.size() - 1; }
+
+        entry* find(const void* buffer) {
+            if (slots.empty()) {
+                return nullptr;
+            }
+            for (size_t i = hash(buffer) >> 32;; ++i) {
+                entry& e = slots[i & mask()];
+                if (e.buffer == buffer) {
+                    return &e;
+                }
+                if (e.buffer == nullptr) {
+                    return nullptr;
+                }
+            }
+        }
+
+        entry& insert(const void* buffer) {
+            if (entry* e = find(buffer)) {
+                return *e;
+            }
+            // keep the load factor at most 1/2
+            if (2 * (used + 1) > slots.size()) {
+                rehash();
+            }
+            for (size_t i = hash(buffer) >> 32;; ++i) {
+                entry& e = slots[i & mask()];
+                if (e.buffer == nullptr) {
+                    e.buffer = buffer;
+                    ++used;
+                    return e;
+                }
+            }
+        }
+
+        /// drop the released buffers, and grow if the live ones still fill
+        /// half of the slots
+        void rehash() {
+            std::vector<entry> live;
+            for (entry& e : slots) {
+                if (e.buffer != nullptr && !e.released()) {
+                    live.push_back(std::move(e));
+                }
+            }
+            size_t size = slots.empty() ? INITIAL_SLOTS : slots.size();
+            while (2 * (live.size() + 1) > size) {
+                size *= 2;
+            }
+            std::vector<entry>(size).swap(slots);
+            used = live.size();
+            for (entry& e : live) {
+                for (size_t i = hash(e.buffer) >> 32;; ++i) {
+                    entry& slot = slots[i & mask()];
+                    if (slot.buffer == nullptr) {
+                        slot = std::move(e);
+                        break;
+                    }
+                }
+            }
+        }
+    };
+
+    static_assert(SHARDS == 8, "shard_of() picks a shard with 3 bits of the hash");
+    shard shards[SHARDS];
+
+    shard& shard_of(const void* buffer) {
+        // the top bits of the hash pick the shard, the ones below the slot
+        return shards[hash(buffer) >> 61];
+    }
+};
@@ -9,7 +9,10 @@
 #include "../hc2/headers/types/program_state.hpp"
 
 #include <cassert>
+#include <atomic>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -18,6 +21,7 @@
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -40,6 +44,9 @@
 
 #include "hc_am_internal.hpp"
 #include "unpinned_copy_engine.h"
+#include "resource_pool.h"
+#include "async_op_ring.h"
+#include "buffer_dep_table.h"
 #include "hc_rt_debug.h"
 #include "hc_printf.hpp"
 
@@ -50,8 +57,6 @@
 #define KALMAR_DEBUG (0)
 #endif
 
-#define CHECK_OLDER_COMPLETE 0
-
 // Detailed debug of kernarg serialization and pushing.
 // TODO - remove when new serialization logic comes online.
 #define HCC_DEBUG_KARG 0
@@ -66,26 +71,33 @@
 // kernel dispatch speed optimization flags
 /////////////////////////////////////////////////
 
-// size of default kernarg buffer in the kernarg pool in HSAContext
-#define KERNARG_BUFFER_SIZE (512)
+// size of the largest kernarg buffer in the kernarg pool in HSADevice, larger
+// kernargs are allocated on every launch
+#define KERNARG_BUFFER_SIZE (4096)
+
+// size in bytes of the chunks of kernarg memory the kernarg pool in HSADevice
+// carves its buffers from, 0 to disable the pool
+// Should hold more small buffers than SIGNAL_POOL_SIZE (some kernels don't allocate signals but nearly all need kernargs)
+#define KERNARG_POOL_SIZE (64 * 1024)
 
-// number of pre-allocated kernarg buffers in HSAContext
-// Should be greater than SIGNAL_POOL_SIZE (some kernels don't allocate signals but nearly all need kernargs)
-#define KERNARG_POOL_SIZE (1024)
+// sizes of the kernarg buffers in the kernarg pool: powers of 2, ascending,
+// the last one KERNARG_BUFFER_SIZE. A buffer is aligned to its size.
+static const size_t kernargSizeClasses[] = { 64, 128, 256, 512, KERNARG_BUFFER_SIZE };
+#define KERNARG_SIZE_CLASS_COUNT (sizeof(kernargSizeClasses) / sizeof(kernargSizeClasses[0]))
+
+// low bits of a kernarg buffer index which hold its size class
+#define KERNARG_SIZE_CLASS_BITS (3)
 
 // number of pre-allocated HSA signals in HSAContext
 // Signals are precious resource so manage carefully
 #define SIGNAL_POOL_SIZE (512) //
 
 // Maximum number of inflight commands sent to a single queue.
-// If limit is exceeded, HCC will force a queue wait to reclaim
-// resources (signals, kernarg)
+// If limit is exceeded, HCC waits for the oldest command to reclaim
+// its resources (signals, kernarg)
 // MUST be a power of 2.
 #define MAX_INFLIGHT_COMMANDS_PER_QUEUE  (2*8192)
 
-// threshold to clean up finished kernel in HSAQueue.asyncOps
-#define ASYNCOPS_VECTOR_GC_SIZE (2*8192)
-
 
 //---
 // Environment variables:
@@ -100,6 +112,9 @@ long int HCC_H2D_STAGING_THRESHOLD    = 64;
 long int HCC_H2D_PININPLACE_THRESHOLD = 4096;
 long int HCC_D2H_PININPLACE_THRESHOLD = 1024;
 
+// Threads copying into and out of staging buffers, 0 to choose from the number of cores.
+int HCC_STAGING_THREADS = 0;
+
 // Chicken bits:
 int HCC_SERIALIZE_KERNEL = 0;
 int HCC_SERIALIZE_COPY = 0;
@@ -336,13 +351,17 @@ inline static void checkHCCRuntimeStatus(const HCCRuntimeStatus status, const un
 
 extern "C" void PushArgImpl(void *ker, int idx, size_t sz, const void *v);
 extern "C" void PushArgPtrImpl(void *ker, int idx, size_t sz, const void *v);
+extern "C" void PushArgBlockImpl(void *ker, int idx, size_t sz, size_t align, const void *v);
 
 // forward declaration
 namespace Kalmar {
 class HSAQueue;
 class HSADevice;
+class HSAGraph;
 } // namespace Kalmar
 
+static Kalmar::hcCommandKind resolveMemcpyDirection(bool srcInDeviceMem, bool dstInDeviceMem);
+
 ///
 /// kernel compilation / kernel launching
 ///
@@ -406,6 +425,8 @@ private:
     uint32_t static_group_segment_size;
     uint32_t private_segment_size;
     uint16_t workitem_vgpr_count;
+    uint32_t kernarg_segment_size;
+    uint32_t kernarg_segment_alignment;
     friend class HSADispatch;
 
 public:
@@ -436,6 +457,20 @@ public:
                 &this->private_segment_size);
         STATUS_CHECK(status, __LINE__);
 
+        status =
+            hsa_executable_symbol_get_info(
+                _hsaExecutableSymbol,
+                HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_ALIGNMENT,
+                &this->kernarg_segment_alignment);
+        STATUS_CHECK(status, __LINE__);
+
+        status =
+            hsa_executable_symbol_get_info(
+                _hsaExecutableSymbol,
+                HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE,
+                &this->kernarg_segment_size);
+        STATUS_CHECK(status, __LINE__);
+
         workitem_vgpr_count = 0;
 
         hsa_ven_amd_loader_1_00_pfn_t ext_table = {nullptr};
@@ -480,14 +515,31 @@ public:
     HSAOp(Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind) ;
 
     const HSAOpCoord opCoord() const { return _opCoord; };
-    int asyncOpsIndex() const { return _asyncOpsIndex; };
 
-    void asyncOpsIndex(int asyncOpsIndex) { _asyncOpsIndex = asyncOpsIndex; };
+    // completion_future waits on the signal of the op through wait(); a
+    // std::shared_future is only made for a caller asking for one
+    std::shared_future<void>* getFuture() override;
+    void get() override { wait(); }
+
+    // ROCr calls back once the signal of the op drops below 1, the callback
+    // then runs on the completion thread rather than in the signal handler
+    void onComplete(std::function<void()> callback) override;
+
+    // blocks on the signal of the op, at most until the timeout expires
+    bool waitFor(std::chrono::nanoseconds timeout) override;
 
 protected:
     uint64_t   apiStartTick;
     HSAOpCoord _opCoord;
-    int        _asyncOpsIndex;
+
+    // Held by waitComplete() of the derived ops. Threads waiting on the same
+    // op at once complete it one after the other: the first runs the
+    // completion and cleanup, the others find the op no longer dispatched.
+    std::mutex _waitLock;
+
+private:
+    std::once_flag _futureFlag;
+    std::unique_ptr<std::shared_future<void>> _future;
 };
 
 
@@ -502,8 +554,6 @@ private:
     uint64_t apiStartTick;
     hsa_wait_state_t waitMode;
 
-    std::shared_future<void>* future;
-
 
     // If copy is dependent on another operation, record reference here.
     // keep a reference which prevents those ops from being deleted until this op is deleted.
@@ -524,7 +574,7 @@ private:
 
 public:
     Kalmar::HSAQueue * hsaQueue() const;
-    std::shared_future<void>* getFuture() override { return future; }
+    void wait() override { waitComplete(); }
     const Kalmar::HSADevice* getCopyDevice() { return copyDevice; } ;  // Which device did the copy.
 
     void* getNativeHandle() override { return &signal; }
@@ -632,9 +682,6 @@ private:
     bool isDispatched;
     hsa_wait_state_t waitMode;
 
-
-    std::shared_future<void>* future;
-
     // prior dependencies
     // maximum up to 5 prior dependencies could be associated with one
     // HSABarrier instance
@@ -650,12 +697,12 @@ private:
 public:
     uint16_t  header;  // stores header of AQL packet.  Preserve so we can see flushes associated with this barrier.
 
-    // array of all operations that this op depends on.
+    // array of all operations that this op depends on: markers, kernels and copies.
     // This array keeps a reference which prevents those ops from being deleted until this op is deleted.
-    std::shared_ptr<HSABarrier> depAsyncOps [HSA_BARRIER_DEP_SIGNAL_CNT];
+    std::shared_ptr<HSAOp> depAsyncOps [HSA_BARRIER_DEP_SIGNAL_CNT];
 
 public:
-    std::shared_future<void>* getFuture() override { return future; }
+    void wait() override { waitComplete(); }
     void acquire_scope(hc::memory_scope acquireScope) { _acquire_scope = acquireScope;};
 
     bool barrierNextSyncNeedsSysRelease() const { return _barrierNextSyncNeedsSysRelease; };
@@ -685,7 +732,6 @@ public:
     HSABarrier(Kalmar::KalmarQueue *queue, std::shared_ptr <Kalmar::KalmarAsyncOp> dependent_op) :
         HSAOp(queue, Kalmar::hcCommandMarker),
         isDispatched(false),
-        future(nullptr),
         _acquire_scope(hc::no_scope),
         _barrierNextSyncNeedsSysRelease(false),
         _barrierNextKernelNeedsSysAcquire(false),
@@ -693,9 +739,7 @@ public:
     {
 
         if (dependent_op != nullptr) {
-            assert (dependent_op->getCommandKind() == hcCommandMarker);
-
-            depAsyncOps[0] = std::static_pointer_cast<HSABarrier> (dependent_op);
+            depAsyncOps[0] = std::static_pointer_cast<HSAOp> (dependent_op);
             depCount = 1;
         } else {
             depCount = 0;
@@ -708,7 +752,6 @@ public:
     HSABarrier(Kalmar::KalmarQueue *queue, int count, std::shared_ptr <Kalmar::KalmarAsyncOp> *dependent_op_array) :
         HSAOp(queue, Kalmar::hcCommandMarker),
         isDispatched(false),
-        future(nullptr),
         _acquire_scope(hc::no_scope),
         _barrierNextSyncNeedsSysRelease(false),
         _barrierNextKernelNeedsSysAcquire(false),
@@ -719,8 +762,7 @@ public:
             for (int i = 0; i < count; ++i) {
                 if (dependent_op_array[i]) {
                     // squish null ops
-                    assert (dependent_op_array[i]->getCommandKind() == hcCommandMarker);
-                    depAsyncOps[depCount] = std::static_pointer_cast<HSABarrier> (dependent_op_array[i]);
+                    depAsyncOps[depCount] = std::static_pointer_cast<HSAOp> (dependent_op_array[i]);
                     depCount++;
                 }
             }
@@ -770,11 +812,17 @@ private:
     const char *kernel_name;
     const HSAKernel* kernel;
 
+    // Arguments are written straight into kernargMemory, reserved with the
+    // kernarg segment size of the kernel at the first push. Only arguments
+    // which do not fit the segment, or pushed for a dispatch without a kernel,
+    // are collected in arg_vec and copied into kernarg memory at dispatch.
     std::vector<uint8_t> arg_vec;
     uint32_t arg_count;
+    size_t arg_size;
     size_t prevArgVecCapacity;
     void* kernargMemory;
     int kernargMemoryIndex;
+    size_t kernargCapacity;
 
 
     hsa_signal_t signal;
@@ -783,12 +831,16 @@ private:
     bool isDispatched;
     hsa_wait_state_t waitMode;
 
-
-    std::shared_future<void>* future;
+    // buffers of array / array_view arguments, and whether the kernel may
+    // write them
+    std::vector<std::pair<void*, bool>> bufferAccesses;
 
 public:
     Kalmar::HSAQueue * hsaQueue() const;
-    std::shared_future<void>* getFuture() override { return future; }
+    void wait() override { waitComplete(); }
+
+    void addBufferAccess(void* buffer, bool modify) { bufferAccesses.emplace_back(buffer, modify); }
+    const std::vector<std::pair<void*, bool>>& getBufferAccesses() const { return bufferAccesses; }
 
     void setKernelName(const char *x_kernel_name) { kernel_name = x_kernel_name;};
     const char *getKernelName() { return kernel_name ? kernel_name : (kernel ? kernel->shortKernelName.c_str() : "<unknown_kernel>"); };
@@ -831,12 +883,51 @@ public:
     hsa_status_t pushShortArg(short s) { return pushArgPrivate(s); }
     hsa_status_t pushPointerArg(void *addr) { return pushArgPrivate(addr); }
 
+    // push size bytes at the next offset aligned to align, a power of 2
+    hsa_status_t pushArgBlock(const void* val, size_t size, size_t align) {
+        size_t offset = (arg_size + align - 1) & ~(align - 1);
+#if KALMAR_DEBUG && HCC_DEBUG_KARG
+        printf("push %lu bytes into kernarg at offset %lu: ", size + offset - arg_size, offset);
+        for (size_t i = 0; i < size; ++i) {
+            printf("%02X ", static_cast<const uint8_t*>(val)[i]);
+        }
+        printf("\n");
+#endif
+        if (arg_count == 0 && kernargMemory == nullptr) {
+            reserveKernarg();
+        }
+        if (kernargCapacity && offset + size > kernargCapacity) {
+            spillKernarg();
+        }
+        if (kernargCapacity) {
+            // the reserved buffer is zeroed, padding needs no writes
+            memcpy(static_cast<uint8_t*>(kernargMemory) + offset, val, size);
+        } else {
+            arg_vec.resize(offset + size);
+            memcpy(arg_vec.data() + offset, val, size);
+        }
+        arg_size = offset + size;
+        arg_count++;
+        return HSA_STATUS_SUCCESS;
+    }
+
     hsa_status_t clearArgs() {
         arg_count = 0;
+        arg_size = 0;
         arg_vec.clear();
         return HSA_STATUS_SUCCESS;
     }
 
+    /// pushed arguments, and their size in bytes
+    const void* pushedKernarg() const { return kernargCapacity ? kernargMemory : arg_vec.data(); }
+    size_t pushedKernargSize() const { return arg_size; }
+
+    /// alignment of the kernarg buffer of the kernel
+    size_t kernargAlignment() const { return kernel ? kernel->kernarg_segment_alignment : 16; }
+
+    /// header of the AQL packet of the dispatch, once its fence bits are set
+    uint16_t packetHeader() const;
+
 
     void overrideAcquireFenceIfNeeded();
     hsa_status_t setLaunchConfiguration(int dims, size_t *globalDims, size_t *localDims,
@@ -872,31 +963,15 @@ public:
 private:
     template <typename T>
     hsa_status_t pushArgPrivate(T val) {
-        /* add padding if necessary */
-        int padding_size = (arg_vec.size() % sizeof(T)) ? (sizeof(T) - (arg_vec.size() % sizeof(T))) : 0;
-#if KALMAR_DEBUG && HCC_DEBUG_KARG
-        printf("push %lu bytes into kernarg: ", sizeof(T) + padding_size);
-#endif
-        for (size_t i = 0; i < padding_size; ++i) {
-            arg_vec.push_back((uint8_t)0x00);
-#if KALMAR_DEBUG && HCC_DEBUG_KARG
-            printf("%02X ", (uint8_t)0x00);
-#endif
-        }
-        uint8_t* ptr = static_cast<uint8_t*>(static_cast<void*>(&val));
-        for (size_t i = 0; i < sizeof(T); ++i) {
-            arg_vec.push_back(ptr[i]);
-#if KALMAR_DEBUG && HCC_DEBUG_KARG
-            printf("%02X ", ptr[i]);
-#endif
-        }
-#if KALMAR_DEBUG && HCC_DEBUG_KARG
-        printf("\n");
-#endif
-        arg_count++;
-        return HSA_STATUS_SUCCESS;
+        return pushArgBlock(&val, sizeof(T), sizeof(T));
     }
 
+    // reserve the kernarg buffer of the kernel to push arguments into
+    void reserveKernarg();
+
+    // move the arguments pushed in place to arg_vec and give back the buffer
+    void spillKernarg();
+
     int computeLaunchAttr(int globalSize, int localSize, int recommendedSize) {
         // localSize of 0 means pick best
         if (localSize == 0) localSize = recommendedSize;
@@ -970,7 +1045,8 @@ struct RocrQueue {
         STATUS_CHECK(status, __LINE__);
     }
 
-    RocrQueue(hsa_agent_t agent, size_t queue_size, HSAQueue *hccQueue)
+    RocrQueue(hsa_agent_t agent, size_t queue_size, HSAQueue *hccQueue) :
+        _lastUsed(0)
     {
 
         assert(queue_size != 0);
@@ -1009,9 +1085,13 @@ struct RocrQueue {
 
     std::vector<uint32_t> cu_arrays;
 
+    // Tick of the device when a command was last submitted to the queue, the
+    // least recently used queue is stolen first.
+    std::atomic<uint64_t> _lastUsed;
+
     // Track profiling enabled state here. - no need now since all hw queues have profiling enabled.
 
-    // Priority could be tracked here:
+    // The priority of the queue is the one of the HSAQueue it is assigned to.
 };
 
 
@@ -1021,6 +1101,7 @@ class HSAQueue final : public KalmarQueue
 private:
     friend class Kalmar::HSADevice;
     friend class RocrQueue;
+    friend class Kalmar::HSAGraph;
     friend std::ostream& operator<<(std::ostream& os, const HSAQueue & hav);
 
     // ROCR queue associated with this HSAQueue instance.
@@ -1028,18 +1109,41 @@ private:
 
     std::mutex   qmutex;  // Protect structures for this KalmarQueue.  Currently just the hsaQueue.
 
+    // Scheduling of the rocrQueues of the device, see HSADevice::createOrstealRocrQueue:
+    // the rocrQueues of lower priority HSAQueues are stolen first, and a pinned
+    // HSAQueue keeps its rocrQueue until it is destroyed.
+    std::atomic<int>  queuePriority;
+    std::atomic<bool> queuePinned;
+
+    // Batched submission, see beginBatch(): while batchDepth > 0, packets are
+    // written to the hw queue with an invalid header, which keeps the packet
+    // processor from reading them. Their headers are published in order and
+    // the doorbell rung once at the end of the batch, or as soon as a command
+    // of the queue is waited for. Protected by qmutex, but for batchPending.
+    int                                          batchDepth;
+    std::vector<std::pair<uint16_t*, uint16_t>>  batchHeaders;
+    hsa_queue_t                                 *batchHwQueue;
+    uint64_t                                     batchLastIndex;
+    std::atomic<bool>                            batchPending;
+
+    // Graph the commands are recorded into instead of being run, between
+    // beginCapture() and endCapture(). Both are set and cleared under qmutex;
+    // capturing lets the launch paths skip the lock when the queue is not
+    // capturing, and getCaptureGraph() hands out a reference to the graph
+    // which outlives a concurrent endCapture().
+    std::atomic<bool>                            capturing;
+    std::shared_ptr<HSAGraph>                    captureGraph;
 
-    bool         drainingQueue_;  // mode that we are draining queue, used to allow barrier ops to be enqueued.
 
     //
     // kernel dispatches and barriers associated with this HSAQueue instance
     //
     // When a kernel k is dispatched, we'll get a KalmarAsyncOp f.
-    // This vector would hold f.  acccelerator_view::wait() would trigger
-    // HSAQueue::wait(), and all future objects in the KalmarAsyncOp objects
-    // will be waited on.
+    // This ring would hold f until f completes.  acccelerator_view::wait()
+    // would trigger HSAQueue::wait(), and all the KalmarAsyncOp objects in
+    // the ring will be waited on.
     //
-    std::vector< std::shared_ptr<HSAOp> > asyncOps;
+    AsyncOpRing<HSAOp> asyncOps;
 
     uint64_t                                      queueSeqNum; // sequence-number of this queue.
 
@@ -1067,35 +1171,23 @@ private:
     std::vector<uint32_t> cu_arrays;
 
     //
-    // kernelBufferMap and bufferKernelMap forms the dependency graph of
-    // kernel / kernel dispatches / buffers
+    // bufferDeps forms the dependency graph of kernel dispatches / buffers
     //
-    // For a particular kernel k, kernelBufferMap[k] holds a vector of
-    // host buffers used by k. The vector is filled at HSAQueue::Push(),
-    // when kernel arguments are prepared.
+    // The buffers used by a kernel k, and whether k may write them, are
+    // collected in the HSADispatch of k at HSAQueue::Push(), when kernel
+    // arguments are prepared.
     //
-    // When a kenrel k is to be dispatched, kernelBufferMap[k] will be traversed
-    // to figure out if there is any previous kernel dispatch associated for
-    // each buffer b used by k.  This is done by checking bufferKernelMap[b].
-    // If there are previous kernel dispatches which use b, then we wait on
-    // them before dispatch kernel k. bufferKernelMap[b] will be cleared then.
+    // When k is to be dispatched, bufferDeps gives the previous dispatches k
+    // has to wait for: the last one which wrote a buffer k uses, and, for a
+    // buffer k writes, the ones which read it since. Kernels which only read
+    // the same buffer do not wait for each other.
     //
-    // After kernel k is dispatched, we'll get a KalmarAsync object f, we then
-    // walk through each buffer b used by k and mark the association as:
-    // bufferKernelMap[b] = f
+    // After k is dispatched, its accesses are recorded in bufferDeps.
     //
-    // Finally kernelBufferMap[k] will be cleared.
+    // In an in-order queue, the barrier bit of the AQL packets already orders
+    // every dispatch after the previous ones, so no dependency is tracked.
     //
-
-    // association between buffers and kernel dispatches
-    // key: buffer address
-    // value: a vector of kernel dispatches
-    std::map<void*, std::vector< std::weak_ptr<KalmarAsyncOp> > > bufferKernelMap;
-
-    // association between a kernel and buffers used by it
-    // key: kernel
-    // value: a vector of buffers used by the kernel
-    std::map<void*, std::vector<void*> > kernelBufferMap;
+    BufferDepTable<KalmarAsyncOp> bufferDeps;
 
     // signal used by sync copy only
     hsa_signal_t  sync_copy_signal;
@@ -1131,8 +1223,7 @@ public:
     {
         hsa_signal_value_t oldv=0;
         s << *this << " : " << asyncOps.size() << " op entries\n";
-        for (int i=0; i<asyncOps.size(); i++) {
-            const std::shared_ptr<HSAOp> &op = asyncOps[i];
+        asyncOps.for_each([&] (uint64_t i, HSAOp* op) {
             s << "index:" << std::setw(4) << i ;
             if (op != nullptr) {
                 s << " op#"<< op->getSeqNum() ;
@@ -1144,11 +1235,11 @@ public:
                 s  << " " << getHcCommandKindString(op->getCommandKind());
                 // TODO - replace with virtual function
                 if (op->getCommandKind() == hc::hcCommandMarker) {
-                    auto b = static_cast<HSABarrier*> (op.get());
+                    auto b = static_cast<HSABarrier*> (op);
                     s << " acq=" << extractBits(b->header, HSA_PACKET_HEADER_SCACQUIRE_FENCE_SCOPE, HSA_PACKET_HEADER_WIDTH_SCACQUIRE_FENCE_SCOPE);
                     s << ",rel=" << extractBits(b->header, HSA_PACKET_HEADER_SCRELEASE_FENCE_SCOPE, HSA_PACKET_HEADER_WIDTH_SCRELEASE_FENCE_SCOPE);
                 } else if (op->getCommandKind() == hc::hcCommandKernel) {
-                    auto d = static_cast<HSADispatch*> (op.get());
+                    auto d = static_cast<HSADispatch*> (op);
                     s << " acq=" << extractBits(d->getAql().header, HSA_PACKET_HEADER_SCACQUIRE_FENCE_SCOPE, HSA_PACKET_HEADER_WIDTH_SCACQUIRE_FENCE_SCOPE);
                     s << ",rel=" << extractBits(d->getAql().header, HSA_PACKET_HEADER_SCRELEASE_FENCE_SCOPE, HSA_PACKET_HEADER_WIDTH_SCRELEASE_FENCE_SCOPE);
                 }
@@ -1163,7 +1254,7 @@ public:
             }
             s  << "\n";
 
-        }
+        });
     }
 
     // Save the command and type
@@ -1180,21 +1271,18 @@ public:
 
 
 
-        if (!drainingQueue_ && (asyncOps.size() >= MAX_INFLIGHT_COMMANDS_PER_QUEUE-1)) {
-            DBOUT(DB_WAIT, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " force sync\n");
-            DBOUT(DB_RESOURCE, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " force sync\n");
-
-            drainingQueue_ = true;
-
-            wait();
+        // completed ops make room by themselves, only when all of them are
+        // still in flight does the queue wait, for the oldest one
+        while (!asyncOps.push(op, op->getSeqNum())) {
+            std::shared_ptr<HSAOp> oldest = asyncOps.oldest();
+            DBOUT(DB_WAIT, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " waits for " << oldest << "\n");
+            DBOUT(DB_RESOURCE, "*** Hit max inflight ops asyncOps.size=" << asyncOps.size() << ". " << op << " waits for " << oldest << "\n");
+            oldest->wait();
+            asyncOps.retire(oldest.get(), oldest->getSeqNum());
         }
-        op->asyncOpsIndex(asyncOps.size());
-        asyncOps.push_back(op);
 
         youngestCommandKind = op->getCommandKind();
 
-        drainingQueue_ = false;
-
         if (DBFLAG(DB_QUEUE)) {
             printAsyncOps(std::cerr);
         }
@@ -1214,7 +1302,13 @@ public:
 
         assert (newCommandKind != hcCommandInvalid);
 
-        if (!asyncOps.empty()) {
+        // a graph orders its commands itself when it is launched
+        if (isCapturing()) {
+            return nullptr;
+        }
+
+        std::shared_ptr<HSAOp> youngestOp = asyncOps.youngest();
+        if (youngestOp != nullptr) {
             assert (youngestCommandKind != hcCommandInvalid);
 
 
@@ -1232,7 +1326,7 @@ public:
             } else if (isCopyCommand(newCommandKind) && isCopyCommand(youngestCommandKind)) {
                 assert (copyOp);
                 HSACopy *hsaCopyOp = static_cast<HSACopy*> (copyOp);
-                HSACopy *youngestCopyOp = static_cast<HSACopy*> (asyncOps.back().get());
+                HSACopy *youngestCopyOp = static_cast<HSACopy*> (youngestOp.get());
                 if (hsaCopyOp->getCopyDevice() != youngestCopyOp->getCopyDevice()) {
                     // This covers cases where two copies are back-to-back in the queue but use different copy engines.
                     // In this case there is no implicit dependency between the ops so we need to add one
@@ -1246,7 +1340,7 @@ public:
 
             if (needDep) {
                 DBOUT(DB_CMD2, "command type changed " << getHcCommandKindString(youngestCommandKind) << "  ->  " << getHcCommandKindString(newCommandKind) << "\n") ;
-                return asyncOps.back();
+                return youngestOp;
             }
         }
 
@@ -1264,44 +1358,21 @@ public:
 
     int getPendingAsyncOps() override {
         int count = 0;
-        for (int i = 0; i < asyncOps.size(); ++i) {
-            auto &asyncOp = asyncOps[i];
-
-            if (asyncOp != nullptr) {
-                hsa_signal_t signal = *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
-                if (signal.handle) {
-                    hsa_signal_value_t v = hsa_signal_load_relaxed(signal);
-                    if (v != 0) {
-                        ++count;
-                    }
-                } else {
-                    ++count;
-                }
+        // only ops younger than the oldest pending one are left to check
+        asyncOps.retire_completed();
+        asyncOps.for_each([&] (uint64_t, HSAOp* asyncOp) {
+            if (!opCompleted(asyncOp)) {
+                ++count;
             }
-        }
+        });
         return count;
     }
 
 
     bool isEmpty() override {
-        // Have to walk asyncOps since it can contain null pointers (if event is waited on and removed)
-        // Also not all commands contain signals.
-        for (int i = 0; i < asyncOps.size(); ++i) {
-            if (asyncOps[i] != nullptr) {
-                auto &asyncOp = asyncOps[i];
-                hsa_signal_t signal = *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
-                if (signal.handle) {
-                    hsa_signal_value_t v = hsa_signal_load_relaxed(signal);
-                    if (v != 0) {
-                        return false;
-                    }
-                } else {
-                    // no signal, have to assume the command is still running
-                    return false;
-                }
-            }
-        };
-        return true;
+        // Not all commands contain signals; ops without one are assumed to be
+        // still running.
+        return asyncOps.retire_completed();
     };
 
 
@@ -1330,25 +1401,18 @@ public:
 
 
 
-        bool foundFirstValidOp = false;
-
-        for (int i = asyncOps.size()-1; i >= 0;  i--) {
-            if (asyncOps[i] != nullptr) {
-                auto asyncOp = asyncOps[i];
-                if (!foundFirstValidOp) {
-                    hsa_signal_t sig =  *(static_cast <hsa_signal_t*> (asyncOp->getNativeHandle()));
-                    assert(sig.handle != 0);
-                    foundFirstValidOp = true;
-                }
-                // wait on valid futures only
-                std::shared_future<void>* future = asyncOp->getFuture();
-                if (future && future->valid()) {
-                    future->wait();
-                }
+        std::vector<std::shared_ptr<HSAOp>> ops = asyncOps.snapshot();
+        for (auto i = ops.rbegin(); i != ops.rend(); ++i) {
+            if (i == ops.rbegin()) {
+                hsa_signal_t sig =  *(static_cast <hsa_signal_t*> ((*i)->getNativeHandle()));
+                assert(sig.handle != 0);
             }
+            (*i)->wait();
+        }
+        // retire the ops waited for, waiting already retired most of them
+        if (!ops.empty()) {
+            asyncOps.retire(ops.back().get(), ops.back()->getSeqNum());
         }
-        // clear async operations table
-        asyncOps.clear();
    }
 
     void LaunchKernel(void *ker, size_t nr_dim, size_t *global, size_t *local) override {
@@ -1361,13 +1425,15 @@ public:
         size_t tmp_local[] = {0, 0, 0};
         if (!local)
             local = tmp_local;
+        if (std::shared_ptr<HSAGraph> graph = getCaptureGraph()) {
+            captureKernel(graph, dispatch, nr_dim, global, local, dynamic_group_size);
+            delete(dispatch);
+            return;
+        }
         dispatch->setLaunchConfiguration(nr_dim, global, local, dynamic_group_size);
 
         // wait for previous kernel dispatches be completed
-        std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                      [&] (void* buffer) {
-                        waitForDependentAsyncOps(buffer);
-                      });
+        waitForDependentAsyncOps(dispatch);
 
         waitForStreamDeps(dispatch);
 
@@ -1377,10 +1443,6 @@ public:
         // and wait for its completion
         dispatch->dispatchKernelWaitComplete();
 
-        // clear data in kernelBufferMap
-        kernelBufferMap[ker].clear();
-        kernelBufferMap.erase(ker);
-
         delete(dispatch);
     }
 
@@ -1394,17 +1456,19 @@ public:
         HSADispatch *dispatch =
             reinterpret_cast<HSADispatch*>(ker);
 
+        if (std::shared_ptr<HSAGraph> graph = getCaptureGraph()) {
+            size_t tmp_local[] = {0, 0, 0};
+            std::shared_ptr<KalmarAsyncOp> node = captureKernel(graph, dispatch, nr_dim, global, local ? local : tmp_local, dynamic_group_size);
+            delete(dispatch);
+            return node;
+        }
 
-
-        bool hasArrayViewBufferDeps = (kernelBufferMap.find(ker) != kernelBufferMap.end());
+        bool hasArrayViewBufferDeps = tracksBufferDeps() && !dispatch->getBufferAccesses().empty();
 
 
         if (hasArrayViewBufferDeps) {
             // wait for previous kernel dispatches be completed
-            std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                      [&] (void* buffer) {
-                        waitForDependentAsyncOps(buffer);
-                     });
+            waitForDependentAsyncOps(dispatch);
         }
 
         waitForStreamDeps(dispatch);
@@ -1427,14 +1491,9 @@ public:
 
         if (hasArrayViewBufferDeps) {
             // associate all buffers used by the kernel with the kernel dispatch instance
-            std::for_each(std::begin(kernelBufferMap[ker]), std::end(kernelBufferMap[ker]),
-                          [&] (void* buffer) {
-                            bufferKernelMap[buffer].push_back(sp_dispatch);
-                          });
-
-                // clear data in kernelBufferMap
-                kernelBufferMap[ker].clear();
-                kernelBufferMap.erase(ker);
+            for (const auto& access : dispatch->getBufferAccesses()) {
+                bufferDeps.record(access.first, access.second, sp_dispatch, dispatch->getSeqNum());
+            }
         }
 
         return sp_dispatch;
@@ -1452,22 +1511,61 @@ public:
     }
 
 
-    // wait for dependent async operations to complete
-    void waitForDependentAsyncOps(void* buffer) {
-        auto&& dependentAsyncOpVector = bufferKernelMap[buffer];
-        for (int i = 0; i < dependentAsyncOpVector.size(); ++i) {
-          auto dependentAsyncOp = dependentAsyncOpVector[i];
-          if (!dependentAsyncOp.expired()) {
-            auto dependentAsyncOpPointer = dependentAsyncOp.lock();
-            // wait on valid futures only
-            std::shared_future<void>* future = dependentAsyncOpPointer->getFuture();
-            if (future->valid()) {
-              future->wait();
+    // whether dependencies through buffers have to be tracked, see bufferDeps
+    bool tracksBufferDeps() const {
+        return get_execute_order() != Kalmar::execute_in_order;
+    }
+
+
+    // make dispatch wait for the async operations its buffer accesses depend
+    // on: read after write, write after read and write after write. Reads of
+    // a buffer by several kernels do not wait for each other.
+    //
+    // The waits are done by the device, with barrier-AND packets enqueued
+    // ahead of the dispatch; the packet processor launches no further packet
+    // until the signals a barrier-AND packet depends on are satisfied.
+    // Operations without a signal are waited for on the host.
+    //
+    // The consumer is a kernel of this device, so the barriers fence at agent
+    // scope; EnqueueMarkerWithDependency raises the acquire to system scope
+    // for an op of another device.
+    void waitForDependentAsyncOps(HSADispatch* dispatch) {
+        if (!tracksBufferDeps()) {
+            return;
+        }
+        std::vector<std::shared_ptr<KalmarAsyncOp>> deps;
+        for (const auto& access : dispatch->getBufferAccesses()) {
+            bufferDeps.dependencies(access.first, access.second, deps);
+        }
+        if (deps.empty()) {
+            return;
+        }
+
+        // a dispatch is usually the dependency of several buffers
+        std::sort(deps.begin(), deps.end(),
+                  [] (const std::shared_ptr<KalmarAsyncOp>& a, const std::shared_ptr<KalmarAsyncOp>& b) {
+                      return a->getSeqNum() < b->getSeqNum();
+                  });
+        deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+
+        // only the ones not completed yet are left for barrier packets
+        size_t pending = 0;
+        for (size_t i = 0; i < deps.size(); ++i) {
+            HSAOp* op = static_cast<HSAOp*>(deps[i].get());
+            if (op->getNativeHandle() == nullptr ||
+                static_cast<hsa_signal_t*>(op->getNativeHandle())->handle == 0) {
+                op->wait();
+            } else if (!opCompleted(op)) {
+                deps[pending++].swap(deps[i]);
             }
-          }
         }
-        dependentAsyncOpVector.clear();
+        deps.resize(pending);
 
+        for (size_t i = 0; i < deps.size(); i += HSA_BARRIER_DEP_SIGNAL_CNT) {
+            int count = std::min<size_t>(deps.size() - i, HSA_BARRIER_DEP_SIGNAL_CNT);
+            DBOUT(DB_CMD2, "  dispatch " << dispatch << " depends on " << count << " op(s) through its buffers\n");
+            EnqueueMarkerWithDependency(count, &deps[i], hc::accelerator_scope);
+        }
     }
 
 
@@ -1707,11 +1805,10 @@ public:
     void Push(void *kernel, int idx, void *device, bool modify) override {
         PushArgImpl(kernel, idx, sizeof(void*), &device);
 
-        // register the buffer with the kernel
-        // when the buffer may be read/written by the kernel
-        // the buffer is not registered if it's only read by the kernel
-        if (modify) {
-          kernelBufferMap[kernel].push_back(device);
+        // register the buffer with the kernel, and whether the kernel may
+        // write it; reads only depend on previous writes
+        if (tracksBufferDeps()) {
+            static_cast<HSADispatch*>(kernel)->addBufferAccess(device, modify);
         }
     }
 
@@ -1723,6 +1820,99 @@ public:
 
     void releaseLockedRocrQueue();
 
+    // Make the packet at index of the locked hw queue, written but for its
+    // header, visible to the packet processor: now, or at the end of the batch.
+    void publishAqlPacket(hsa_queue_t *lockedHsaQueue, uint64_t index, uint16_t *packetHeader, uint16_t header) {
+        if (batchDepth > 0) {
+            batchHeaders.emplace_back(packetHeader, header);
+            batchHwQueue = lockedHsaQueue;
+            batchLastIndex = index;
+            batchPending.store(true, std::memory_order_release);
+            // unpublished packets hold slots the packet processor can not free
+            if (batchHeaders.size() >= lockedHsaQueue->size / 4) {
+                publishBatchLocked();
+            }
+            return;
+        }
+
+        __atomic_store_n(packetHeader, header, __ATOMIC_RELEASE);
+
+        // Ring door bell
+        hsa_signal_store_relaxed(lockedHsaQueue->doorbell_signal, index);
+    }
+
+    // publish the headers of the batch in order, and ring the doorbell once
+    void publishBatchLocked() {
+        if (batchHeaders.empty()) {
+            return;
+        }
+        for (auto &h : batchHeaders) {
+            __atomic_store_n(h.first, h.second, __ATOMIC_RELEASE);
+        }
+        DBOUT(DB_AQL, "  publish batch of " << batchHeaders.size() << " packets, last index=" << batchLastIndex << "\n");
+        hsa_signal_store_relaxed(batchHwQueue->doorbell_signal, batchLastIndex);
+        batchHeaders.clear();
+        batchPending.store(false, std::memory_order_relaxed);
+    }
+
+    // Wait until the locked hw queue has a free slot for the packet at index.
+    // The ops in flight keep ordinary commands well below the size of the hw
+    // queue, but a graph launch writes a packet per recorded command and
+    // tracks a single op; its packets, and the commands behind them, wait
+    // here for the packet processor to make room.
+    void waitForAqlSlotLocked(hsa_queue_t *lockedHsaQueue, uint64_t index) {
+        if (index + 1 - hsa_queue_load_read_index_acquire(lockedHsaQueue) < lockedHsaQueue->size) {
+            return;
+        }
+        // the slots may be taken by packets of the batch, which the packet
+        // processor has not been shown yet
+        publishBatchLocked();
+        DBOUT(DB_WAIT, "  hw queue " << lockedHsaQueue << " full, wait for room for packet " << index << "\n");
+        while (index + 1 - hsa_queue_load_read_index_acquire(lockedHsaQueue) >= lockedHsaQueue->size) {
+            std::this_thread::yield();
+        }
+    }
+
+    // publish the batch before waiting for one of its commands
+    void flushBatch() {
+        if (batchPending.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> l(this->qmutex);
+            publishBatchLocked();
+        }
+    }
+
+    void beginBatch() override {
+        std::lock_guard<std::mutex> l(this->qmutex);
+        ++batchDepth;
+    }
+
+    void endBatch() override {
+        std::lock_guard<std::mutex> l(this->qmutex);
+        if (batchDepth > 0 && --batchDepth == 0) {
+            publishBatchLocked();
+        }
+    }
+
+    bool isCapturing() const override { return capturing.load(std::memory_order_acquire); }
+
+    // the graph being captured, nullptr if the queue is not capturing
+    std::shared_ptr<HSAGraph> getCaptureGraph() {
+        if (!isCapturing()) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> l(this->qmutex);
+        return captureGraph;
+    }
+
+    bool beginCapture() override;
+
+    std::shared_ptr<KalmarGraph> endCapture() override;
+
+    // record commands into graph, see HSAGraph; they return a placeholder
+    // for the recorded command
+    std::shared_ptr<KalmarAsyncOp> captureKernel(const std::shared_ptr<HSAGraph> &graph, HSADispatch *dispatch, size_t nr_dim, size_t *global, size_t *local, size_t dynamic_group_size);
+    std::shared_ptr<KalmarAsyncOp> captureMarker(const std::shared_ptr<HSAGraph> &graph, int count, std::shared_ptr<KalmarAsyncOp> *depOps, hc::memory_scope fenceScope);
+
 
     void* getHSAAgent() override;
 
@@ -1744,6 +1934,13 @@ public:
                              const void * args, size_t argsize,
                              hc::completion_future *cf, const char *kernelName) override ;
 
+    bool set_queue_priority(int priority) override {
+        queuePriority = priority;
+        return true;
+    }
+
+    bool set_queue_pinned(bool pinned) override;
+
     bool set_cu_mask(const std::vector<bool>& cu_mask) override {
         // get device's total compute unit count
         auto device = getDev();
@@ -1789,6 +1986,10 @@ public:
 
         hsa_status_t status = HSA_STATUS_SUCCESS;
 
+        if (std::shared_ptr<HSAGraph> graph = getCaptureGraph()) {
+            return captureMarker(graph, 0, nullptr, release_scope);
+        }
+
         // create shared_ptr instance
         std::shared_ptr<HSABarrier> barrier = std::make_shared<HSABarrier>(this, 0, nullptr);
         // associate the barrier with this queue
@@ -1819,6 +2020,10 @@ public:
 
         hsa_status_t status = HSA_STATUS_SUCCESS;
 
+        if (std::shared_ptr<HSAGraph> graph = getCaptureGraph()) {
+            return captureMarker(graph, count, depOps, fenceScope);
+        }
+
         if ((count >= 0) && (count <= HSA_BARRIER_DEP_SIGNAL_CNT)) {
 
             // create shared_ptr instance
@@ -1841,11 +2046,15 @@ public:
                     // If creating a dependency on a queue which needs_system_release, copy that
                     // state here.   If the host then waits on the freshly created marker,
                     // runtime will issue a system-release fence.
-                    if (depOp->barrierNextKernelNeedsSysAcquire()) {
+                    //
+                    // Kernels and copies the barrier depends on only contribute their
+                    // completion signal.
+                    auto depBarrier = std::dynamic_pointer_cast<HSABarrier> (depOp);
+                    if (depBarrier && depBarrier->barrierNextKernelNeedsSysAcquire()) {
                         DBOUTL(DB_CMD2, *this << " setting NextKernelNeedsSysAcquire(true) due to dependency on barrier " << depOp)
                         setNextKernelNeedsSysAcquire(true);
                     }
-                    if (depOp->barrierNextSyncNeedsSysRelease()) {
+                    if (depBarrier && depBarrier->barrierNextSyncNeedsSysRelease()) {
                         DBOUTL(DB_CMD2, *this << " setting NextSyncNeedsSysRelease(true) due to dependency on barrier " << depOp)
                         setNextSyncNeedsSysRelease(true);
                     }
@@ -1915,57 +2124,18 @@ public:
 
 
     // remove finished async operation from waiting list
+    // All older ops are known to be done and we can reclaim their resources here:
+    // Both execute_in_order and execute_any_order flags always remove ops in-order at the end of the pipe.
+    // If the queue waited for it already, the op is not in asyncOps any more.
     void removeAsyncOp(HSAOp* asyncOp) {
-        int targetIndex = asyncOp->asyncOpsIndex();
-
-
-        int nullifiedCount = 0;
-        // Make sure the opindex is still valid.
-        // If the queue is destroyed first it may not exist in asyncops anymore so no need to destroy.
-        if (targetIndex < asyncOps.size() &&
-            asyncOp == asyncOps[targetIndex].get()) {
-
-            // All older ops are known to be done and we can reclaim their resources here:
-            // Both execute_in_order and execute_any_order flags always remove ops in-order at the end of the pipe.
-            // Note if not found above targetIndex=-1 and we skip the loop:
-            for (int i = targetIndex; i>=0; i--) {
-                Kalmar::KalmarAsyncOp *op = asyncOps[i].get();
-                if (op) {
-                    nullifiedCount++;
-                    asyncOps[i] = nullptr;
-
-        #if CHECK_OLDER_COMPLETE
-                    // opportunistically update status for any ops we encounter along the way:
-                    hsa_signal_t signal =  *(static_cast<hsa_signal_t*> (op->getNativeHandle()));
-
-                    // v<0 : no signal, v==0 signal and done, v>0 : signal and not done:
-                    hsa_signal_value_t v = -1;
-                    if (signal.handle)
-                        v = hsa_signal_load_acquire(signal);
-                    assert (v <=0);
-        #endif
-
-                } else {
-                    // The queue is retired in-order, and ops only inserted at "top", and ops can only be removed at two defined points:
-                    //   - Draining the entire queue in HSAQueue::wait() - this calls asyncOps.clear()
-                    //   - Events in the middle of the queue can be removed, but will call this function which removes all older ops.
-                    //   So once we remove the asyncOps, there is no way for an older async op to be come non-null and we can stop search here:
-
-                    break; // stop searching if we find null, there cannot be any more valid pointers below.
-                }
-            }
-        }
-        if (nullifiedCount > 1000) {
-            DBOUTL(DB_RESOURCE, "removeAsyncOps nullified " << nullifiedCount << " ops.");
-        }
-
+        asyncOps.retire(asyncOp, asyncOp->getSeqNum());
+    }
 
-        // GC for finished kernels
-        if (asyncOps.size() > ASYNCOPS_VECTOR_GC_SIZE) {
-            DBOUTL(DB_RESOURCE, "asyncOps size=" << asyncOps.size() << " exceeds collection size, compacting");
-            asyncOps.erase(std::remove(asyncOps.begin(), asyncOps.end(), nullptr),
-                         asyncOps.end());
-        }
+    // an op whose completion signal has dropped to 0; ops without a signal
+    // can not be known to be complete
+    static bool opCompleted(HSAOp* op) {
+        hsa_signal_t signal = *(static_cast<hsa_signal_t*> (op->getNativeHandle()));
+        return signal.handle && hsa_signal_load_acquire(signal) == 0;
     }
 };
 
@@ -1995,13 +2165,11 @@ class HSADevice final : public KalmarDevice
 {
     friend std::ostream& operator<<(std::ostream& os, const HSAQueue & hav);
 private:
-    /// memory pool for kernargs
-    std::vector<void*> kernargPool;
-    std::vector<bool> kernargPoolFlag;
-    int kernargCursor;
-    std::mutex kernargPoolMutex;
+    /// memory pools for kernargs, one per size class in kernargSizeClasses
+    std::unique_ptr<ResourcePool<void*>> kernargPools[KERNARG_SIZE_CLASS_COUNT];
 
 
+    std::mutex programsMutex; // protects programs
     std::map<std::string, HSAKernel *> programs;
     hsa_agent_t agent;
     size_t max_tile_static_size;
@@ -2010,9 +2178,18 @@ private:
     std::mutex queues_mutex; // protects access to the queues vector:
     std::vector< std::weak_ptr<KalmarQueue> > queues;
 
-    std::mutex                  rocrQueuesMutex; // protects rocrQueues
+    std::mutex                  rocrQueuesMutex; // protects rocrQueues and rocrQueueWaiters
     std::vector< RocrQueue *>    rocrQueues;
 
+    // HSAQueues waiting for a rocrQueue, by decreasing priority then in
+    // arrival order: (-priority, ticket)
+    std::set< std::pair<int, uint64_t> > rocrQueueWaiters;
+    std::condition_variable      rocrQueuesCv;
+    uint64_t                     rocrQueueTickets;
+
+    // ticks for RocrQueue::_lastUsed
+    std::atomic<uint64_t>        rocrQueueTick;
+
     pool_iterator ri;
 
     bool useCoarseGrainedRegion;
@@ -2047,9 +2224,19 @@ public:
 
 
     // Creates or steals a rocrQueue and returns it in theif->rocrQueue
+    //
+    // Below HCC_MAX_QUEUES, a new rocrQueue is created. Above, the thief takes
+    // an unused rocrQueue if there is one, or steals the one of an idle
+    // HSAQueue: the idle HSAQueue of lowest priority, and among those the
+    // least recently used. Pinned HSAQueues are never robbed.
+    //
+    // When no rocrQueue can be taken, the thief sleeps on rocrQueuesCv until
+    // one is released, or for an increasing timeout since HSAQueues become
+    // idle without notice. Thieves are served by decreasing priority, then in
+    // arrival order.
     void createOrstealRocrQueue(Kalmar::HSAQueue *thief) {
 
-        std::lock_guard<std::mutex> (this->rocrQueuesMutex);
+        std::unique_lock<std::mutex> l(this->rocrQueuesMutex);
 
         if (rocrQueues.size() < HCC_MAX_QUEUES) {
 
@@ -2062,57 +2249,95 @@ public:
             DBOUT(DB_QUEUE, "Create new rocrQueue=" << rq << " for thief=" << thief << "\n")
 
         } else {
+            const std::pair<int, uint64_t> waiter(-thief->queuePriority, rocrQueueTickets++);
+            rocrQueueWaiters.insert(waiter);
+
+            std::chrono::microseconds backoff(10);
             RocrQueue *foundRQ = nullptr;
-            while (!foundRQ) {
-                // First make a pass to see if we can find an unused queue:
-                for (auto rq : rocrQueues) {
-                    if (rq->_hccQueue == nullptr) {
-                        DBOUT(DB_QUEUE, "Found unused rocrQueue=" << rq << " for thief=" << thief << ".  hwQueue=" << rq->_hwQueue << "\n")
-                        foundRQ = rq;
+            while (true) {
+                if (*rocrQueueWaiters.begin() == waiter) {
+                    foundRQ = findRocrQueueToSteal(thief);
+                    if (foundRQ) {
                         break;
                     }
                 }
-                if (!foundRQ) {
-                    for (auto rq : rocrQueues) {
-                        if (rq->_hccQueue != thief)  {
-                            auto victimHccQueue = rq->_hccQueue;
-                            // victimHccQueue==nullptr should be detected by above loop.
-                            std::lock_guard<std::mutex> (victimHccQueue->qmutex);
-                            if (victimHccQueue->isEmpty()) {
-                                DBOUT(DB_LOCK, " ptr:" << this << " lock_guard...\n");
-
-                                assert (victimHccQueue->rocrQueue == rq);  // ensure the link is consistent.
-                                victimHccQueue->rocrQueue = nullptr;
-                                foundRQ = rq;
-                                DBOUT(DB_QUEUE, "Stole existing rocrQueue=" << rq << " from victimHccQueue=" << victimHccQueue << " to hccQueue=" << thief << "\n")
-                                break;
-                            }
-                        }
-                    }
-                }
-                if (foundRQ) {
 
-                    // update the queue pointers to indicate the theft:
-                    foundRQ->assignHccQueue(thief);
+                rocrQueuesCv.wait_for(l, backoff);
+                backoff = std::min(backoff * 2, std::chrono::microseconds(1000));
+            }
 
-                    break; // while !foundVictim
-                };
+            // update the queue pointers to indicate the theft:
+            foundRQ->assignHccQueue(thief);
 
-                // Allow other threads a small window to release threads to make progress:
-                this->rocrQueuesMutex.unlock();
-                this->rocrQueuesMutex.lock();
+            rocrQueueWaiters.erase(waiter);
+            if (!rocrQueueWaiters.empty()) {
+                // the next thief in line
+                rocrQueuesCv.notify_all();
             }
-
         }
     };
 
+    // Called with rocrQueuesMutex locked, detaches the rocrQueue to steal from
+    // its HSAQueue.
+    RocrQueue *findRocrQueueToSteal(Kalmar::HSAQueue *thief) {
+        // First make a pass to see if we can find an unused queue:
+        for (auto rq : rocrQueues) {
+            if (rq->_hccQueue == nullptr) {
+                DBOUT(DB_QUEUE, "Found unused rocrQueue=" << rq << " for thief=" << thief << ".  hwQueue=" << rq->_hwQueue << "\n")
+                return rq;
+            }
+        }
+
+        // Victims by increasing priority, then from the least recently used
+        std::vector<RocrQueue *> victims;
+        for (auto rq : rocrQueues) {
+            if (rq->_hccQueue != thief && !rq->_hccQueue->queuePinned) {
+                victims.push_back(rq);
+            }
+        }
+        std::sort(victims.begin(), victims.end(), [] (RocrQueue *a, RocrQueue *b) {
+            int pa = a->_hccQueue->queuePriority;
+            int pb = b->_hccQueue->queuePriority;
+            return pa != pb ? pa < pb : a->_lastUsed < b->_lastUsed;
+        });
+
+        for (auto rq : victims) {
+            auto victimHccQueue = rq->_hccQueue;
+            // The victim may be submitting a command and wait for rocrQueuesMutex
+            // with its queue locked: it is busy anyway, so skip it.
+            std::unique_lock<std::mutex> victimLock(victimHccQueue->qmutex, std::try_to_lock);
+            if (victimLock.owns_lock() && victimHccQueue->isEmpty()) {
+                DBOUT(DB_LOCK, " ptr:" << this << " lock_guard...\n");
+
+                assert (victimHccQueue->rocrQueue == rq);  // ensure the link is consistent.
+                victimHccQueue->rocrQueue = nullptr;
+                rq->_hccQueue = nullptr;
+                DBOUT(DB_QUEUE, "Stole existing rocrQueue=" << rq << " from victimHccQueue=" << victimHccQueue << " to hccQueue=" << thief << "\n")
+                return rq;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // wake up thieves waiting for a rocrQueue
+    void notifyRocrQueueWaiters() {
+        std::lock_guard<std::mutex> l(this->rocrQueuesMutex);
+        rocrQueuesCv.notify_all();
+    }
+
+    // tick for RocrQueue::_lastUsed
+    uint64_t nextRocrQueueTick() {
+        return rocrQueueTick.fetch_add(1, std::memory_order_relaxed);
+    }
+
     void removeRocrQueue(RocrQueue *rocrQueue) {
 
         // queues already locked:
         size_t hccSize = queues.size();
 
         {
-            std::lock_guard<std::mutex> (this->rocrQueuesMutex);
+            std::lock_guard<std::mutex> l(this->rocrQueuesMutex);
 
             // a perf optimization to keep the HSA queue if we have more HCC queues that might want it.
             // This defers expensive queue deallocation if an hccQueue that holds an hwQueue is destroyed -
@@ -2130,6 +2355,8 @@ public:
                 DBOUT(DB_QUEUE, "removeRocrQueue-soft: rocrQueue=" << rocrQueue << " keep hwQUeue, set _hccQueue link to nullptr" << " hccQueues/rocrQueues=" << hccSize << "/" << rqSize << "\n");
                 rocrQueue->_hccQueue = nullptr; // mark it as available.
             }
+
+            rocrQueuesCv.notify_all();
         }
 
     };
@@ -2297,21 +2524,13 @@ public:
 
         // deallocate kernarg buffers in the pool
 #if KERNARG_POOL_SIZE > 0
-        kernargPoolMutex.lock();
-
-        hsa_status_t status = HSA_STATUS_SUCCESS;
-
-        // kernargPool is allocated in batch, KERNARG_POOL_SIZE for each
-        // allocation. it is therefore be released also in batch.
-        for (int i = 0; i < kernargPool.size() / KERNARG_POOL_SIZE; ++i) {
-            hsa_amd_memory_pool_free(kernargPool[i * KERNARG_POOL_SIZE]);
-            STATUS_CHECK(status, __LINE__);
+        for (size_t c = 0; c < KERNARG_SIZE_CLASS_COUNT; ++c) {
+            if (!kernargPools[c])
+                continue;
+            DBOUTL(DB_RESOURCE, "Releasing kernarg pool of " << kernargPools[c]->capacity()
+                                << " buffers of " << kernargSizeClasses[c] << " bytes");
+            kernargPools[c]->clear();
         }
-
-        kernargPool.clear();
-        kernargPoolFlag.clear();
-
-        kernargPoolMutex.unlock();
 #endif
 
         // release all data in programs
@@ -2461,7 +2680,9 @@ public:
         return isCompatible;
     }
 
-    void* CreateKernel(const char* fun, Kalmar::KalmarQueue *queue) override {
+    void* GetKernelHandle(const char* fun) override {
+        // launches from several threads may resolve kernels at the same time
+        std::lock_guard<std::mutex> l(programsMutex);
         std::string str(fun);
         HSAKernel *kernel = programs[str];
 
@@ -2603,15 +2824,22 @@ public:
             }
             programs[str] = kernel;
         }
+        return kernel;
+    }
 
+    void* CreateKernelFromHandle(void* handle, Kalmar::KalmarQueue *queue) override {
         // HSADispatch instance will be deleted in:
         // HSAQueue::LaunchKernel()
         // or it will be created as a shared_ptr<KalmarAsyncOp> in:
         // HSAQueue::LaunchKernelAsync()
-        HSADispatch *dispatch = new HSADispatch(this, queue, kernel);
+        HSADispatch *dispatch = new HSADispatch(this, queue, static_cast<HSAKernel*>(handle));
         return dispatch;
     }
 
+    void* CreateKernel(const char* fun, Kalmar::KalmarQueue *queue) override {
+        return CreateKernelFromHandle(GetKernelHandle(fun), queue);
+    }
+
     std::shared_ptr<KalmarQueue> createQueue(execute_order order = execute_in_order) override {
         auto hsaAv = new HSAQueue(this, agent, order);
         std::shared_ptr<KalmarQueue> q =  std::shared_ptr<KalmarQueue>(hsaAv);
@@ -2727,13 +2955,9 @@ public:
 
     void releaseKernargBuffer(void* kernargBuffer, int kernargBufferIndex) {
         if ( (KERNARG_POOL_SIZE > 0) && (kernargBufferIndex >= 0) ) {
-            kernargPoolMutex.lock();
-
-
             // mark the kernarg buffer pointed by kernelBufferIndex as available
-            kernargPoolFlag[kernargBufferIndex] = false;
-
-            kernargPoolMutex.unlock();
+            int sizeClass = kernargBufferIndex & ((1 << KERNARG_SIZE_CLASS_BITS) - 1);
+            kernargPools[sizeClass]->release(kernargBufferIndex >> KERNARG_SIZE_CLASS_BITS);
          } else {
             if (kernargBuffer != nullptr) {
                 hsa_amd_memory_pool_free(kernargBuffer);
@@ -2741,114 +2965,56 @@ public:
          }
     }
 
-    void growKernargBuffer()
+    /// carve count kernarg buffers of bufferSize bytes from one chunk of
+    /// kernarg memory, called by the kernarg pool of the size whenever it
+    /// runs out of buffers
+    bool growKernargBuffer(size_t bufferSize, void** buffers, size_t count)
     {
         uint8_t * kernargMemory = nullptr;
-        // increase kernarg pool on demand by KERNARG_POOL_SIZE
         hsa_amd_memory_pool_t kernarg_region = getHSAKernargRegion();
 
-        hsa_status_t status = hsa_amd_memory_pool_allocate(kernarg_region, KERNARG_POOL_SIZE * KERNARG_BUFFER_SIZE, 0, (void**)(&kernargMemory));
+        DBOUTL(DB_RESOURCE, "Growing kernarg pool of " << bufferSize << " byte buffers by " << count);
+
+        hsa_status_t status = hsa_amd_memory_pool_allocate(kernarg_region, count * bufferSize, 0, (void**)(&kernargMemory));
         STATUS_CHECK(status, __LINE__);
 
         status = hsa_amd_agents_allow_access(1, &agent, NULL, kernargMemory);
         STATUS_CHECK(status, __LINE__);
 
-        for (size_t i = 0; i < KERNARG_POOL_SIZE * KERNARG_BUFFER_SIZE; i+=KERNARG_BUFFER_SIZE) {
-            kernargPool.push_back(kernargMemory+i);
-            kernargPoolFlag.push_back(false);
-        };
+        for (size_t i = 0; i < count; ++i) {
+            buffers[i] = kernargMemory + i * bufferSize;
+        }
+        return true;
     }
 
-    std::pair<void*, int> getKernargBuffer(int size) {
+    /// get a kernarg buffer of at least size bytes, aligned to align bytes;
+    /// returns the buffer and the index to release it with
+    std::pair<void*, int> getKernargBuffer(int size, size_t align = 16) {
         void* ret = nullptr;
-        int cursor = 0;
+        int cursor = -1;
 
-        // find an available buffer in the pool in case
+        // find an available buffer in the smallest size class that fits in case
         // - kernarg pool is available
         // - requested size is smaller than KERNARG_BUFFER_SIZE
         if ( (KERNARG_POOL_SIZE > 0) && (size <= KERNARG_BUFFER_SIZE) ) {
-            kernargPoolMutex.lock();
-            cursor = kernargCursor;
-
-            if (kernargPoolFlag[cursor] == false) {
-                // the cursor is valid, use it
-                ret = kernargPool[cursor];
-
-                // set the kernarg buffer as used
-                kernargPoolFlag[cursor] = true;
-
-                // simply move the cursor to the next index
-                ++kernargCursor;
-                if (kernargCursor == kernargPool.size()) kernargCursor = 0;
-            } else {
-                // the cursor is not valid, sequentially find the next available slot
-                bool found = false;
-
-                int startingCursor = cursor;
-                do {
-                    ++cursor;
-                    if (cursor == kernargPool.size()) cursor = 0;
-
-                    if (kernargPoolFlag[cursor] == false) {
-                        // the cursor is valid, use it
-                        ret = kernargPool[cursor];
-
-                        // set the kernarg buffer as used
-                        kernargPoolFlag[cursor] = true;
-
-                        // simply move the cursor to the next index
-                        kernargCursor = cursor + 1;
-                        if (kernargCursor == kernargPool.size()) kernargCursor = 0;
-
-                        // break from the loop
-                        found = true;
-                        break;
-                    }
-                } while(cursor != startingCursor); // ensure we at most scan the vector once
-
-                if (found == false) {
-                    hsa_status_t status = HSA_STATUS_SUCCESS;
-
-                    // increase kernarg pool on demand by KERNARG_POOL_SIZE
-                    hsa_amd_memory_pool_t kernarg_region = getHSAKernargRegion();
-
-                    // keep track of the size of kernarg pool before increasing it
-                    int oldKernargPoolSize = kernargPool.size();
-                    int oldKernargPoolFlagSize = kernargPoolFlag.size();
-                    assert(oldKernargPoolSize == oldKernargPoolFlagSize);
-
-
-                    growKernargBuffer();
-                    assert(kernargPool.size() == oldKernargPoolSize + KERNARG_POOL_SIZE);
-                    assert(kernargPoolFlag.size() == oldKernargPoolFlagSize + KERNARG_POOL_SIZE);
-
-                    // set return values, after the pool has been increased
-
-                    // use the first item in the newly allocated pool
-                    cursor = oldKernargPoolSize;
-
-                    // access the new item through the newly assigned cursor
-                    ret = kernargPool[cursor];
-
-                    // mark the item as used
-                    kernargPoolFlag[cursor] = true;
-
-                    // simply move the cursor to the next index
-                    kernargCursor = cursor + 1;
-                    if (kernargCursor == kernargPool.size()) kernargCursor = 0;
-
-                    found = true;
+            size_t need = std::max<size_t>(size, align);
+            for (size_t c = 0; c < KERNARG_SIZE_CLASS_COUNT; ++c) {
+                if (need <= kernargSizeClasses[c]) {
+                    int index = kernargPools[c]->acquire(ret);
+                    if (index >= 0)
+                        cursor = (index << KERNARG_SIZE_CLASS_BITS) | c;
+                    break;
                 }
-
             }
+        }
 
-            kernargPoolMutex.unlock();
-            memset (ret, 0x00, KERNARG_BUFFER_SIZE);
+        if (cursor >= 0) {
+            memset (ret, 0x00, size);
         } else {
             // allocate new buffers in case:
             // - the kernarg pool is set at compile-time
             // - requested kernarg buffer size is larger than KERNARG_BUFFER_SIZE
-            //
+            // - the kernarg pool cannot grow any further
 
             hsa_status_t status = HSA_STATUS_SUCCESS;
             hsa_amd_memory_pool_t kernarg_region = getHSAKernargRegion();
@@ -2867,8 +3033,6 @@ public:
             memset (ret, 0x00, size);
         }
 
-
-
         return std::make_pair(ret, cursor);
     }
 
@@ -3040,11 +3204,12 @@ class HSAContext final : public KalmarContext
 public:
     std::map<uint64_t, HSADevice *> agentToDeviceMap_;
 private:
-    /// memory pool for signals
-    std::vector<hsa_signal_t> signalPool;
-    std::vector<bool> signalPoolFlag;
-    int signalCursor;
-    std::mutex signalPoolMutex;
+    /// memory pool for signals, with a cache per thread since signals are
+    /// taken and given back for nearly every command
+    ResourcePool<hsa_signal_t> signalPool;
+
+    /// index getSignal returns for a signal which is not from signalPool
+    static const int NON_POOL_SIGNAL_INDEX = INT_MAX;
     /* TODO: Modify properly when supporing multi-gpu.
     When using memory pool api, each agent will only report memory pool
     which is attached with the agent itself physically, eg, GPU won't
@@ -3120,7 +3285,14 @@ public:
     void ReadHccEnv() ;
     std::ostream &getHccProfileStream() const { return *hccProfileStream; };
 
-    HSAContext() : KalmarContext(), signalPool(), signalPoolFlag(), signalCursor(0), signalPoolMutex() {
+    HSAContext() : KalmarContext(),
+                   signalPool(SIGNAL_POOL_SIZE,
+                              [this](hsa_signal_t* signals, size_t count) { return growSignalPool(signals, count); },
+                              [](hsa_signal_t* signals, size_t count) {
+                                  for (size_t i = 0; i < count; ++i)
+                                      hsa_signal_destroy(signals[i]);
+                              },
+                              true) {
         host.handle = (uint64_t)-1;
 
         ReadHccEnv();
@@ -3155,19 +3327,9 @@ public:
         }
 
 #if SIGNAL_POOL_SIZE > 0
-        signalPoolMutex.lock();
-
         // pre-allocate signals
         DBOUT(DB_SIG,  " pre-allocate " << SIGNAL_POOL_SIZE << " signals\n");
-        for (int i = 0; i < SIGNAL_POOL_SIZE; ++i) {
-          hsa_signal_t signal;
-          status = hsa_signal_create(1, 0, NULL, &signal);
-          STATUS_CHECK(status, __LINE__);
-          signalPool.push_back(signal);
-          signalPoolFlag.push_back(false);
-        }
-
-        signalPoolMutex.unlock();
+        signalPool.grow();
 #endif
 
         // initialize the printf buffer
@@ -3187,116 +3349,51 @@ public:
             DBOUT(DB_SIG, "  releaseSignal: 0x" << std::hex << signal.handle << std::dec << " and restored value to 1\n");
             hsa_status_t status = HSA_STATUS_SUCCESS;
 #if SIGNAL_POOL_SIZE > 0
-            signalPoolMutex.lock();
+            if (signalIndex != NON_POOL_SIGNAL_INDEX) {
+                // restore signal to the initial value 1
+                hsa_signal_store_release(signal, 1);
 
-            // restore signal to the initial value 1
-            hsa_signal_store_release(signal, 1);
+                // mark the signal pointed by signalIndex as available
+                signalPool.release(signalIndex);
+                return;
+            }
+#endif
+            status = hsa_signal_destroy(signal);
+            STATUS_CHECK(status, __LINE__);
+        }
+    }
 
-            // mark the signal pointed by signalIndex as available
-            signalPoolFlag[signalIndex] = false;
+    /// create count signals for signalPool, which calls this whenever it runs
+    /// out of signals
+    bool growSignalPool(hsa_signal_t* signals, size_t count) {
+        ResourcePool<hsa_signal_t>::statistics stats = signalPool.stats();
+        DBOUTL(DB_RESOURCE, "Growing signal pool from " << stats.capacity << " to " << stats.capacity + count
+                            << ", in use=" << stats.in_use << " peak=" << stats.peak);
 
-            signalPoolMutex.unlock();
-#else
-            status = hsa_signal_destroy(signal);
+        for (size_t i = 0; i < count; ++i) {
+            hsa_status_t status = hsa_signal_create(1, 0, NULL, &signals[i]);
             STATUS_CHECK(status, __LINE__);
-#endif
         }
+
+        DBOUT(DB_SIG,  "grew signal pool to size=" << stats.capacity + count << "\n");
+        return true;
     }
 
     std::pair<hsa_signal_t, int> getSignal() {
         hsa_signal_t ret;
+        int cursor = -1;
 
 #if SIGNAL_POOL_SIZE > 0
-        signalPoolMutex.lock();
-        int cursor = signalCursor;
-
-        if (signalPoolFlag[cursor] == false) {
-            // the cursor is valid, use it
-            ret = signalPool[cursor];
-
-            // set the signal as used
-            signalPoolFlag[cursor] = true;
-
-            // simply move the cursor to the next index
-            ++signalCursor;
-            if (signalCursor == signalPool.size()) signalCursor = 0;
-        } else {
-            // the cursor is not valid, sequentially find the next available slot
-            bool found = false;
-            int startingCursor = cursor;
-            do {
-                ++cursor;
-                if (cursor == signalPool.size()) cursor = 0;
-
-                if (signalPoolFlag[cursor] == false) {
-                    // the cursor is valid, use it
-                    ret = signalPool[cursor];
-
-                    // set the signal as used
-                    signalPoolFlag[cursor] = true;
-
-                    // simply move the cursor to the next index
-                    signalCursor = cursor + 1;
-                    if (signalCursor == signalPool.size()) signalCursor = 0;
-
-                    // break from the loop
-                    found = true;
-                    break;
-                }
-            } while(cursor != startingCursor); // ensure we at most scan the vector once
-
-            if (found == false) {
-                hsa_status_t status = HSA_STATUS_SUCCESS;
-
-                // increase signal pool on demand by SIGNAL_POOL_SIZE
-
-                // keep track of the size of signal pool before increasing it
-                int oldSignalPoolSize = signalPool.size();
-                int oldSignalPoolFlagSize = signalPoolFlag.size();
-                assert(oldSignalPoolSize == oldSignalPoolFlagSize);
-
-                DBOUTL(DB_RESOURCE, "Growing signal pool from " << signalPool.size() << " to " << signalPool.size() + SIGNAL_POOL_SIZE);
-
-                // increase signal pool on demand for another SIGNAL_POOL_SIZE
-                for (int i = 0; i < SIGNAL_POOL_SIZE; ++i) {
-                    hsa_signal_t signal;
-                    status = hsa_signal_create(1, 0, NULL, &signal);
-                    STATUS_CHECK(status, __LINE__);
-                    signalPool.push_back(signal);
-                    signalPoolFlag.push_back(false);
-                }
-
-                DBOUT(DB_SIG,  "grew signal pool to size=" << signalPool.size() << "\n");
-
-                assert(signalPool.size() == oldSignalPoolSize + SIGNAL_POOL_SIZE);
-                assert(signalPoolFlag.size() == oldSignalPoolFlagSize + SIGNAL_POOL_SIZE);
-
-                // set return values, after the pool has been increased
-
-                // use the first item in the newly allocated pool
-                cursor = oldSignalPoolSize;
-
-                // access the new item through the newly assigned cursor
-                ret = signalPool[cursor];
-
-                // mark the item as used
-                signalPoolFlag[cursor] = true;
-
-                // simply move the cursor to the next index
-                signalCursor = cursor + 1;
-                if (signalCursor == signalPool.size()) signalCursor = 0;
-
-                found = true;
-            }
-        }
-
-        signalPoolMutex.unlock();
-#else
-        hsa_signal_t signal;
-        hsa_status_t status = hsa_signal_create(1, 0, NULL, &signal);
-        STATUS_CHECK(status, __LINE__);
-        int cursor = 0;
+        cursor = signalPool.acquire(ret);
 #endif
+        if (cursor < 0) {
+            // no pool, or the pool cannot grow any further; the index stays
+            // non-negative as callers take a negative one for "no signal"
+            hsa_status_t status = hsa_signal_create(1, 0, NULL, &ret);
+            STATUS_CHECK(status, __LINE__);
+            DBOUTL(DB_RESOURCE, "Allocating non-pool signal");
+            cursor = NON_POOL_SIGNAL_INDEX;
+        }
         return std::make_pair(ret, cursor);
     }
 
@@ -3325,19 +3422,11 @@ public:
         def = nullptr;
 
 #if SIGNAL_POOL_SIZE > 0
-        signalPoolMutex.lock();
-
         // deallocate signals in the pool
-        for (int i = 0; i < signalPool.size(); ++i) {
-            hsa_signal_t signal;
-            status = hsa_signal_destroy(signalPool[i]);
-            STATUS_CHECK(status, __LINE__);
-        }
-
+        ResourcePool<hsa_signal_t>::statistics stats = signalPool.stats();
+        DBOUTL(DB_RESOURCE, "Releasing signal pool of " << stats.capacity << " signals in " << stats.chunks
+                            << " chunks, peak in use=" << stats.peak);
         signalPool.clear();
-        signalPoolFlag.clear();
-
-        signalPoolMutex.unlock();
 #endif
 
         // shutdown HSA runtime
@@ -3412,6 +3501,7 @@ void HSAContext::ReadHccEnv()
     GET_ENV_INT (HCC_H2D_STAGING_THRESHOLD,    "Min size (in KB) to use staging buffer algorithm for H2D copy if ChooseBest algorithm selected");
     GET_ENV_INT (HCC_H2D_PININPLACE_THRESHOLD, "Min size (in KB) to use pin-in-place algorithm for H2D copy if ChooseBest algorithm selected");
     GET_ENV_INT (HCC_D2H_PININPLACE_THRESHOLD, "Min size (in KB) to use pin-in-place for D2H copy if ChooseBest algorithm selected");
+    GET_ENV_INT (HCC_STAGING_THREADS,          "Number of host threads copying a chunk into or out of a staging buffer.  0=choose from the number of cores");
 
 
     GET_ENV_INT    (HCC_PROFILE,         "Enable HCC kernel and data profiling.  1=summary, 2=trace");
@@ -3438,9 +3528,9 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) : KalmarD
                                agent(a), programs(), max_tile_static_size(0),
                                queue_size(0), queues(), queues_mutex(),
                                rocrQueues(0/*empty*/), rocrQueuesMutex(),
+                               rocrQueueWaiters(), rocrQueuesCv(), rocrQueueTickets(0), rocrQueueTick(0),
                                ri(),
                                useCoarseGrainedRegion(false),
-                               kernargPool(), kernargPoolFlag(), kernargCursor(0), kernargPoolMutex(),
                                executables(),
                                profile(hcAgentProfileNone),
                                path(), description(), hostAgent(host),
@@ -3525,12 +3615,19 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) : KalmarD
     }
     useCoarseGrainedRegion = result;
 
-    /// pre-allocate a pool of kernarg buffers in case:
+    /// pre-allocate a chunk of kernarg buffers of every size in case:
     /// - kernarg region is available
     /// - compile-time macro KERNARG_POOL_SIZE is larger than 0
+    for (size_t c = 0; c < KERNARG_SIZE_CLASS_COUNT; ++c) {
+        size_t bufferSize = kernargSizeClasses[c];
+        kernargPools[c].reset(new ResourcePool<void*>(
+            KERNARG_POOL_SIZE / bufferSize,
+            [this, bufferSize](void** buffers, size_t count) { return growKernargBuffer(bufferSize, buffers, count); },
+            [](void** buffers, size_t) { hsa_amd_memory_pool_free(buffers[0]); }));
 #if KERNARG_POOL_SIZE > 0
-    growKernargBuffer();
+        kernargPools[c]->grow();
 #endif
+    }
 
     // Setup AM pool.
     ri._am_memory_pool = (ri._found_local_memory_pool)
@@ -3593,13 +3690,15 @@ HSADevice::HSADevice(hsa_agent_t a, hsa_agent_t host, int x_accSeqNum) : KalmarD
                                             this->cpu_accessible_am,
                                             HCC_H2D_STAGING_THRESHOLD,
                                             HCC_H2D_PININPLACE_THRESHOLD,
-                                            HCC_D2H_PININPLACE_THRESHOLD);
+                                            HCC_D2H_PININPLACE_THRESHOLD,
+                                            HCC_STAGING_THREADS);
 
     copy_engine[1] = new UnpinnedCopyEngine(agent, hostAgent, stagingSize, 2/*staging Buffers*/,
                                             this->cpu_accessible_am,
                                             HCC_H2D_STAGING_THRESHOLD,
                                             HCC_H2D_PININPLACE_THRESHOLD,
-                                            HCC_D2H_PININPLACE_THRESHOLD);
+                                            HCC_D2H_PININPLACE_THRESHOLD,
+                                            HCC_STAGING_THREADS);
 
 
     if (HCC_CHECK_COPY && !this->cpu_accessible_am) {
@@ -3655,8 +3754,11 @@ inline std::ostream& operator<<(std::ostream& os, const HSAOp & op)
 HSAQueue::HSAQueue(KalmarDevice* pDev, hsa_agent_t agent, execute_order order) :
     KalmarQueue(pDev, queuing_mode_automatic, order),
     rocrQueue(nullptr),
-    asyncOps(), drainingQueue_(false),
-    valid(true), _nextSyncNeedsSysRelease(false), _nextKernelNeedsSysAcquire(false), bufferKernelMap(), kernelBufferMap()
+    queuePriority(0), queuePinned(false),
+    batchDepth(0), batchHeaders(), batchHwQueue(nullptr), batchLastIndex(0), batchPending(false),
+    capturing(false), captureGraph(),
+    asyncOps(MAX_INFLIGHT_COMMANDS_PER_QUEUE, opCompleted),
+    valid(true), _nextSyncNeedsSysRelease(false), _nextKernelNeedsSysAcquire(false), bufferDeps()
 {
     {
         // Protect the HSA queue we can steal it.
@@ -3690,17 +3792,8 @@ void HSAQueue::dispose() override {
 
         this->valid = false;
 
-        // clear bufferKernelMap
-        for (auto iter = bufferKernelMap.begin(); iter != bufferKernelMap.end(); ++iter) {
-           iter->second.clear();
-        }
-        bufferKernelMap.clear();
-
-        // clear kernelBufferMap
-        for (auto iter = kernelBufferMap.begin(); iter != kernelBufferMap.end(); ++iter) {
-            iter->second.clear();
-        }
-        kernelBufferMap.clear();
+        // clear bufferDeps
+        bufferDeps.clear();
 
 
         Kalmar::HSADevice* device = static_cast<Kalmar::HSADevice*>(getDev());
@@ -3718,6 +3811,435 @@ void HSAQueue::dispose() override {
     DBOUT(DB_INIT, "HSAQueue::dispose() " << this <<  " out\n");
 }
 
+// Placeholder for a command recorded into an HSAGraph, returned in place of
+// the async op of the command while capturing. It never completes: the
+// commands of the graph run when the graph is launched.
+class HSACapturedOp : public KalmarAsyncOp {
+public:
+    HSACapturedOp(KalmarQueue *queue, hcCommandKind commandKind, const HSAGraph *graph, size_t node) :
+        KalmarAsyncOp(queue, commandKind), graph(graph), node(node) {}
+
+    const HSAGraph *getGraph() const { return graph; }
+    size_t getNode() const { return node; }
+
+    void wait() override {
+        throw Kalmar::runtime_exception("can not wait for a command recorded into a command_graph", 0);
+    }
+
+    void get() override { wait(); }
+
+    // the callback runs at once, and learns from get() it never will complete
+    void onComplete(std::function<void()> callback) override {
+        Kalmar::CompletionThread::get().post(std::move(callback));
+    }
+
+private:
+    const HSAGraph *graph;
+    size_t node;
+};
+
+
+// HSAGraph
+//
+// The commands recorded from an HSAQueue between beginCapture() and
+// endCapture(), launched again with launch().
+//
+// Kernels and markers are kept as AQL packets, complete but for their
+// completion signal, along with their headers; the arguments of a kernel are
+// copied once into kernarg memory owned by the graph. A launch writes the
+// packets of consecutive kernels and markers straight into the hw queue, in a
+// single batch, without creating an HSAOp for each of them or going through
+// CreateKernel, argument marshalling and dependency detection again.
+//
+// Dependencies are resolved at capture:
+//   - a kernel of an execute_any_order queue which accesses a buffer written
+//     by an earlier kernel of the graph, or writes a buffer read by one, gets
+//     the barrier bit, found with a BufferDepTable of the placeholders. In an
+//     execute_in_order queue every kernel has the barrier bit already.
+//   - markers get the barrier bit, so they wait for all earlier packets.
+//     Markers may only depend on commands of the graph, or completed ones.
+//   - copies are not run by the packet processor: at launch, a copy waits for
+//     a marker enqueued behind the packets before it, and the packets after
+//     the copy wait for it with a barrier-AND packet.
+//
+// A launch ends with a system-scope marker, which is what the launch returns.
+class HSAGraph final : public KalmarGraph {
+public:
+    enum NodeKind { NODE_KERNEL, NODE_MARKER, NODE_COPY };
+
+    struct CopyArgs {
+        const void *src;
+        void *dst;
+        size_t sizeBytes;
+        hcCommandKind copyDir;
+        hc::AmPointerInfo srcPtrInfo;
+        hc::AmPointerInfo dstPtrInfo;
+        const Kalmar::KalmarDevice *copyDevice;
+    };
+
+    struct Node {
+        NodeKind kind;
+
+        // kernel and marker nodes: the packet with an invalid header, and
+        // the header to publish it with
+        union {
+            hsa_kernel_dispatch_packet_t dispatch;
+            hsa_barrier_and_packet_t barrier;
+        } packet;
+        uint16_t header;
+
+        // kernel nodes: the arguments in kernarg memory, and their value for
+        // the next launch
+        void *kernarg;
+        int kernargIndex;
+        std::vector<uint8_t> hostKernarg;
+
+        // copy nodes
+        std::unique_ptr<CopyArgs> copy;
+
+        explicit Node(NodeKind kind) : kind(kind), header(0), kernarg(nullptr), kernargIndex(-1) {
+            memset(&packet, 0, sizeof(packet));
+        }
+    };
+
+    explicit HSAGraph(HSAQueue *queue) :
+        queue(queue), nodes(), placeholders(), bufferDeps(), recordLock(),
+        recording(true), launchLock(), lastLaunch(), dirty(false) {}
+
+    ~HSAGraph() {
+        // the kernarg memory may still be read by the last launch
+        if (lastLaunch) {
+            lastLaunch->wait();
+        }
+        HSADevice *device = queue->getHSADev();
+        for (Node &n : nodes) {
+            if (n.kernarg != nullptr) {
+                device->releaseKernargBuffer(n.kernarg, n.kernargIndex);
+            }
+        }
+    }
+
+    size_t getNodeCount() const override { return nodes.size(); }
+
+    bool patchKernarg(size_t node, size_t offset, const void *data, size_t size) override {
+        std::lock_guard<std::mutex> l(launchLock);
+        if (node >= nodes.size() || nodes[node].kind != NODE_KERNEL ||
+            offset > nodes[node].hostKernarg.size() || size > nodes[node].hostKernarg.size() - offset) {
+            return false;
+        }
+        memcpy(nodes[node].hostKernarg.data() + offset, data, size);
+        dirty = true;
+        return true;
+    }
+
+    std::shared_ptr<KalmarAsyncOp> launch() override;
+
+    // record a kernel whose launch configuration is set
+    std::shared_ptr<KalmarAsyncOp> recordKernel(HSADispatch *dispatch) {
+        std::lock_guard<std::mutex> l(recordLock);
+        checkRecording();
+        Node n(NODE_KERNEL);
+        n.packet.dispatch = dispatch->getAql();
+        n.header = dispatch->packetHeader();
+        setKernarg(n, dispatch->pushedKernarg(), dispatch->pushedKernargSize(), dispatch->kernargAlignment());
+
+        std::shared_ptr<KalmarAsyncOp> placeholder = addNode(std::move(n), hcCommandKernel);
+
+        if (queue->tracksBufferDeps() && !dispatch->getBufferAccesses().empty()) {
+            std::vector<std::shared_ptr<KalmarAsyncOp>> deps;
+            for (const auto &access : dispatch->getBufferAccesses()) {
+                bufferDeps.dependencies(access.first, access.second, deps);
+            }
+            if (!deps.empty()) {
+                DBOUT(DB_CMD2, "  graph node " << nodes.size() - 1 << " depends on earlier nodes through its buffers\n");
+                nodes.back().header |= (1 << HSA_PACKET_HEADER_BARRIER);
+            }
+            for (const auto &access : dispatch->getBufferAccesses()) {
+                bufferDeps.record(access.first, access.second, placeholder, nodes.size() - 1);
+            }
+        }
+        return placeholder;
+    }
+
+    // record a kernel packet prepared by the caller, see dispatch_hsa_kernel
+    std::shared_ptr<KalmarAsyncOp> recordPacket(const hsa_kernel_dispatch_packet_t *aql, const void *args, size_t argSize) {
+        std::lock_guard<std::mutex> l(recordLock);
+        checkRecording();
+        Node n(NODE_KERNEL);
+        n.packet.dispatch = *aql;
+        n.header = aql->header;
+        if (queue->get_execute_order() == Kalmar::execute_in_order) {
+            n.header |= (1 << HSA_PACKET_HEADER_BARRIER);
+        }
+        setKernarg(n, args, argSize, 16);
+        return addNode(std::move(n), hcCommandKernel);
+    }
+
+    std::shared_ptr<KalmarAsyncOp> recordMarker(int count, std::shared_ptr<KalmarAsyncOp> *depOps, hc::memory_scope fenceScope) {
+        if ((count < 0) || (count > HSA_BARRIER_DEP_SIGNAL_CNT)) {
+            throw Kalmar::runtime_exception("Incorrect number of dependent signals passed to EnqueueMarkerWithDependency", count);
+        }
+        for (int i = 0; i < count; ++i) {
+            KalmarAsyncOp *depOp = depOps[i].get();
+            if (depOp == nullptr) {
+                continue;
+            }
+            // commands of the graph are waited for by the barrier bit
+            HSACapturedOp *captured = dynamic_cast<HSACapturedOp*>(depOp);
+            if (captured != nullptr ? captured->getGraph() != this : !depOp->isReady()) {
+                throw Kalmar::runtime_exception("a command_graph can only depend on its own commands", 0);
+            }
+        }
+
+        unsigned scope = HSA_FENCE_SCOPE_NONE;
+        switch (fenceScope) {
+            case hc::no_scope:
+                scope = HSA_FENCE_SCOPE_NONE;
+                break;
+            case hc::accelerator_scope:
+                scope = HSA_FENCE_SCOPE_AGENT;
+                break;
+            case hc::system_scope:
+                scope = HSA_FENCE_SCOPE_SYSTEM;
+                break;
+            default:
+                STATUS_CHECK(HSA_STATUS_ERROR_INVALID_ARGUMENT, __LINE__);
+        }
+
+        std::lock_guard<std::mutex> l(recordLock);
+        checkRecording();
+        Node n(NODE_MARKER);
+        n.header = (HSA_PACKET_TYPE_BARRIER_AND << HSA_PACKET_HEADER_TYPE) |
+                   (1 << HSA_PACKET_HEADER_BARRIER) |
+                   (scope << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE) |
+                   (scope << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE);
+        return addNode(std::move(n), hcCommandMarker);
+    }
+
+    std::shared_ptr<KalmarAsyncOp> recordCopy(const void *src, void *dst, size_t sizeBytes, hcCommandKind copyDir,
+                                              const hc::AmPointerInfo &srcPtrInfo, const hc::AmPointerInfo &dstPtrInfo,
+                                              const Kalmar::KalmarDevice *copyDevice) {
+        std::lock_guard<std::mutex> l(recordLock);
+        checkRecording();
+        Node n(NODE_COPY);
+        n.copy.reset(new CopyArgs{src, dst, sizeBytes, copyDir, srcPtrInfo, dstPtrInfo, copyDevice});
+        return addNode(std::move(n), copyDir);
+    }
+
+    // capture is over, the placeholders are not needed for dependencies
+    // any more
+    void endRecord() {
+        std::lock_guard<std::mutex> l(recordLock);
+        recording = false;
+        bufferDeps.clear();
+        std::vector<std::shared_ptr<KalmarAsyncOp>>().swap(placeholders);
+    }
+
+private:
+    HSAQueue *queue;
+    std::vector<Node> nodes;
+
+    // placeholders of the recorded commands, kept until the end of the
+    // capture since bufferDeps only refers to them weakly
+    std::vector<std::shared_ptr<KalmarAsyncOp>> placeholders;
+    BufferDepTable<KalmarAsyncOp> bufferDeps;
+    std::mutex recordLock;
+    // cleared by endRecord(); a command enqueued by another thread while
+    // endCapture() runs may find the graph ended
+    bool recording;
+
+    // launches are serialized; the kernarg memory is rewritten only once
+    // lastLaunch is over, and only if arguments were patched (dirty)
+    std::mutex launchLock;
+    std::shared_ptr<KalmarAsyncOp> lastLaunch;
+    bool dirty;
+
+    // called with recordLock held
+    void checkRecording() const {
+        if (!recording) {
+            throw Kalmar::runtime_exception("command enqueued while the capture of its command_graph ended", 0);
+        }
+    }
+
+    void setKernarg(Node &n, const void *args, size_t size, size_t align) {
+        n.hostKernarg.assign(static_cast<const uint8_t*>(args), static_cast<const uint8_t*>(args) + size);
+        if (size > 0) {
+            std::pair<void*, int> ret = queue->getHSADev()->getKernargBuffer(size, align);
+            n.kernarg = ret.first;
+            n.kernargIndex = ret.second;
+            // as kernarg buffers are fine-grained, we can directly use memcpy
+            memcpy(n.kernarg, args, size);
+        }
+        n.packet.dispatch.kernarg_address = n.kernarg;
+        n.packet.dispatch.completion_signal.handle = 0;
+        n.packet.dispatch.header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    }
+
+    std::shared_ptr<KalmarAsyncOp> addNode(Node &&n, hcCommandKind kind) {
+        nodes.push_back(std::move(n));
+        std::shared_ptr<KalmarAsyncOp> placeholder = std::make_shared<HSACapturedOp>(queue, kind, this, nodes.size() - 1);
+        placeholders.push_back(placeholder);
+        return placeholder;
+    }
+
+    // write the packets of nodes [first, last), kernels and markers, into the
+    // hw queue
+    void writePackets(size_t first, size_t last);
+};
+
+
+inline void
+HSAGraph::writePackets(size_t first, size_t last) {
+    hsa_queue_t* rocrQueue = queue->acquireLockedRocrQueue();
+    const uint32_t queueMask = rocrQueue->size - 1;
+
+    for (size_t i = first; i < last; ++i) {
+        const Node &n = nodes[i];
+        uint16_t header = n.header;
+        if (i == first) {
+            // the packets follow the commands enqueued before them
+            header |= (1 << HSA_PACKET_HEADER_BARRIER);
+        }
+        if (n.kind == NODE_KERNEL && queue->nextKernelNeedsSysAcquire()) {
+            // pick up the data of copies done before the graph
+            header |= ((HSA_FENCE_SCOPE_SYSTEM) << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE);
+            queue->setNextKernelNeedsSysAcquire(false);
+        }
+
+        uint64_t index = hsa_queue_load_write_index_relaxed(rocrQueue);
+        queue->waitForAqlSlotLocked(rocrQueue, index);
+
+        // both packet types are 64 bytes; the header stays invalid until
+        // the packet is published
+        hsa_kernel_dispatch_packet_t* q_aql =
+            &(((hsa_kernel_dispatch_packet_t*)(rocrQueue->base_address))[index & queueMask]);
+        memcpy(q_aql, &n.packet, sizeof(*q_aql));
+
+        hsa_queue_store_write_index_relaxed(rocrQueue, index + 1);
+        queue->publishAqlPacket(rocrQueue, index, &q_aql->header, header);
+    }
+    DBOUT(DB_AQL, " graph_aql " << last - first << " packet(s) into hwq=" << rocrQueue << "\n");
+
+    queue->releaseLockedRocrQueue();
+}
+
+
+inline std::shared_ptr<KalmarAsyncOp>
+HSAGraph::launch() {
+    if (queue->isCapturing()) {
+        throw Kalmar::runtime_exception("can not launch a command_graph into a queue which is capturing", 0);
+    }
+
+    std::lock_guard<std::mutex> l(launchLock);
+
+    if (dirty) {
+        // the previous launch may still read the arguments
+        if (lastLaunch) {
+            lastLaunch->wait();
+        }
+        for (Node &n : nodes) {
+            if (n.kind == NODE_KERNEL && !n.hostKernarg.empty()) {
+                memcpy(n.kernarg, n.hostKernarg.data(), n.hostKernarg.size());
+            }
+        }
+        dirty = false;
+    }
+
+    if (HCC_SERIALIZE_KERNEL & 0x1) {
+        queue->wait();
+    }
+
+    queue->beginBatch();
+
+    // the copy the next packets have to wait for, the packet processor only
+    // orders packets
+    std::shared_ptr<KalmarAsyncOp> copyOp = queue->asyncOps.youngest();
+    if (copyOp && !isCopyCommand(copyOp->getCommandKind())) {
+        copyOp = nullptr;
+    }
+
+    for (size_t i = 0; i < nodes.size(); ) {
+        if (nodes[i].kind == NODE_COPY) {
+            // the copy waits for this marker, behind the packets before it
+            queue->EnqueueMarkerWithDependency(copyOp ? 1 : 0, &copyOp, hc::system_scope);
+            const CopyArgs &c = *nodes[i].copy;
+            copyOp = queue->EnqueueAsyncCopyExt(c.src, c.dst, c.sizeBytes, c.copyDir,
+                                                c.srcPtrInfo, c.dstPtrInfo, c.copyDevice);
+            ++i;
+            continue;
+        }
+
+        if (copyOp) {
+            // and the packets after the copy wait for it
+            queue->EnqueueMarkerWithDependency(1, &copyOp, hc::system_scope);
+            copyOp = nullptr;
+        }
+
+        size_t last = i;
+        while (last < nodes.size() && nodes[last].kind != NODE_COPY) {
+            ++last;
+        }
+        writePackets(i, last);
+        queue->setNextSyncNeedsSysRelease(true);
+        i = last;
+    }
+
+    // completes with the last command of the graph
+    lastLaunch = queue->EnqueueMarkerWithDependency(copyOp ? 1 : 0, &copyOp, hc::system_scope);
+
+    queue->endBatch();
+
+    if (HCC_SERIALIZE_KERNEL & 0x2) {
+        lastLaunch->wait();
+    }
+
+    return lastLaunch;
+}
+
+
+inline bool
+HSAQueue::beginCapture() {
+    std::lock_guard<std::mutex> l(this->qmutex);
+    if (captureGraph) {
+        return false;
+    }
+    captureGraph = std::make_shared<HSAGraph>(this);
+    capturing.store(true, std::memory_order_release);
+    return true;
+}
+
+inline std::shared_ptr<KalmarGraph>
+HSAQueue::endCapture() {
+    std::shared_ptr<HSAGraph> graph;
+    {
+        std::lock_guard<std::mutex> l(this->qmutex);
+        capturing.store(false, std::memory_order_release);
+        graph.swap(captureGraph);
+    }
+    if (graph) {
+        graph->endRecord();
+        DBOUT(DB_CMD, *this << " captured a graph of " << graph->getNodeCount() << " command(s)\n");
+    }
+    return graph;
+}
+
+inline std::shared_ptr<KalmarAsyncOp>
+HSAQueue::captureKernel(const std::shared_ptr<HSAGraph> &graph, HSADispatch *dispatch, size_t nr_dim, size_t *global, size_t *local, size_t dynamic_group_size) {
+    // the acquire fence the next kernel dispatched may need is added at
+    // launch, the queue keeps needing it
+    bool needsSysAcquire = nextKernelNeedsSysAcquire();
+    dispatch->setLaunchConfiguration(nr_dim, global, local, dynamic_group_size);
+    setNextKernelNeedsSysAcquire(needsSysAcquire);
+
+    return graph->recordKernel(dispatch);
+}
+
+inline std::shared_ptr<KalmarAsyncOp>
+HSAQueue::captureMarker(const std::shared_ptr<HSAGraph> &graph, int count, std::shared_ptr<KalmarAsyncOp> *depOps, hc::memory_scope fenceScope) {
+    return graph->recordMarker(count, depOps, fenceScope);
+}
+
+
 Kalmar::HSADevice * HSAQueue::getHSADev() const {
     return static_cast<Kalmar::HSADevice*>(this->getDev());
 };
@@ -3730,6 +4252,8 @@ hsa_queue_t *HSAQueue::acquireLockedRocrQueue() {
         device->createOrstealRocrQueue(this);
     }
 
+    this->rocrQueue->_lastUsed.store(static_cast<HSADevice*>(this->getDev())->nextRocrQueueTick(), std::memory_order_relaxed);
+
     DBOUT (DB_QUEUE, "acquireLockedRocrQueue returned hwQueue=" << this->rocrQueue->_hwQueue << "\n");
     assert (this->rocrQueue->_hwQueue != 0);
     return this->rocrQueue->_hwQueue;
@@ -3742,6 +4266,16 @@ void HSAQueue::releaseLockedRocrQueue()
     this->qmutex.unlock();
 }
 
+inline bool
+HSAQueue::set_queue_pinned(bool pinned) override {
+    queuePinned = pinned;
+    if (!pinned) {
+        // thieves may be waiting for a queue to steal
+        static_cast<HSADevice*>(getDev())->notifyRocrQueueWaiters();
+    }
+    return true;
+}
+
 inline void*
 HSAQueue::getHSAAgent() override {
     return static_cast<void*>(&(static_cast<HSADevice*>(getDev())->getAgent()));
@@ -3815,6 +4349,10 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopyExt(const void* src, vo
 
     hsa_status_t status = HSA_STATUS_SUCCESS;
 
+    if (std::shared_ptr<HSAGraph> graph = getCaptureGraph()) {
+        return graph->recordCopy(src, dst, size_bytes, copyDir, srcPtrInfo, dstPtrInfo, copyDevice);
+    }
+
     // create shared_ptr instance
     const Kalmar::HSADevice *copyDeviceHsa = static_cast<const Kalmar::HSADevice*> (copyDevice);
     std::shared_ptr<HSACopy> copyCommand = std::make_shared<HSACopy>(this, src, dst, size_bytes);
@@ -3834,10 +4372,6 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopyExt(const void* src, vo
 std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy(const void *src, void *dst, size_t size_bytes) override {
     hsa_status_t status = HSA_STATUS_SUCCESS;
 
-    // create shared_ptr instance
-    std::shared_ptr<HSACopy> copyCommand = std::make_shared<HSACopy>(this, src, dst, size_bytes);
-
-
     hc::accelerator acc;
     hc::AmPointerInfo srcPtrInfo(NULL, NULL, NULL, 0, acc, 0, 0);
     hc::AmPointerInfo dstPtrInfo(NULL, NULL, NULL, 0, acc, 0, 0);
@@ -3870,6 +4404,15 @@ std::shared_ptr<KalmarAsyncOp> HSAQueue::EnqueueAsyncCopy(const void *src, void
         copyDevice = nullptr; // H2H
     }
 
+    if (std::shared_ptr<HSAGraph> graph = getCaptureGraph()) {
+        return graph->recordCopy(src, dst, size_bytes,
+                                 resolveMemcpyDirection(srcPtrInfo._isInDeviceMem, dstPtrInfo._isInDeviceMem),
+                                 srcPtrInfo, dstPtrInfo, copyDevice);
+    }
+
+    // create shared_ptr instance
+    std::shared_ptr<HSACopy> copyCommand = std::make_shared<HSACopy>(this, src, dst, size_bytes);
+
     // enqueue the async copy command
     status = copyCommand.get()->enqueueAsyncCopyCommand(copyDevice, srcPtrInfo, dstPtrInfo);
     STATUS_CHECK(status, __LINE__);
@@ -3902,6 +4445,14 @@ HSAQueue::dispatch_hsa_kernel(const hsa_kernel_dispatch_packet_t *aql,
     }
 
 
+    if (std::shared_ptr<HSAGraph> graph = getCaptureGraph()) {
+        std::shared_ptr<KalmarAsyncOp> node = graph->recordPacket(aql, args, argSize);
+        if (cf) {
+            *cf = hc::completion_future(node);
+        }
+        return;
+    }
+
     Kalmar::HSADevice* device = static_cast<Kalmar::HSADevice*>(this->getDev());
     //HSADispatch *dispatch = new HSADispatch(device, nullptr, aql);
     std::shared_ptr<HSADispatch> sp_dispatch = std::make_shared<HSADispatch>(device, this/*queue*/, nullptr, aql);
@@ -3946,8 +4497,9 @@ HSADispatch::HSADispatch(Kalmar::HSADevice* _device, Kalmar::KalmarQueue *queue,
     kernel(_kernel),
     isDispatched(false),
     waitMode(HSA_WAIT_STATE_BLOCKED),
-    future(nullptr),
-    kernargMemory(nullptr)
+    kernargMemory(nullptr),
+    kernargMemoryIndex(-1),
+    kernargCapacity(0)
 {
     signal.handle = 0;
     signalIndex = -1;
@@ -4059,6 +4611,20 @@ static void printKernarg(const void *kernarg_address, int bytesToPrint)
 }
 
 
+inline uint16_t
+HSADispatch::packetHeader() const {
+    uint16_t header = aql.header;
+    if (hsaQueue()->get_execute_order() == Kalmar::execute_in_order) {
+        // set AQL header with barrier bit on if execute in order
+        header |= ((HSA_PACKET_TYPE_KERNEL_DISPATCH << HSA_PACKET_HEADER_TYPE) |
+                     (1 << HSA_PACKET_HEADER_BARRIER));
+    } else {
+        // set AQL header with barrier bit off if execute in any order
+        header |= (HSA_PACKET_TYPE_KERNEL_DISPATCH << HSA_PACKET_HEADER_TYPE);
+    }
+    return header;
+}
+
 // dispatch a kernel asynchronously
 // -  allocates signal, copies arguments into kernarg buffer, and places aql packet into queue.
 hsa_status_t
@@ -4076,31 +4642,27 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
      */
     // set dispatch fences
     // The fence bits must be set on entry into this function.
-    uint16_t header = aql.header;
-    if (hsaQueue()->get_execute_order() == Kalmar::execute_in_order) {
-        //std::cout << "barrier bit on\n";
-        // set AQL header with barrier bit on if execute in order
-        header |= ((HSA_PACKET_TYPE_KERNEL_DISPATCH << HSA_PACKET_HEADER_TYPE) |
-                     (1 << HSA_PACKET_HEADER_BARRIER));
-    } else {
-        //std::cout << "barrier bit off\n";
-        // set AQL header with barrier bit off if execute in any order
-        header |= (HSA_PACKET_TYPE_KERNEL_DISPATCH << HSA_PACKET_HEADER_TYPE);
-    }
+    uint16_t header = packetHeader();
 
 
     // bind kernel arguments
     //printf("hostKernargSize size: %d in bytesn", hostKernargSize);
 
     if (hostKernargSize > 0) {
-        hsa_amd_memory_pool_t kernarg_region = device->getHSAKernargRegion();
-        std::pair<void*, int> ret = device->getKernargBuffer(hostKernargSize);
-        kernargMemory = ret.first;
-        kernargMemoryIndex = ret.second;
-        //std::cerr << "op #" << getSeqNum() << " allocated kernarg cursor=" << kernargMemoryIndex << "\n";
+        if (hostKernarg != kernargMemory) {
+            // arguments not pushed in place
+            if (kernargMemory != nullptr) {
+                device->releaseKernargBuffer(kernargMemory, kernargMemoryIndex);
+                kernargCapacity = 0;
+            }
+            std::pair<void*, int> ret = device->getKernargBuffer(hostKernargSize, kernel ? kernel->kernarg_segment_alignment : 16);
+            kernargMemory = ret.first;
+            kernargMemoryIndex = ret.second;
+            //std::cerr << "op #" << getSeqNum() << " allocated kernarg cursor=" << kernargMemoryIndex << "\n";
 
-        // as kernarg buffers are fine-grained, we can directly use memcpy
-        memcpy(kernargMemory, hostKernarg, hostKernargSize);
+            // as kernarg buffers are fine-grained, we can directly use memcpy
+            memcpy(kernargMemory, hostKernarg, hostKernargSize);
+        }
 
         aql.kernarg_address = kernargMemory;
     } else {
@@ -4112,17 +4674,16 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
     uint32_t queueMask = lockedHsaQueue->size - 1;
     // TODO: Need to check if package write is correct.
     uint64_t index = hsa_queue_load_write_index_relaxed(lockedHsaQueue);
-    uint64_t nextIndex = index + 1;
-    if (nextIndex - hsa_queue_load_read_index_acquire(lockedHsaQueue) >= lockedHsaQueue->size) {
-      checkHCCRuntimeStatus(Kalmar::HCCRuntimeStatus::HCCRT_STATUS_ERROR_COMMAND_QUEUE_OVERFLOW, __LINE__, lockedHsaQueue);
-    }
+    hsaQueue()->waitForAqlSlotLocked(lockedHsaQueue, index);
 
 
     hsa_kernel_dispatch_packet_t* q_aql =
         &(((hsa_kernel_dispatch_packet_t*)(lockedHsaQueue->base_address))[index & queueMask]);
 
-    // Copy mostly-finished AQL packet into the queue
+    // Copy mostly-finished AQL packet into the queue, with an invalid header
+    // until it is published
     *q_aql = aql;
+    q_aql->header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
 
     // Set some specific fields:
     if (allocSignal) {
@@ -4138,9 +4699,6 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
         signalIndex = -1;
     }
 
-    // Lastly copy in the header:
-    q_aql->header = header;
-
     hsa_queue_store_write_index_relaxed(lockedHsaQueue, index + 1);
     DBOUTL(DB_AQL, " dispatch_aql " << *this << "(hwq=" << lockedHsaQueue << ") kernargs=" << hostKernargSize << " " << *q_aql );
     DBOUTL(DB_AQL2, rawAql(*q_aql));
@@ -4150,8 +4708,8 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
     }
 
 
-    // Ring door bell
-    hsa_signal_store_relaxed(lockedHsaQueue->doorbell_signal, index);
+    // Lastly publish the header, and ring door bell
+    hsaQueue()->publishAqlPacket(lockedHsaQueue, index, &q_aql->header, header);
 
     isDispatched = true;
 
@@ -4164,10 +4722,12 @@ HSADispatch::dispatchKernel(hsa_queue_t* lockedHsaQueue, const void *hostKernarg
 inline hsa_status_t
 HSADispatch::waitComplete() {
     hsa_status_t status = HSA_STATUS_SUCCESS;
+    std::lock_guard<std::mutex> l(_waitLock);
     if (!isDispatched)  {
         return HSA_STATUS_ERROR_INVALID_ARGUMENT;
     }
 
+    hsaQueue()->flushBatch();
 
 
     if (signal.handle) {
@@ -4197,6 +4757,26 @@ HSADispatch::waitComplete() {
     return status;
 }
 
+inline void
+HSADispatch::reserveKernarg() {
+    if (kernel == nullptr || kernel->kernarg_segment_size == 0 || isDispatched) {
+        return;
+    }
+    std::pair<void*, int> ret = device->getKernargBuffer(kernel->kernarg_segment_size, kernel->kernarg_segment_alignment);
+    kernargMemory = ret.first;
+    kernargMemoryIndex = ret.second;
+    kernargCapacity = kernel->kernarg_segment_size;
+}
+
+inline void
+HSADispatch::spillKernarg() {
+    DBOUTL(DB_KERNARG, "kernargs of " << getKernelName() << " exceed its kernarg segment of " << kernargCapacity << " bytes");
+    arg_vec.assign(static_cast<uint8_t*>(kernargMemory), static_cast<uint8_t*>(kernargMemory) + arg_size);
+    device->releaseKernargBuffer(kernargMemory, kernargMemoryIndex);
+    kernargMemory = nullptr;
+    kernargCapacity = 0;
+}
+
 inline hsa_status_t
 HSADispatch::dispatchKernelWaitComplete() {
     hsa_status_t status = HSA_STATUS_SUCCESS;
@@ -4217,7 +4797,7 @@ HSADispatch::dispatchKernelWaitComplete() {
         hsa_queue_t* rocrQueue = hsaQueue()->acquireLockedRocrQueue();
 
         // dispatch kernel
-        status = dispatchKernel(rocrQueue, arg_vec.data(), arg_vec.size(), true);
+        status = dispatchKernel(rocrQueue, pushedKernarg(), pushedKernargSize(), true);
         STATUS_CHECK(status, __LINE__);
 
         hsaQueue()->releaseLockedRocrQueue();
@@ -4236,7 +4816,7 @@ HSADispatch::dispatchKernelWaitComplete() {
 inline hsa_status_t
 HSADispatch::dispatchKernelAsyncFromOp()
 {
-    return dispatchKernelAsync(arg_vec.data(), arg_vec.size(), true);
+    return dispatchKernelAsync(pushedKernarg(), pushedKernargSize(), true);
 }
 
 inline hsa_status_t
@@ -4265,12 +4845,6 @@ HSADispatch::dispatchKernelAsync(const void *hostKernarg, int hostKernargSize, b
         hsaQueue()->releaseLockedRocrQueue();
     }
 
-
-    // dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
-        waitComplete();
-    }).share());
-
     if (HCC_SERIALIZE_KERNEL & 0x2) {
         status = waitComplete();
         STATUS_CHECK(status, __LINE__);
@@ -4287,6 +4861,7 @@ HSADispatch::dispose() {
       //std::cerr << "op#" << getSeqNum() << " releasing kernal arg buffer index=" << kernargMemoryIndex<< "\n";
       device->releaseKernargBuffer(kernargMemory, kernargMemoryIndex);
       kernargMemory = nullptr;
+      kernargCapacity = 0;
     }
 
     clearArgs();
@@ -4300,11 +4875,6 @@ HSADispatch::dispose() {
         LOG_PROFILE(this, start, end, "kernel", getKernelName(), "");
     }
     Kalmar::ctx.releaseSignal(signal, signalIndex);
-
-    if (future != nullptr) {
-      delete future;
-      future = nullptr;
-    }
 }
 
 inline uint64_t
@@ -4431,10 +5001,13 @@ Kalmar::HSAQueue *HSADispatch::hsaQueue() const { return static_cast<Kalmar::HSA
 inline hsa_status_t
 HSABarrier::waitComplete() {
     hsa_status_t status = HSA_STATUS_SUCCESS;
+    std::lock_guard<std::mutex> l(_waitLock);
     if (!isDispatched)  {
         return HSA_STATUS_ERROR_INVALID_ARGUMENT;
     }
 
+    hsaQueue()->flushBatch();
+
     DBOUT(DB_WAIT,  "  wait for barrier " << *this << " completion with wait flag: " << waitMode << "  signal="<< std::hex  << signal.handle << std::dec <<"...\n");
 
     // Wait on completion signal until the barrier is finished
@@ -4522,13 +5095,12 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
         uint64_t index = hsa_queue_load_write_index_relaxed(rocrQueue);
         const uint32_t queueMask = rocrQueue->size - 1;
         uint64_t nextIndex = index + 1;
-        if (nextIndex - hsa_queue_load_read_index_acquire(rocrQueue) >= rocrQueue->size) {
-          checkHCCRuntimeStatus(Kalmar::HCCRuntimeStatus::HCCRT_STATUS_ERROR_COMMAND_QUEUE_OVERFLOW, __LINE__, rocrQueue);
-        }
+        hsaQueue()->waitForAqlSlotLocked(rocrQueue, index);
 
         // Define the barrier packet to be at the calculated queue index address
         hsa_barrier_and_packet_t* barrier = &(((hsa_barrier_and_packet_t*)(rocrQueue->base_address))[index&queueMask]);
         memset(barrier, 0, sizeof(hsa_barrier_and_packet_t));
+        barrier->header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
 
 
         // setup dependent signals
@@ -4540,16 +5112,13 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
 
         barrier->completion_signal = signal;
 
-        // Set header last:
-        barrier->header = header;
-
         DBOUTL(DB_AQL, " barrier_aql " << *this << " "<< *barrier );
         DBOUTL(DB_AQL2, rawAql(*barrier));
 
 
-        // Increment write index and ring doorbell to dispatch the kernel
+        // Increment write index, set header last and ring doorbell to dispatch the barrier
         hsa_queue_store_write_index_relaxed(rocrQueue, nextIndex);
-        hsa_signal_store_relaxed(rocrQueue->doorbell_signal, index);
+        hsaQueue()->publishAqlPacket(rocrQueue, index, &barrier->header, header);
 
         hsaQueue()->releaseLockedRocrQueue();
     }
@@ -4560,12 +5129,6 @@ HSABarrier::enqueueAsync(hc::memory_scope fenceScope) {
     _barrierNextKernelNeedsSysAcquire = hsaQueue()->nextKernelNeedsSysAcquire();
     _barrierNextSyncNeedsSysRelease   = hsaQueue()->nextSyncNeedsSysRelease();
 
-    // dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
-        waitComplete();
-    }).share());
-
-
     return HSA_STATUS_SUCCESS;
 }
 
@@ -4583,6 +5146,7 @@ static std::string fenceToString(int fenceBits)
 
 
 bool HSABarrier::isReady() override {
+    hsaQueue()->flushBatch();
     bool ready = (hsa_signal_load_acquire(signal) == 0);
     if (ready) {
         hsaQueue()->removeAsyncOp(this);
@@ -4592,6 +5156,7 @@ bool HSABarrier::isReady() override {
 }
 
 bool HSACopy::isReady() override {
+    hsaQueue()->flushBatch();
     bool ready = (hsa_signal_load_acquire(signal) == 0);
     if (ready) {
         hsaQueue()->removeAsyncOp(this);
@@ -4601,6 +5166,7 @@ bool HSACopy::isReady() override {
 }
 
 bool HSADispatch::isReady() override {
+    hsaQueue()->flushBatch();
     bool ready = (hsa_signal_load_acquire(signal) == 0);
     if (ready) {
         hsaQueue()->removeAsyncOp(this);
@@ -4636,11 +5202,6 @@ HSABarrier::dispose() {
     for (int i=0; i<depCount; i++) {
         depAsyncOps[i] = nullptr;
     }
-
-    if (future != nullptr) {
-      delete future;
-      future = nullptr;
-    }
 }
 
 inline uint64_t
@@ -4670,12 +5231,83 @@ HSAOpCoord::HSAOpCoord(Kalmar::HSAQueue *queue) :
 
 HSAOp::HSAOp(Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind) :
     KalmarAsyncOp(queue, commandKind),
-    _opCoord(static_cast<Kalmar::HSAQueue*> (queue)),
-    _asyncOpsIndex(-1)
+    _opCoord(static_cast<Kalmar::HSAQueue*> (queue))
 {
     apiStartTick = Kalmar::ctx.getSystemTicks();
 };
 
+static bool
+signalCompletionHandler(hsa_signal_value_t value, void* arg) {
+    std::unique_ptr<std::function<void()>> callback(static_cast<std::function<void()>*>(arg));
+    Kalmar::CompletionThread::get().post(std::move(*callback));
+    // one shot, do not rearm
+    return false;
+}
+
+void
+HSAOp::onComplete(std::function<void()> callback) {
+    void* handle = getNativeHandle();
+    hsa_signal_t signal = handle ? *static_cast<hsa_signal_t*>(handle) : hsa_signal_t{0};
+    if (signal.handle == 0) {
+        // ops launched without a signal are waited for by the thread which
+        // launched them, they are done by now
+        Kalmar::CompletionThread::get().post(std::move(callback));
+        return;
+    }
+    // the op may still sit in an unpublished batch, whose signal would
+    // never drop
+    if (Kalmar::HSAQueue* queue = static_cast<Kalmar::HSAQueue*>(getQueue())) {
+        queue->flushBatch();
+    }
+    std::function<void()>* arg = new std::function<void()>(std::move(callback));
+    hsa_status_t status = hsa_amd_signal_async_handler(signal, HSA_SIGNAL_CONDITION_LT, 1,
+                                                       signalCompletionHandler, arg);
+    if (status != HSA_STATUS_SUCCESS) {
+        Kalmar::KalmarAsyncOp::onComplete(std::move(*arg));
+        delete arg;
+    }
+}
+
+bool
+HSAOp::waitFor(std::chrono::nanoseconds timeout) {
+    void* handle = getNativeHandle();
+    hsa_signal_t signal = handle ? *static_cast<hsa_signal_t*>(handle) : hsa_signal_t{0};
+    if (signal.handle == 0) {
+        // ops launched without a signal were waited for by their launcher
+        return true;
+    }
+    if (Kalmar::HSAQueue* queue = static_cast<Kalmar::HSAQueue*>(getQueue())) {
+        queue->flushBatch();
+    }
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    const double ticksPerNs = getTimestampFrequency() * 1e-9;
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline - std::chrono::steady_clock::now());
+        uint64_t ticks = remaining.count() > 0 ? uint64_t(remaining.count() * ticksPerNs) : 0;
+        // the timeout is only a hint to ROCr, which may return before it
+        // expires with the signal still set
+        if (hsa_signal_wait_scacquire(signal, HSA_SIGNAL_CONDITION_LT, 1, ticks,
+                                      HSA_WAIT_STATE_BLOCKED) < 1) {
+            // unregisters the op from its queue
+            return isReady();
+        }
+        if (remaining.count() <= 0) {
+            return false;
+        }
+    }
+}
+
+std::shared_future<void>*
+HSAOp::getFuture() {
+    std::call_once(_futureFlag, [this] {
+        _future.reset(new std::shared_future<void>(std::async(std::launch::deferred, [this] {
+            wait();
+        }).share()));
+    });
+    return _future.get();
+}
+
 // ----------------------------------------------------------------------
 // member function implementation of HSACopy
 // ----------------------------------------------------------------------
@@ -4683,7 +5315,7 @@ HSAOp::HSAOp(Kalmar::KalmarQueue *queue, hc::hcCommandKind commandKind) :
 // Copy mode will be set later on.
 // HSA signals would be waited in HSA_WAIT_STATE_ACTIVE by default for HSACopy instances
 HSACopy::HSACopy(Kalmar::KalmarQueue *queue, const void* src_, void* dst_, size_t sizeBytes_) : HSAOp(queue, Kalmar::hcCommandInvalid),
-    isSubmitted(false), isAsync(false), isSingleStepCopy(false), isPeerToPeer(false), future(nullptr), depAsyncOp(nullptr), copyDevice(nullptr), waitMode(HSA_WAIT_STATE_ACTIVE),
+    isSubmitted(false), isAsync(false), isSingleStepCopy(false), isPeerToPeer(false), depAsyncOp(nullptr), copyDevice(nullptr), waitMode(HSA_WAIT_STATE_ACTIVE),
     src(src_), dst(dst_),
     sizeBytes(sizeBytes_),
     signalIndex(-1) {
@@ -4697,10 +5329,13 @@ HSACopy::HSACopy(Kalmar::KalmarQueue *queue, const void* src_, void* dst_, size_
 inline hsa_status_t
 HSACopy::waitComplete() {
     hsa_status_t status = HSA_STATUS_SUCCESS;
+    std::lock_guard<std::mutex> l(_waitLock);
     if (!isSubmitted)  {
         return HSA_STATUS_ERROR_INVALID_ARGUMENT;
     }
 
+    // the copy may depend on packets of the batch
+    hsaQueue()->flushBatch();
 
 
     // Wait on completion signal until the async copy is finishedS
@@ -4962,11 +5597,6 @@ HSACopy::enqueueAsyncCopyCommand(const Kalmar::HSADevice *copyDevice, const hc::
 
     STATUS_CHECK(status, __LINE__);
 
-    // dynamically allocate a std::shared_future<void> object
-    future = new std::shared_future<void>(std::async(std::launch::deferred, [&] {
-        waitComplete();
-    }).share());
-
     if (HCC_SERIALIZE_COPY & 0x2) {
         status = waitComplete();
         STATUS_CHECK(status, __LINE__);
@@ -5004,11 +5634,6 @@ HSACopy::dispose() {
             LOG_PROFILE(this, start, end, "copyslo", getCopyCommandString(),  "\t" << sizeBytes << " bytes;\t" << sizeBytes/1024.0/1024 << " MB;\t" << bw << " GB/s;");
         }
     }
-
-    if (future != nullptr) {
-        delete future;
-        future = nullptr;
-    }
 }
 
 inline uint64_t
@@ -5231,10 +5856,20 @@ extern "C" void PushArgImpl(void *ker, int idx, size_t sz, const void *v) {
       dispatch->pushBooleanArg(*reinterpret_cast<unsigned char*>(val));
       break;
     default:
-      assert(0 && "Unsupported kernel argument size");
+      // any other size is an aggregate, aligned to the largest power of 2
+      // dividing its size, as the compiler lays out vector types
+      assert(sz != 0 && "Unsupported kernel argument size");
+      dispatch->pushArgBlock(v, sz, std::min<size_t>(sz & -sz, 16));
+      break;
   }
 }
 
+extern "C" void PushArgBlockImpl(void *ker, int idx, size_t sz, size_t align, const void *v) {
+  HSADispatch *dispatch =
+      reinterpret_cast<HSADispatch*>(ker);
+  dispatch->pushArgBlock(v, sz, align);
+}
+
 extern "C" void PushArgPtrImpl(void *ker, int idx, size_t sz, const void *v) {
   //std::cerr << "pushing:" << ker << " of size " << sz << "\n";
   HSADispatch *dispatch =
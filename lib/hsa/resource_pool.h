@@ -0,0 +1,313 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+
+/// ResourcePool
+///
+/// Lock-free pool of runtime resources such as kernarg buffers and signals.
+/// Resources are made chunk by chunk through the create callback, handed out
+/// by index and kept until the pool is destroyed, when the destroy callback
+/// gets every chunk back. Free resources are kept on a Treiber stack of
+/// indices whose head carries a tag against ABA, so acquire and release are a
+/// single CAS. Only growing the pool takes a lock, and only when it is empty.
+///
+/// A pool may put a small per-thread cache in front of the shared stack. A
+/// thread then takes resources from and returns them to its own cache, and
+/// moves them to and from the stack in batches, which keeps threads that
+/// dispatch and wait a lot off the shared cache line. A thread caches for one
+/// pool of each resource type, the first it uses; other pools of the type go
+/// to their stack directly. Every pool gets an id of its own, which the caches
+/// check besides the address, so a cache left over from a cleared pool is
+/// never used for a new pool created at the same address.
+///
+/// The pool does not depend on the HSA runtime, the callbacks do all the
+/// allocation, which keeps it usable on hosts without an HSA agent.
+template <typename T>
+class ResourcePool
+{
+public:
+    /// fill items[0, count) with new resources
+    typedef std::function<bool(T* items, size_t count)> create_fn;
+    /// release items[0, count) made by one call of create_fn
+    typedef std::function<void(T* items, size_t count)> destroy_fn;
+
+    /// most chunks a pool grows to; acquire fails once they are used up
+    static const size_t MAX_CHUNKS = 4096;
+
+    /// resources a thread cache holds at most
+    static const int THREAD_CACHE_SIZE = 32;
+
+    /// occupancy and growth of a pool
+    struct statistics {
+        size_t capacity;    ///< resources the pool owns
+        size_t in_use;      ///< resources not on the shared stack, cached ones included
+        size_t peak;        ///< highest in_use seen
+        size_t chunks;      ///< chunks created
+    };
+
+    ResourcePool(size_t chunk_size, create_fn create, destroy_fn destroy, bool thread_cache = false)
+        : id(next_id().fetch_add(1, std::memory_order_relaxed)),
+          chunk_size(chunk_size), create(create), destroy(destroy), cached(thread_cache),
+          head(0), chunk_count(0), outstanding(0), peak(0), grow_mutex() {
+        for (size_t i = 0; i < MAX_CHUNKS; ++i)
+            chunks[i].store(nullptr, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> l(live_mutex());
+        live().insert(this);
+    }
+
+    ResourcePool(const ResourcePool&) = delete;
+    ResourcePool& operator=(const ResourcePool&) = delete;
+
+    ~ResourcePool() { clear(); }
+
+    /// release all chunks; no resource may be in use and the pool may only be
+    /// destroyed afterwards
+    void clear() {
+        {
+            // threads ending from now on keep their cached indices
+            std::lock_guard<std::mutex> l(live_mutex());
+            live().erase(this);
+        }
+        std::lock_guard<std::mutex> l(grow_mutex);
+        if (cached) {
+            thread_cache& c = local();
+            if (c.owner == this) {
+                c.owner = nullptr;
+                c.count = 0;
+            }
+        }
+        size_t n = chunk_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+            chunk* c = chunks[i].exchange(nullptr, std::memory_order_relaxed);
+            destroy(c->items.get(), chunk_size);
+            delete c;
+        }
+        chunk_count.store(0, std::memory_order_release);
+        head.store(0, std::memory_order_release);
+        outstanding.store(0, std::memory_order_relaxed);
+    }
+
+    /// take a free resource, growing the pool by a chunk if there is none;
+    /// returns its index, or -1 if the pool cannot grow
+    int acquire(T& item) {
+        thread_cache* c = cache();
+        if (c) {
+            if (c->count == 0) {
+                // refill half of the cache so that alternating acquire and
+                // release on an empty cache do not go to the stack every time
+                while (c->count < THREAD_CACHE_SIZE / 2) {
+                    int index = pop();
+                    if (index < 0)
+                        break;
+                    c->items[c->count++] = index;
+                }
+                if (c->count == 0)
+                    return -1;
+                count_out(c->count);
+            }
+            int index = c->items[--c->count];
+            item = at(index);
+            return index;
+        }
+        int index = pop();
+        if (index >= 0) {
+            count_out(1);
+            item = at(index);
+        }
+        return index;
+    }
+
+    /// put back a resource taken with acquire
+    void release(int index) {
+        thread_cache* c = cache();
+        if (c) {
+            if (c->count == THREAD_CACHE_SIZE)
+                c->flush(THREAD_CACHE_SIZE / 2);
+            c->items[c->count++] = index;
+            return;
+        }
+        outstanding.fetch_sub(1, std::memory_order_relaxed);
+        push(index, index);
+    }
+
+    /// resource of an index returned by acquire
+    T& at(int index) const {
+        return chunks[index / chunk_size].load(std::memory_order_acquire)->items[index % chunk_size];
+    }
+
+    /// number of resources the pool owns
+    size_t capacity() const { return chunk_count.load(std::memory_order_relaxed) * chunk_size; }
+
+    statistics stats() const {
+        statistics s;
+        s.chunks = chunk_count.load(std::memory_order_relaxed);
+        s.capacity = s.chunks * chunk_size;
+        s.in_use = outstanding.load(std::memory_order_relaxed);
+        s.peak = peak.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    /// add a chunk unless another thread has put resources back meanwhile
+    bool grow() {
+        std::lock_guard<std::mutex> l(grow_mutex);
+        if (slot_of(head.load(std::memory_order_acquire)) != 0)
+            return true;
+        size_t n = chunk_count.load(std::memory_order_relaxed);
+        if (n == MAX_CHUNKS)
+            return false;
+        std::unique_ptr<chunk> c(new chunk(chunk_size));
+        if (!create(c->items.get(), chunk_size))
+            return false;
+        // chain the new slots and push them all at once
+        int first = n * chunk_size;
+        int last = first + chunk_size - 1;
+        for (int i = first; i < last; ++i)
+            c->next[i - first].store(i + 2, std::memory_order_relaxed);
+        chunks[n].store(c.release(), std::memory_order_release);
+        chunk_count.store(n + 1, std::memory_order_release);
+        push(first, last);
+        return true;
+    }
+
+private:
+    struct chunk {
+        std::unique_ptr<T[]> items;
+        /// free list link of every slot: index + 1 of the next free slot
+        std::unique_ptr<std::atomic<uint32_t>[]> next;
+        explicit chunk(size_t n) : items(new T[n]), next(new std::atomic<uint32_t>[n]) {}
+    };
+
+    struct thread_cache {
+        ResourcePool* owner;
+        uint64_t owner_id;
+        int count;
+        int items[THREAD_CACHE_SIZE];
+
+        thread_cache() : owner(nullptr), owner_id(0), count(0) {}
+
+        /// return the n oldest cached resources to the stack of the owner
+        void flush(int n) {
+            for (int i = 0; i + 1 < n; ++i)
+                owner->link(items[i]).store(items[i + 1] + 1, std::memory_order_relaxed);
+            owner->outstanding.fetch_sub(n, std::memory_order_relaxed);
+            owner->push(items[0], items[n - 1]);
+            count -= n;
+            for (int i = 0; i < count; ++i)
+                items[i] = items[i + n];
+        }
+
+        // a thread may end after its pool is gone, only flush to live pools
+        ~thread_cache() {
+            std::lock_guard<std::mutex> l(live_mutex());
+            if (owner && count && live().count(owner) && owner->id == owner_id)
+                flush(count);
+        }
+    };
+
+    static std::mutex& live_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::set<const ResourcePool*>& live() {
+        static std::set<const ResourcePool*> pools;
+        return pools;
+    }
+
+    static std::atomic<uint64_t>& next_id() {
+        static std::atomic<uint64_t> n(1);
+        return n;
+    }
+
+    static thread_cache& local() {
+        static thread_local thread_cache c;
+        return c;
+    }
+
+    /// the cache of the calling thread if it caches for this pool
+    thread_cache* cache() {
+        if (!cached)
+            return nullptr;
+        thread_cache& c = local();
+        if (c.owner == this && c.owner_id == id)
+            return &c;
+        // same address, other id: the pool the cache was made for is gone,
+        // and so are the resources it holds
+        if (c.owner == nullptr || c.owner == this) {
+            c.owner = this;
+            c.owner_id = id;
+            c.count = 0;
+            return &c;
+        }
+        return nullptr;
+    }
+
+    void count_out(size_t n) {
+        size_t now = outstanding.fetch_add(n, std::memory_order_relaxed) + n;
+        size_t seen = peak.load(std::memory_order_relaxed);
+        while (now > seen && !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed))
+            ;
+    }
+
+    // head of the free list: a tag in the upper half, index + 1 of the first
+    // free slot in the lower half, 0 if there is none
+    static uint64_t pack(uint32_t tag, uint32_t slot) { return (uint64_t(tag) << 32) | slot; }
+    static uint32_t tag_of(uint64_t v) { return uint32_t(v >> 32); }
+    static uint32_t slot_of(uint64_t v) { return uint32_t(v); }
+
+    std::atomic<uint32_t>& link(int index) const {
+        return chunks[index / chunk_size].load(std::memory_order_acquire)->next[index % chunk_size];
+    }
+
+    /// take the first free slot off the stack, growing the pool if needed
+    int pop() {
+        for (;;) {
+            uint64_t old = head.load(std::memory_order_acquire);
+            while (slot_of(old) != 0) {
+                int index = slot_of(old) - 1;
+                // if the slot was taken meanwhile, next may be stale, but then
+                // the tag of head has changed and the CAS fails
+                uint32_t next = link(index).load(std::memory_order_relaxed);
+                if (head.compare_exchange_weak(old, pack(tag_of(old) + 1, next),
+                                               std::memory_order_acquire, std::memory_order_acquire))
+                    return index;
+            }
+            if (!grow())
+                return -1;
+        }
+    }
+
+    /// push the chain of free slots first .. last, already linked in between
+    void push(int first, int last) {
+        uint64_t old = head.load(std::memory_order_relaxed);
+        do {
+            link(last).store(slot_of(old), std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(old, pack(tag_of(old) + 1, first + 1),
+                                             std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    const uint64_t id;
+    const size_t chunk_size;
+    create_fn create;
+    destroy_fn destroy;
+    const bool cached;
+    std::atomic<uint64_t> head;
+    std::atomic<chunk*> chunks[MAX_CHUNKS];
+    std::atomic<size_t> chunk_count;
+    std::atomic<size_t> outstanding;
+    std::atomic<size_t> peak;
+    std::mutex grow_mutex;
+};
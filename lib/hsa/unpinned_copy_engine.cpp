@@ -18,7 +18,9 @@ THE SOFTWARE.
 */
 
 #include <cassert>
+#include <algorithm>
 #include <atomic>
+#include <thread>
 #include <hc.hpp>
 #include <hc_am.hpp>
 
@@ -27,6 +29,10 @@ THE SOFTWARE.
 #include "unpinned_copy_engine.h"
 #include "hc_rt_debug.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define THROW_ERROR(err, hsaErr) { hc::print_backtrace(); throw (Kalmar::runtime_exception("HCC unpinned copy engine error", hsaErr)); }
 
 void errorCheck(hsa_status_t hsa_error_code, int line_num, std::string str) {
@@ -81,67 +87,321 @@ static hsa_status_t find_gpu(hsa_agent_t agent, void *data) {
     return HSA_STATUS_SUCCESS;
 }
 
+//-------------------------------------------------------------------------------------------------
+// Stores of a chunk copied into a staging buffer bypass the caches: the DMA engine reads the buffer,
+// not the CPU, and a large copy would otherwise evict the working set of the application.
+static void memcpyNonTemporal(char *dst, const char *src, size_t sizeBytes)
+{
+#if defined(__SSE2__)
+    size_t head = std::min<size_t>((16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15, sizeBytes);
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    sizeBytes -= head;
+
+    for (; sizeBytes >= 64; sizeBytes -= 64, dst += 64, src += 64) {
+        __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst), x0);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), x1);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), x2);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), x3);
+    }
+    memcpy(dst, src, sizeBytes);
+    // streaming stores are weakly ordered; make them visible before the chunk is handed to the DMA engine
+    _mm_sfence();
+#else
+    memcpy(dst, src, sizeBytes);
+#endif
+}
+
+
+//-------------------------------------------------------------------------------------------------
+// Helper threads for the CPU side of staged copies.  A copy is cut into slices; the thread copying
+// runs slices too, so a copy never waits for a helper to wake up before it makes progress.
+class UnpinnedCopyEngine::StagingCopier {
+public:
+    // Slices below this size are not worth handing to another thread.
+    static const size_t _min_slice = 256*1024;
+
+    explicit StagingCopier(int threads) : _stopping(false) {
+        for (int i = 0; i < threads; i++) {
+            _threads.emplace_back(&StagingCopier::workerLoop, this);
+        }
+    }
+
+    ~StagingCopier() {
+        {
+            std::lock_guard<std::mutex> l(_lock);
+            _stopping = true;
+        }
+        _workAvailable.notify_all();
+        for (auto &t : _threads) {
+            t.join();
+        }
+    }
+
+    void copy(char *dst, const char *src, size_t sizeBytes, bool nonTemporal) {
+        size_t slices = std::min<size_t>(_threads.size() + 1, sizeBytes / _min_slice);
+        if (slices <= 1) {
+            copySlice(dst, src, sizeBytes, nonTemporal);
+            return;
+        }
+
+        // slices stay multiples of 64 bytes, so all but the first start on a cache line of dst
+        // whenever dst is aligned
+        Job job {dst, src, sizeBytes, (sizeBytes / slices + 63) & ~size_t(63), slices, nonTemporal, {0}, 0};
+        {
+            std::lock_guard<std::mutex> l(_lock);
+            _jobs.push_back(&job);
+        }
+        _workAvailable.notify_all();
+
+        drain(job);
+
+        std::unique_lock<std::mutex> l(_lock);
+        _jobs.erase(std::find(_jobs.begin(), _jobs.end(), &job));
+        // every slice has been claimed; wait for the helpers still copying theirs
+        _jobReleased.wait(l, [&job] { return job.users == 0; });
+    }
+
+private:
+    struct Job {
+        char *dst;
+        const char *src;
+        size_t sizeBytes;
+        size_t sliceBytes;
+        size_t slices;
+        bool nonTemporal;
+        std::atomic<size_t> next;  // next slice to copy
+        int users;                 // helpers working on the job, guarded by _lock
+    };
+
+    static void copySlice(char *dst, const char *src, size_t sizeBytes, bool nonTemporal) {
+        if (nonTemporal) {
+            memcpyNonTemporal(dst, src, sizeBytes);
+        } else {
+            memcpy(dst, src, sizeBytes);
+        }
+    }
+
+    static void drain(Job &job) {
+        for (size_t i = job.next++; i < job.slices; i = job.next++) {
+            size_t offset = i * job.sliceBytes;
+            if (offset < job.sizeBytes) {
+                copySlice(job.dst + offset, job.src + offset, std::min(job.sliceBytes, job.sizeBytes - offset), job.nonTemporal);
+            }
+        }
+    }
+
+    void workerLoop() {
+        std::unique_lock<std::mutex> l(_lock);
+        while (true) {
+            // jobs stay listed until their owner removes them; skip those with every slice claimed
+            Job *job = nullptr;
+            _workAvailable.wait(l, [this, &job] {
+                for (Job *j : _jobs) {
+                    if (j->next.load(std::memory_order_relaxed) < j->slices) {
+                        job = j;
+                        return true;
+                    }
+                }
+                return _stopping;
+            });
+            if (!job) {
+                return;
+            }
+            job->users++;
+            l.unlock();
+            drain(*job);
+            l.lock();
+            if (--job->users == 0) {
+                _jobReleased.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> _threads;
+    std::vector<Job*> _jobs;
+    bool _stopping;
+    std::mutex _lock;
+    std::condition_variable _workAvailable;
+    std::condition_variable _jobReleased;
+};
+
+
+const int UnpinnedCopyEngine::_max_buffers;
+const int UnpinnedCopyEngine::_max_sets;
+const size_t UnpinnedCopyEngine::_max_chunk;
+const size_t UnpinnedCopyEngine::StagingCopier::_min_slice;
+
 //-------------------------------------------------------------------------------------------------
 UnpinnedCopyEngine::UnpinnedCopyEngine(hsa_agent_t hsaAgent, hsa_agent_t cpuAgent, size_t bufferSize, int numBuffers, 
                                        bool isLargeBar, int thresholdH2DDirectStaging, 
-                                       int thresholdH2DStagingPinInPlace, int thresholdD2H) :
+                                       int thresholdH2DStagingPinInPlace, int thresholdD2H,
+                                       int stagingThreads) :
     _hsaAgent(hsaAgent),
     _cpuAgent(cpuAgent),
     _bufferSize(bufferSize),
     _numBuffers(numBuffers > _max_buffers ? _max_buffers : numBuffers),
     _isLargeBar(isLargeBar),
+    _stagingThreads(stagingThreads),
     _hipH2DTransferThresholdDirectOrStaging(thresholdH2DDirectStaging),
     _hipH2DTransferThresholdStagingOrPininplace(thresholdH2DStagingPinInPlace),
     _hipD2HTransferThreshold(thresholdD2H)
 {
-    hsa_amd_memory_pool_t sys_pool;
-    hsa_status_t err = hsa_amd_agent_iterate_memory_pools(_cpuAgent, findGlobalPool, &sys_pool);
+    hsa_status_t err = hsa_amd_agent_iterate_memory_pools(_cpuAgent, findGlobalPool, &_sysPool);
+    ErrorCheck(err);
 
-    // Generate a packed C-style array of agents, for use below with hsa_amd_agents_allow_access
+    // Agents given access to the staging buffers, for use with hsa_amd_agents_allow_access
     // TODO - should this include the CPU agents as well?
-    std::vector<hsa_agent_t> agents;
-    err = hsa_iterate_agents(&find_gpu, &agents);
+    err = hsa_iterate_agents(&find_gpu, &_gpuAgents);
     ErrorCheck(err);
-    hsa_agent_t * agentBlock = new hsa_agent_t[agents.size()];
-    int i=0;
-    for (auto iter=agents.begin(); iter!= agents.end(); iter++) {
-        agentBlock[i++] = *iter;
-        assert (i<=agents.size());
-    };
 
-    ErrorCheck(err);
-    for (int i=0; i<_numBuffers; i++) {
+    if (_stagingThreads <= 0) {
+        // half of the cores, leaving the others to the application; a few threads already saturate memory bandwidth
+        _stagingThreads = std::min(4u, std::max(1u, std::thread::hardware_concurrency() / 2));
+    }
+
+    // The first staging set is allocated up front, so that small copies never allocate.
+    StagingSet *set = acquireStaging(_bufferSize, _numBuffers);
+    releaseStaging(set);
+};
+
+
+//---
+UnpinnedCopyEngine::~UnpinnedCopyEngine()
+{
+    _copier.reset();
+    for (StagingSet *set : _allSets) {
+        for (int i=0; i<set->numBuffers; i++) {
+            hsa_amd_memory_pool_free(set->buffer[i]);
+        }
+        for (int i=0; i<_max_buffers; i++) {
+            hsa_signal_destroy(set->completionSignal[i]);
+            hsa_signal_destroy(set->completionSignal2[i]);
+        }
+        delete set;
+    }
+}
+
+
+//---
+// Chunks grow with the copy until it fills _max_buffers of them: enough chunks in flight to overlap the
+// CPU and DMA sides, large enough that the per-chunk signal and DMA overheads stay small and that the
+// CPU side of a chunk can be split across the helper threads.
+void UnpinnedCopyEngine::chooseStaging(size_t sizeBytes, size_t *chunkSize, int *numBuffers) const
+{
+    size_t chunk = (sizeBytes / _max_buffers + 0xFFF) & ~size_t(0xFFF);
+    chunk = std::max(_bufferSize, std::min(_max_chunk, chunk));
+    size_t chunks = (sizeBytes + chunk - 1) / chunk;
+
+    *chunkSize = chunk;
+    *numBuffers = static_cast<int>(std::max<size_t>(1, std::min<size_t>(_max_buffers, chunks)));
+}
+
+
+//---
+void UnpinnedCopyEngine::allocateBuffers(StagingSet *set, size_t chunkSize, int numBuffers)
+{
+    // Buffers only grow: a set which served a large copy keeps its buffers for the next one.
+    if (chunkSize > set->bufferSize) {
+        for (int i=0; i<set->numBuffers; i++) {
+            hsa_amd_memory_pool_free(set->buffer[i]);
+        }
+        set->numBuffers = 0;
+        set->bufferSize = chunkSize;
+    }
+
+    for (int i=set->numBuffers; i<numBuffers; i++) {
         // TODO - experiment with alignment here.
-        err = hsa_amd_memory_pool_allocate(sys_pool, _bufferSize, 0, (void**)(&_pinnedStagingBuffer[i]));
+        hsa_status_t err = hsa_amd_memory_pool_allocate(_sysPool, set->bufferSize, 0, (void**)(&set->buffer[i]));
         ErrorCheck(err);
 
-        if ((err != HSA_STATUS_SUCCESS) || (_pinnedStagingBuffer[i] == NULL)) {
+        if ((err != HSA_STATUS_SUCCESS) || (set->buffer[i] == NULL)) {
             THROW_ERROR(hipErrorMemoryAllocation, err);
         }
 
         // Allow access from every agent:
         // This is used in peer-to-peer copies, since we use the buffers to copy from different agents.
         // TODO - may want to review this algorithm for NUMA locality - it might be faster to use staging buffer closer to devices?
-        err = hsa_amd_agents_allow_access(agents.size(), agentBlock, NULL, _pinnedStagingBuffer[i]);
+        err = hsa_amd_agents_allow_access(_gpuAgents.size(), _gpuAgents.data(), NULL, set->buffer[i]);
         ErrorCheck(err);
 
-        hsa_signal_create(0, 0, NULL, &_completionSignal[i]);
-        hsa_signal_create(0, 0, NULL, &_completionSignal2[i]);
+        set->numBuffers = i + 1;
     }
-
-};
+}
 
 
 //---
-UnpinnedCopyEngine::~UnpinnedCopyEngine()
+UnpinnedCopyEngine::StagingSet *UnpinnedCopyEngine::acquireStaging(size_t chunkSize, int numBuffers)
 {
-    for (int i=0; i<_numBuffers; i++) {
-        if (_pinnedStagingBuffer[i]) {
-            hsa_amd_memory_pool_free(_pinnedStagingBuffer[i]);
-            _pinnedStagingBuffer[i] = NULL;
+    StagingSet *set = nullptr;
+    {
+        std::unique_lock<std::mutex> l (_stagingLock);
+        while (_freeSets.empty() && (_allSets.size() >= _max_sets)) {
+            _stagingAvailable.wait(l);
+        }
+        if (!_freeSets.empty()) {
+            // the smallest set which needs no allocation, else the largest one, so that small copies
+            // leave the large sets to large copies
+            auto best = _freeSets.begin();
+            for (auto it = _freeSets.begin(); it != _freeSets.end(); ++it) {
+                StagingSet *x = *it, *y = *best;
+                bool fitsX = (x->bufferSize >= chunkSize) && (x->numBuffers >= numBuffers);
+                bool fitsY = (y->bufferSize >= chunkSize) && (y->numBuffers >= numBuffers);
+                size_t sizeX = x->bufferSize * x->numBuffers, sizeY = y->bufferSize * y->numBuffers;
+                if ((fitsX && !fitsY) || ((fitsX == fitsY) && (fitsX ? (sizeX < sizeY) : (sizeX > sizeY)))) {
+                    best = it;
+                }
+            }
+            set = *best;
+            _freeSets.erase(best);
+        } else {
+            set = new StagingSet();
+            set->numBuffers = 0;
+            set->bufferSize = chunkSize;
+            for (int i=0; i<_max_buffers; i++) {
+                hsa_signal_create(0, 0, NULL, &set->completionSignal[i]);
+                hsa_signal_create(0, 0, NULL, &set->completionSignal2[i]);
+            }
+            _allSets.push_back(set);
         }
-        hsa_signal_destroy(_completionSignal[i]);
-        hsa_signal_destroy(_completionSignal2[i]);
+    }
+
+    // the copy owns the set now, allocations do not hold up other copies
+    try {
+        allocateBuffers(set, chunkSize, numBuffers);
+    } catch (...) {
+        releaseStaging(set);
+        throw;
+    }
+    return set;
+}
+
+
+void UnpinnedCopyEngine::releaseStaging(StagingSet *set)
+{
+    {
+        std::lock_guard<std::mutex> l (_stagingLock);
+        _freeSets.push_back(set);
+    }
+    _stagingAvailable.notify_one();
+}
+
+
+//---
+void UnpinnedCopyEngine::stagingMemcpy(void *dst, const void *src, size_t sizeBytes, bool nonTemporal)
+{
+    if ((_stagingThreads > 1) && (sizeBytes >= 2 * StagingCopier::_min_slice)) {
+        std::call_once(_copierOnce, [this] { _copier.reset(new StagingCopier(_stagingThreads - 1)); });
+        _copier->copy(static_cast<char*>(dst), static_cast<const char*>(src), sizeBytes, nonTemporal);
+    } else if (nonTemporal) {
+        memcpyNonTemporal(static_cast<char*>(dst), static_cast<const char*>(src), sizeBytes);
+    } else {
+        memcpy(dst, src, sizeBytes);
     }
 }
 
@@ -154,14 +414,14 @@ UnpinnedCopyEngine::~UnpinnedCopyEngine()
 //IN: waitFor - hsaSignal to wait for - the copy will begin only when the specified dependency is resolved.  May be NULL indicating no dependency.
 void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src, size_t sizeBytes, hsa_signal_t *waitFor)
 {
-    std::lock_guard<std::mutex> l (_copyLock);
+    // only the signals of the set are used, the copy pins src instead of staging it
+    StagingHold hold(this, _bufferSize, 0);
+    hsa_signal_t *completionSignal = hold.set->completionSignal;
 
     const char *srcp = static_cast<const char*> (src);
     char *dstp = static_cast<char*> (dst);
 
-    for (int i=0; i<_numBuffers; i++) {
-        hsa_signal_store_relaxed(_completionSignal[i], 0);
-    }
+    hsa_signal_store_relaxed(completionSignal[0], 0);
 
     if (sizeBytes >= UINT64_MAX/2) {
         THROW_ERROR (hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
@@ -169,8 +429,8 @@ void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src,
     int bufferIndex = 0;
 
     size_t theseBytes= sizeBytes;
-    //tprintf (DB_COPY2, "H2D: waiting... on completion signal handle=%lu\n", _completionSignal[bufferIndex].handle);
-    //hsa_signal_wait_acquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+    //tprintf (DB_COPY2, "H2D: waiting... on completion signal handle=%lu\n", completionSignal[bufferIndex].handle);
+    //hsa_signal_wait_acquire(completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
     //void * masked_srcp = (void*) ((uintptr_t)srcp & (uintptr_t)(~0x3f)) ; // TODO
     void *locked_srcp;
@@ -183,16 +443,16 @@ void UnpinnedCopyEngine::CopyHostToDevicePinInPlace(void* dst, const void* src,
         THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
     }
 
-    hsa_signal_store_relaxed(_completionSignal[bufferIndex], 1);
+    hsa_signal_store_relaxed(completionSignal[bufferIndex], 1);
 
-    hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, locked_srcp, _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, _completionSignal[bufferIndex]);
+    hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, locked_srcp, _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, completionSignal[bufferIndex]);
     //tprintf (DB_COPY2, "H2D: bytesRemaining=%zu: async_copy %zu bytes %p to %p status=%x\n", bytesRemaining, theseBytes, _pinnedStagingBuffer[bufferIndex], dstp, hsa_status);
 
     if (hsa_status != HSA_STATUS_SUCCESS) {
         THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
     }
-    DBOUTL (DB_COPY2, "H2D: waiting... on completion signal handle=" << _completionSignal[bufferIndex].handle);
-    hsa_signal_wait_acquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+    DBOUTL (DB_COPY2, "H2D: waiting... on completion signal handle=" << completionSignal[bufferIndex].handle);
+    hsa_signal_wait_acquire(completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
     hsa_amd_memory_unlock(const_cast<char*> (srcp));
     // Assume subsequent commands are dependent on previous and don't need dependency after first copy submitted, HIP_ONESHOT_COPY_DEP=1
     waitFor = NULL;
@@ -262,69 +522,72 @@ void UnpinnedCopyEngine::CopyHostToDevice(UnpinnedCopyEngine::CopyMode copyMode,
 //IN: waitFor - hsaSignal to wait for - the copy will begin only when the specified dependency is resolved.  May be NULL indicating no dependency.
 void UnpinnedCopyEngine::CopyHostToDeviceStaging(void* dst, const void* src, size_t sizeBytes, hsa_signal_t *waitFor)
 {
-	{
-        std::lock_guard<std::mutex> l (_copyLock);
+    if (sizeBytes >= UINT64_MAX/2) {
+        THROW_ERROR (hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
+    }
 
-        const char *srcp = static_cast<const char*> (src);
-        char *dstp = static_cast<char*> (dst);
+    size_t chunkSize;
+    int numBuffers;
+    chooseStaging(sizeBytes, &chunkSize, &numBuffers);
+    StagingHold hold(this, chunkSize, numBuffers);
+    StagingSet *set = hold.set;
 
-        for (int i=0; i<_numBuffers; i++) {
-            hsa_signal_store_relaxed(_completionSignal[i], 0);
-        }
+    const char *srcp = static_cast<const char*> (src);
+    char *dstp = static_cast<char*> (dst);
 
-        if (sizeBytes >= UINT64_MAX/2) {
-            THROW_ERROR (hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
-        }
-        int bufferIndex = 0;
-        for (int64_t bytesRemaining=sizeBytes; bytesRemaining>0 ;  bytesRemaining -= _bufferSize) {
+    for (int i=0; i<numBuffers; i++) {
+        hsa_signal_store_relaxed(set->completionSignal[i], 0);
+    }
 
-            size_t theseBytes = (bytesRemaining > _bufferSize) ? _bufferSize : bytesRemaining;
+    int bufferIndex = 0;
+    for (size_t bytesRemaining=sizeBytes; bytesRemaining>0; bytesRemaining -= std::min(bytesRemaining, chunkSize)) {
 
-            DBOUTL (DB_COPY2,  "H2D: waiting... on completion signal handle=" << _completionSignal[bufferIndex].handle);
-            hsa_signal_wait_acquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+        size_t theseBytes = std::min(bytesRemaining, chunkSize);
 
-            DBOUTL (DB_COPY2, "H2D: bytesRemaining=" << bytesRemaining << ": copy " << theseBytes << " bytes " 
-                    << static_cast<const void*>(srcp) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(_pinnedStagingBuffer[bufferIndex])); 
-            // TODO - use uncached memcpy, someday.
-            memcpy(_pinnedStagingBuffer[bufferIndex], srcp, theseBytes);
+        DBOUTL (DB_COPY2,  "H2D: waiting... on completion signal handle=" << set->completionSignal[bufferIndex].handle);
+        hsa_signal_wait_acquire(set->completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
+        DBOUTL (DB_COPY2, "H2D: bytesRemaining=" << bytesRemaining << ": copy " << theseBytes << " bytes " 
+                << static_cast<const void*>(srcp) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(set->buffer[bufferIndex])); 
+        // Only the DMA engine reads the staging buffer: stream the chunk past the caches.
+        stagingMemcpy(set->buffer[bufferIndex], srcp, theseBytes, true);
 
-            hsa_signal_store_relaxed(_completionSignal[bufferIndex], 1);
-            hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, _pinnedStagingBuffer[bufferIndex], _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, _completionSignal[bufferIndex]);
-            DBOUTL (DB_COPY2, "H2D: bytesRemaining=" << bytesRemaining << ": async_copy " << theseBytes << " bytes " 
-                    << static_cast<void*>(_pinnedStagingBuffer[bufferIndex]) << " to " << static_cast<void*>(dstp) << " status=" << hsa_status);
-            if (hsa_status != HSA_STATUS_SUCCESS) {
-                THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
-            }
 
-            srcp += theseBytes;
-            dstp += theseBytes;
-            if (++bufferIndex >= _numBuffers) {
-                bufferIndex = 0;
-            }
+        hsa_signal_store_relaxed(set->completionSignal[bufferIndex], 1);
+        hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp, _hsaAgent, set->buffer[bufferIndex], _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, set->completionSignal[bufferIndex]);
+        DBOUTL (DB_COPY2, "H2D: bytesRemaining=" << bytesRemaining << ": async_copy " << theseBytes << " bytes " 
+                << static_cast<void*>(set->buffer[bufferIndex]) << " to " << static_cast<void*>(dstp) << " status=" << hsa_status);
+        if (hsa_status != HSA_STATUS_SUCCESS) {
+            THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
+        }
 
-            // Assume subsequent commands are dependent on previous and don't need dependency after first copy submitted, HIP_ONESHOT_COPY_DEP=1
-            waitFor = NULL;
+        srcp += theseBytes;
+        dstp += theseBytes;
+        if (++bufferIndex >= numBuffers) {
+            bufferIndex = 0;
         }
 
+        // Assume subsequent commands are dependent on previous and don't need dependency after first copy submitted, HIP_ONESHOT_COPY_DEP=1
+        waitFor = NULL;
+    }
+
 
-        for (int i=0; i<_numBuffers; i++) {
-            hsa_signal_wait_acquire(_completionSignal[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
-        }
-	}
+    for (int i=0; i<numBuffers; i++) {
+        hsa_signal_wait_acquire(set->completionSignal[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+    }
 }
 
 
 void UnpinnedCopyEngine::CopyDeviceToHostPinInPlace(void* dst, const void* src, size_t sizeBytes, hsa_signal_t *waitFor)
 {
-    std::lock_guard<std::mutex> l (_copyLock);
+    // only the signals of the set are used, the copy pins dst instead of staging it
+    StagingHold hold(this, _bufferSize, 0);
+    hsa_signal_t *completionSignal = hold.set->completionSignal;
 
     const char *srcp = static_cast<const char*> (src);
     char *dstp = static_cast<char*> (dst);
 
-    for (int i=0; i<_numBuffers; i++) {
-        hsa_signal_store_relaxed(_completionSignal[i], 0);
-    }
+    hsa_signal_store_relaxed(completionSignal[0], 0);
 
     if (sizeBytes >= UINT64_MAX/2) {
         THROW_ERROR (hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
@@ -340,15 +603,15 @@ void UnpinnedCopyEngine::CopyDeviceToHostPinInPlace(void* dst, const void* src,
         THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
     }
 
-    hsa_signal_store_relaxed(_completionSignal[bufferIndex], 1);
+    hsa_signal_store_relaxed(completionSignal[bufferIndex], 1);
 
-    hsa_status = hsa_amd_memory_async_copy(locked_destp,_hsaAgent , srcp, _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, _completionSignal[bufferIndex]);
+    hsa_status = hsa_amd_memory_async_copy(locked_destp,_hsaAgent , srcp, _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, completionSignal[bufferIndex]);
 
     if (hsa_status != HSA_STATUS_SUCCESS) {
         THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
     }
-    DBOUTL (DB_COPY2, "D2H: waiting... on completion signal handle=\n" << _completionSignal[bufferIndex].handle);
-    hsa_signal_wait_acquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+    DBOUTL (DB_COPY2, "D2H: waiting... on completion signal handle=\n" << completionSignal[bufferIndex].handle);
+    hsa_signal_wait_acquire(completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
     hsa_amd_memory_unlock(const_cast<char*> (dstp));
 
     // Assume subsequent commands are dependent on previous and don't need dependency after first copy submitted, HIP_ONESHOT_COPY_DEP=1
@@ -384,60 +647,64 @@ void UnpinnedCopyEngine::CopyDeviceToHost(CopyMode copyMode ,void* dst, const vo
 //IN: waitFor - hsaSignal to wait for - the copy will begin only when the specified dependency is resolved.  May be NULL indicating no dependency.
 void UnpinnedCopyEngine::CopyDeviceToHostStaging(void* dst, const void* src, size_t sizeBytes, hsa_signal_t *waitFor)
 {
-    {
-        std::lock_guard<std::mutex> l (_copyLock);
-
-        const char *srcp0 = static_cast<const char*> (src);
-        char *dstp1 = static_cast<char*> (dst);
+    if (sizeBytes >= UINT64_MAX/2) {
+        THROW_ERROR (hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
+    }
 
-        for (int i=0; i<_numBuffers; i++) {
-            hsa_signal_store_relaxed(_completionSignal[i], 0);
-        }
+    size_t chunkSize;
+    int numBuffers;
+    chooseStaging(sizeBytes, &chunkSize, &numBuffers);
+    StagingHold hold(this, chunkSize, numBuffers);
+    StagingSet *set = hold.set;
 
-        if (sizeBytes >= UINT64_MAX/2) {
-            THROW_ERROR (hipErrorInvalidValue, HSA_STATUS_ERROR_INVALID_ARGUMENT);
-        }
-
-        int64_t bytesRemaining0 = sizeBytes; // bytes to copy from dest into staging buffer.
-        int64_t bytesRemaining1 = sizeBytes; // bytes to copy from staging buffer into final dest
+    const char *srcp0 = static_cast<const char*> (src);
+    char *dstp1 = static_cast<char*> (dst);
 
-        while (bytesRemaining1 > 0)
-        {
-            // First launch the async copies to copy from dest to host
-            for (int bufferIndex = 0; (bytesRemaining0>0) && (bufferIndex < _numBuffers);  bytesRemaining0 -= _bufferSize, bufferIndex++) {
+    for (int i=0; i<numBuffers; i++) {
+        hsa_signal_store_relaxed(set->completionSignal[i], 0);
+    }
 
-                size_t theseBytes = (bytesRemaining0 > _bufferSize) ? _bufferSize : bytesRemaining0;
+    size_t bytesIssued = 0;   // bytes whose copy from src into a staging buffer has been launched
+    size_t bytesDrained = 0;  // bytes copied from the staging buffers into dst
 
-                DBOUTL (DB_COPY2, "D2H: bytesRemaining0=" << bytesRemaining0 << ": copy " << theseBytes << " bytes " 
-                        << static_cast<const void*>(srcp0) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(_pinnedStagingBuffer[bufferIndex])); 
-                hsa_signal_store_relaxed(_completionSignal[bufferIndex], 1);
-                hsa_status_t hsa_status = hsa_amd_memory_async_copy(_pinnedStagingBuffer[bufferIndex], _hsaAgent, srcp0, _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, _completionSignal[bufferIndex]);
-                if (hsa_status != HSA_STATUS_SUCCESS) {
-                    THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
-                }
+    // Chunk k goes through buffer k % numBuffers; a buffer is refilled as soon as it has been unloaded,
+    // so the DMA engine fills the next chunks while the CPU unloads this one.
+    auto launch = [&] (int bufferIndex) {
+        size_t theseBytes = std::min(sizeBytes - bytesIssued, chunkSize);
 
-                srcp0 += theseBytes;
+        DBOUTL (DB_COPY2, "D2H: bytesRemaining0=" << (sizeBytes - bytesIssued) << ": copy " << theseBytes << " bytes " 
+                << static_cast<const void*>(srcp0 + bytesIssued) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(set->buffer[bufferIndex])); 
+        hsa_signal_store_relaxed(set->completionSignal[bufferIndex], 1);
+        hsa_status_t hsa_status = hsa_amd_memory_async_copy(set->buffer[bufferIndex], _hsaAgent, srcp0 + bytesIssued, _hsaAgent, theseBytes, waitFor ? 1:0, waitFor, set->completionSignal[bufferIndex]);
+        if (hsa_status != HSA_STATUS_SUCCESS) {
+            THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
+        }
+        bytesIssued += theseBytes;
 
+        // Assume subsequent commands are dependent on previous and don't need dependency after first copy submitted, HIP_ONESHOT_COPY_DEP=1
+        waitFor = NULL;
+    };
 
-                // Assume subsequent commands are dependent on previous and don't need dependency after first copy submitted, HIP_ONESHOT_COPY_DEP=1
-                waitFor = NULL;
-            }
+    for (int bufferIndex = 0; (bytesIssued < sizeBytes) && (bufferIndex < numBuffers); bufferIndex++) {
+        launch(bufferIndex);
+    }
 
-            // Now unload the staging buffers:
-            for (int bufferIndex=0; (bytesRemaining1>0) && (bufferIndex < _numBuffers);  bytesRemaining1 -= _bufferSize, bufferIndex++) {
+    for (int bufferIndex = 0; bytesDrained < sizeBytes; bufferIndex = (bufferIndex + 1) % numBuffers) {
 
-                size_t theseBytes = (bytesRemaining1 > _bufferSize) ? _bufferSize : bytesRemaining1;
+        size_t theseBytes = std::min(sizeBytes - bytesDrained, chunkSize);
 
-                DBOUTL (DB_COPY2, "D2H: wait_completion[" << bufferIndex << "] bytesRemaining=" << bytesRemaining1);
-                hsa_signal_wait_acquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+        DBOUTL (DB_COPY2, "D2H: wait_completion[" << bufferIndex << "] bytesRemaining=" << (sizeBytes - bytesDrained));
+        hsa_signal_wait_acquire(set->completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
-                DBOUTL (DB_COPY2, "D2H: bytesRemaining1=" << bytesRemaining1 << ": copy " << theseBytes << " bytes " 
-                        << " stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(_pinnedStagingBuffer[bufferIndex]) << " to dst " << static_cast<void*>(dstp1)); 
-                memcpy(dstp1, _pinnedStagingBuffer[bufferIndex], theseBytes);
+        DBOUTL (DB_COPY2, "D2H: bytesRemaining1=" << (sizeBytes - bytesDrained) << ": copy " << theseBytes << " bytes " 
+                << " stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(set->buffer[bufferIndex]) << " to dst " << static_cast<void*>(dstp1 + bytesDrained)); 
+        // dst is likely read by the CPU next, keep it in the caches
+        stagingMemcpy(dstp1 + bytesDrained, set->buffer[bufferIndex], theseBytes, false);
+        bytesDrained += theseBytes;
 
-                dstp1 += theseBytes;
-            }
-		}
+        if (bytesIssued < sizeBytes) {
+            launch(bufferIndex);
+        }
     }
 }
 
@@ -449,14 +716,18 @@ void UnpinnedCopyEngine::CopyDeviceToHostStaging(void* dst, const void* src, siz
 //IN: waitFor - hsaSignal to wait for - the copy will begin only when the specified dependency is resolved.  May be NULL indicating no dependency.
 void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const void* src, hsa_agent_t srcAgent, size_t sizeBytes, hsa_signal_t *waitFor)
 {
-    std::lock_guard<std::mutex> l (_copyLock);
+    size_t chunkSize;
+    int numBuffers;
+    chooseStaging(sizeBytes, &chunkSize, &numBuffers);
+    StagingHold hold(this, chunkSize, numBuffers);
+    StagingSet *set = hold.set;
 
     const char *srcp0 = static_cast<const char*> (src);
     char *dstp1 = static_cast<char*> (dst);
 
-    for (int i=0; i<_numBuffers; i++) {
-        hsa_signal_store_relaxed(_completionSignal[i], 0);
-        hsa_signal_store_relaxed(_completionSignal2[i], 0);
+    for (int i=0; i<numBuffers; i++) {
+        hsa_signal_store_relaxed(set->completionSignal[i], 0);
+        hsa_signal_store_relaxed(set->completionSignal2[i], 0);
     }
 
     if (sizeBytes >= UINT64_MAX/2) {
@@ -470,18 +741,18 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
 
     while (bytesRemaining1 > 0) {
         // First launch the async copies to copy from dest to host
-        for (int bufferIndex = 0; (bytesRemaining0>0) && (bufferIndex < _numBuffers);  bytesRemaining0 -= _bufferSize, bufferIndex++) {
+        for (int bufferIndex = 0; (bytesRemaining0>0) && (bufferIndex < numBuffers);  bytesRemaining0 -= chunkSize, bufferIndex++) {
 
-            size_t theseBytes = (bytesRemaining0 > _bufferSize) ? _bufferSize : bytesRemaining0;
+            size_t theseBytes = (bytesRemaining0 > chunkSize) ? chunkSize : bytesRemaining0;
 
             // Wait to make sure we are not overwriting a buffer before it has been drained:
-            hsa_signal_wait_acquire(_completionSignal2[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+            hsa_signal_wait_acquire(set->completionSignal2[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
 
             DBOUTL (DB_COPY2, "P2P: bytesRemaining0=" << bytesRemaining0 << ": async_copy " << theseBytes << " bytes " 
-                    << static_cast<const void*>(srcp0) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(_pinnedStagingBuffer[bufferIndex])); 
-            hsa_signal_store_relaxed(_completionSignal[bufferIndex], 1);
+                    << static_cast<const void*>(srcp0) << " to stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(set->buffer[bufferIndex])); 
+            hsa_signal_store_relaxed(set->completionSignal[bufferIndex], 1);
             // Select CPU-agent here to ensure Runtime picks the H2D blit kernel.  Makes a 5X-10X difference in performance.
-            hsa_status_t hsa_status = hsa_amd_memory_async_copy(_pinnedStagingBuffer[bufferIndex], _cpuAgent, srcp0, srcAgent, theseBytes, waitFor ? 1:0, waitFor, _completionSignal[bufferIndex]);
+            hsa_status_t hsa_status = hsa_amd_memory_async_copy(set->buffer[bufferIndex], _cpuAgent, srcp0, srcAgent, theseBytes, waitFor ? 1:0, waitFor, set->completionSignal[bufferIndex]);
             if (hsa_status != HSA_STATUS_SUCCESS) {
                 THROW_ERROR (hipErrorRuntimeMemory, hsa_status);
             }
@@ -494,9 +765,9 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
         }
 
         // Now unload the staging buffers:
-        for (int bufferIndex=0; (bytesRemaining1>0) && (bufferIndex < _numBuffers);  bytesRemaining1 -= _bufferSize, bufferIndex++) {
+        for (int bufferIndex=0; (bytesRemaining1>0) && (bufferIndex < numBuffers);  bytesRemaining1 -= chunkSize, bufferIndex++) {
 
-            size_t theseBytes = (bytesRemaining1 > _bufferSize) ? _bufferSize : bytesRemaining1;
+            size_t theseBytes = (bytesRemaining1 > chunkSize) ? chunkSize : bytesRemaining1;
 
             DBOUTL (DB_COPY2, "P2P: wait_completion[" << bufferIndex << "] bytesRemaining=" << bytesRemaining1);
 
@@ -504,16 +775,16 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
 
             if (hostWait) {
                 // Host-side wait, should not be necessary:
-                hsa_signal_wait_acquire(_completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+                hsa_signal_wait_acquire(set->completionSignal[bufferIndex], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
             }
 
             DBOUTL (DB_COPY2, "P2P: bytesRemaining1=" << bytesRemaining1 << ": copy " << theseBytes << " bytes " 
-                    << " stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(_pinnedStagingBuffer[bufferIndex]) << " to dst " << static_cast<void*>(dstp1)); 
-            hsa_signal_store_relaxed(_completionSignal2[bufferIndex], 1);
+                    << " stagingBuf[" << bufferIndex << "]:" << static_cast<void*>(set->buffer[bufferIndex]) << " to dst " << static_cast<void*>(dstp1)); 
+            hsa_signal_store_relaxed(set->completionSignal2[bufferIndex], 1);
             // Select CPU-agent here to ensure Runtime picks the H2D blit kernel.  Makes a 5X-10X difference in performance.
-            hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp1, dstAgent, _pinnedStagingBuffer[bufferIndex], _cpuAgent, theseBytes,
-                                      hostWait ? 0:1, hostWait ? NULL : &_completionSignal[bufferIndex],
-                                      _completionSignal2[bufferIndex]);
+            hsa_status_t hsa_status = hsa_amd_memory_async_copy(dstp1, dstAgent, set->buffer[bufferIndex], _cpuAgent, theseBytes,
+                                      hostWait ? 0:1, hostWait ? NULL : &set->completionSignal[bufferIndex],
+                                      set->completionSignal2[bufferIndex]);
 
             dstp1 += theseBytes;
         }
@@ -521,7 +792,7 @@ void UnpinnedCopyEngine::CopyPeerToPeer(void* dst, hsa_agent_t dstAgent, const v
 
 
     // Wait for the staging-buffer to dest copies to complete:
-    for (int i=0; i<_numBuffers; i++) {
-        hsa_signal_wait_acquire(_completionSignal2[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
+    for (int i=0; i<numBuffers; i++) {
+        hsa_signal_wait_acquire(set->completionSignal2[i], HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_ACTIVE);
     }
 }
@@ -22,6 +22,12 @@ THE SOFTWARE.
 #define STAGING_BUFFER_H
 
 #include "hsa/hsa.h"
+#include "hsa/hsa_ext_amd.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 
 //-------------------------------------------------------------------------------------------------
@@ -31,20 +37,26 @@ THE SOFTWARE.
 // uses the CPU to copy to a pinned "staging buffer", and then use the GPU DMA engine to copy
 // from the staging buffer to the final destination.  The copy is broken into buffer-sized chunks
 // to limit the size of the buffer and also to provide better performance by overlapping the CPU copies
-// with the DMA copies.
+// with the DMA copies.  The chunk size and the number of buffers grow with the size of the copy,
+// and the CPU side of each chunk is split across a few helper threads.
 //
 // PinInPlace is another algorithm which pins the host memory "in-place", and copies it with the DMA
 // engine.  This routine is under development.
 //
-// Staging buffer provides thread-safe access via a mutex.
+// Staging buffer provides thread-safe access: each copy in flight holds a staging set of its own, so
+// copies from several threads only contend when all _max_sets sets are busy.
 struct UnpinnedCopyEngine {
 
     enum CopyMode {ChooseBest=0, UsePinInPlace=1, UseStaging=2, UseMemcpy=3} ; 
 
     static const int _max_buffers = 4;
+    static const int _max_sets = 4;
+    // Largest chunk staged at once; bounds a staging set to _max_buffers * _max_chunk bytes.
+    static const size_t _max_chunk = 4*1024*1024;
 
     UnpinnedCopyEngine(hsa_agent_t hsaAgent,hsa_agent_t cpuAgent, size_t bufferSize, int numBuffers, 
-                       bool isLargeBar, int thresholdH2D_directStaging, int thresholdH2D_stagingPinInPlace, int thresholdD2H) ;
+                       bool isLargeBar, int thresholdH2D_directStaging, int thresholdH2D_stagingPinInPlace, int thresholdD2H,
+                       int stagingThreads = 0) ;
     ~UnpinnedCopyEngine();
 
     // Use hueristic to choose best copy algorithm 
@@ -68,6 +80,40 @@ struct UnpinnedCopyEngine {
 
 
 private:
+    // Staging buffers and their completion signals, held by one copy at a time.
+    struct StagingSet {
+        int             numBuffers;   // buffers allocated, <= _max_buffers
+        size_t          bufferSize;   // size of each of them
+        char            *buffer[_max_buffers];
+        hsa_signal_t     completionSignal[_max_buffers];
+        hsa_signal_t     completionSignal2[_max_buffers]; // P2P needs another set of signals.
+    };
+
+    // Holds a staging set for the duration of a copy.
+    struct StagingHold {
+        UnpinnedCopyEngine  *engine;
+        StagingSet          *set;
+
+        StagingHold(UnpinnedCopyEngine *e, size_t chunkSize, int numBuffers) :
+            engine(e), set(e->acquireStaging(chunkSize, numBuffers)) {}
+        ~StagingHold() { engine->releaseStaging(set); }
+        StagingHold(const StagingHold&) = delete;
+        StagingHold& operator=(const StagingHold&) = delete;
+    };
+
+    class StagingCopier;
+
+    // Chunk size and number of buffers to stage a copy of sizeBytes through.
+    void chooseStaging(size_t sizeBytes, size_t *chunkSize, int *numBuffers) const;
+
+    // Take a free staging set with at least numBuffers buffers of chunkSize bytes, waiting if all are busy.
+    StagingSet *acquireStaging(size_t chunkSize, int numBuffers);
+    void releaseStaging(StagingSet *set);
+    void allocateBuffers(StagingSet *set, size_t chunkSize, int numBuffers);
+
+    // CPU copy of a chunk into (nonTemporal) or out of a staging buffer.
+    void stagingMemcpy(void *dst, const void *src, size_t sizeBytes, bool nonTemporal);
+
     hsa_agent_t     _hsaAgent;
     hsa_agent_t     _cpuAgent;
     size_t          _bufferSize;  // Size of the buffers.
@@ -76,10 +122,18 @@ private:
     // True if system supports large-bar and thus can benefit from CPU directly performing copy operation.
     bool            _isLargeBar;
 
-    char            *_pinnedStagingBuffer[_max_buffers];
-    hsa_signal_t     _completionSignal[_max_buffers];
-    hsa_signal_t     _completionSignal2[_max_buffers]; // P2P needs another set of signals.
-    std::mutex       _copyLock;    // provide thread-safe access
+    hsa_amd_memory_pool_t     _sysPool;
+    std::vector<hsa_agent_t>  _gpuAgents;  // agents given access to the staging buffers
+
+    std::mutex                _stagingLock;  // guards the two lists below
+    std::condition_variable   _stagingAvailable;
+    std::vector<StagingSet*>  _allSets;
+    std::vector<StagingSet*>  _freeSets;
+
+    int                       _stagingThreads;
+    std::once_flag            _copierOnce;
+    std::unique_ptr<StagingCopier> _copier;  // started on the first copy that can use it
+
     size_t              _hipH2DTransferThresholdDirectOrStaging;
     size_t              _hipH2DTransferThresholdStagingOrPininplace;
     size_t              _hipD2HTransferThreshold;
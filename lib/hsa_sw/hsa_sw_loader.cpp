@@ -0,0 +1,410 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Software HSA runtime: ISA, code objects and executables. Code objects are
+// not looked into; the kernel symbols of an executable are the host kernels
+// registered with hsa_sw_register_kernel().
+
+#include <cstring>
+
+#include <hsa/hsa.h>
+
+#include "hsa_sw_runtime.h"
+
+namespace hsa_sw {
+
+static const char ISA_PREFIX[] = "AMD:AMDGPU:";
+
+const char* isaName() {
+    return "AMD:AMDGPU:8:0:3";
+}
+
+/// the single ISA every AMDGPU ISA name resolves to
+static int theIsa;
+
+static std::mutex kernelsLock;
+static std::map<std::string, std::unique_ptr<Kernel>> registry;
+
+Kernel* findKernel(const std::string& name) {
+    std::lock_guard<std::mutex> l(kernelsLock);
+    auto it = registry.find(name);
+    return (it == registry.end()) ? nullptr : it->second.get();
+}
+
+std::vector<Kernel*> kernels() {
+    std::lock_guard<std::mutex> l(kernelsLock);
+    std::vector<Kernel*> all;
+    for (auto& k : registry) {
+        all.push_back(k.second.get());
+    }
+    return all;
+}
+
+struct Symbol {
+    hsa_symbol_kind_t kind;
+    std::string name;
+    Agent* agent;
+    /// the kernel of a kernel symbol
+    Kernel* kernel;
+    /// the address of a variable symbol
+    void* address;
+
+    static Symbol* of(hsa_executable_symbol_t s) { return reinterpret_cast<Symbol*>(s.handle); }
+    hsa_executable_symbol_t handle() { return hsa_executable_symbol_t{reinterpret_cast<uint64_t>(this)}; }
+};
+
+struct Executable {
+    hsa_executable_state_t state;
+    Agent* agent;
+    std::mutex lock;
+    /// the symbols handed out so far, by name
+    std::map<std::string, std::unique_ptr<Symbol>> symbols;
+
+    explicit Executable(hsa_executable_state_t state) : state(state), agent(nullptr) {}
+
+    static Executable* of(hsa_executable_t e) { return reinterpret_cast<Executable*>(e.handle); }
+    hsa_executable_t handle() { return hsa_executable_t{reinterpret_cast<uint64_t>(this)}; }
+
+    /// the symbol called name: a variable defined in the executable or a
+    /// registered kernel; nullptr if there is none
+    Symbol* find(const std::string& name) {
+        std::lock_guard<std::mutex> l(lock);
+        auto it = symbols.find(name);
+        if (it != symbols.end()) {
+            return it->second.get();
+        }
+        Kernel* kernel = findKernel(name);
+        if (!kernel) {
+            return nullptr;
+        }
+        Symbol* s = new Symbol{HSA_SYMBOL_KIND_KERNEL, name, agent, kernel, nullptr};
+        symbols[name].reset(s);
+        return s;
+    }
+};
+
+/// code objects and their readers only record that they were loaded
+struct CodeObject {
+    static CodeObject* of(uint64_t handle) { return reinterpret_cast<CodeObject*>(handle); }
+    uint64_t handle() { return reinterpret_cast<uint64_t>(this); }
+};
+
+} // namespace hsa_sw
+
+using namespace hsa_sw;
+
+template <typename T>
+static hsa_status_t put(void* value, T v) {
+    *static_cast<T*>(value) = v;
+    return HSA_STATUS_SUCCESS;
+}
+
+extern "C" {
+
+int hsa_sw_register_kernel(const char* name, hsa_sw_kernel_entry_t entry,
+                           uint32_t kernarg_segment_size, uint32_t kernarg_segment_alignment,
+                           uint32_t group_segment_size) {
+    if (!name || !entry) {
+        return 1;
+    }
+    std::lock_guard<std::mutex> l(kernelsLock);
+    std::unique_ptr<Kernel>& k = registry[name];
+    if (k) {
+        return (k->entry == entry) ? 0 : 1;
+    }
+    k.reset(new Kernel{name, entry, kernarg_segment_size, kernarg_segment_alignment, group_segment_size});
+    return 0;
+}
+
+// ISA
+
+hsa_status_t hsa_isa_from_name(const char* name, hsa_isa_t* isa) {
+    if (!name || !isa) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    if (strncmp(name, ISA_PREFIX, sizeof(ISA_PREFIX) - 1) != 0) {
+        return HSA_STATUS_ERROR_INVALID_ISA_NAME;
+    }
+    isa->handle = reinterpret_cast<uint64_t>(&theIsa);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_isa_get_info_alt(hsa_isa_t isa, hsa_isa_info_t attribute, void* value) {
+    if (isa.handle != reinterpret_cast<uint64_t>(&theIsa)) {
+        return HSA_STATUS_ERROR_INVALID_ISA;
+    }
+    if (!value) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    switch (attribute) {
+    case HSA_ISA_INFO_NAME_LENGTH: return put<uint32_t>(value, strlen(isaName()));
+    case HSA_ISA_INFO_NAME: memcpy(value, isaName(), strlen(isaName())); return HSA_STATUS_SUCCESS;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_isa_get_info(hsa_isa_t isa, hsa_isa_info_t attribute, uint32_t index, void* value) {
+    if (index != 0) {
+        return HSA_STATUS_ERROR_INVALID_INDEX;
+    }
+    return hsa_isa_get_info_alt(isa, attribute, value);
+}
+
+hsa_status_t hsa_isa_compatible(hsa_isa_t code_object_isa, hsa_isa_t agent_isa, bool* result) {
+    if (!result) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    if (code_object_isa.handle != reinterpret_cast<uint64_t>(&theIsa) ||
+        agent_isa.handle != reinterpret_cast<uint64_t>(&theIsa)) {
+        return HSA_STATUS_ERROR_INVALID_ISA;
+    }
+    *result = true;
+    return HSA_STATUS_SUCCESS;
+}
+
+// Code objects
+
+hsa_status_t hsa_code_object_deserialize(void* serialized_code_object, size_t serialized_code_object_size,
+                                         const char* options, hsa_code_object_t* code_object) {
+    if (!serialized_code_object || serialized_code_object_size == 0 || !code_object) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    code_object->handle = (new CodeObject)->handle();
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_code_object_destroy(hsa_code_object_t code_object) {
+    if (!code_object.handle) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+    }
+    delete CodeObject::of(code_object.handle);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_code_object_get_info(hsa_code_object_t code_object, hsa_code_object_info_t attribute, void* value) {
+    if (!code_object.handle) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+    }
+    if (!value) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    switch (attribute) {
+    case HSA_CODE_OBJECT_INFO_ISA: return hsa_isa_from_name(isaName(), static_cast<hsa_isa_t*>(value));
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_code_object_reader_create_from_memory(const void* code_object, size_t size,
+                                                       hsa_code_object_reader_t* code_object_reader) {
+    if (!code_object || size == 0 || !code_object_reader) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    code_object_reader->handle = (new CodeObject)->handle();
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_code_object_reader_destroy(hsa_code_object_reader_t code_object_reader) {
+    if (!code_object_reader.handle) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT_READER;
+    }
+    delete CodeObject::of(code_object_reader.handle);
+    return HSA_STATUS_SUCCESS;
+}
+
+// Executables
+
+hsa_status_t hsa_executable_create(hsa_profile_t profile, hsa_executable_state_t executable_state,
+                                   const char* options, hsa_executable_t* executable) {
+    if (!executable) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    *executable = (new Executable(executable_state))->handle();
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_create_alt(hsa_profile_t profile,
+                                       hsa_default_float_rounding_mode_t default_float_rounding_mode,
+                                       const char* options, hsa_executable_t* executable) {
+    return hsa_executable_create(profile, HSA_EXECUTABLE_STATE_UNFROZEN, options, executable);
+}
+
+hsa_status_t hsa_executable_destroy(hsa_executable_t executable) {
+    if (!executable.handle) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    }
+    delete Executable::of(executable);
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t loadInto(hsa_executable_t executable, hsa_agent_t agent) {
+    Executable* e = Executable::of(executable);
+    if (!e) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    }
+    if (!agent.handle) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    std::lock_guard<std::mutex> l(e->lock);
+    if (e->state == HSA_EXECUTABLE_STATE_FROZEN) {
+        return HSA_STATUS_ERROR_FROZEN_EXECUTABLE;
+    }
+    e->agent = Agent::of(agent);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_load_code_object(hsa_executable_t executable, hsa_agent_t agent,
+                                             hsa_code_object_t code_object, const char* options) {
+    if (!code_object.handle) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+    }
+    return loadInto(executable, agent);
+}
+
+hsa_status_t hsa_executable_load_agent_code_object(hsa_executable_t executable, hsa_agent_t agent,
+                                                   hsa_code_object_reader_t code_object_reader,
+                                                   const char* options,
+                                                   hsa_loaded_code_object_t* loaded_code_object) {
+    if (!code_object_reader.handle) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT_READER;
+    }
+    hsa_status_t status = loadInto(executable, agent);
+    if (status == HSA_STATUS_SUCCESS && loaded_code_object) {
+        loaded_code_object->handle = code_object_reader.handle;
+    }
+    return status;
+}
+
+hsa_status_t hsa_executable_freeze(hsa_executable_t executable, const char* options) {
+    Executable* e = Executable::of(executable);
+    if (!e) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    }
+    std::lock_guard<std::mutex> l(e->lock);
+    if (e->state == HSA_EXECUTABLE_STATE_FROZEN) {
+        return HSA_STATUS_ERROR_FROZEN_EXECUTABLE;
+    }
+    e->state = HSA_EXECUTABLE_STATE_FROZEN;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_validate_alt(hsa_executable_t executable, const char* options, uint32_t* result) {
+    if (!executable.handle) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    }
+    if (!result) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    *result = 0;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_agent_global_variable_define(hsa_executable_t executable, hsa_agent_t agent,
+                                                         const char* variable_name, void* address) {
+    Executable* e = Executable::of(executable);
+    if (!e) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    }
+    if (!variable_name) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    std::lock_guard<std::mutex> l(e->lock);
+    if (e->state == HSA_EXECUTABLE_STATE_FROZEN) {
+        return HSA_STATUS_ERROR_FROZEN_EXECUTABLE;
+    }
+    std::unique_ptr<Symbol>& s = e->symbols[variable_name];
+    if (s) {
+        return HSA_STATUS_ERROR_VARIABLE_ALREADY_DEFINED;
+    }
+    s.reset(new Symbol{HSA_SYMBOL_KIND_VARIABLE, variable_name, Agent::of(agent), nullptr, address});
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_get_symbol(hsa_executable_t executable, const char* module_name,
+                                       const char* symbol_name, hsa_agent_t agent, int32_t call_convention,
+                                       hsa_executable_symbol_t* symbol) {
+    Executable* e = Executable::of(executable);
+    if (!e) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    }
+    if (!symbol_name || !symbol) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    Symbol* s = e->find(symbol_name);
+    if (!s) {
+        return HSA_STATUS_ERROR_INVALID_SYMBOL_NAME;
+    }
+    *symbol = s->handle();
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_get_symbol_by_name(hsa_executable_t executable, const char* symbol_name,
+                                               const hsa_agent_t* agent, hsa_executable_symbol_t* symbol) {
+    return hsa_executable_get_symbol(executable, nullptr, symbol_name,
+                                     agent ? *agent : hsa_agent_t{0}, 0, symbol);
+}
+
+hsa_status_t hsa_executable_iterate_agent_symbols(hsa_executable_t executable, hsa_agent_t agent,
+                                                  hsa_status_t (*callback)(hsa_executable_t exec, hsa_agent_t agent,
+                                                                           hsa_executable_symbol_t symbol,
+                                                                           void* data),
+                                                  void* data) {
+    Executable* e = Executable::of(executable);
+    if (!e) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE;
+    }
+    if (!callback) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    for (Kernel* k : kernels()) {
+        hsa_status_t status = callback(executable, agent, e->find(k->name)->handle(), data);
+        if (status != HSA_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_executable_symbol_get_info(hsa_executable_symbol_t executable_symbol,
+                                            hsa_executable_symbol_info_t attribute, void* value) {
+    Symbol* s = Symbol::of(executable_symbol);
+    if (!s) {
+        return HSA_STATUS_ERROR_INVALID_EXECUTABLE_SYMBOL;
+    }
+    if (!value) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    bool kernel = (s->kind == HSA_SYMBOL_KIND_KERNEL);
+    switch (attribute) {
+    case HSA_EXECUTABLE_SYMBOL_INFO_TYPE: return put(value, s->kind);
+    case HSA_EXECUTABLE_SYMBOL_INFO_NAME_LENGTH: return put<uint32_t>(value, s->name.size());
+    case HSA_EXECUTABLE_SYMBOL_INFO_NAME: memcpy(value, s->name.data(), s->name.size()); return HSA_STATUS_SUCCESS;
+    case HSA_EXECUTABLE_SYMBOL_INFO_MODULE_NAME_LENGTH: return put<uint32_t>(value, 0);
+    case HSA_EXECUTABLE_SYMBOL_INFO_LINKAGE: return put(value, HSA_SYMBOL_LINKAGE_PROGRAM);
+    case HSA_EXECUTABLE_SYMBOL_INFO_IS_DEFINITION: return put<bool>(value, true);
+    case HSA_EXECUTABLE_SYMBOL_INFO_AGENT: return put(value, hsa_agent_t{reinterpret_cast<uint64_t>(s->agent)});
+    default: break;
+    }
+    if (kernel) {
+        switch (attribute) {
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT: return put<uint64_t>(value, reinterpret_cast<uint64_t>(s->kernel));
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE: return put<uint32_t>(value, s->kernel->kernargSegmentSize);
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_ALIGNMENT: return put<uint32_t>(value, s->kernel->kernargSegmentAlignment);
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_GROUP_SEGMENT_SIZE: return put<uint32_t>(value, s->kernel->groupSegmentSize);
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_PRIVATE_SEGMENT_SIZE: return put<uint32_t>(value, 0);
+        case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_DYNAMIC_CALLSTACK: return put<bool>(value, false);
+        default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+        }
+    }
+    switch (attribute) {
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_ADDRESS: return put<uint64_t>(value, reinterpret_cast<uint64_t>(s->address));
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_ALLOCATION: return put(value, HSA_VARIABLE_ALLOCATION_AGENT);
+    case HSA_EXECUTABLE_SYMBOL_INFO_VARIABLE_SEGMENT: return put(value, HSA_VARIABLE_SEGMENT_GLOBAL);
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+} // extern "C"
@@ -0,0 +1,414 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Software HSA runtime: user mode queues and their packet processors.
+
+#include <cstdlib>
+#include <cstring>
+
+#include <hsa/hsa.h>
+#include <hsa/hsa_ext_amd.h>
+
+#include "hsa_sw_runtime.h"
+
+namespace hsa_sw {
+
+/// size in bytes of an AQL packet
+static const size_t PACKET_SIZE = 64;
+
+/// an idle packet processor re-checks its queue at least this often, in ticks
+static const uint64_t MAX_IDLE = 100000000;
+
+static uint16_t packetType(uint16_t header) {
+    return (header >> HSA_PACKET_HEADER_TYPE) & ((1 << HSA_PACKET_HEADER_WIDTH_TYPE) - 1);
+}
+
+static uint16_t fenceScope(uint16_t header, int position) {
+    return (header >> position) & ((1 << HSA_PACKET_HEADER_WIDTH_SCACQUIRE_FENCE_SCOPE) - 1);
+}
+
+// WorkerPool
+
+WorkerPool::WorkerPool(unsigned int count) : threads(), jobs(), stopping(false) {
+    for (unsigned int i = 0; i < count; ++i) {
+        threads.emplace_back(&WorkerPool::workerLoop, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> l(lock);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+/// the group segment of the workgroups run by the calling thread
+static void* groupSegment(uint32_t size) {
+    static thread_local std::unique_ptr<char[]> buffer;
+    static thread_local uint32_t capacity = 0;
+    if (size > capacity) {
+        buffer.reset(new char[size]);
+        capacity = size;
+    }
+    return buffer.get();
+}
+
+void WorkerPool::drain(Job& job) {
+    void* group = groupSegment(job.groupSegmentSize);
+    for (uint64_t i = job.next.fetch_add(1, std::memory_order_relaxed); i < job.count;
+         i = job.next.fetch_add(1, std::memory_order_relaxed)) {
+        (*job.fn)(i, group);
+    }
+}
+
+void WorkerPool::run(uint64_t count, uint32_t groupSegmentSize, const job_fn& fn) {
+    Job job;
+    job.count = count;
+    job.groupSegmentSize = groupSegmentSize;
+    job.fn = &fn;
+    job.next.store(0, std::memory_order_relaxed);
+    job.users = 0;
+
+    bool shared = (count > 1 && !threads.empty());
+    if (shared) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            jobs.push_back(&job);
+        }
+        workAvailable.notify_all();
+    }
+    drain(job);
+    if (shared) {
+        // every index is taken; wait for the workers still running theirs
+        std::unique_lock<std::mutex> l(lock);
+        jobs.remove(&job);
+        jobReleased.wait(l, [&job] { return job.users == 0; });
+    }
+}
+
+void WorkerPool::workerLoop() {
+    std::unique_lock<std::mutex> l(lock);
+    while (true) {
+        workAvailable.wait(l, [this] { return stopping || !jobs.empty(); });
+        if (stopping) {
+            return;
+        }
+        Job* job = jobs.front();
+        ++job->users;
+        l.unlock();
+        drain(*job);
+        l.lock();
+        // the job has no index left, the other workers need not look at it
+        jobs.remove(job);
+        if (--job->users == 0) {
+            jobReleased.notify_all();
+        }
+    }
+}
+
+/// Queue
+///
+/// A user mode queue and the host thread which processes its packets, one at
+/// a time and in order, so the barrier bit of a packet always holds. Kernel
+/// dispatches run their workgroups on the workers of the agent. The packet
+/// processor sleeps on the doorbell signal while the packet at the read index
+/// is not valid yet.
+struct Queue {
+    /// the part of the queue the API hands out; first, so that the
+    /// hsa_queue_t* of the API point to the Queue
+    hsa_queue_t hsa;
+    Agent* agent;
+    void (*callback)(hsa_status_t status, hsa_queue_t* source, void* data);
+    void* callbackData;
+    std::atomic<uint64_t> readIndex;
+    std::atomic<uint64_t> writeIndex;
+    std::atomic<bool> stopping;
+    std::thread processor;
+
+    static Queue* of(const hsa_queue_t* q) {
+        return reinterpret_cast<Queue*>(const_cast<hsa_queue_t*>(q));
+    }
+
+    Signal* doorbell() { return Signal::of(hsa.doorbell_signal); }
+
+    void process();
+    hsa_status_t execute(void* packet, uint16_t header);
+    hsa_status_t dispatch(const hsa_kernel_dispatch_packet_t* packet);
+    void waitDependencies(const hsa_barrier_and_packet_t* packet, bool any);
+};
+
+void Queue::process() {
+    const uint64_t mask = hsa.size - 1;
+    char* packets = static_cast<char*>(hsa.base_address);
+    while (true) {
+        // read before looking at the queue, so that a doorbell rung after
+        // the look wakes the wait below
+        hsa_signal_value_t rung = doorbell()->value.load(std::memory_order_acquire);
+        if (stopping.load(std::memory_order_acquire)) {
+            return;
+        }
+        uint64_t index = readIndex.load(std::memory_order_relaxed);
+        uint16_t* header = reinterpret_cast<uint16_t*>(packets + (index & mask) * PACKET_SIZE);
+        uint16_t h = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+        if (index < writeIndex.load(std::memory_order_acquire)) {
+            // producers write the body first and the header last
+            h = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+        }
+        if (packetType(h) == HSA_PACKET_TYPE_INVALID) {
+            doorbell()->wait(HSA_SIGNAL_CONDITION_NE, rung, MAX_IDLE, HSA_WAIT_STATE_BLOCKED);
+            continue;
+        }
+
+        hsa_status_t status = execute(header, h);
+        if (status != HSA_STATUS_SUCCESS) {
+            // like a hardware queue in error, stop processing
+            if (callback) {
+                callback(status, &hsa, callbackData);
+            }
+            return;
+        }
+
+        // give the slot back to the producers
+        __atomic_store_n(header, HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE, __ATOMIC_RELAXED);
+        readIndex.store(index + 1, std::memory_order_release);
+    }
+}
+
+hsa_status_t Queue::execute(void* packet, uint16_t header) {
+    if (fenceScope(header, HSA_PACKET_HEADER_SCACQUIRE_FENCE_SCOPE) != HSA_FENCE_SCOPE_NONE) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    uint64_t start = now();
+    hsa_signal_t completion;
+    switch (packetType(header)) {
+    case HSA_PACKET_TYPE_KERNEL_DISPATCH: {
+        const hsa_kernel_dispatch_packet_t* p = static_cast<const hsa_kernel_dispatch_packet_t*>(packet);
+        hsa_status_t status = dispatch(p);
+        if (status != HSA_STATUS_SUCCESS) {
+            return status;
+        }
+        completion = p->completion_signal;
+        break;
+    }
+    case HSA_PACKET_TYPE_BARRIER_AND:
+    case HSA_PACKET_TYPE_BARRIER_OR: {
+        // both barrier packets have the same layout
+        const hsa_barrier_and_packet_t* p = static_cast<const hsa_barrier_and_packet_t*>(packet);
+        waitDependencies(p, packetType(header) == HSA_PACKET_TYPE_BARRIER_OR);
+        completion = p->completion_signal;
+        break;
+    }
+    default:
+        return HSA_STATUS_ERROR_INVALID_PACKET_FORMAT;
+    }
+
+    if (fenceScope(header, HSA_PACKET_HEADER_SCRELEASE_FENCE_SCOPE) != HSA_FENCE_SCOPE_NONE) {
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    if (completion.handle) {
+        Signal* s = Signal::of(completion);
+        s->start.store(start, std::memory_order_relaxed);
+        s->end.store(now(), std::memory_order_relaxed);
+        s->value.fetch_sub(1, std::memory_order_release);
+        s->notify();
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t Queue::dispatch(const hsa_kernel_dispatch_packet_t* packet) {
+    const Kernel* kernel = reinterpret_cast<const Kernel*>(packet->kernel_object);
+    uint32_t dims = (packet->setup >> HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS) &
+                    ((1 << HSA_KERNEL_DISPATCH_PACKET_SETUP_WIDTH_DIMENSIONS) - 1);
+    if (!kernel || !kernel->entry || dims < 1 || dims > 3) {
+        return HSA_STATUS_ERROR_INVALID_PACKET_FORMAT;
+    }
+
+    hsa_sw_workgroup_t first;
+    first.kernarg = packet->kernarg_address;
+    first.group_segment = nullptr;
+    first.group_segment_size = packet->group_segment_size;
+    first.dimensions = dims;
+    uint32_t grid[3] = {packet->grid_size_x, packet->grid_size_y, packet->grid_size_z};
+    uint32_t size[3] = {packet->workgroup_size_x, packet->workgroup_size_y, packet->workgroup_size_z};
+    uint64_t groups[3];
+    uint64_t count = 1;
+    for (uint32_t d = 0; d < 3; ++d) {
+        first.grid_size[d] = (d < dims) ? grid[d] : 1;
+        first.workgroup_size[d] = (d < dims) ? size[d] : 1;
+        first.workgroup_id[d] = 0;
+        if (first.workgroup_size[d] == 0) {
+            return HSA_STATUS_ERROR_INVALID_PACKET_FORMAT;
+        }
+        groups[d] = (first.grid_size[d] + first.workgroup_size[d] - 1) / first.workgroup_size[d];
+        count *= groups[d];
+    }
+
+    agent->workers->run(count, first.group_segment_size, [&](uint64_t i, void* group) {
+        hsa_sw_workgroup_t wg = first;
+        wg.group_segment = group;
+        wg.workgroup_id[0] = i % groups[0];
+        wg.workgroup_id[1] = (i / groups[0]) % groups[1];
+        wg.workgroup_id[2] = i / (groups[0] * groups[1]);
+        kernel->entry(&wg);
+    });
+    return HSA_STATUS_SUCCESS;
+}
+
+void Queue::waitDependencies(const hsa_barrier_and_packet_t* packet, bool any) {
+    std::vector<Signal*> deps;
+    for (const hsa_signal_t& s : packet->dep_signal) {
+        if (s.handle) {
+            deps.push_back(Signal::of(s));
+        }
+    }
+    if (!any) {
+        for (Signal* s : deps) {
+            s->wait(HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
+        }
+        return;
+    }
+    // a barrier-OR packet waits for one of its signals, look at each in turn
+    for (size_t i = 0; !deps.empty(); i = (i + 1) % deps.size()) {
+        if (deps[i]->wait(HSA_SIGNAL_CONDITION_EQ, 0, MAX_IDLE / 1000, HSA_WAIT_STATE_BLOCKED) == 0) {
+            return;
+        }
+    }
+}
+
+} // namespace hsa_sw
+
+using namespace hsa_sw;
+
+extern "C" {
+
+hsa_status_t hsa_queue_create(hsa_agent_t agent, uint32_t size, hsa_queue_type32_t type,
+                              void (*callback)(hsa_status_t status, hsa_queue_t* source, void* data),
+                              void* data, uint32_t private_segment_size, uint32_t group_segment_size,
+                              hsa_queue_t** queue) {
+    Agent* a = Agent::of(agent);
+    if (!a) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (!queue || size == 0 || (size & (size - 1)) != 0) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    if (a->type != HSA_DEVICE_TYPE_GPU) {
+        return HSA_STATUS_ERROR_INVALID_QUEUE_CREATION;
+    }
+
+    void* packets = nullptr;
+    if (posix_memalign(&packets, 4096, size_t(size) * PACKET_SIZE) != 0) {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+    memset(packets, 0, size_t(size) * PACKET_SIZE);
+    for (uint32_t i = 0; i < size; ++i) {
+        *reinterpret_cast<uint16_t*>(static_cast<char*>(packets) + i * PACKET_SIZE) =
+            HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    }
+
+    static std::atomic<uint64_t> nextId(0);
+    Queue* q = new Queue();
+    q->hsa.type = type;
+    q->hsa.features = HSA_QUEUE_FEATURE_KERNEL_DISPATCH;
+    q->hsa.base_address = packets;
+    q->hsa.doorbell_signal = (new Signal(0))->handle();
+    q->hsa.size = size;
+    q->hsa.id = nextId++;
+    q->agent = a;
+    q->callback = callback;
+    q->callbackData = data;
+    q->readIndex.store(0, std::memory_order_relaxed);
+    q->writeIndex.store(0, std::memory_order_relaxed);
+    q->stopping.store(false, std::memory_order_relaxed);
+    q->processor = std::thread(&Queue::process, q);
+
+    *queue = &q->hsa;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_queue_destroy(hsa_queue_t* queue) {
+    if (!queue) {
+        return HSA_STATUS_ERROR_INVALID_QUEUE;
+    }
+    Queue* q = Queue::of(queue);
+    q->stopping.store(true, std::memory_order_release);
+    // a change of the doorbell wakes the packet processor
+    q->doorbell()->value.fetch_add(1, std::memory_order_release);
+    q->doorbell()->notify();
+    q->processor.join();
+
+    delete q->doorbell();
+    free(q->hsa.base_address);
+    delete q;
+    return HSA_STATUS_SUCCESS;
+}
+
+uint64_t hsa_queue_load_read_index_scacquire(const hsa_queue_t* queue) {
+    return Queue::of(queue)->readIndex.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_read_index_acquire(const hsa_queue_t* queue) {
+    return Queue::of(queue)->readIndex.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_read_index_relaxed(const hsa_queue_t* queue) {
+    return Queue::of(queue)->readIndex.load(std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_load_write_index_scacquire(const hsa_queue_t* queue) {
+    return Queue::of(queue)->writeIndex.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_write_index_acquire(const hsa_queue_t* queue) {
+    return Queue::of(queue)->writeIndex.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_write_index_relaxed(const hsa_queue_t* queue) {
+    return Queue::of(queue)->writeIndex.load(std::memory_order_relaxed);
+}
+
+void hsa_queue_store_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    Queue::of(queue)->writeIndex.store(value, std::memory_order_relaxed);
+}
+
+void hsa_queue_store_write_index_screlease(const hsa_queue_t* queue, uint64_t value) {
+    Queue::of(queue)->writeIndex.store(value, std::memory_order_release);
+}
+
+void hsa_queue_store_write_index_release(const hsa_queue_t* queue, uint64_t value) {
+    Queue::of(queue)->writeIndex.store(value, std::memory_order_release);
+}
+
+uint64_t hsa_queue_add_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    return Queue::of(queue)->writeIndex.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_add_write_index_scacq_screl(const hsa_queue_t* queue, uint64_t value) {
+    return Queue::of(queue)->writeIndex.fetch_add(value, std::memory_order_acq_rel);
+}
+
+uint64_t hsa_queue_cas_write_index_relaxed(const hsa_queue_t* queue, uint64_t expected, uint64_t value) {
+    Queue::of(queue)->writeIndex.compare_exchange_strong(expected, value, std::memory_order_relaxed);
+    return expected;
+}
+
+hsa_status_t hsa_amd_profiling_set_profiler_enabled(hsa_queue_t* queue, int enable) {
+    // dispatches always leave their ticks in their completion signal
+    return queue ? HSA_STATUS_SUCCESS : HSA_STATUS_ERROR_INVALID_QUEUE;
+}
+
+hsa_status_t hsa_amd_queue_cu_set_mask(const hsa_queue_t* queue, uint32_t num_cu_mask_count, const uint32_t* cu_mask) {
+    // the workers of the agent are shared by all its queues
+    return queue ? HSA_STATUS_SUCCESS : HSA_STATUS_ERROR_INVALID_QUEUE;
+}
+
+} // extern "C"
@@ -0,0 +1,814 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Software HSA runtime: system, agents, memory pools, signals, async copies
+// and profiling.
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <hsa/hsa.h>
+#include <hsa/hsa_ext_amd.h>
+#include <hsa/hsa_ven_amd_loader.h>
+
+#include "hsa_sw_runtime.h"
+
+namespace hsa_sw {
+
+/// sizes of the group segment of a workgroup and of the allocations
+static const size_t GROUP_SEGMENT_SIZE = 64 * 1024;
+static const size_t ALLOC_GRANULE = 4096;
+
+/// iterations a waiter which asked to be active spins before it sleeps
+static const int SPIN_COUNT = 4096;
+
+/// sleepers re-check their condition at least this often, in ticks
+static const uint64_t MAX_SLEEP = 1000000;
+
+struct Allocation {
+    size_t size;
+    hsa_amd_pointer_type_t type;
+    /// hsa_amd_memory_lock() calls not undone yet, for LOCKED ranges
+    int locks;
+};
+
+struct Runtime {
+    Agent cpu;
+    Agent gpu;
+    Pool systemFine;
+    Pool systemCoarse;
+    Pool device;
+    Pool group;
+
+    /// allocations and locked ranges by base address, for hsa_amd_pointer_info()
+    std::mutex allocationsLock;
+    std::map<uintptr_t, Allocation> allocations;
+
+    Runtime() {
+        size_t memory = size_t(sysconf(_SC_PHYS_PAGES)) * size_t(sysconf(_SC_PAGE_SIZE));
+
+        systemFine = Pool{&cpu, HSA_AMD_SEGMENT_GLOBAL,
+                          HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_FINE_GRAINED | HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_KERNARG_INIT,
+                          memory};
+        systemCoarse = Pool{&cpu, HSA_AMD_SEGMENT_GLOBAL, HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_COARSE_GRAINED, memory};
+        device = Pool{&gpu, HSA_AMD_SEGMENT_GLOBAL, HSA_AMD_MEMORY_POOL_GLOBAL_FLAG_COARSE_GRAINED, memory};
+        group = Pool{&gpu, HSA_AMD_SEGMENT_GROUP, 0, GROUP_SEGMENT_SIZE};
+
+        cpu.type = HSA_DEVICE_TYPE_CPU;
+        cpu.name = "cpu";
+        cpu.node = 0;
+        cpu.pools = {&systemFine, &systemCoarse};
+
+        unsigned int threads = std::thread::hardware_concurrency();
+        if (const char* env = getenv("HSA_SW_WORKERS")) {
+            threads = atoi(env);
+        }
+        gpu.type = HSA_DEVICE_TYPE_GPU;
+        gpu.name = "gfx803";
+        gpu.node = 1;
+        gpu.pools = {&device, &group};
+        gpu.workers.reset(new WorkerPool(std::max(threads, 1u) - 1));
+    }
+
+    /// the allocation ptr points into, allocations.end() if there is none;
+    /// called with allocationsLock held
+    std::map<uintptr_t, Allocation>::iterator find(const void* ptr) {
+        uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+        auto it = allocations.upper_bound(p);
+        if (it == allocations.begin()) {
+            return allocations.end();
+        }
+        --it;
+        return (p < it->first + std::max<size_t>(it->second.size, 1)) ? it : allocations.end();
+    }
+};
+
+static std::mutex initLock;
+static int initCount = 0;
+static std::atomic<Runtime*> theRuntime(nullptr);
+
+Runtime* runtime() { return theRuntime.load(std::memory_order_acquire); }
+Agent* cpuAgent() { return &runtime()->cpu; }
+Agent* gpuAgent() { return &runtime()->gpu; }
+
+// Signal
+
+void Signal::notify() {
+    // pairs with the fence of wait(): either the waiter sees the new value or
+    // this sees the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> l(lock);
+        cv.notify_all();
+    }
+    signalChanged();
+}
+
+hsa_signal_value_t Signal::wait(hsa_signal_condition_t condition, hsa_signal_value_t compare,
+                                uint64_t timeout, hsa_wait_state_t state) {
+    hsa_signal_value_t v = value.load(std::memory_order_acquire);
+    if (satisfied(condition, v, compare)) {
+        return v;
+    }
+    if (state == HSA_WAIT_STATE_ACTIVE) {
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            v = value.load(std::memory_order_acquire);
+            if (satisfied(condition, v, compare)) {
+                return v;
+            }
+        }
+    }
+
+    uint64_t start = now();
+    uint64_t deadline = (timeout > UINT64_MAX - start) ? UINT64_MAX : start + timeout;
+    std::unique_lock<std::mutex> l(lock);
+    sleepers.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (true) {
+        v = value.load(std::memory_order_acquire);
+        uint64_t t = now();
+        if (satisfied(condition, v, compare) || t >= deadline) {
+            break;
+        }
+        cv.wait_for(l, std::chrono::nanoseconds(std::min(deadline - t, MAX_SLEEP)));
+    }
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+    return v;
+}
+
+// Async signal handlers, all run by one thread
+
+struct AsyncHandler {
+    Signal* signal;
+    hsa_signal_condition_t condition;
+    hsa_signal_value_t value;
+    hsa_amd_signal_handler handler;
+    void* arg;
+};
+
+// The state of the service threads is allocated, as the runtime, and never
+// destroyed: HCC does not call hsa_shut_down(), and destroying a condition
+// variable a thread still waits on blocks the exit of the process.
+static std::mutex& handlersLock = *new std::mutex;
+static std::condition_variable& handlersCv = *new std::condition_variable;
+static std::list<AsyncHandler>& handlers = *new std::list<AsyncHandler>;
+static std::atomic<int> handlerCount(0);
+/// signal changes seen by signalChanged(), guarded by handlersLock
+static uint64_t signalChanges = 0;
+static bool handlersStopping = false;
+static std::thread& handlerThread = *new std::thread;
+
+void signalChanged() {
+    if (handlerCount.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> l(handlersLock);
+        ++signalChanges;
+        handlersCv.notify_one();
+    }
+}
+
+static void handlerLoop() {
+    std::unique_lock<std::mutex> l(handlersLock);
+    while (!handlersStopping) {
+        uint64_t changes = signalChanges;
+        // run the satisfied handlers outside of the lock, they may register
+        // handlers of their own
+        std::list<AsyncHandler> ready;
+        for (auto it = handlers.begin(); it != handlers.end();) {
+            hsa_signal_value_t v = it->signal->value.load(std::memory_order_acquire);
+            auto next = std::next(it);
+            if (Signal::satisfied(it->condition, v, it->value)) {
+                ready.splice(ready.end(), handlers, it);
+            }
+            it = next;
+        }
+        if (!ready.empty()) {
+            l.unlock();
+            int done = 0;
+            for (auto it = ready.begin(); it != ready.end();) {
+                auto next = std::next(it);
+                // a handler returning true keeps waiting on its signal
+                if (!it->handler(it->signal->value.load(std::memory_order_acquire), it->arg)) {
+                    ready.erase(it);
+                    ++done;
+                }
+                it = next;
+            }
+            l.lock();
+            handlerCount.fetch_sub(done);
+            handlers.splice(handlers.end(), ready);
+            continue;
+        }
+        if (changes == signalChanges) {
+            handlersCv.wait_for(l, std::chrono::nanoseconds(MAX_SLEEP));
+        }
+    }
+}
+
+// Copy engine: copies run in order of submission among those whose
+// dependencies are satisfied, so a copy waiting for a signal holds up no other
+
+struct CopyJob {
+    void* dst;
+    const void* src;
+    size_t size;
+    std::vector<Signal*> deps;
+    Signal* completion;
+
+    bool ready() const {
+        for (Signal* s : deps) {
+            if (s->value.load(std::memory_order_acquire) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static std::mutex& copiesLock = *new std::mutex;
+static std::condition_variable& copiesCv = *new std::condition_variable;
+static std::list<CopyJob>& copies = *new std::list<CopyJob>;
+static bool copiesStopping = false;
+static std::thread& copyThread = *new std::thread;
+
+void asyncCopy(void* dst, const void* src, size_t size, std::vector<Signal*> deps, Signal* completion) {
+    {
+        std::lock_guard<std::mutex> l(copiesLock);
+        copies.push_back(CopyJob{dst, src, size, std::move(deps), completion});
+    }
+    copiesCv.notify_one();
+}
+
+static void copyLoop() {
+    std::unique_lock<std::mutex> l(copiesLock);
+    while (true) {
+        auto it = std::find_if(copies.begin(), copies.end(), [](const CopyJob& c) { return c.ready(); });
+        if (it == copies.end()) {
+            if (copiesStopping && copies.empty()) {
+                return;
+            }
+            // the dependencies are signals of other agents, poll them
+            if (copies.empty()) {
+                copiesCv.wait(l);
+            } else {
+                copiesCv.wait_for(l, std::chrono::microseconds(50));
+            }
+            continue;
+        }
+        CopyJob c = *it;
+        copies.erase(it);
+        l.unlock();
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t start = now();
+        memcpy(c.dst, c.src, c.size);
+        if (c.completion) {
+            c.completion->start.store(start, std::memory_order_relaxed);
+            c.completion->end.store(now(), std::memory_order_relaxed);
+            c.completion->value.fetch_sub(1, std::memory_order_release);
+            c.completion->notify();
+        }
+
+        l.lock();
+    }
+}
+
+void startServices() {
+    handlersStopping = false;
+    copiesStopping = false;
+    handlerThread = std::thread(handlerLoop);
+    copyThread = std::thread(copyLoop);
+}
+
+void stopServices() {
+    {
+        std::lock_guard<std::mutex> l(handlersLock);
+        handlersStopping = true;
+    }
+    handlersCv.notify_one();
+    handlerThread.join();
+    {
+        std::lock_guard<std::mutex> l(copiesLock);
+        copiesStopping = true;
+    }
+    copiesCv.notify_one();
+    copyThread.join();
+}
+
+} // namespace hsa_sw
+
+using namespace hsa_sw;
+
+template <typename T>
+static hsa_status_t put(void* value, T v) {
+    *static_cast<T*>(value) = v;
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t putString(void* value, const std::string& s, size_t size) {
+    memset(value, 0, size);
+    memcpy(value, s.c_str(), std::min(s.size(), size - 1));
+    return HSA_STATUS_SUCCESS;
+}
+
+extern "C" {
+
+// System
+
+hsa_status_t hsa_init() {
+    std::lock_guard<std::mutex> l(initLock);
+    if (initCount++ == 0) {
+        if (!runtime()) {
+            // lives until the process exits, like the agents it hands out
+            theRuntime.store(new Runtime(), std::memory_order_release);
+        }
+        startServices();
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_shut_down() {
+    std::lock_guard<std::mutex> l(initLock);
+    if (initCount == 0) {
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    }
+    if (--initCount == 0) {
+        stopServices();
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_status_string(hsa_status_t status, const char** status_string) {
+    if (!status_string) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    switch (status) {
+    case HSA_STATUS_SUCCESS: *status_string = "HSA_STATUS_SUCCESS: The function has been executed successfully."; break;
+    case HSA_STATUS_INFO_BREAK: *status_string = "HSA_STATUS_INFO_BREAK: A traversal over a list of elements has been interrupted by the application before completing."; break;
+    case HSA_STATUS_ERROR_INVALID_ARGUMENT: *status_string = "HSA_STATUS_ERROR_INVALID_ARGUMENT: One of the actual arguments does not meet a precondition stated in the documentation of the corresponding formal argument."; break;
+    case HSA_STATUS_ERROR_INVALID_QUEUE_CREATION: *status_string = "HSA_STATUS_ERROR_INVALID_QUEUE_CREATION: The requested queue creation is not valid."; break;
+    case HSA_STATUS_ERROR_INVALID_ALLOCATION: *status_string = "HSA_STATUS_ERROR_INVALID_ALLOCATION: The requested allocation is not valid."; break;
+    case HSA_STATUS_ERROR_INVALID_AGENT: *status_string = "HSA_STATUS_ERROR_INVALID_AGENT: The agent is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_SIGNAL: *status_string = "HSA_STATUS_ERROR_INVALID_SIGNAL: The signal is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_QUEUE: *status_string = "HSA_STATUS_ERROR_INVALID_QUEUE: The queue is invalid."; break;
+    case HSA_STATUS_ERROR_OUT_OF_RESOURCES: *status_string = "HSA_STATUS_ERROR_OUT_OF_RESOURCES: The runtime failed to allocate the necessary resources."; break;
+    case HSA_STATUS_ERROR_INVALID_PACKET_FORMAT: *status_string = "HSA_STATUS_ERROR_INVALID_PACKET_FORMAT: The AQL packet is malformed."; break;
+    case HSA_STATUS_ERROR_NOT_INITIALIZED: *status_string = "HSA_STATUS_ERROR_NOT_INITIALIZED: An API other than hsa_init has been invoked while the reference count of the HSA runtime is zero."; break;
+    case HSA_STATUS_ERROR_INVALID_ISA: *status_string = "HSA_STATUS_ERROR_INVALID_ISA: The instruction set architecture is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_ISA_NAME: *status_string = "HSA_STATUS_ERROR_INVALID_ISA_NAME: The instruction set architecture name is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_CODE_OBJECT: *status_string = "HSA_STATUS_ERROR_INVALID_CODE_OBJECT: The code object is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_EXECUTABLE: *status_string = "HSA_STATUS_ERROR_INVALID_EXECUTABLE: The executable is invalid."; break;
+    case HSA_STATUS_ERROR_FROZEN_EXECUTABLE: *status_string = "HSA_STATUS_ERROR_FROZEN_EXECUTABLE: The executable is frozen."; break;
+    case HSA_STATUS_ERROR_INVALID_SYMBOL_NAME: *status_string = "HSA_STATUS_ERROR_INVALID_SYMBOL_NAME: There is no symbol with the given name."; break;
+    case HSA_STATUS_ERROR_VARIABLE_ALREADY_DEFINED: *status_string = "HSA_STATUS_ERROR_VARIABLE_ALREADY_DEFINED: The variable is already defined."; break;
+    case HSA_STATUS_ERROR_VARIABLE_UNDEFINED: *status_string = "HSA_STATUS_ERROR_VARIABLE_UNDEFINED: The variable is undefined."; break;
+    case HSA_STATUS_ERROR_INVALID_EXECUTABLE_SYMBOL: *status_string = "HSA_STATUS_ERROR_INVALID_EXECUTABLE_SYMBOL: The executable symbol is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_CODE_OBJECT_READER: *status_string = "HSA_STATUS_ERROR_INVALID_CODE_OBJECT_READER: The code object reader is invalid."; break;
+    default: *status_string = "HSA_STATUS_ERROR: A generic error has occurred."; break;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_system_get_info(hsa_system_info_t attribute, void* value) {
+    if (!value) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    switch (attribute) {
+    case HSA_SYSTEM_INFO_VERSION_MAJOR: return put<uint16_t>(value, 1);
+    case HSA_SYSTEM_INFO_VERSION_MINOR: return put<uint16_t>(value, 1);
+    case HSA_SYSTEM_INFO_TIMESTAMP: return put<uint64_t>(value, now());
+    case HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY: return put<uint64_t>(value, TIMESTAMP_FREQUENCY);
+    case HSA_SYSTEM_INFO_SIGNAL_MAX_WAIT: return put<uint64_t>(value, UINT64_MAX);
+    case HSA_SYSTEM_INFO_ENDIANNESS: return put(value, HSA_ENDIANNESS_LITTLE);
+    case HSA_SYSTEM_INFO_MACHINE_MODEL: return put(value, HSA_MACHINE_MODEL_LARGE);
+    case HSA_SYSTEM_INFO_EXTENSIONS: memset(value, 0, 128); return HSA_STATUS_SUCCESS;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_system_get_extension_table(uint16_t extension, uint16_t version_major,
+                                            uint16_t version_minor, void* table) {
+    if (!table) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    if (extension == HSA_EXTENSION_AMD_LOADER) {
+        // kernel objects have no amd_kernel_code_t to query: an empty table
+        memset(table, 0, sizeof(hsa_ven_amd_loader_1_00_pfn_t));
+        return HSA_STATUS_SUCCESS;
+    }
+    return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+}
+
+// Agents
+
+hsa_status_t hsa_iterate_agents(hsa_status_t (*callback)(hsa_agent_t agent, void* data), void* data) {
+    if (!runtime()) {
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    }
+    if (!callback) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    for (Agent* a : {cpuAgent(), gpuAgent()}) {
+        hsa_status_t status = callback(a->handle(), data);
+        if (status != HSA_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_agent_get_info(hsa_agent_t agent, hsa_agent_info_t attribute, void* value) {
+    Agent* a = Agent::of(agent);
+    if (!a) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (!value) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    bool gpu = (a->type == HSA_DEVICE_TYPE_GPU);
+    switch (static_cast<int>(attribute)) {
+    case HSA_AGENT_INFO_NAME: return putString(value, a->name, 64);
+    case HSA_AGENT_INFO_VENDOR_NAME: return putString(value, "AMD", 64);
+    case HSA_AGENT_INFO_FEATURE: return put<uint32_t>(value, gpu ? HSA_AGENT_FEATURE_KERNEL_DISPATCH : 0);
+    case HSA_AGENT_INFO_MACHINE_MODEL: return put(value, HSA_MACHINE_MODEL_LARGE);
+    case HSA_AGENT_INFO_PROFILE: return put(value, HSA_PROFILE_FULL);
+    case HSA_AGENT_INFO_DEFAULT_FLOAT_ROUNDING_MODE: return put(value, HSA_DEFAULT_FLOAT_ROUNDING_MODE_NEAR);
+    case HSA_AGENT_INFO_BASE_PROFILE_DEFAULT_FLOAT_ROUNDING_MODES: return put<uint32_t>(value, HSA_DEFAULT_FLOAT_ROUNDING_MODE_NEAR);
+    case HSA_AGENT_INFO_FAST_F16_OPERATION: return put<bool>(value, false);
+    case HSA_AGENT_INFO_WAVEFRONT_SIZE: return put<uint32_t>(value, gpu ? 64 : 0);
+    case HSA_AGENT_INFO_WORKGROUP_MAX_DIM: {
+        uint16_t* dims = static_cast<uint16_t*>(value);
+        dims[0] = dims[1] = dims[2] = gpu ? 1024 : 0;
+        return HSA_STATUS_SUCCESS;
+    }
+    case HSA_AGENT_INFO_WORKGROUP_MAX_SIZE: return put<uint32_t>(value, gpu ? 1024 : 0);
+    case HSA_AGENT_INFO_GRID_MAX_DIM: return put(value, hsa_dim3_t{UINT32_MAX, UINT32_MAX, UINT32_MAX});
+    case HSA_AGENT_INFO_GRID_MAX_SIZE: return put<uint32_t>(value, UINT32_MAX);
+    case HSA_AGENT_INFO_FBARRIER_MAX_SIZE: return put<uint32_t>(value, gpu ? 32 : 0);
+    case HSA_AGENT_INFO_QUEUES_MAX: return put<uint32_t>(value, gpu ? 128 : 0);
+    case HSA_AGENT_INFO_QUEUE_MIN_SIZE: return put<uint32_t>(value, gpu ? 64 : 0);
+    case HSA_AGENT_INFO_QUEUE_MAX_SIZE: return put<uint32_t>(value, gpu ? 131072 : 0);
+    case HSA_AGENT_INFO_QUEUE_TYPE: return put<uint32_t>(value, HSA_QUEUE_TYPE_MULTI);
+    case HSA_AGENT_INFO_NODE: return put<uint32_t>(value, a->node);
+    case HSA_AGENT_INFO_DEVICE: return put(value, a->type);
+    case HSA_AGENT_INFO_CACHE_SIZE: memset(value, 0, 4 * sizeof(uint32_t)); return HSA_STATUS_SUCCESS;
+    case HSA_AGENT_INFO_ISA:
+        if (!gpu) {
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+        }
+        return hsa_isa_from_name(isaName(), static_cast<hsa_isa_t*>(value));
+    case HSA_AGENT_INFO_EXTENSIONS: memset(value, 0, 128); return HSA_STATUS_SUCCESS;
+    case HSA_AGENT_INFO_VERSION_MAJOR: return put<uint16_t>(value, 1);
+    case HSA_AGENT_INFO_VERSION_MINOR: return put<uint16_t>(value, 1);
+    case HSA_AMD_AGENT_INFO_CHIP_ID: return put<uint32_t>(value, 0);
+    case HSA_AMD_AGENT_INFO_CACHELINE_SIZE: return put<uint32_t>(value, 64);
+    case HSA_AMD_AGENT_INFO_COMPUTE_UNIT_COUNT:
+        return put<uint32_t>(value, gpu ? a->workers->size() : std::thread::hardware_concurrency());
+    case HSA_AMD_AGENT_INFO_MAX_CLOCK_FREQUENCY: return put<uint32_t>(value, 0);
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+// Memory pools
+
+hsa_status_t hsa_amd_agent_iterate_memory_pools(hsa_agent_t agent,
+                                                hsa_status_t (*callback)(hsa_amd_memory_pool_t memory_pool, void* data),
+                                                void* data) {
+    Agent* a = Agent::of(agent);
+    if (!a) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (!callback) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    for (Pool* p : a->pools) {
+        hsa_status_t status = callback(p->handle(), data);
+        if (status != HSA_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_pool_get_info(hsa_amd_memory_pool_t memory_pool,
+                                          hsa_amd_memory_pool_info_t attribute, void* value) {
+    Pool* p = Pool::of(memory_pool);
+    if (!p || !value) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    bool global = (p->segment == HSA_AMD_SEGMENT_GLOBAL);
+    switch (attribute) {
+    case HSA_AMD_MEMORY_POOL_INFO_SEGMENT: return put(value, p->segment);
+    case HSA_AMD_MEMORY_POOL_INFO_GLOBAL_FLAGS: return put<uint32_t>(value, p->flags);
+    case HSA_AMD_MEMORY_POOL_INFO_SIZE: return put<size_t>(value, p->size);
+    case HSA_AMD_MEMORY_POOL_INFO_RUNTIME_ALLOC_ALLOWED: return put<bool>(value, global);
+    case HSA_AMD_MEMORY_POOL_INFO_RUNTIME_ALLOC_GRANULE: return put<size_t>(value, global ? ALLOC_GRANULE : 0);
+    case HSA_AMD_MEMORY_POOL_INFO_RUNTIME_ALLOC_ALIGNMENT: return put<size_t>(value, global ? ALLOC_GRANULE : 0);
+    case HSA_AMD_MEMORY_POOL_INFO_ACCESSIBLE_BY_ALL: return put<bool>(value, global);
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_amd_agent_memory_pool_get_info(hsa_agent_t agent, hsa_amd_memory_pool_t memory_pool,
+                                                hsa_amd_agent_memory_pool_info_t attribute, void* value) {
+    Agent* a = Agent::of(agent);
+    Pool* p = Pool::of(memory_pool);
+    if (!a) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (!p || !value) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    switch (attribute) {
+    case HSA_AMD_AGENT_MEMORY_POOL_INFO_ACCESS:
+        // every global pool is host memory, the group segment is private
+        return put(value, (p->segment == HSA_AMD_SEGMENT_GLOBAL || p->owner == a)
+                              ? HSA_AMD_MEMORY_POOL_ACCESS_ALLOWED_BY_DEFAULT
+                              : HSA_AMD_MEMORY_POOL_ACCESS_NEVER_ALLOWED);
+    case HSA_AMD_AGENT_MEMORY_POOL_INFO_NUM_LINK_HOPS: return put<uint32_t>(value, 0);
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+hsa_status_t hsa_amd_memory_pool_allocate(hsa_amd_memory_pool_t memory_pool, size_t size, uint32_t flags, void** ptr) {
+    Pool* p = Pool::of(memory_pool);
+    if (!p || !ptr || size == 0) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    if (p->segment != HSA_AMD_SEGMENT_GLOBAL) {
+        return HSA_STATUS_ERROR_INVALID_ALLOCATION;
+    }
+    size = (size + ALLOC_GRANULE - 1) & ~(ALLOC_GRANULE - 1);
+    void* mem = nullptr;
+    if (posix_memalign(&mem, ALLOC_GRANULE, size) != 0) {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+    Runtime* rt = runtime();
+    std::lock_guard<std::mutex> l(rt->allocationsLock);
+    rt->allocations[reinterpret_cast<uintptr_t>(mem)] = Allocation{size, HSA_EXT_POINTER_TYPE_HSA, 0};
+    *ptr = mem;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_pool_free(void* ptr) {
+    if (!ptr) {
+        return HSA_STATUS_SUCCESS;
+    }
+    Runtime* rt = runtime();
+    {
+        std::lock_guard<std::mutex> l(rt->allocationsLock);
+        auto it = rt->allocations.find(reinterpret_cast<uintptr_t>(ptr));
+        if (it == rt->allocations.end() || it->second.type != HSA_EXT_POINTER_TYPE_HSA) {
+            return HSA_STATUS_ERROR_INVALID_ALLOCATION;
+        }
+        rt->allocations.erase(it);
+    }
+    free(ptr);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_agents_allow_access(uint32_t num_agents, const hsa_agent_t* agents,
+                                         const uint32_t* flags, const void* ptr) {
+    if (num_agents == 0 || !agents || !ptr) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    // every agent accesses all memory already
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_memory_copy(void* dst, const void* src, size_t size) {
+    if (!dst || !src) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    memcpy(dst, src, size);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_lock(void* host_ptr, size_t size, hsa_agent_t* agents, int num_agent, void** agent_ptr) {
+    if (!host_ptr || size == 0 || !agent_ptr) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    // agents see host memory at its host address
+    *agent_ptr = host_ptr;
+    Runtime* rt = runtime();
+    std::lock_guard<std::mutex> l(rt->allocationsLock);
+    auto it = rt->find(host_ptr);
+    if (it != rt->allocations.end() && it->second.type == HSA_EXT_POINTER_TYPE_HSA) {
+        return HSA_STATUS_SUCCESS;
+    }
+    Allocation& a = rt->allocations[reinterpret_cast<uintptr_t>(host_ptr)];
+    if (a.locks++ == 0) {
+        a.size = size;
+        a.type = HSA_EXT_POINTER_TYPE_LOCKED;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_unlock(void* host_ptr) {
+    Runtime* rt = runtime();
+    std::lock_guard<std::mutex> l(rt->allocationsLock);
+    auto it = rt->allocations.find(reinterpret_cast<uintptr_t>(host_ptr));
+    if (it != rt->allocations.end() && it->second.type == HSA_EXT_POINTER_TYPE_LOCKED && --it->second.locks == 0) {
+        rt->allocations.erase(it);
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_pointer_info(void* ptr, hsa_amd_pointer_info_t* info, void* (*alloc)(size_t),
+                                  uint32_t* num_agents_accessible, hsa_agent_t** accessible) {
+    if (!ptr || !info) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    Runtime* rt = runtime();
+    {
+        std::lock_guard<std::mutex> l(rt->allocationsLock);
+        auto it = rt->find(ptr);
+        if (it == rt->allocations.end()) {
+            info->type = HSA_EXT_POINTER_TYPE_UNKNOWN;
+            return HSA_STATUS_SUCCESS;
+        }
+        info->type = it->second.type;
+        info->agentBaseAddress = reinterpret_cast<void*>(it->first);
+        info->hostBaseAddress = reinterpret_cast<void*>(it->first);
+        info->sizeInBytes = it->second.size;
+        info->userData = nullptr;
+    }
+    if (num_agents_accessible && accessible) {
+        if (!alloc) {
+            return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+        }
+        hsa_agent_t* agents = static_cast<hsa_agent_t*>(alloc(2 * sizeof(hsa_agent_t)));
+        if (!agents) {
+            return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+        }
+        agents[0] = cpuAgent()->handle();
+        agents[1] = gpuAgent()->handle();
+        *num_agents_accessible = 2;
+        *accessible = agents;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_memory_async_copy(void* dst, hsa_agent_t dst_agent, const void* src, hsa_agent_t src_agent,
+                                       size_t size, uint32_t num_dep_signals, const hsa_signal_t* dep_signals,
+                                       hsa_signal_t completion_signal) {
+    if (!dst || !src || (num_dep_signals && !dep_signals) || !completion_signal.handle) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    std::vector<Signal*> deps;
+    for (uint32_t i = 0; i < num_dep_signals; ++i) {
+        deps.push_back(Signal::of(dep_signals[i]));
+    }
+    asyncCopy(dst, src, size, std::move(deps), Signal::of(completion_signal));
+    return HSA_STATUS_SUCCESS;
+}
+
+// Signals
+
+hsa_status_t hsa_signal_create(hsa_signal_value_t initial_value, uint32_t num_consumers,
+                               const hsa_agent_t* consumers, hsa_signal_t* signal) {
+    if (!signal || (num_consumers && !consumers)) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    *signal = (new Signal(initial_value))->handle();
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_signal_destroy(hsa_signal_t signal) {
+    if (!signal.handle) {
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    }
+    delete Signal::of(signal);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_signal_value_t hsa_signal_load_scacquire(hsa_signal_t signal) {
+    return Signal::of(signal)->value.load(std::memory_order_acquire);
+}
+
+hsa_signal_value_t hsa_signal_load_acquire(hsa_signal_t signal) {
+    return Signal::of(signal)->value.load(std::memory_order_acquire);
+}
+
+hsa_signal_value_t hsa_signal_load_relaxed(hsa_signal_t signal) {
+    return Signal::of(signal)->value.load(std::memory_order_relaxed);
+}
+
+void hsa_signal_store_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
+    Signal* s = Signal::of(signal);
+    s->value.store(value, std::memory_order_relaxed);
+    s->notify();
+}
+
+void hsa_signal_store_screlease(hsa_signal_t signal, hsa_signal_value_t value) {
+    Signal* s = Signal::of(signal);
+    s->value.store(value, std::memory_order_release);
+    s->notify();
+}
+
+void hsa_signal_store_release(hsa_signal_t signal, hsa_signal_value_t value) {
+    hsa_signal_store_screlease(signal, value);
+}
+
+void hsa_signal_add_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
+    Signal* s = Signal::of(signal);
+    s->value.fetch_add(value, std::memory_order_relaxed);
+    s->notify();
+}
+
+void hsa_signal_add_screlease(hsa_signal_t signal, hsa_signal_value_t value) {
+    Signal* s = Signal::of(signal);
+    s->value.fetch_add(value, std::memory_order_release);
+    s->notify();
+}
+
+void hsa_signal_subtract_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
+    Signal* s = Signal::of(signal);
+    s->value.fetch_sub(value, std::memory_order_relaxed);
+    s->notify();
+}
+
+void hsa_signal_subtract_screlease(hsa_signal_t signal, hsa_signal_value_t value) {
+    Signal* s = Signal::of(signal);
+    s->value.fetch_sub(value, std::memory_order_release);
+    s->notify();
+}
+
+hsa_signal_value_t hsa_signal_wait_scacquire(hsa_signal_t signal, hsa_signal_condition_t condition,
+                                             hsa_signal_value_t compare_value, uint64_t timeout_hint,
+                                             hsa_wait_state_t wait_state_hint) {
+    return Signal::of(signal)->wait(condition, compare_value, timeout_hint, wait_state_hint);
+}
+
+hsa_signal_value_t hsa_signal_wait_acquire(hsa_signal_t signal, hsa_signal_condition_t condition,
+                                           hsa_signal_value_t compare_value, uint64_t timeout_hint,
+                                           hsa_wait_state_t wait_state_hint) {
+    return Signal::of(signal)->wait(condition, compare_value, timeout_hint, wait_state_hint);
+}
+
+hsa_signal_value_t hsa_signal_wait_relaxed(hsa_signal_t signal, hsa_signal_condition_t condition,
+                                           hsa_signal_value_t compare_value, uint64_t timeout_hint,
+                                           hsa_wait_state_t wait_state_hint) {
+    return Signal::of(signal)->wait(condition, compare_value, timeout_hint, wait_state_hint);
+}
+
+hsa_status_t hsa_amd_signal_async_handler(hsa_signal_t signal, hsa_signal_condition_t cond, hsa_signal_value_t value,
+                                          hsa_amd_signal_handler handler, void* arg) {
+    if (!signal.handle || !handler) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    {
+        std::lock_guard<std::mutex> l(handlersLock);
+        handlers.push_back(AsyncHandler{Signal::of(signal), cond, value, handler, arg});
+        handlerCount.fetch_add(1);
+        ++signalChanges;
+    }
+    handlersCv.notify_one();
+    return HSA_STATUS_SUCCESS;
+}
+
+// Profiling: dispatches and copies always leave their ticks in their
+// completion signal
+
+hsa_status_t hsa_amd_profiling_async_copy_enable(bool enable) {
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_profiling_get_dispatch_time(hsa_agent_t agent, hsa_signal_t signal,
+                                                 hsa_amd_profiling_dispatch_time_t* time) {
+    if (!signal.handle || !time) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    Signal* s = Signal::of(signal);
+    time->start = s->start.load(std::memory_order_relaxed);
+    time->end = s->end.load(std::memory_order_relaxed);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_profiling_get_async_copy_time(hsa_signal_t signal, hsa_amd_profiling_async_copy_time_t* time) {
+    if (!signal.handle || !time) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    Signal* s = Signal::of(signal);
+    time->start = s->start.load(std::memory_order_relaxed);
+    time->end = s->end.load(std::memory_order_relaxed);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t hsa_amd_profiling_convert_tick_to_system_domain(hsa_agent_t agent, uint64_t agent_tick,
+                                                             uint64_t* system_tick) {
+    if (!system_tick) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    // agents and the system share the steady clock
+    *system_tick = agent_tick;
+    return HSA_STATUS_SUCCESS;
+}
+
+} // extern "C"
@@ -0,0 +1,182 @@
+//===----------------------------------------------------------------------===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <hsa/hsa.h>
+#include <hsa/hsa_ext_amd.h>
+
+#include "hsa_sw.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Internals of the software HSA runtime. Handles of the HSA API are pointers
+// to the objects below.
+
+namespace hsa_sw {
+
+/// agent ticks: nanoseconds of the steady clock
+inline uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const uint64_t TIMESTAMP_FREQUENCY = 1000000000;
+
+/// Signal
+///
+/// A value host threads wait on. Waiters spin for a while if they asked to
+/// be active, then sleep on the condition variable; writers only take the
+/// lock when somebody sleeps. The dispatch or copy which completes a signal
+/// leaves its start and end ticks in it for the profiling API.
+struct Signal {
+    std::atomic<hsa_signal_value_t> value;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+    std::atomic<int> sleepers;
+    std::mutex lock;
+    std::condition_variable cv;
+
+    explicit Signal(hsa_signal_value_t v) : value(v), start(0), end(0), sleepers(0) {}
+
+    /// wake the waiters after a change of the value
+    void notify();
+
+    /// wait until the value satisfies condition against compare, for at most
+    /// timeout ticks; returns the last value observed
+    hsa_signal_value_t wait(hsa_signal_condition_t condition, hsa_signal_value_t compare,
+                            uint64_t timeout, hsa_wait_state_t state);
+
+    static bool satisfied(hsa_signal_condition_t condition, hsa_signal_value_t value,
+                          hsa_signal_value_t compare) {
+        switch (condition) {
+        case HSA_SIGNAL_CONDITION_EQ:  return value == compare;
+        case HSA_SIGNAL_CONDITION_NE:  return value != compare;
+        case HSA_SIGNAL_CONDITION_LT:  return value < compare;
+        case HSA_SIGNAL_CONDITION_GTE: return value >= compare;
+        }
+        return false;
+    }
+
+    static Signal* of(hsa_signal_t s) { return reinterpret_cast<Signal*>(s.handle); }
+    hsa_signal_t handle() { return hsa_signal_t{reinterpret_cast<uint64_t>(this)}; }
+};
+
+/// WorkerPool
+///
+/// Host threads running the workgroups of kernel dispatches. The thread which
+/// submits a dispatch runs workgroups too, so dispatches of several queues
+/// share the workers.
+class WorkerPool {
+public:
+    /// run job(i, group_segment) for every i < count; returns once all have
+    /// returned
+    typedef std::function<void(uint64_t, void*)> job_fn;
+
+    explicit WorkerPool(unsigned int threads);
+    ~WorkerPool();
+
+    void run(uint64_t count, uint32_t groupSegmentSize, const job_fn& job);
+
+    unsigned int size() const { return threads.size() + 1; }
+
+private:
+    struct Job {
+        uint64_t count;
+        uint32_t groupSegmentSize;
+        const job_fn* fn;
+        /// the next index to run
+        std::atomic<uint64_t> next;
+        /// workers running indices of the job, guarded by the lock of the pool
+        unsigned int users;
+    };
+
+    std::vector<std::thread> threads;
+    std::list<Job*> jobs;
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable workAvailable;
+    std::condition_variable jobReleased;
+
+    /// run workgroups of job until it has none left
+    static void drain(Job& job);
+    void workerLoop();
+};
+
+struct Agent;
+
+/// a memory pool of an agent; all pools are host memory
+struct Pool {
+    Agent* owner;
+    hsa_amd_segment_t segment;
+    uint32_t flags;
+    size_t size;
+
+    static Pool* of(hsa_amd_memory_pool_t p) { return reinterpret_cast<Pool*>(p.handle); }
+    hsa_amd_memory_pool_t handle() { return hsa_amd_memory_pool_t{reinterpret_cast<uint64_t>(this)}; }
+};
+
+struct Agent {
+    hsa_device_type_t type;
+    std::string name;
+    uint32_t node;
+    std::vector<Pool*> pools;
+    /// workers of the kernel dispatches, GPU agent only
+    std::unique_ptr<WorkerPool> workers;
+
+    static Agent* of(hsa_agent_t a) { return reinterpret_cast<Agent*>(a.handle); }
+    hsa_agent_t handle() { return hsa_agent_t{reinterpret_cast<uint64_t>(this)}; }
+};
+
+/// the host entry a kernel symbol resolves to
+struct Kernel {
+    std::string name;
+    hsa_sw_kernel_entry_t entry;
+    uint32_t kernargSegmentSize;
+    uint32_t kernargSegmentAlignment;
+    uint32_t groupSegmentSize;
+};
+
+/// the registered kernel called name, nullptr if there is none; kernels are
+/// never unregistered
+Kernel* findKernel(const std::string& name);
+
+/// all registered kernels
+std::vector<Kernel*> kernels();
+
+/// the agents and pools, nullptr until hsa_init()
+struct Runtime;
+Runtime* runtime();
+Agent* cpuAgent();
+Agent* gpuAgent();
+
+/// the name of the single ISA of the GPU agent; every AMDGPU ISA name
+/// resolves to it, as kernels are host code anyway
+const char* isaName();
+
+/// notify the async signal handlers of a change of some signal
+void signalChanged();
+
+/// queue a copy on the copy engine
+void asyncCopy(void* dst, const void* src, size_t size, std::vector<Signal*> deps, Signal* completion);
+
+/// start and stop the threads of the copy engine and of the async handlers
+void startServices();
+void stopServices();
+
+} // namespace hsa_sw
@@ -39,6 +39,7 @@ struct RuntimeImpl {
     m_RuntimeHandle(nullptr),
     m_PushArgImpl(nullptr),
     m_PushArgPtrImpl(nullptr),
+    m_PushArgBlockImpl(nullptr),
     m_GetContextImpl(nullptr),
     isCPU(false) {
     //std::cout << "dlopen(" << libraryName << ")\n";
@@ -60,6 +61,7 @@ struct RuntimeImpl {
   void LoadSymbols() {
     m_PushArgImpl = (PushArgImpl_t) dlsym(m_RuntimeHandle, "PushArgImpl");
     m_PushArgPtrImpl = (PushArgPtrImpl_t) dlsym(m_RuntimeHandle, "PushArgPtrImpl");
+    m_PushArgBlockImpl = (PushArgBlockImpl_t) dlsym(m_RuntimeHandle, "PushArgBlockImpl");
     m_GetContextImpl= (GetContextImpl_t) dlsym(m_RuntimeHandle, "GetContextImpl");
   }
 
@@ -70,6 +72,7 @@ struct RuntimeImpl {
   void* m_RuntimeHandle;
   PushArgImpl_t m_PushArgImpl;
   PushArgPtrImpl_t m_PushArgPtrImpl;
+  PushArgBlockImpl_t m_PushArgBlockImpl;
   GetContextImpl_t m_GetContextImpl;
   bool isCPU;
 };
@@ -218,11 +221,11 @@ bool is_cpu()
     return GetOrInitRuntime()->is_cpu();
 }
 
-static bool in_kernel = false;
-bool in_cpu_kernel() { return in_kernel; }
-void enter_kernel() { in_kernel = true; }
-void leave_kernel() { in_kernel = false; }
-
+// CPU path code built against current headers uses the inline versions of
+// these; the exported ones stay for binaries built before
+bool in_cpu_kernel() { return cpu_kernel_flag(); }
+void enter_kernel() { cpu_kernel_flag() = true; }
+void leave_kernel() { cpu_kernel_flag() = false; }
 
 /// Handler for binary files. The bundled file will have the following format
 /// (all integers are stored in little-endian format):
@@ -361,12 +364,25 @@ void *CreateKernel(std::string s, KalmarQueue* pQueue) {
   return pQueue->getDev()->CreateKernel(s.c_str(), pQueue);
 }
 
+// used in kalmar_launch.h, once per kernel type and device
+void *GetKernelHandle(const char* name, KalmarQueue* pQueue) {
+  return pQueue->getDev()->GetKernelHandle(name);
+}
+
+// used in kalmar_launch.h
+void *CreateKernelFromHandle(void* handle, KalmarQueue* pQueue) {
+  return pQueue->getDev()->CreateKernelFromHandle(handle, pQueue);
+}
+
 void PushArg(void *k_, int idx, size_t sz, const void *s) {
   GetOrInitRuntime()->m_PushArgImpl(k_, idx, sz, s);
 }
 void PushArgPtr(void *k_, int idx, size_t sz, const void *s) {
   GetOrInitRuntime()->m_PushArgPtrImpl(k_, idx, sz, s);
 }
+void PushArgBlock(void *k_, int idx, size_t sz, size_t align, const void *s) {
+  GetOrInitRuntime()->m_PushArgBlockImpl(k_, idx, sz, align, s);
+}
 
 } // namespace CLAMP
 
@@ -458,3 +474,51 @@ extern "C" float __gnu_h2f_ieee(unsigned short h){
 extern "C" unsigned short __gnu_f2h_ieee(float f){
   return (unsigned short)__convert_float_to_half(f);
 }
+
+// context switch between the work-items of a tile on the CPU path
+//
+// Only the state a function call has to preserve is saved: the callee-saved
+// registers, the control bits of MXCSR and the x87 control word. They are
+// pushed on the stack being left, whose pointer is stored to *from, and popped
+// off the stack at to. Unlike swapcontext() there is no signal mask to save,
+// so a switch does not enter the kernel.
+#if defined(__x86_64__)
+asm(
+    ".pushsection .text\n"
+    ".globl __hcc_cpu_fiber_switch\n"
+    ".type __hcc_cpu_fiber_switch, @function\n"
+    "__hcc_cpu_fiber_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size __hcc_cpu_fiber_switch, .-__hcc_cpu_fiber_switch\n"
+    // first switch to a fresh stack lands here with the entry point in rbx
+    // and its argument in r12, see Kalmar::CPUFiber::init
+    ".globl __hcc_cpu_fiber_start\n"
+    ".type __hcc_cpu_fiber_start, @function\n"
+    "__hcc_cpu_fiber_start:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%rbx\n"
+    "    ud2\n"
+    ".size __hcc_cpu_fiber_start, .-__hcc_cpu_fiber_start\n"
+    ".popsection\n"
+);
+#endif
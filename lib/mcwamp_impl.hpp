@@ -4,4 +4,5 @@
 
 typedef void* (*PushArgImpl_t)(void *, int, size_t, const void *);
 typedef void* (*PushArgPtrImpl_t)(void *, int, size_t, const void *);
+typedef void* (*PushArgBlockImpl_t)(void *, int, size_t, size_t, const void *);
 typedef void* (*GetContextImpl_t)();
@@ -96,6 +96,26 @@ macro(add_mcwamp_library_hc_am name )
   add_libcxx_option_if_needed(${name})
 endmacro(add_mcwamp_library_hc_am name )
 
+####################
+# Software HSA runtime, a stand-in for libhsa-runtime64 on hosts without an
+# HSA agent
+####################
+macro(add_mcwamp_library_hsa_sw name )
+  add_library( ${name} SHARED ${ARGN} )
+  amp_target(${name})
+  # Clang shall be compiled beforehand
+  add_dependencies(${name} clang)
+  target_include_directories(${name} SYSTEM PRIVATE ${HSA_HEADER})
+  target_link_libraries(${name} PRIVATE pthread)
+  add_libcxx_option_if_needed(${name})
+  # same file name as the runtime it stands in for, in a directory of its own
+  set_target_properties(${name} PROPERTIES
+    OUTPUT_NAME hsa-runtime64
+    VERSION 1
+    SOVERSION 1
+    LIBRARY_OUTPUT_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}/lib)
+endmacro(add_mcwamp_library_hsa_sw name )
+
 if(POLICY CMP0046)
   cmake_policy(POP)
 endif()
@@ -0,0 +1,105 @@
+// RUN: %hc -cpu %s -o %t.out && HCC_RUNTIME=CPU %t.out
+
+#include <hc.hpp>
+
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <random>
+
+// loop to deliberately slow down kernel execution
+#define LOOP_COUNT (1024)
+
+// An example which shows kernels launched on the CPU path are asynchronous:
+// completion_future::wait(), is_ready() and then() follow the launched kernel
+bool test() {
+  bool ret = true;
+
+  // define inputs and output
+  const int vecSize = 2048;
+
+  std::vector<int> table_a(vecSize);
+  std::vector<int> table_b(vecSize);
+  std::vector<int> table_c(vecSize);
+  std::vector<int> table_d(vecSize);
+
+  // initialize test data
+  std::random_device rd;
+  std::uniform_int_distribution<int32_t> int_dist;
+  for (int i = 0; i < vecSize; ++i) {
+    table_a[i] = int_dist(rd);
+    table_b[i] = int_dist(rd);
+  }
+
+  std::atomic<int> then_count(0);
+  std::promise<void> done_promise;
+  {
+    hc::array_view<const int, 1> av_a(vecSize, table_a);
+    hc::array_view<const int, 1> av_b(vecSize, table_b);
+    hc::array_view<int, 1> av_c(vecSize, table_c);
+    hc::array_view<int, 1> av_d(vecSize, table_d);
+
+    // launch kernel
+    hc::extent<1> e(vecSize);
+    hc::completion_future fut = hc::parallel_for_each(
+      e,
+      [=](hc::index<1> idx) __HC__ {
+        for (int i = 0; i < LOOP_COUNT; ++i)
+          av_c(idx) = av_a(idx) + av_b(idx);
+    });
+
+    fut.then([&] {
+      ++then_count;
+      done_promise.set_value();
+    });
+
+    // a kernel sharing no buffer with the 1st one is launched without
+    // waiting for it, and still completes after it
+    hc::completion_future fut_d = hc::parallel_for_each(
+      e,
+      [=](hc::index<1> idx) __HC__ {
+        av_d(idx) = idx[0];
+    });
+    fut_d.wait();
+    ret &= (fut.is_ready() == true);
+
+    // the 2nd kernel is ordered after the 1st one on the same queue
+    hc::completion_future fut2 = hc::parallel_for_each(
+      e,
+      [=](hc::index<1> idx) __HC__ {
+        av_c(idx) -= av_a(idx);
+    });
+
+    fut2.wait();
+    ret &= (fut.is_ready() == true);
+    ret &= (fut2.is_ready() == true);
+
+    done_promise.get_future().wait();
+    ret &= (then_count == 1);
+
+    // array_view destructors synchronize the results back to table_c
+  }
+
+  // verify
+  int error = 0;
+  for(unsigned i = 0; i < vecSize; i++) {
+    error += table_c[i] - table_b[i];
+    error += table_d[i] != int(i);
+  }
+  if (error == 0) {
+    std::cout << "Verify success!\n";
+  } else {
+    std::cout << "Verify failed!\n";
+  }
+  ret &= (error == 0);
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test();
+
+  return !(ret == true);
+}
@@ -0,0 +1,90 @@
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <hc.hpp>
+
+// test chained completion_future::then: every continuation returns a
+// completion_future which is ready once the continuation has run, and holds
+// the exception the continuation threw, or the one of the operation it
+// continues
+#define KERNEL_COUNT (256)
+
+bool test() {
+  bool ret = true;
+
+  const int vecSize = 1024;
+
+  hc::array_view<int, 1> table(vecSize);
+  for (int i = 0; i < vecSize; ++i) {
+    table[i] = 0;
+  }
+
+  std::atomic<int> first(0);
+  std::atomic<int> second(0);
+  std::vector<hc::completion_future> futures;
+
+  for (int k = 0; k < KERNEL_COUNT; ++k) {
+    hc::completion_future fut = hc::parallel_for_each(
+      hc::extent<1>(vecSize),
+      [=](hc::index<1> idx) __HC__ {
+        table(idx) += 1;
+    });
+
+    // the 2nd continuation only runs after the 1st one
+    futures.push_back(fut.then([&] {
+      ++first;
+    }).then([&] {
+      if (second >= first) {
+        throw std::logic_error("continuation ran out of order");
+      }
+      ++second;
+    }));
+  }
+
+  for (auto& f : futures) {
+    f.get();
+  }
+  ret &= (first == KERNEL_COUNT);
+  ret &= (second == KERNEL_COUNT);
+
+  // an exception thrown by a continuation is reported by its future
+  hc::completion_future failed = futures.back().then([] {
+    throw std::runtime_error("failed continuation");
+  });
+  try {
+    failed.get();
+    ret = false;
+  } catch (std::runtime_error&) {
+  }
+
+  // a continuation of a failed future does not run, its future gets the
+  // exception instead
+  std::atomic<bool> ran(false);
+  try {
+    failed.then([&] { ran = true; }).get();
+    ret = false;
+  } catch (std::runtime_error&) {
+  }
+  ret &= !ran;
+
+  // continuations of an empty completion_future never run
+  hc::completion_future empty;
+  ret &= !empty.then([&] { ret = false; }).valid();
+
+  for (int i = 0; i < vecSize; ++i) {
+    ret &= (table[i] == KERNEL_COUNT);
+  }
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test();
+
+  return !(ret == true);
+}
@@ -0,0 +1,72 @@
+// RUN: %hc -cpu %s -o %t.out && HCC_RUNTIME=CPU %t.out
+
+#include <hc.hpp>
+
+#include <iostream>
+
+// upper bound on the spin of the kernel, so a host access blocking on it
+// fails the test instead of hanging it
+#define SPIN_LIMIT (1L << 34)
+
+// On the CPU path the host only waits for the kernels using the buffer it
+// accesses: a kernel spinning until the host has read another buffer must
+// not hold that read up
+bool test() {
+  bool ret = true;
+
+  const int vecSize = 256;
+
+  volatile int released = 0;
+  volatile int* flag = &released;
+
+  std::vector<int> table_a(vecSize);
+  std::vector<int> table_b(vecSize);
+  for (int i = 0; i < vecSize; ++i) {
+    table_b[i] = i;
+  }
+
+  {
+    hc::array_view<int, 1> av_a(vecSize, table_a);
+    hc::array_view<int, 1> av_b(vecSize, table_b);
+
+    // make av_b resident on the CPU accelerator, as av_a is about to be
+    hc::parallel_for_each(hc::extent<1>(vecSize), [=](hc::index<1> idx) __HC__ {
+      av_b(idx) += 1;
+    }).wait();
+
+    hc::completion_future fut = hc::parallel_for_each(
+      hc::extent<1>(1),
+      [=](hc::index<1> idx) __HC__ {
+        long i = 0;
+        while (*flag == 0 && i < SPIN_LIMIT)
+          ++i;
+        av_a(idx) = (*flag != 0);
+    });
+
+    // av_b is not used by the spinning kernel
+    int sum = 0;
+    for (int i = 0; i < vecSize; ++i) {
+      sum += av_b[i];
+    }
+    released = 1;
+
+    fut.wait();
+    ret &= (sum == vecSize * (vecSize + 1) / 2);
+    ret &= (av_a[0] == 1);
+  }
+
+  if (ret) {
+    std::cout << "Verify success!\n";
+  } else {
+    std::cout << "Verify failed!\n";
+  }
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test();
+
+  return !(ret == true);
+}
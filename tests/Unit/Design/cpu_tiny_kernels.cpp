@@ -0,0 +1,31 @@
+// RUN: %cxxamp -cpu %s -o %t.out && HCC_RUNTIME=CPU %t.out
+
+#include <amp.h>
+
+#include <vector>
+
+#define LAUNCHES (20000)
+
+// many tiny kernels back to back on the CPU path: a launch returns as soon as
+// its last partition has counted down, while that partition may still be
+// finishing up on a worker
+int main() {
+  using namespace concurrency;
+
+  std::vector<int> v(4, 0);
+  array_view<int, 1> av(4, v);
+
+  for (int k = 0; k < LAUNCHES; ++k) {
+    parallel_for_each(av.get_extent(), [=](index<1> i) restrict(amp) {
+      av[i] += 1;
+    });
+  }
+  av.synchronize();
+
+  bool ret = true;
+  for (int i = 0; i < 4; ++i) {
+    ret &= (v[i] == LAUNCHES);
+  }
+
+  return !(ret == true);
+}
@@ -0,0 +1,64 @@
+
+// RUN: %hc -cpu %s -o %t.out && HCC_RUNTIME=CPU %t.out
+
+#include <hc.hpp>
+
+#include <iostream>
+
+#define __KERNEL__ __attribute__((amp))
+
+// dynamic group memory on the CPU path: every tile sees its own group
+// segment, and the segment is reused by the following tiles and launches
+template<size_t GRID_SIZE, size_t TILE_SIZE>
+bool test() {
+  using namespace hc;
+
+  array_view<int, 1> av(GRID_SIZE);
+  tiled_extent<1> ex(GRID_SIZE, TILE_SIZE);
+  ex.set_dynamic_group_segment_size(TILE_SIZE * sizeof(int));
+
+  completion_future fut = parallel_for_each(hc::accelerator().get_default_view(),
+                    ex,
+                    __KERNEL__ [=](tiled_index<1>& tidx) {
+    index<1> global = tidx.global;
+    index<1> local = tidx.local;
+
+    int* dynamic_lds = (int*)get_dynamic_group_segment_base_pointer();
+    dynamic_lds[local[0]] = global[0];
+    tidx.barrier.wait();
+
+    // sum of the global indices of the tile
+    int sum = 0;
+    for (int i = 0; i < TILE_SIZE; ++i)
+      sum += dynamic_lds[i];
+    tidx.barrier.wait();
+
+    av(global) = sum + get_group_segment_size();
+  });
+
+  // wait for kernel to complete
+  fut.wait();
+
+  // verify data
+  bool ret = true;
+  for (int i = 0; i < GRID_SIZE; ++i) {
+    int first = i - (i % TILE_SIZE);
+    int expected = TILE_SIZE * first + TILE_SIZE * (TILE_SIZE - 1) / 2 + TILE_SIZE * sizeof(int);
+    if (av[i] != expected) {
+      ret = false;
+      break;
+    }
+  }
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test<1, 1>();
+  ret &= test<64, 16>();
+  ret &= test<4096, 64>();
+  ret &= test<1024, 256>();
+
+  return !(ret == true);
+}
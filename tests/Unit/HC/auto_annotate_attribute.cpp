@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 // RUN: %hc -Xclang -fauto-compile-for-accelerator %s -o %t.out && %t.out
 
 #include <hc.hpp>
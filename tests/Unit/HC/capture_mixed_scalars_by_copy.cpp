@@ -0,0 +1,48 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <vector>
+
+// test scalars of mixed sizes captured by copy, which the runtime pushes
+// into kernarg memory as one block with the padding between them, and a
+// pointer which ends the block
+
+#define SIZE (64)
+
+int main() {
+  bool ret = true;
+
+  char c = 3;
+  int i = 5;
+  double d = 7.0;
+  short s = 11;
+  float f = 13.0f;
+  long l = 17;
+
+  hc::array<double, 1> table(SIZE);
+  hc::array_view<double, 1> out(SIZE);
+  unsigned char u = 19;
+
+  hc::parallel_for_each(hc::extent<1>(SIZE), [=, &table](hc::index<1> idx) [[hc]] {
+    double v = c + i + d + s + f + l;
+    table[idx] = v;
+    out[idx] = v * u + idx[0];
+  });
+
+  for (int k = 0; k < SIZE; ++k) {
+    if (out[k] != (3 + 5 + 7 + 11 + 13 + 17) * 19 + k) {
+      ret = false;
+    }
+  }
+
+  std::vector<double> t = table;
+  for (int k = 0; k < SIZE; ++k) {
+    if (t[k] != 3 + 5 + 7 + 11 + 13 + 17) {
+      ret = false;
+    }
+  }
+
+  return !(ret == true);
+}
@@ -0,0 +1,53 @@
+// RUN: %hc -lhc_am %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#define N 1024
+#define KERNELS 64
+#define LAUNCHES 1024
+
+// add 1 to every element of d
+struct AddOne {
+  int* d;
+  void operator()(hc::index<1> i) const [[hc]] {
+    d[i[0]] += 1;
+  }
+};
+
+// a graph relaunched over and over without waiting writes many more packets
+// than the hw queue holds; the launches wait for room instead of failing
+int main() {
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.create_view();
+
+  int* d = hc::am_alloc(N * sizeof(int), acc, 0);
+  int* h = hc::am_alloc(N * sizeof(int), acc, amHostPinned);
+  for (int i = 0; i < N; ++i) {
+    h[i] = 0;
+  }
+  av.copy(h, d, N * sizeof(int));
+
+  bool ret = av.begin_capture();
+  for (int k = 0; k < KERNELS; ++k) {
+    hc::parallel_for_each(av, hc::extent<1>(N), AddOne{d});
+  }
+  hc::command_graph graph = av.end_capture();
+  ret &= graph.valid() && graph.get_node_count() == KERNELS;
+
+  hc::completion_future last;
+  for (int l = 0; l < LAUNCHES; ++l) {
+    last = graph.launch();
+  }
+  last.wait();
+
+  av.copy(d, h, N * sizeof(int));
+  for (int i = 0; i < N; ++i) {
+    ret &= (h[i] == KERNELS * LAUNCHES);
+  }
+
+  hc::am_free(d);
+  hc::am_free(h);
+
+  return !(ret == true);
+}
@@ -0,0 +1,96 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc -lhc_am %s -o %t.out && %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <cstddef>
+#include <vector>
+
+#define N 4096
+
+// add k to every element of d
+struct AddK {
+  int* d;
+  int k;
+  void operator()(hc::index<1> i) const [[hc]] {
+    d[i[0]] += k;
+  }
+};
+
+// copies, a kernel and a marker recorded into a command_graph, launched
+// several times, with the argument of the kernel patched in between
+int main() {
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.create_view();
+
+  int* d = hc::am_alloc(N * sizeof(int), acc, 0);
+  int* h = hc::am_alloc(N * sizeof(int), acc, amHostPinned);
+
+  bool ret = av.begin_capture();
+  // a queue records one graph at a time
+  ret &= !av.begin_capture();
+
+  av.copy_async(h, d, N * sizeof(int));
+  hc::completion_future kernel = hc::parallel_for_each(av, hc::extent<1>(N), AddK{d, 1});
+  av.create_marker();
+  av.copy_async(d, h, N * sizeof(int));
+
+  // kernels recorded into a graph can not use array_views
+  std::vector<int> v(N, 0);
+  hc::array_view<int, 1> view(N, v);
+  try {
+    hc::parallel_for_each(av, view.get_extent(), [=](hc::index<1> i) [[hc]] {
+      view[i] = 1;
+    });
+    ret = false;
+  } catch (hc::runtime_exception&) {
+  }
+
+  hc::command_graph graph = av.end_capture();
+  ret &= graph.valid() && graph.get_node_count() == 4;
+
+  // the future of a recorded command never becomes ready, waiting on it,
+  // or on a continuation of it, throws
+  ret &= !kernel.is_ready();
+  try {
+    kernel.wait();
+    ret = false;
+  } catch (hc::runtime_exception&) {
+  }
+  bool continued = false;
+  try {
+    kernel.then([&] { continued = true; }).get();
+    ret = false;
+  } catch (hc::runtime_exception&) {
+  }
+  ret &= !continued;
+
+  for (int i = 0; i < N; ++i) {
+    h[i] = i;
+  }
+
+  // h += 1
+  graph.launch().wait();
+  for (int i = 0; i < N; ++i) {
+    ret &= (h[i] == i + 1);
+  }
+
+  // h += 10, twice
+  ret &= graph.set_kernel_arg(1, offsetof(AddK, k), 10);
+  graph.launch();
+  hc::completion_future last = graph.launch();
+  last.wait();
+  for (int i = 0; i < N; ++i) {
+    ret &= (h[i] == i + 21);
+  }
+
+  // only kernels have arguments
+  ret &= !graph.set_kernel_arg(0, 0, 0);
+  ret &= !graph.set_kernel_arg(4, 0, 0);
+
+  hc::am_free(d);
+  hc::am_free(h);
+
+  return !(ret == true);
+}
@@ -0,0 +1,59 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <chrono>
+#include <future>
+
+// test completion_future::wait_for and the conversion to std::shared_future
+// on a kernel dispatch, whose completion_future waits on the op itself
+bool test() {
+  bool ret = true;
+
+  const int vecSize = 2048;
+
+  hc::array_view<int, 1> table(vecSize);
+  for (int i = 0; i < vecSize; ++i) {
+    table[i] = i;
+  }
+
+  hc::completion_future fut = hc::parallel_for_each(
+    hc::extent<1>(vecSize),
+    [=](hc::index<1> idx) __HC__ {
+      table(idx) = table(idx) * 2;
+  });
+
+  // a dispatched kernel is either ready or times out, it is never deferred
+  std::future_status status = fut.wait_for(std::chrono::seconds(0));
+  ret &= (status != std::future_status::deferred);
+
+  ret &= (fut.wait_for(std::chrono::seconds(60)) == std::future_status::ready);
+  ret &= (fut.wait_until(std::chrono::system_clock::now() + std::chrono::seconds(60)) ==
+          std::future_status::ready);
+  ret &= fut.is_ready();
+
+  std::shared_future<void> sf = fut;
+  ret &= sf.valid();
+  sf.get();
+
+  // a moved-from completion_future refers to no operation
+  hc::completion_future moved(std::move(fut));
+  ret &= !fut.valid();
+  ret &= moved.valid();
+  moved.get();
+
+  for (int i = 0; i < vecSize; ++i) {
+    ret &= (table[i] == i * 2);
+  }
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test();
+
+  return !(ret == true);
+}
@@ -0,0 +1,57 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc -cpu %s -o %t.out && HCC_RUNTIME=CPU HCC_CPU_GROUP_SIZE=1 %t.out
+
+#include <hc.hpp>
+
+#include <iostream>
+#include <vector>
+
+// With HCC_CPU_GROUP_SIZE=1 the CPU runtime exposes every CPU as an
+// accelerator. Shard a kernel over all of them; the array_view is migrated
+// from one accelerator to the next.
+bool test() {
+  bool ret = true;
+
+  std::vector<hc::accelerator> groups;
+  for (auto& acc : hc::accelerator::get_all()) {
+    if (acc.get_device_path().compare(0, 9, L"cpu_group") == 0)
+      groups.push_back(acc);
+  }
+  ret &= !groups.empty();
+
+  const int vecSize = 4096;
+  std::vector<int> table(vecSize, 0);
+  hc::array_view<int, 1> av(vecSize, table);
+
+  for (auto& acc : groups) {
+    ret &= (acc.get_cu_count() == 1);
+    hc::parallel_for_each(acc.get_default_view(), av.get_extent(), [=](hc::index<1> idx) __HC__ {
+      av[idx] += idx[0];
+    }).wait();
+  }
+
+  // memory of an array lives on the node of its accelerator
+  for (auto& acc : groups) {
+    hc::array<int, 1> arr(vecSize, acc.get_default_view());
+    hc::parallel_for_each(acc.get_default_view(), arr.get_extent(), [&arr](hc::index<1> idx) __HC__ {
+      arr[idx] = idx[0];
+    }).wait();
+    std::vector<int> result = arr;
+    for (int i = 0; i < vecSize; ++i)
+      ret &= (result[i] == i);
+  }
+
+  av.synchronize();
+  for (int i = 0; i < vecSize; ++i)
+    ret &= (table[i] == static_cast<int>(groups.size()) * i);
+
+  return ret;
+}
+
+int main() {
+  bool ret = true;
+
+  ret &= test();
+
+  return !(ret == true);
+}
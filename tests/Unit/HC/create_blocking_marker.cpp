@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 // RUN: %hc %s -I/opt/rocm/hsa/include -L/opt/rocm/lib -lhsa-runtime64 -o %t.out && %t.out
 
 #include <hc.hpp>
@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 
 // RUN: %hc %s -I%hsa_header_path -L%hsa_library_path -lhsa-runtime64 -o %t.out && %t.out
 
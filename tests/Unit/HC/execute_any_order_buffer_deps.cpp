@@ -0,0 +1,52 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <vector>
+
+#define N 4096
+
+// kernels on an execute_any_order accelerator_view are ordered by the
+// array_views they use: read after write, write after read and write after
+// write; kernels which only read the same array_view are not
+int main() {
+  using namespace hc;
+
+  accelerator_view av = accelerator().create_view(execute_any_order);
+
+  std::vector<int> a(N, 0), b(N, 0), c(N, 0);
+  array_view<int, 1> av_a(N, a);
+  array_view<int, 1> av_b(N, b);
+  array_view<int, 1> av_c(N, c);
+
+  // write a
+  parallel_for_each(av, av_a.get_extent(), [=](index<1> i) [[hc]] {
+    av_a[i] = i[0];
+  });
+
+  // two readers of a
+  array_view<const int, 1> ro_a(av_a);
+  parallel_for_each(av, av_b.get_extent(), [=](index<1> i) [[hc]] {
+    av_b[i] = ro_a[i] + 1;
+  });
+  parallel_for_each(av, av_c.get_extent(), [=](index<1> i) [[hc]] {
+    av_c[i] = ro_a[i] * 2;
+  });
+
+  // write a again, after both reads
+  parallel_for_each(av, av_a.get_extent(), [=](index<1> i) [[hc]] {
+    av_a[i] = -1;
+  });
+
+  av_a.synchronize();
+  av_b.synchronize();
+  av_c.synchronize();
+
+  bool ret = true;
+  for (int i = 0; i < N; ++i) {
+    ret &= (a[i] == -1) && (b[i] == i + 1) && (c[i] == i * 2);
+  }
+
+  return !(ret == true);
+}
@@ -0,0 +1,74 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc %s -o %t.out && %t.out
+
+#include <hc.hpp>
+
+#include <vector>
+
+#define N 4096
+#define PRODUCERS 7
+#define CHAIN 16
+
+// a kernel on an execute_any_order accelerator_view which reads the output
+// of earlier kernels waits for all of them, including when they are more
+// than fit into a single barrier packet, and a chain of kernels each reading
+// the output of the one before runs in order
+int main() {
+  using namespace hc;
+
+  accelerator_view av = accelerator().create_view(execute_any_order);
+
+  std::vector<std::vector<int>> in(PRODUCERS, std::vector<int>(N, 0));
+  std::vector<array_view<int, 1>> av_in;
+  for (int k = 0; k < PRODUCERS; ++k) {
+    av_in.push_back(array_view<int, 1>(N, in[k]));
+  }
+
+  // every producer writes one buffer
+  for (int k = 0; k < PRODUCERS; ++k) {
+    array_view<int, 1> out = av_in[k];
+    parallel_for_each(av, out.get_extent(), [=](index<1> i) [[hc]] {
+      out[i] = i[0] + k;
+    });
+  }
+
+  // the consumer reads the outputs of all producers
+  std::vector<int> sum(N, 0);
+  array_view<int, 1> av_sum(N, sum);
+  array_view<const int, 1> p0(av_in[0]), p1(av_in[1]), p2(av_in[2]), p3(av_in[3]),
+                           p4(av_in[4]), p5(av_in[5]), p6(av_in[6]);
+  parallel_for_each(av, av_sum.get_extent(), [=](index<1> i) [[hc]] {
+    av_sum[i] = p0[i] + p1[i] + p2[i] + p3[i] + p4[i] + p5[i] + p6[i];
+  });
+
+  // each kernel of the chain reads the buffer the one before wrote
+  std::vector<std::vector<int>> chain(CHAIN + 1, std::vector<int>(N, 0));
+  std::vector<array_view<int, 1>> av_chain;
+  for (int k = 0; k <= CHAIN; ++k) {
+    av_chain.push_back(array_view<int, 1>(N, chain[k]));
+  }
+  array_view<const int, 1> ro_sum(av_sum);
+  array_view<int, 1> first = av_chain[0];
+  parallel_for_each(av, first.get_extent(), [=](index<1> i) [[hc]] {
+    first[i] = ro_sum[i];
+  });
+  for (int k = 1; k <= CHAIN; ++k) {
+    array_view<const int, 1> src(av_chain[k - 1]);
+    array_view<int, 1> dst = av_chain[k];
+    parallel_for_each(av, dst.get_extent(), [=](index<1> i) [[hc]] {
+      dst[i] = src[i] + 1;
+    });
+  }
+
+  av_sum.synchronize();
+  av_chain[CHAIN].synchronize();
+
+  bool ret = true;
+  for (int i = 0; i < N; ++i) {
+    int expected = PRODUCERS * i + PRODUCERS * (PRODUCERS - 1) / 2;
+    ret &= (sum[i] == expected);
+    ret &= (chain[CHAIN][i] == expected + CHAIN);
+  }
+
+  return !(ret == true);
+}
@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 // RUN: %hc %s -o %t.out && %t.out
 
 #include <hc.hpp>
@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 #define DISABLED_PENDING_REMOVAL true
 
 #if !DISABLED_PENDING_REMOVAL
@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 // RUN: %not %hc %s -o %t.out 2>&1 | %not grep 'Segmentation fault'
 #include <hc.hpp>
 #include <vector>
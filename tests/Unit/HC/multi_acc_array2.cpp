@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 // RUN: %hc --amdgpu-target=gfx701 --amdgpu-target=gfx801 --amdgpu-target=gfx802 --amdgpu-target=gfx803 %s -o %t.out && %t.out
 #include <random>
 #include <algorithm>
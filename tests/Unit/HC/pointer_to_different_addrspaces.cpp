@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 // XFAIL: *
 // RUN: %hc -lhc_am %s -o %t.out && %t.out
 
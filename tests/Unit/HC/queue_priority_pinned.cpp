@@ -0,0 +1,61 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc %s -o %t.out && HCC_MAX_QUEUES=2 %t.out
+
+#include <hc.hpp>
+
+#include <thread>
+#include <vector>
+
+#define VIEWS 8
+#define ROUNDS 32
+#define N 1024
+
+// more accelerator_views than hardware queues: views of different priorities,
+// one of them pinned, steal the hardware queues from each other from several
+// threads
+int main() {
+  using namespace hc;
+
+  accelerator acc;
+  std::vector<accelerator_view> views;
+  for (int v = 0; v < VIEWS; ++v) {
+    views.push_back(acc.create_view());
+    if (acc.is_hsa_accelerator()) {
+      views.back().set_queue_priority(v % 3);
+    }
+  }
+  if (acc.is_hsa_accelerator()) {
+    views[0].set_queue_pinned(true);
+  }
+
+  std::vector<std::vector<int>> data(VIEWS, std::vector<int>(N, 0));
+  std::vector<std::thread> threads;
+  for (int v = 0; v < VIEWS; ++v) {
+    threads.emplace_back([&, v]() {
+      array_view<int, 1> av(N, data[v]);
+      for (int r = 0; r < ROUNDS; ++r) {
+        parallel_for_each(views[v], av.get_extent(), [=](index<1> i) [[hc]] {
+          av[i] += 1;
+        });
+        views[v].wait();
+      }
+      av.synchronize();
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  if (acc.is_hsa_accelerator()) {
+    views[0].set_queue_pinned(false);
+  }
+
+  bool ret = true;
+  for (int v = 0; v < VIEWS; ++v) {
+    for (int i = 0; i < N; ++i) {
+      ret &= (data[v][i] == ROUNDS);
+    }
+  }
+
+  return !(ret == true);
+}
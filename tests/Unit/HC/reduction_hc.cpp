@@ -1,3 +1,4 @@
+// UNSUPPORTED: hsa-sw
 // XFAIL: *
 // JIRA SWDEV-129742
 
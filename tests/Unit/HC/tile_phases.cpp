@@ -0,0 +1,78 @@
+// UNSUPPORTED: hsa-sw
+// RUN: %hc %s -o %t.out && %t.out
+// RUN: %hc -cpu %s -o %t.cpu.out && HCC_RUNTIME=CPU %t.cpu.out fission
+// RUN: HCC_RUNTIME=CPU %t.cpu.out fibers
+
+#include <hc.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#define TILE_SIZE (64)
+#define GRID_SIZE (TILE_SIZE * 32)
+
+struct private_state {
+  int local;
+};
+
+struct shared_state {
+  int scratch[TILE_SIZE];
+};
+
+// tile reduction written as phases separated by barriers
+template <hc::cpu_tile_mode mode>
+bool test() {
+  std::vector<int> in(GRID_SIZE);
+  std::vector<int> out(GRID_SIZE / TILE_SIZE, 0);
+  for (int i = 0; i < GRID_SIZE; ++i)
+    in[i] = i % 7;
+
+  hc::array_view<const int, 1> av_in(GRID_SIZE, in.data());
+  hc::array_view<int, 1> av_out(GRID_SIZE / TILE_SIZE, out.data());
+
+  auto load = [=](const hc::tiled_index<1>& tidx, private_state& p, shared_state& s) __HC__ {
+    p.local = tidx.local[0];
+    s.scratch[p.local] = av_in[tidx.global];
+  };
+  auto step = [=](const hc::tiled_index<1>& tidx, private_state& p, shared_state& s) __HC__ {
+    // the lower half of the tile adds the upper half of the scratch to its
+    // own slot, found through the local index kept in the private state
+    if (p.local < TILE_SIZE / 2)
+      s.scratch[p.local] += s.scratch[p.local + TILE_SIZE / 2];
+  };
+  auto store = [=](const hc::tiled_index<1>& tidx, private_state& p, shared_state& s) __HC__ {
+    if (p.local == 0) {
+      int sum = 0;
+      for (int i = 0; i < TILE_SIZE / 2; ++i)
+        sum += s.scratch[i];
+      av_out[tidx.tile] = sum;
+    }
+  };
+
+  hc::parallel_for_each(hc::extent<1>(GRID_SIZE).tile(TILE_SIZE),
+                        hc::make_tile_phases<1, private_state, shared_state>(mode, load, step, store)).wait();
+  av_out.synchronize();
+
+  bool ret = true;
+  for (int t = 0; t < GRID_SIZE / TILE_SIZE; ++t) {
+    int sum = 0;
+    for (int i = 0; i < TILE_SIZE; ++i)
+      sum += in[t * TILE_SIZE + i];
+    ret &= (out[t] == sum);
+  }
+  return ret;
+}
+
+// runs the cpu_tile_mode given as argument, or both
+int main(int argc, char* argv[]) {
+  bool ret = true;
+  const char* mode = argc > 1 ? argv[1] : nullptr;
+
+  if (!mode || !strcmp(mode, "fission"))
+    ret &= test<hc::cpu_tile_mode::fission>();
+  if (!mode || !strcmp(mode, "fibers"))
+    ret &= test<hc::cpu_tile_mode::fibers>();
+
+  return !(ret == true);
+}
@@ -0,0 +1,53 @@
+// REQUIRES: hsa-sw-built
+// RUN: %hc -cpu %s -o %t.out -lhc_am -ldl && env LD_LIBRARY_PATH=%hsa_sw_lib_dir:$LD_LIBRARY_PATH %t.out
+
+#include <hc.hpp>
+#include <hc_am.hpp>
+
+#include <dlfcn.h>
+#include <vector>
+
+#define N 4096
+
+// a program built with host-callable kernels runs its kernels on the
+// software HSA runtime, and is told so when a kernel can not run there
+int main() {
+  // the software runtime is loaded in place of the real one
+  bool ret = dlsym(RTLD_DEFAULT, "hsa_sw_register_kernel") != nullptr;
+
+  hc::accelerator acc;
+  hc::accelerator_view av = acc.get_default_view();
+
+  int* d = hc::am_alloc(N * sizeof(int), acc, 0);
+  hc::parallel_for_each(av, hc::extent<1>(N), [=](hc::index<1> i) [[hc]] {
+    d[i[0]] = 2 * i[0];
+  }).wait();
+  std::vector<int> h(N, 0);
+  av.copy(d, h.data(), N * sizeof(int));
+  for (int i = 0; i < N; ++i) {
+    ret &= (h[i] == 2 * i);
+  }
+
+  // tiled kernels are rejected
+  try {
+    hc::parallel_for_each(av, hc::extent<1>(N).tile(64), [=](hc::tiled_index<1> i) [[hc]] {
+      d[i.global[0]] = 0;
+    }).wait();
+    ret = false;
+  } catch (hc::runtime_exception&) {
+  }
+
+  // and so are kernels capturing an array_view
+  hc::array_view<int, 1> view(N, h);
+  try {
+    hc::parallel_for_each(av, view.get_extent(), [=](hc::index<1> i) [[hc]] {
+      view[i] = 0;
+    }).wait();
+    ret = false;
+  } catch (hc::runtime_exception&) {
+  }
+
+  hc::am_free(d);
+
+  return !(ret == true);
+}